@@ -13,6 +13,10 @@ extern "C"
 	#include "H5MMprivate.h"   // Memory management     
 	#include "H5Pprivate.h"    // Property lists  
 }
+#if defined(__linux__)
+#	include <sys/ioctl.h>
+#	include <linux/fs.h>       // FICLONE
+#endif
 
 hid_t XHdf5::BlockDriver::m_DriverID = 0;
 hid_t H5E_ERR_CLS_g;
@@ -21,6 +25,15 @@ namespace XHdf5
 BlockDriver::BlockDriver(/*size_t userblock_size, */size_t block_size, size_t cbuf_size, DriverCallback* Callback)
 {
 	m_Callback   = Callback;
+	m_ReplLog    = nullptr;
+	m_ReplEpoch  = 0;
+	m_Cache      = nullptr;
+	m_CacheClient = 0;
+	m_Stats       = nullptr;
+	m_Faults      = nullptr;
+	m_CommitDelay = 0;
+	m_FlushDurability = DURABILITY_DISK;
+	m_Prefetch    = 0;
 	m_UBlockSize = block_size;
 	m_BlockSize  = block_size;
 	m_MemBufSize = cbuf_size;
@@ -29,6 +42,12 @@ BlockDriver::BlockDriver(/*size_t userblock_size, */size_t block_size, size_t cb
 BlockDriver::~BlockDriver()
 {
 }
+void BlockDriver::SetCommitDelay(uint32_t MaxDelay)
+{
+	m_CommitDelay = MaxDelay;
+	if(m_Commit)
+		m_Commit->SetMaxDelay(MaxDelay);
+}
 ////////////////////////////////////////////////////////////////
 // Description:  
 //      Initialize this driver by registering the driver with the library.
@@ -180,6 +199,32 @@ herr_t BlockDriver::UpdateUserBlock()
 }
 ////////////////////////////////////////////////////////////////
 // Description:  
+//      Starts the log LogName of the new epoch Epoch and switches
+//      the replication to it. The epoch is stamped into the user
+//      block first, through the previous log if there is one.
+// Return: 
+//      Success:  0
+//      Failure:  Negative, the previous log is kept
+////////////////////////////////////////////////////////////////
+int BlockDriver::StartReplication(ReplicationLog* Log, const char* LogName, uint64_t Epoch)
+{
+	if(m_File==nullptr || m_File->fa.ubsize<sizeof(Epoch))
+		return -1;
+	if(Log->Open(LogName, Epoch, (haddr_t)(m_File->fa.ubsize - sizeof(Epoch)))<0)
+		return -1;
+	uint64_t Previous = m_ReplEpoch;
+	m_ReplEpoch = Epoch;
+	if(UpdateUserBlock()<0 || XDX::Platform::FileSync(m_File->fd)!=0 || (m_ReplLog!=nullptr && m_ReplLog->Flush()<0))
+	{
+		m_ReplEpoch = Previous;
+		Log->Close();
+		return -1;
+	}
+	m_ReplLog = Log;
+	return 0;
+}
+////////////////////////////////////////////////////////////////
+// Description:  
 //      Returns information about the crypto file access property
 //      list though the function arguments.
 // Return: 
@@ -245,24 +290,37 @@ int BlockDriver::DoWriteUserBlock(int FileHandle, void * Buffer, unsigned int Si
 		return 0;
 	if(m_Callback->OnH5WriteUserBlock(Buffer, Size)!=0)
 		return -1;
+	if(Size>=sizeof(m_ReplEpoch))
+		HDmemcpy((char*)Buffer + Size - sizeof(m_ReplEpoch), &m_ReplEpoch, sizeof(m_ReplEpoch));
+
+	if(DoBeforeOverwrite(0, Size)<0)
+		return -1;
 
 	// Get the current fileposition
 	file_offset_t old_pos = file_tell(FileHandle);
 
 	// Jump to the user-block place in the file	
-	if(file_seek(FileHandle, (file_offset_t)(0), SEEK_SET) < 0)
+	if(DoSeek(FileHandle, (file_offset_t)(0), SEEK_SET) < 0)
 	{
 		m_Callback->OnH5ToLog(H5E_IO, L"unable to seek to proper position"); 
 		return FAIL;
 	}
 	
+	if(m_Cache != nullptr)
+		m_Cache->Invalidate(m_CacheClient, 0, Size);
+	if(m_ReplLog != nullptr && m_ReplLog->Append(0, Buffer, Size)<0)
+	{
+		m_Callback->OnH5ToLog(H5E_WRITEERROR, L"unable to append to the replication log"); 
+		return FAIL;
+	}
+
 	// Write the userblock
 	int res = HDwrite(FileHandle, Buffer, Size);
 	if(res<=0)
 		return -1;
 
 	// Jump back to the old place in the file	
-	if(file_seek(FileHandle, (file_offset_t)(old_pos), SEEK_SET) < 0)
+	if(DoSeek(FileHandle, (file_offset_t)(old_pos), SEEK_SET) < 0)
 	{
 		m_Callback->OnH5ToLog(H5E_IO, L"unable to seek to proper position"); 
 		return FAIL;
@@ -277,9 +335,42 @@ int BlockDriver::DoReadUserBlock(void * Buffer, unsigned int Size)
 }
 int BlockDriver::DoBlockRead(int FileHandle, void * Buffer, unsigned int Size)
 {	
-	int res = HDread(FileHandle, Buffer, Size);
-	if(res<0)
-		return res;
+	// The callback and the cache take the blocks by the address
+	haddr_t Addr = (haddr_t)file_tell(FileHandle);
+
+	// A read of the cached blocks only moves the file position
+	if(m_Cache != nullptr && m_BlockSize>0)
+	{
+		if(m_Cache->Lookup(m_CacheClient, Addr, Buffer, Size, m_BlockSize))
+		{
+			if(m_Stats != nullptr)
+				IoCounters::Add(m_Stats->CacheHits, Size / m_BlockSize);
+			return (DoSeek(FileHandle, (file_offset_t)(Addr + Size), SEEK_SET) < 0)?-1:0;
+		}
+	}
+	if(m_Faults != nullptr && m_Faults->Before(FaultInjector::FAULT_READ)<0)
+		return -1;
+	// A read may return less than asked, the rest is read on up to the end of the file
+	int res = 0;
+	while(res < (int)Size)
+	{
+		unsigned int Want = Size - res;
+		if(m_Faults != nullptr)
+			Want = (unsigned int)m_Faults->ReadLength(Want);
+		int n = HDread(FileHandle, (char*)Buffer + res, Want);
+		if(n<0 && errno==EINTR)
+			continue;
+		if(n<0)
+			return n;
+		if(n==0)
+			break;
+		res += n;
+	}
+	if(m_Stats != nullptr)
+	{
+		IoCounters::Add(m_Stats->BlockReads, (m_BlockSize>0)?(res + m_BlockSize - 1) / m_BlockSize:1);
+		IoCounters::Add(m_Stats->BytesRead, res);
+	}
 	if(m_Callback == nullptr)
 		return res;
 	
@@ -289,16 +380,31 @@ int BlockDriver::DoBlockRead(int FileHandle, void * Buffer, unsigned int Size)
 	do
 	{
 		pos = (Size - remaining_bytes);
-		if(m_Callback->OnH5AfterBlockRead((char*)Buffer + pos, ChunkSize)<0)
+		if(m_Callback->OnH5AfterBlockRead(Addr + pos, (char*)Buffer + pos, ChunkSize)<0)
 			return -1;
 		remaining_bytes-=ChunkSize;
 	}
 	while(remaining_bytes>0);
+
+	// Only the blocks actually in the file
+	if(m_Cache != nullptr && m_BlockSize>0)
+		m_Cache->Insert(m_CacheClient, Addr, Buffer, res / m_BlockSize * m_BlockSize, m_BlockSize);
 	return 0;
 }
+int BlockDriver::DoBeforeOverwrite(haddr_t Addr, haddr_t Size)
+{
+	if(m_Callback == nullptr || Size==0)
+		return 0;
+	return m_Callback->OnH5BeforeOverwrite(Addr, Size);
+}
 int BlockDriver::DoBlockWrite(int FileHandle, void * Buffer, unsigned int Size)
 {
 	int res = 0;
+	haddr_t Addr = (haddr_t)file_tell(FileHandle);
+
+	// The cache keeps the plain blocks, they are encrypted in place below
+	if(m_Cache != nullptr && m_BlockSize>0)
+		m_Cache->Insert(m_CacheClient, Addr, Buffer, Size, m_BlockSize);
 	if(m_Callback != nullptr)
 	{			
 		int remaining_bytes = Size;
@@ -307,17 +413,45 @@ int BlockDriver::DoBlockWrite(int FileHandle, void * Buffer, unsigned int Size)
 		do
 		{
 			pos = (Size - remaining_bytes);
-			if(m_Callback->OnH5BeforeBlockWrite((char*)Buffer + pos, ChunkSize)<0)
+			if(m_Callback->OnH5BeforeBlockWrite(Addr + pos, (char*)Buffer + pos, ChunkSize)<0)
 				return -1;
 			remaining_bytes-=ChunkSize;
 		}
 		while(remaining_bytes>0);
 	}
-	res = HDwrite(FileHandle, Buffer, Size);
+	// Logged ahead of the write, as it goes to the disk
+	if(m_ReplLog != nullptr && m_ReplLog->Append(Addr, Buffer, Size)<0)
+	{
+		if(m_Callback != nullptr)
+			m_Callback->OnH5ToLog(H5E_WRITEERROR, L"unable to append to the replication log"); 
+		if(m_Cache != nullptr)
+			m_Cache->Invalidate(m_CacheClient, Addr, Addr + Size);
+		return -1;
+	}
+	if(m_Faults != nullptr && m_Faults->Before(FaultInjector::FAULT_WRITE)<0)
+		res = -1;
+	else
+		res = HDwrite(FileHandle, Buffer, Size);
 	if(res<=0)
+	{
+		// What is on the disk is unknown now
+		if(m_Cache != nullptr)
+			m_Cache->Invalidate(m_CacheClient, Addr, Addr + Size);
 		return res; 
+	}
+	if(m_Stats != nullptr)
+	{
+		IoCounters::Add(m_Stats->BlockWrites, (m_BlockSize>0)?(res + m_BlockSize - 1) / m_BlockSize:1);
+		IoCounters::Add(m_Stats->BytesWritten, res);
+	}
 	return res;
 }
+file_offset_t BlockDriver::DoSeek(int FileHandle, file_offset_t Offset, int Origin)
+{
+	if(m_Stats != nullptr)
+		IoCounters::Add(m_Stats->Seeks);
+	return file_seek(FileHandle, Offset, Origin);
+}
 
 ////////////////////////////////////////////////////////////////
 // Description:  
@@ -469,20 +603,28 @@ H5FD_t* BlockDriver::open(const char *name, unsigned flags, hid_t fapl_id, haddr
 	// First thing is to read the userblock
 	// Allocate a buffer for use block
 	uint32_t UserBlockSize = fa->ubsize;
-	void* UserBlockBuffer = HDmalloc(UserBlockSize);
+	// With a block cache the head of the file comes in the same read, so the
+	// superblock and the root objects do not cost a request each
+	size_t ReadSize = UserBlockSize;
+	if(!IsCreate && fa->drv->m_Cache != nullptr && sb.st_size > (h5_stat_size_t)UserBlockSize)
+		ReadSize += (size_t)MIN((h5_stat_size_t)fa->drv->m_Prefetch, sb.st_size - (h5_stat_size_t)UserBlockSize);
+	// A one off buffer of the prefetch size, it is not kept on the data free lists
+	void* UserBlockBuffer = HDmalloc(ReadSize);
 	if(UserBlockBuffer == nullptr)
 	{
 		fa->drv->m_Callback->OnH5ToLog(H5E_NOSPACE, L"unable to allocate user block"); 
 		return NULL;
 	}
 	// Read it from the file
-	int res = HDread(fd, UserBlockBuffer, UserBlockSize);
+	int res = HDread(fd, UserBlockBuffer, ReadSize);
 	if(res<=0)
 	{
 		HDfree(UserBlockBuffer);
 		fa->drv->m_Callback->OnH5ToLog(H5E_NOSPACE, L"failed to read user block"); 
 		return NULL; 
 	}
+	if(fa->drv->m_Stats != nullptr)
+		IoCounters::Add(fa->drv->m_Stats->BytesRead, res);
 
 	// Ask the callback to check it
 	if(fa->drv->DoReadUserBlock(UserBlockBuffer, UserBlockSize)!=0)
@@ -490,6 +632,19 @@ H5FD_t* BlockDriver::open(const char *name, unsigned flags, hid_t fapl_id, haddr
 		HDfree(UserBlockBuffer);
 		return NULL;
 	}
+	fa->drv->m_ReplEpoch = 0;
+	if(UserBlockSize>=sizeof(uint64_t) && res>=(int)UserBlockSize)
+		HDmemcpy(&fa->drv->m_ReplEpoch, (char*)UserBlockBuffer + UserBlockSize - sizeof(uint64_t), sizeof(uint64_t));
+	// The key is known now, the blocks read ahead are decrypted at once.
+	// A failure here is not fatal, the blocks are read again on demand.
+	size_t BlockSize = fa->drv->m_BlockSize;
+	if(res > (int)UserBlockSize && BlockSize>0 && UserBlockSize % BlockSize==0)
+	{
+		char*        Blocks = (char*)UserBlockBuffer + UserBlockSize;
+		unsigned int Count  = (unsigned int)((res - UserBlockSize) / BlockSize);
+		if(Count>0 && fa->drv->m_Callback->OnH5AfterBlocksRead(UserBlockSize, Blocks, (unsigned int)BlockSize, Count)==0)
+			fa->drv->m_Cache->Insert(fa->drv->m_CacheClient, UserBlockSize, Blocks, Count*BlockSize, BlockSize);
+	}
 	// Free user block
 	HDfree(UserBlockBuffer);
 	
@@ -537,6 +692,7 @@ H5FD_t* BlockDriver::open(const char *name, unsigned flags, hid_t fapl_id, haddr
 	// Set return value
 	ret_value=(H5FD_t*)file;
 	fa->drv->m_File = file;
+	fa->drv->m_Commit = std::make_shared<GroupCommit>(fd, fa->drv->m_CommitDelay);
 
 //done:
 	if(ret_value==NULL) 
@@ -561,6 +717,12 @@ herr_t BlockDriver::close(H5FD_t *_file)
 
 	// FUNC_ENTER_NOAPI_NOINIT
 
+	// Callers still holding the group commit must not sync a reused descriptor
+	if(file->fa.drv->m_Commit)
+	{
+		file->fa.drv->m_Commit->Detach();
+		file->fa.drv->m_Commit.reset();
+	}
 	if (HDclose(file->fd)<0)
 	{
 		file->fa.drv->m_Callback->OnH5ToLog(H5E_CANTCLOSEFILE, L"unable to close file"); 
@@ -741,6 +903,7 @@ herr_t BlockDriver::read(H5FD_t *_file, H5FD_mem_t UNUSED type, hid_t UNUSED dxp
 	haddr_t        read_size;              // Size to read into copy buffer 
 	size_t         copy_size = size;       // Size remaining to read when using copy buffer 
 	size_t         copy_offset;            // Offset into copy buffer of the requested data 
+	uint64_t       started = LatencyHistogram::Now();
 
 	// FUNC_ENTER_NOAPI_NOINIT
 
@@ -780,7 +943,8 @@ herr_t BlockDriver::read(H5FD_t *_file, H5FD_mem_t UNUSED type, hid_t UNUSED dxp
 		alloc_size = _cbsize;
 	HDassert(!(alloc_size % _fbsize));
 
-	copy_buf = HDmalloc(alloc_size);
+	DataBuffer CopyBuffer(alloc_size);
+	copy_buf = CopyBuffer.Get();
 	//if (HDposix_memalign(&copy_buf, _boundary, alloc_size) != 0)
 	if (copy_buf == NULL)
 	{
@@ -791,7 +955,7 @@ herr_t BlockDriver::read(H5FD_t *_file, H5FD_mem_t UNUSED type, hid_t UNUSED dxp
 	// look for the aligned position for reading the data 
 	HDassert(!(((addr / _fbsize) * _fbsize) % _fbsize));
 
-	if(file_seek(file->fd, (file_offset_t)((addr / _fbsize) * _fbsize), SEEK_SET) < 0)
+	if(file->fa.drv->DoSeek(file->fd, (file_offset_t)((addr / _fbsize) * _fbsize), SEEK_SET) < 0)
 	{
 		file->fa.drv->m_Callback->OnH5ToLog(H5E_IO, L"unable to seek to proper position"); 
 		return FAIL;
@@ -854,23 +1018,17 @@ herr_t BlockDriver::read(H5FD_t *_file, H5FD_mem_t UNUSED type, hid_t UNUSED dxp
 	// Final step: update address
 	addr = (haddr_t)(((addr + size - 1) / _fbsize + 1) * _fbsize);
 
-	if(copy_buf) 
-	{
-		HDfree(copy_buf);
-		copy_buf = NULL;
-	} 
-	
+	// copy_buf goes back with CopyBuffer, on the error paths as well
 
 	// Update current position 
 	file->pos = addr;
 	file->op = OP_READ;
+	if(file->fa.drv->m_Stats != nullptr)
+		file->fa.drv->m_Stats->ReadTime.Record(LatencyHistogram::Now() - started);
 
 //done:
 	if(ret_value<0) 
 	{
-		if(copy_buf)
-			HDfree(copy_buf);
-
 		// Reset last file I/O information
 		file->pos = HADDR_UNDEF;
 		file->op = OP_UNKNOWN;
@@ -902,6 +1060,7 @@ herr_t BlockDriver::write(H5FD_t *_file, H5FD_mem_t UNUSED type, hid_t UNUSED dx
 	haddr_t       read_size;              // Size to read into copy buffer
 	size_t        copy_size = size;       // Size remaining to write when using copy buffer
 	size_t        copy_offset;            // Offset into copy buffer of the data to write
+	uint64_t      started = LatencyHistogram::Now();
 
 	// FUNC_ENTER_NOAPI_NOINIT
 
@@ -935,6 +1094,13 @@ herr_t BlockDriver::write(H5FD_t *_file, H5FD_mem_t UNUSED type, hid_t UNUSED dx
 	write_addr = (addr / _fbsize) * _fbsize;
 	copy_offset = (size_t)(addr % _fbsize);
 
+	// Let the owner keep the blocks about to be overwritten
+	if(file->fa.drv->DoBeforeOverwrite(write_addr, ((addr + size - 1) / _fbsize + 1) * _fbsize - write_addr)<0)
+	{
+		file->fa.drv->m_Callback->OnH5ToLog(H5E_WRITEERROR, L"unable to preserve the overwritten blocks");  
+		return FAIL;
+	}
+
 	// allocate memory needed for the Direct IO option up to the maximal
 	// copy buffer size. Make a bigger buffer for aligned I/O if size is
 	// smaller than maximal copy buffer.
@@ -943,7 +1109,8 @@ herr_t BlockDriver::write(H5FD_t *_file, H5FD_mem_t UNUSED type, hid_t UNUSED dx
 		alloc_size = _cbsize;
 	HDassert(!(alloc_size % _fbsize));
 
-	copy_buf = HDmalloc(alloc_size);
+	DataBuffer CopyBuffer(alloc_size);
+	copy_buf = CopyBuffer.Get();
 	//if (HDposix_memalign(&copy_buf, _boundary, alloc_size) != 0)
 	if (copy_buf == NULL)
 	{
@@ -985,7 +1152,7 @@ herr_t BlockDriver::write(H5FD_t *_file, H5FD_mem_t UNUSED type, hid_t UNUSED dx
 	}*/
 
 	// look for the right position for reading or writing the data 
-	if(file_seek(file->fd, (file_offset_t)write_addr, SEEK_SET) < 0)
+	if(file->fa.drv->DoSeek(file->fd, (file_offset_t)write_addr, SEEK_SET) < 0)
 	{
 		file->fa.drv->m_Callback->OnH5ToLog(H5E_SEEKERROR, L"unable to seek to proper position");  
 		return FAIL;
@@ -1033,7 +1200,7 @@ herr_t BlockDriver::write(H5FD_t *_file, H5FD_mem_t UNUSED type, hid_t UNUSED dx
 
 			// Seek to the last block, for reading
 			HDassert(!((write_addr + write_size - _fbsize) % _fbsize));
-			if(file_seek(file->fd, (file_offset_t)(write_addr + write_size - _fbsize), SEEK_SET) < 0)
+			if(file->fa.drv->DoSeek(file->fd, (file_offset_t)(write_addr + write_size - _fbsize), SEEK_SET) < 0)
 			{
 				file->fa.drv->m_Callback->OnH5ToLog(H5E_SEEKERROR, L"unable to seek to proper position");  
 				return FAIL;
@@ -1080,7 +1247,7 @@ herr_t BlockDriver::write(H5FD_t *_file, H5FD_mem_t UNUSED type, hid_t UNUSED dx
 
 		// look for the aligned position for writing the data
 		HDassert(!(write_addr % _fbsize));
-		if(file_seek(file->fd, (file_offset_t)write_addr, SEEK_SET) < 0)
+		if(file->fa.drv->DoSeek(file->fd, (file_offset_t)write_addr, SEEK_SET) < 0)
 		{
 			file->fa.drv->m_Callback->OnH5ToLog(H5E_SEEKERROR, L"unable to seek to proper position");  
 			return FAIL;
@@ -1110,25 +1277,19 @@ herr_t BlockDriver::write(H5FD_t *_file, H5FD_mem_t UNUSED type, hid_t UNUSED dx
 	addr = write_addr;
 	buf = (const char*)buf + size;
 
-	if(copy_buf) 
-	{
-		HDfree(copy_buf);
-		copy_buf = NULL;
-	}
-	
+	// copy_buf goes back with CopyBuffer, on the error paths as well
 
 	// Update current position and eof
 	file->pos = addr;
 	file->op = OP_WRITE;
 	if (file->pos>file->eof)
 		file->eof = file->pos;
+	if(file->fa.drv->m_Stats != nullptr)
+		file->fa.drv->m_Stats->WriteTime.Record(LatencyHistogram::Now() - started);
 
 
 	if(ret_value<0) 
 	{
-		if(copy_buf)
-			HDfree(copy_buf);
-
 		// Reset last file I/O information
 		file->pos = HADDR_UNDEF;
 		file->op = OP_UNKNOWN;
@@ -1157,6 +1318,18 @@ herr_t BlockDriver::truncate(H5FD_t *_file, hid_t UNUSED dxpl_id, hbool_t UNUSED
 
 	//if (file->eoa!=file->eof) 
 	{
+		// The tail being cut off may still be needed by the owner
+		if(file->eoa < file->eof && file->fa.drv->DoBeforeOverwrite(file->eoa, file->eof - file->eoa)<0)
+		{
+			file->fa.drv->m_Callback->OnH5ToLog(H5E_WRITEERROR, L"unable to preserve the truncated blocks");  
+			return FAIL;
+		}
+		haddr_t NewSize = file->eoa;
+		if(file->fa.drv->m_Faults != nullptr && file->fa.drv->m_Faults->Before(FaultInjector::FAULT_TRUNCATE)<0)
+		{
+			file->fa.drv->m_Callback->OnH5ToLog(H5E_SEEKERROR, L"unable to extend file properly");  
+			return FAIL;
+		}
 #ifdef H5_HAVE_WIN32_API
 		intptr_t filehandle;   /* Windows file handle */
 		LARGE_INTEGER li;   /* 64-bit integer for SetFilePointer() call */
@@ -1168,6 +1341,7 @@ herr_t BlockDriver::truncate(H5FD_t *_file, hid_t UNUSED dxpl_id, hbool_t UNUSED
 		/* [This algorithm is from the Windows documentation for SetFilePointer()] */
 		size_t RoundedSize = ceil((double)file->eoa / file->fa.fbsize) * file->fa.fbsize;
 		li.QuadPart = RoundedSize;//(LONGLONG)file->eoa;
+		NewSize = RoundedSize;
 		(void)SetFilePointer((HANDLE)filehandle,li.LowPart,&li.HighPart,FILE_BEGIN);
 		if(SetEndOfFile((HANDLE)filehandle)==0)
 		{
@@ -1178,9 +1352,19 @@ herr_t BlockDriver::truncate(H5FD_t *_file, hid_t UNUSED dxpl_id, hbool_t UNUSED
 		if (-1==file_truncate(file->fd, (file_offset_t)file->eoa))
 			HSYS_GOTO_ERROR(H5E_IO, H5E_SEEKERROR, FAIL, "unable to extend file properly")
 #endif
+		// The blocks past the end are not in the file anymore
+		if(file->fa.drv->m_Cache != nullptr && file->fa.drv->m_BlockSize>0)
+			file->fa.drv->m_Cache->Invalidate(file->fa.drv->m_CacheClient, NewSize / file->fa.drv->m_BlockSize * file->fa.drv->m_BlockSize, HADDR_MAX);
+		if(file->fa.drv->m_ReplLog != nullptr && file->fa.drv->m_ReplLog->SetSize(NewSize)<0)
+		{
+			file->fa.drv->m_Callback->OnH5ToLog(H5E_WRITEERROR, L"unable to append to the replication log");  
+			return FAIL;
+		}
 
 		// Update the eof value
 		file->eof = file->eoa;
+		if(file->fa.drv->m_Stats != nullptr)
+			IoCounters::Add(file->fa.drv->m_Stats->Truncates);
 
 		// Reset last file I/O information
 		file->pos = HADDR_UNDEF;
@@ -1201,9 +1385,22 @@ herr_t BlockDriver::truncate(H5FD_t *_file, hid_t UNUSED dxpl_id, hbool_t UNUSED
 herr_t BlockDriver::flush(H5FD_t *_file, hid_t dxpl_id, hbool_t closing)
 {
 	FileHandle_t  *file = (FileHandle_t*)_file;
-	intptr_t filehandle = _get_osfhandle(file->fd);
-	BOOL bRes = FlushFileBuffers((HANDLE)filehandle);
-	return (!bRes)?(FAIL):(SUCCEED);
+	IoCounters    *stats = file->fa.drv->m_Stats;
+	uint64_t       started = LatencyHistogram::Now();
+	herr_t         ret_value = SUCCEED;
+	if(file->fa.drv->m_Faults != nullptr && file->fa.drv->m_Faults->Before(FaultInjector::FAULT_FLUSH)<0)
+		ret_value = FAIL;
+	// The log goes first, a replica must not lag behind the file
+	else if(file->fa.drv->m_ReplLog != nullptr && file->fa.drv->m_ReplLog->Flush()<0)
+		return FAIL;
+	else if(file->fa.drv->m_FlushDurability >= DURABILITY_DISK && file->fa.drv->m_Commit->Sync()<0)
+		ret_value = FAIL;
+	if(stats != nullptr)
+	{
+		IoCounters::Add(stats->Flushes);
+		stats->FlushTime.Record(LatencyHistogram::Now() - started);
+	}
+	return ret_value;
 }
 haddr_t BlockDriver::alloc(H5FD_t *_file, H5FD_mem_t type, hid_t UNUSED dxpl_id, hsize_t size)
 {
@@ -1225,6 +1422,11 @@ haddr_t BlockDriver::alloc(H5FD_t *_file, H5FD_mem_t type, hid_t UNUSED dxpl_id,
             addr = ((addr / file->pub.alignment) + 1) * file->pub.alignment;
     }
 	set_eoa(_file, type, addr + size);
+	if(file->fa.drv->m_Stats != nullptr)
+	{
+		IoCounters::Add(file->fa.drv->m_Stats->Allocs);
+		IoCounters::Add(file->fa.drv->m_Stats->AllocBytes, size);
+	}
 	// Get the current fileposition
 	file_offset_t old_pos = file_tell(file->fd);
 
@@ -1241,7 +1443,7 @@ haddr_t BlockDriver::alloc(H5FD_t *_file, H5FD_mem_t type, hid_t UNUSED dxpl_id,
 	file->fa.drv->DoFillEmptyBlock(JunkMem, JunkSize);
 
 	// Jump to the right place in the file	
-	if(file_seek(file->fd, (file_offset_t)(addr), SEEK_SET) < 0)
+	if(file->fa.drv->DoSeek(file->fd, (file_offset_t)(addr), SEEK_SET) < 0)
 	{
 		file->fa.drv->m_Callback->OnH5ToLog(H5E_IO, L"unable to seek to proper position"); 
 		return FAIL;
@@ -1256,7 +1458,7 @@ haddr_t BlockDriver::alloc(H5FD_t *_file, H5FD_mem_t type, hid_t UNUSED dxpl_id,
 	HDfree(JunkMem);
 
 	// Jump back to the old place in the file	
-	if(file_seek(file->fd, (file_offset_t)(old_pos), SEEK_SET) < 0)
+	if(file->fa.drv->DoSeek(file->fd, (file_offset_t)(old_pos), SEEK_SET) < 0)
 	{
 		file->fa.drv->m_Callback->OnH5ToLog(H5E_IO, L"unable to seek to proper position"); 
 		return FAIL;
@@ -1265,4 +1467,636 @@ haddr_t BlockDriver::alloc(H5FD_t *_file, H5FD_mem_t type, hid_t UNUSED dxpl_id,
 
 	return ret_value;
 }
+
+////////////////////////////////////////////////////////////////
+// BlockSnapshot
+////////////////////////////////////////////////////////////////
+namespace
+{
+	int ReadAll(int FileHandle, file_offset_t Offset, char* Buffer, size_t Size)
+	{
+		if(file_seek(FileHandle, Offset, SEEK_SET) < 0)
+			return -1;
+		while(Size>0)
+		{
+			int res = HDread(FileHandle, Buffer, (unsigned int)Size);
+			if(res<0 && errno==EINTR)
+				continue;
+			if(res<=0)
+				return -1;
+			Buffer += res;
+			Size   -= res;
+		}
+		return 0;
+	}
+	int WriteAll(int FileHandle, file_offset_t Offset, const char* Buffer, size_t Size)
+	{
+		if(file_seek(FileHandle, Offset, SEEK_SET) < 0)
+			return -1;
+		while(Size>0)
+		{
+			int res = HDwrite(FileHandle, Buffer, (unsigned int)Size);
+			if(res<0 && errno==EINTR)
+				continue;
+			if(res<=0)
+				return -1;
+			Buffer += res;
+			Size   -= res;
+		}
+		return 0;
+	}
+	uint32_t Crc32(uint32_t Crc, const void* Data, size_t Size)
+	{
+		static const std::vector<uint32_t> Table = []()
+		{
+			std::vector<uint32_t> t(256);
+			for(uint32_t i = 0; i < 256; i++)
+			{
+				uint32_t c = i;
+				for(int k = 0; k < 8; k++)
+					c = (c & 1)?(0xEDB88320 ^ (c >> 1)):(c >> 1);
+				t[i] = c;
+			}
+			return t;
+		}();
+		const uint8_t* p = (const uint8_t*)Data;
+		Crc = ~Crc;
+		while(Size--)
+			Crc = Table[(Crc ^ *p++) & 0xFF] ^ (Crc >> 8);
+		return ~Crc;
+	}
+	const char* ReplicationSignature = "XDXRLOG\0";
+	const char* RekeySignature       = "XDXREKY\0";
+}
+BlockSnapshot::BlockSnapshot(size_t BlockSize)
+{
+	m_Source      = -1;
+	m_Target      = -1;
+	m_BlockSize   = (BlockSize>0)?BlockSize:FBSIZE_DEF;
+	m_Size        = 0;
+	m_Next        = 0;
+	m_Pending     = 0;
+	m_Incremental = false;
+	m_Cloned      = false;
+	m_Failed      = false;
+	m_Written     = 0;
+}
+BlockSnapshot::~BlockSnapshot()
+{
+	Close();
+}
+////////////////////////////////////////////////////////////////
+// Description:  
+//      Takes the snapshot of Source as it is on the disk now. The
+//      caller makes sure that nothing is written meanwhile.
+// Return: 
+//      Success:  0, IsCloned tells if the copy is complete already
+//      Failure:  Negative
+////////////////////////////////////////////////////////////////
+int BlockSnapshot::Open(const char* Source, const char* Target)
+{
+	h5_stat_t sb;
+	Close();
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	m_Cloned  = false;
+	m_Failed  = false;
+	m_Written = 0;
+	if((m_Source = HDopen(Source, O_RDONLY, 0))<0 || HDfstat(m_Source, &sb)<0)
+		return -1;
+	m_Size = (haddr_t)sb.st_size;
+
+	// An older snapshot in place is updated rather than rewritten
+	m_Target      = HDopen(Target, O_RDWR, 0);
+	m_Incremental = (m_Target>=0);
+	if(m_Target<0 && (m_Target = HDopen(Target, O_RDWR | O_CREAT | O_TRUNC, 0666))<0)
+		return -1;
+#ifdef FICLONE
+	// The file system shares the extents, nothing is left to copy
+	if(ioctl(m_Target, FICLONE, m_Source)==0)
+	{
+		m_Cloned  = true;
+		m_Written = m_Size;
+		return 0;
+	}
+#endif
+#ifdef H5_HAVE_WIN32_API
+	if(_chsize_s(m_Target, (file_offset_t)m_Size)!=0)
+		return -1;
+#else
+	if(file_truncate(m_Target, (file_offset_t)m_Size)!=0)
+		return -1;
+#endif
+	size_t Blocks = (size_t)((m_Size + m_BlockSize - 1) / m_BlockSize);
+	m_Copied.assign(Blocks, false);
+	m_Pending = Blocks;
+	m_Next    = 0;
+	return 0;
+}
+////////////////////////////////////////////////////////////////
+// Description:  
+//      Copies the pending blocks of the region before the source
+//      changes them. Called by the writer, the region may span
+//      past the snapshot size.
+// Return: 
+//      Success:  0
+//      Failure:  Negative, the snapshot is failed
+////////////////////////////////////////////////////////////////
+int BlockSnapshot::Preserve(haddr_t Addr, haddr_t Size)
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	if(m_Pending==0 || m_Failed || Size==0 || Addr >= m_Size)
+		return 0;
+	size_t First = (size_t)(Addr / m_BlockSize);
+	size_t Last  = (size_t)((MIN(Addr + Size, m_Size) - 1) / m_BlockSize);
+	for(size_t Block = First; Block <= Last; )
+	{
+		if(m_Copied[Block])
+		{
+			Block++;
+			continue;
+		}
+		size_t End = Block;
+		while(End <= Last && !m_Copied[End])
+			End++;
+		if(CopyRun(Block, End - Block)<0)
+		{
+			m_Failed = true;
+			return -1;
+		}
+		Block = End;
+	}
+	return 0;
+}
+int BlockSnapshot::CopyNext(size_t MaxBytes, size_t* Copied)
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	*Copied = 0;
+	if(m_Failed)
+		return -1;
+	size_t Blocks = m_Copied.size();
+	while(m_Next < Blocks && m_Copied[m_Next])
+		m_Next++;
+	if(m_Next == Blocks)
+		return 0;
+	size_t MaxBlocks = MAX(MaxBytes / m_BlockSize, (size_t)1);
+	size_t End = m_Next;
+	while(End < Blocks && !m_Copied[End] && End - m_Next < MaxBlocks)
+		End++;
+	if(CopyRun(m_Next, End - m_Next)<0)
+	{
+		m_Failed = true;
+		return -1;
+	}
+	*Copied = (End - m_Next) * m_BlockSize;
+	m_Next  = End;
+	return 0;
+}
+int BlockSnapshot::CopyAll()
+{
+	size_t Copied = 0;
+	while(!IsDone())
+	{
+		if(CopyNext(CBSIZE_DEF, &Copied)<0)
+			return -1;
+	}
+	return 0;
+}
+bool BlockSnapshot::IsDone()
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	return m_Cloned || m_Failed || m_Pending==0;
+}
+bool BlockSnapshot::IsFailed()
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	return m_Failed;
+}
+int BlockSnapshot::Close()
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	int ret_value = 0;
+	if(m_Target>=0 && HDclose(m_Target)<0)
+		ret_value = -1;
+	if(m_Source>=0)
+		HDclose(m_Source);
+	m_Target  = -1;
+	m_Source  = -1;
+	m_Pending = 0;
+	m_Copied.clear();
+	return ret_value;
+}
+// Copies Count blocks from First, called with the mutex held
+int BlockSnapshot::CopyRun(size_t First, size_t Count)
+{
+	file_offset_t Offset = (file_offset_t)First * m_BlockSize;
+	size_t        Bytes  = (size_t)MIN((haddr_t)Count * m_BlockSize, m_Size - (haddr_t)Offset);
+	m_Buffer.resize(Bytes);
+	if(ReadAll(m_Source, Offset, m_Buffer.data(), Bytes)<0)
+		return -1;
+	if(!m_Incremental)
+	{
+		if(WriteAll(m_Target, Offset, m_Buffer.data(), Bytes)<0)
+			return -1;
+		m_Written += Bytes;
+	}
+	else
+	{
+		// Only the blocks changed since the older snapshot are written
+		m_Existing.resize(Bytes);
+		if(ReadAll(m_Target, Offset, m_Existing.data(), Bytes)<0)
+			return -1;
+		for(size_t Pos = 0; Pos < Bytes; Pos += m_BlockSize)
+		{
+			size_t Size = MIN(m_BlockSize, Bytes - Pos);
+			if(memcmp(m_Buffer.data() + Pos, m_Existing.data() + Pos, Size)==0)
+				continue;
+			if(WriteAll(m_Target, Offset + Pos, m_Buffer.data() + Pos, Size)<0)
+				return -1;
+			m_Written += Size;
+		}
+	}
+	for(size_t Block = First; Block < First + Count; Block++)
+		m_Copied[Block] = true;
+	m_Pending -= Count;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////
+// ReplicationLog
+////////////////////////////////////////////////////////////////
+ReplicationLog::ReplicationLog()
+{
+	m_File     = -1;
+	m_End      = 0;
+	m_Sequence = 0;
+}
+ReplicationLog::~ReplicationLog()
+{
+	Close();
+}
+////////////////////////////////////////////////////////////////
+// Description:  
+//      Starts the log LogName over for the copies of the epoch
+//      Epoch, an older log there is cut off.
+// Return: 
+//      Success:  0
+//      Failure:  Negative
+////////////////////////////////////////////////////////////////
+int ReplicationLog::Open(const char* LogName, uint64_t Epoch, haddr_t EpochAddr)
+{
+	Close();
+	if((m_File = HDopen(LogName, O_RDWR | O_CREAT, 0666))<0)
+		return -1;
+	m_Sequence = 0;
+	m_End      = sizeof(ReplicationLogHeader);
+	ReplicationLogHeader Header;
+	HDmemset(&Header, 0, sizeof(Header));
+	HDmemcpy(Header.Signature, ReplicationSignature, sizeof(Header.Signature));
+	Header.Version   = LOG_VERSION;
+	Header.Epoch     = Epoch;
+	Header.EpochAddr = EpochAddr;
+	if(file_truncate(m_File, 0)!=0 || WriteAll(m_File, 0, (const char*)&Header, sizeof(Header))<0 ||
+		XDX::Platform::FileSync(m_File)!=0)
+		return -1;
+	return 0;
+}
+int ReplicationLog::Append(haddr_t Addr, const void* Buffer, size_t Size)
+{
+	return AppendRecord(REC_WRITE, Addr, Buffer, Size);
+}
+int ReplicationLog::SetSize(haddr_t Size)
+{
+	return AppendRecord(REC_SIZE, Size, nullptr, 0);
+}
+int ReplicationLog::Flush()
+{
+	if(m_File<0)
+		return 0;
+	return (XDX::Platform::FileSync(m_File)!=0)?-1:0;
+}
+int ReplicationLog::Close()
+{
+	int ret_value = 0;
+	if(m_File>=0 && (XDX::Platform::FileSync(m_File)!=0 || HDclose(m_File)<0))
+		ret_value = -1;
+	m_File = -1;
+	return ret_value;
+}
+int ReplicationLog::AppendRecord(uint32_t Type, haddr_t Addr, const void* Buffer, size_t Size)
+{
+	if(m_File<0 || Size > MAX_RECORD_SIZE)
+		return -1;
+	// One write per record, so a crash tears only the last one
+	m_Record.resize(sizeof(ReplicationRecord) + Size);
+	ReplicationRecord* Record = (ReplicationRecord*)m_Record.data();
+	Record->Type     = Type;
+	Record->Size     = (uint32_t)Size;
+	Record->Addr     = Addr;
+	Record->Sequence = m_Sequence + 1;
+	Record->Checksum = 0;
+	Record->Reserved = 0;
+	if(Size>0)
+		HDmemcpy(m_Record.data() + sizeof(ReplicationRecord), Buffer, Size);
+	Record->Checksum = Crc32(0, m_Record.data(), m_Record.size());
+	if(WriteAll(m_File, m_End, m_Record.data(), m_Record.size())<0)
+		return -1;
+	m_End += (file_offset_t)m_Record.size();
+	m_Sequence++;
+	return 0;
+}
+int ReplicationLog::ReadHeader(int FileHandle, ReplicationLogHeader& Header)
+{
+	if(ReadAll(FileHandle, 0, (char*)&Header, sizeof(Header))<0 ||
+		HDmemcmp(Header.Signature, ReplicationSignature, sizeof(Header.Signature))!=0 ||
+		Header.Version!=LOG_VERSION)
+		return -1;
+	return 0;
+}
+// Reads the record at Offset and moves past it. Fails at the end of the log or on a torn record.
+int ReplicationLog::ReadRecord(int FileHandle, file_offset_t& Offset, ReplicationRecord& Record, std::vector<char>& Payload)
+{
+	if(ReadAll(FileHandle, Offset, (char*)&Record, sizeof(Record))<0 ||
+		(Record.Type!=REC_WRITE && Record.Type!=REC_SIZE) || Record.Size > MAX_RECORD_SIZE)
+		return -1;
+	Payload.resize(Record.Size);
+	if(Record.Size>0 && ReadAll(FileHandle, Offset + sizeof(Record), Payload.data(), Record.Size)<0)
+		return -1;
+	uint32_t Checksum = Record.Checksum;
+	Record.Checksum = 0;
+	uint32_t Crc = Crc32(Crc32(0, &Record, sizeof(Record)), Payload.data(), Payload.size());
+	Record.Checksum = Checksum;
+	if(Crc!=Checksum)
+		return -1;
+	Offset += (file_offset_t)(sizeof(Record) + Record.Size);
+	return 0;
+}
+////////////////////////////////////////////////////////////////
+// Description:  
+//      Rolls the copy Target forward by the records of the log
+//      LogName. The copy must be of the epoch of the log.
+// Return: 
+//      Success:  0, Applied is the number of records applied
+//      Failure:  enApplyErrors, Applied records are applied
+////////////////////////////////////////////////////////////////
+int ReplicationLog::Apply(const char* LogName, const char* Target, uint64_t* Applied)
+{
+	*Applied = 0;
+	int Log = HDopen(LogName, O_RDONLY, 0);
+	if(Log<0)
+		return APPLY_FAILED;
+	int Dst = -1;
+	int ret_value = APPLY_FAILED;
+	ReplicationLogHeader Header;
+	h5_stat_t sb;
+	if(HDfstat(Log, &sb)==0 && ReadHeader(Log, Header)==0 && (Dst = HDopen(Target, O_RDWR, 0))>=0)
+	{
+		uint64_t Epoch = 0;
+		if(ReadAll(Dst, (file_offset_t)Header.EpochAddr, (char*)&Epoch, sizeof(Epoch))<0 || Epoch!=Header.Epoch)
+		{
+			HDclose(Dst);
+			HDclose(Log);
+			return APPLY_EPOCH;
+		}
+		ReplicationRecord Record;
+		std::vector<char> Payload;
+		file_offset_t Offset = sizeof(ReplicationLogHeader);
+		file_offset_t LogEnd = (file_offset_t)sb.st_size;
+		ret_value = 0;
+		while(ret_value==0 && Offset<LogEnd)
+		{
+			file_offset_t Start = Offset;
+			HDmemset(&Record, 0, sizeof(Record));
+			if(ReadRecord(Log, Offset, Record, Payload)!=0)
+			{
+				// Only the record written last may be torn by a crash, it runs to the end
+				// of the file. A bad record before it is a damaged log, not its end.
+				file_offset_t End = Start + (file_offset_t)sizeof(Record);
+				if(End<=LogEnd && Record.Size<=MAX_RECORD_SIZE)
+					End += (file_offset_t)Record.Size;
+				if(End<LogEnd)
+					ret_value = APPLY_CORRUPT;
+				break;
+			}
+			if(Record.Type==REC_WRITE)
+				ret_value = WriteAll(Dst, (file_offset_t)Record.Addr, Payload.data(), Payload.size());
+			else
+			{
+#ifdef H5_HAVE_WIN32_API
+				ret_value = (_chsize_s(Dst, (file_offset_t)Record.Addr)!=0)?-1:0;
+#else
+				ret_value = (file_truncate(Dst, (file_offset_t)Record.Addr)!=0)?-1:0;
+#endif
+			}
+			if(ret_value==0)
+				(*Applied)++;
+		}
+		if(XDX::Platform::FileSync(Dst)!=0 || HDclose(Dst)<0)
+			ret_value = -1;
+	}
+	HDclose(Log);
+	return ret_value;
+}
+
+////////////////////////////////////////////////////////////////
+// BlockRekey
+////////////////////////////////////////////////////////////////
+BlockRekey::BlockRekey()
+{
+	m_Target    = -1;
+	m_Journal   = -1;
+	m_BlockSize = FBSIZE_DEF;
+	m_Mark      = 0;
+	m_Sequence  = 0;
+	m_Broken    = false;
+}
+BlockRekey::~BlockRekey()
+{
+	Close();
+}
+////////////////////////////////////////////////////////////////
+// Description:  
+//      Starts the recoding of Target from Start on with a new
+//      journal JournalName, an older one is overwritten. Record
+//      is kept in the journal for the owner.
+// Return: 
+//      Success:  0, the journal is synced
+//      Failure:  Negative
+////////////////////////////////////////////////////////////////
+int BlockRekey::Create(const char* Target, const char* JournalName, size_t BlockSize, haddr_t Start, const void* Record, size_t RecordSize)
+{
+	Close();
+	if(BlockSize==0 || RecordSize > MAX_RECORD_SIZE)
+		return -1;
+	if((m_Target = HDopen(Target, O_RDWR, 0))<0 ||
+		(m_Journal = HDopen(JournalName, O_RDWR | O_CREAT | O_TRUNC, 0666))<0)
+		return -1;
+	m_JournalName = JournalName;
+	m_BlockSize   = BlockSize;
+	m_Mark        = Start;
+	m_Sequence    = 0;
+	m_Broken      = false;
+	m_Record.assign((const char*)Record, (const char*)Record + RecordSize);
+	if(WriteSlot(0, 0)<0 || XDX::Platform::FileSync(m_Journal)!=0)
+		return -1;
+	return 0;
+}
+////////////////////////////////////////////////////////////////
+// Description:  
+//      Opens the journal JournalName of Target left by an earlier
+//      session. The batch of the slot in effect was not marked
+//      applied, it is written again when it reached the journal
+//      whole: the file may have got any part of it.
+// Return: 
+//      Success:  0, GetMark is where the recoding stopped
+//      Failure:  Negative
+////////////////////////////////////////////////////////////////
+int BlockRekey::Open(const char* Target, const char* JournalName)
+{
+	Close();
+	if((m_Journal = HDopen(JournalName, O_RDWR, 0))<0 ||
+		(m_Target = HDopen(Target, O_RDWR, 0))<0)
+		return -1;
+	RekeyJournalSlot Slots[2];
+	bool Valid[2];
+	for(int i = 0; i < 2; i++)
+		Valid[i] = (ReadSlot(m_Journal, i, Slots[i])==0);
+	if(!Valid[0] && !Valid[1])
+		return -1;
+	int Slot = (Valid[0] && (!Valid[1] || Slots[0].Sequence > Slots[1].Sequence))?0:1;
+	const RekeyJournalSlot& Header = Slots[Slot];
+	m_JournalName = JournalName;
+	m_BlockSize   = Header.BlockSize;
+	m_Mark        = Header.Mark;
+	m_Sequence    = Header.Sequence;
+	m_Broken      = false;
+	m_Record.assign(Header.Record, Header.Record + Header.RecordSize);
+	if(Header.BatchSize==0)
+		return 0;
+	// A batch torn in the journal was not written to the file at all
+	m_Buffer.resize(Header.BatchSize);
+	if(ReadAll(m_Journal, BatchOffset(Slot), m_Buffer.data(), Header.BatchSize)<0 ||
+		Crc32(0, m_Buffer.data(), Header.BatchSize)!=Header.BatchChecksum)
+		return 0;
+	return ApplyBatch(Header.BatchSize);
+}
+////////////////////////////////////////////////////////////////
+// Description:  
+//      Recodes the next batch of up to MaxBytes whole blocks from
+//      the mark on, by Recode, and moves the mark past it. The
+//      end of the file is taken anew on every call, so the blocks
+//      appended meanwhile are recoded as well.
+// Return: 
+//      Success:  0, Done is the bytes recoded, 0 at the end
+//      Failure:  Negative, the mark stays
+////////////////////////////////////////////////////////////////
+int BlockRekey::Next(size_t MaxBytes, const Recoder& Recode, size_t* Done)
+{
+	h5_stat_t sb;
+	*Done = 0;
+	if(m_Target<0 || m_Journal<0 || m_Broken || HDfstat(m_Target, &sb)<0)
+		return -1;
+	haddr_t End = (haddr_t)sb.st_size / m_BlockSize * m_BlockSize;
+	if(m_Mark >= End)
+		return 0;
+	size_t Blocks = MIN(MIN(MaxBytes, (size_t)MAX_BATCH_SIZE) / m_BlockSize, (size_t)((End - m_Mark) / m_BlockSize));
+	if(Blocks==0)
+		Blocks = 1;
+	size_t Size = Blocks * m_BlockSize;
+	m_Buffer.resize(Size);
+	if(ReadAll(m_Target, (file_offset_t)m_Mark, m_Buffer.data(), Size)<0 ||
+		Recode(m_Mark, m_Buffer.data(), Blocks)<0)
+		return -1;
+
+	// 1. The batch and then the slot naming it, synced before the file is touched
+	int Slot = (int)((m_Sequence + 1) % 2);
+	if(WriteAll(m_Journal, BatchOffset(Slot), m_Buffer.data(), Size)<0 ||
+		WriteSlot((uint32_t)Size, Crc32(0, m_Buffer.data(), Size))<0 ||
+		XDX::Platform::FileSync(m_Journal)!=0)
+		return -1;
+
+	// 2. The file, from here on a failure leaves the batch to Open
+	if(ApplyBatch(Size)<0)
+		return -1;
+	*Done = Size;
+	return 0;
+}
+int BlockRekey::Close()
+{
+	int ret_value = 0;
+	if(m_Journal>=0 && HDclose(m_Journal)<0)
+		ret_value = -1;
+	if(m_Target>=0 && HDclose(m_Target)<0)
+		ret_value = -1;
+	m_Journal = -1;
+	m_Target  = -1;
+	return ret_value;
+}
+// Deletes the journal once the owner no longer needs the mark
+int BlockRekey::Remove()
+{
+	int ret_value = Close();
+	if(!m_JournalName.empty() && !XDX::Platform::FileDelete(m_JournalName.c_str()))
+		ret_value = -1;
+	return ret_value;
+}
+// Writes the batch in m_Buffer at the mark, tried twice, and marks it
+// applied. Until it is marked the rekey is broken, see IsBroken.
+int BlockRekey::ApplyBatch(size_t Size)
+{
+	m_Broken = true;
+	for(int Try = 0; Try < 2 && m_Broken; Try++)
+	{
+		if(WriteAll(m_Target, (file_offset_t)m_Mark, m_Buffer.data(), Size)>=0 &&
+			XDX::Platform::FileSync(m_Target)==0)
+			m_Broken = false;
+	}
+	if(m_Broken)
+		return -1;
+	// The slot of the batch stays in effect if this one is torn, Open writes it again
+	m_Mark += Size;
+	if(WriteSlot(0, 0)<0 || XDX::Platform::FileSync(m_Journal)!=0)
+	{
+		m_Mark  -= Size;
+		m_Broken = true;
+		return -1;
+	}
+	return 0;
+}
+// Writes the slot of the next sequence, the batch is at the mark
+int BlockRekey::WriteSlot(uint32_t BatchSize, uint32_t BatchChecksum)
+{
+	RekeyJournalSlot Header;
+	HDmemset(&Header, 0, sizeof(Header));
+	HDmemcpy(Header.Signature, RekeySignature, sizeof(Header.Signature));
+	Header.Version       = JOURNAL_VERSION;
+	Header.BlockSize     = (uint32_t)m_BlockSize;
+	Header.Sequence      = m_Sequence + 1;
+	Header.Mark          = m_Mark;
+	Header.BatchSize     = BatchSize;
+	Header.BatchChecksum = BatchChecksum;
+	Header.RecordSize    = (uint32_t)m_Record.size();
+	if(!m_Record.empty())
+		HDmemcpy(Header.Record, m_Record.data(), m_Record.size());
+	Header.Checksum      = Crc32(0, &Header, sizeof(Header));
+	if(WriteAll(m_Journal, (file_offset_t)(Header.Sequence % 2) * SLOT_SIZE, (const char*)&Header, sizeof(Header))<0)
+		return -1;
+	m_Sequence = Header.Sequence;
+	return 0;
+}
+int BlockRekey::ReadSlot(int FileHandle, int Slot, RekeyJournalSlot& Header)
+{
+	if(ReadAll(FileHandle, (file_offset_t)Slot * SLOT_SIZE, (char*)&Header, sizeof(Header))<0 ||
+		HDmemcmp(Header.Signature, RekeySignature, sizeof(Header.Signature))!=0 ||
+		Header.Version!=JOURNAL_VERSION)
+		return -1;
+	uint32_t Checksum = Header.Checksum;
+	Header.Checksum = 0;
+	if(Crc32(0, &Header, sizeof(Header))!=Checksum)
+		return -1;
+	Header.Checksum = Checksum;
+	if(Header.BlockSize==0 || Header.RecordSize > MAX_RECORD_SIZE || Header.BatchSize > MAX_BATCH_SIZE ||
+		Header.Sequence % 2!=(uint64_t)Slot)
+		return -1;
+	return 0;
+}
 }
@@ -1,9 +1,20 @@
 #pragma once
+#include "platform.h"
 
 extern "C"
 {
 #include "H5Ipublic.h"
 }
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "H5FDcache.h"
+#include "H5FDfault.h"
+#include "H5FDmem.h"
+#include "H5FDstats.h"
+#include "H5FDsync.h"
 
 #pragma region Defines
 // These macros check for overflow of various quantities.  These macros
@@ -71,6 +82,7 @@ namespace XHdf5
 		OP_WRITE    = 2,
 	};
 	class BlockDriver;
+	class ReplicationLog;
 	// Driver-specific file access properties
 	typedef struct 
 	{
@@ -125,12 +137,18 @@ namespace XHdf5
 	class DriverCallback
 	{
 	public:
+		// The last 8 bytes of the user block hold the replication epoch of the driver
 		virtual int OnH5WriteUserBlock(void * Buffer, unsigned int Size)=0;
 		virtual int OnH5ReadUserBlock(void * Buffer, unsigned int Size)=0;
 		virtual int OnH5FillEmptyBlock(void * Buffer, unsigned int Size)=0;
-		virtual int OnH5AfterBlockRead(void * Buffer, unsigned int Size)=0;
-		virtual int OnH5BeforeBlockWrite(void * Buffer, unsigned int Size)=0;
+		// Addr is where the block is in the file
+		virtual int OnH5AfterBlockRead(haddr_t Addr, void * Buffer, unsigned int Size)=0;
+		// The Count blocks read ahead at the open from Addr on, in one buffer
+		virtual int OnH5AfterBlocksRead(haddr_t Addr, void * Buffer, unsigned int BlockSize, unsigned int Count)=0;
+		virtual int OnH5BeforeBlockWrite(haddr_t Addr, void * Buffer, unsigned int Size)=0;
 		virtual void OnH5ToLog(DWORD Event, LPCWSTR Message)=0;
+		// Called before the region [Addr, Addr+Size) of the file is overwritten or cut off
+		virtual int OnH5BeforeOverwrite(haddr_t Addr, haddr_t Size)=0;
 	};
 
 	class BlockDriver
@@ -149,6 +167,53 @@ namespace XHdf5
 		{
 			return m_BlockSize;
 		}
+		// The blocks written from now on are appended to Log, nullptr stops it
+		void SetReplicationLog(ReplicationLog* Log)
+		{
+			m_ReplLog = Log;
+		}
+		int StartReplication(ReplicationLog* Log, const char* LogName, uint64_t Epoch);
+		// The decrypted blocks are kept in Cache as Client, set before Attach
+		void SetBlockCache(BlockCache* Cache, BlockCache::client_t Client)
+		{
+			m_Cache       = Cache;
+			m_CacheClient = Client;
+		}
+		// The open reads Bytes past the user block along with it and keeps
+		// them in the block cache, set before Attach
+		void SetPrefetch(size_t Bytes)
+		{
+			m_Prefetch = Bytes;
+		}
+		// The I/O is counted into Stats, nullptr stops it
+		void SetStats(IoCounters* Stats)
+		{
+			m_Stats = Stats;
+		}
+		// The disk reads, writes, flushes and truncates go through Faults,
+		// for the tests; nullptr is the disk as it is
+		void SetFaultInjector(FaultInjector* Faults)
+		{
+			m_Faults = Faults;
+		}
+		// How far the flush callback takes the data: DURABILITY_DISK syncs
+		// through the group commit, DURABILITY_OS leaves the sync to Sync
+		void SetFlushDurability(int Level)
+		{
+			m_FlushDurability = Level;
+		}
+		int GetFlushDurability()
+		{
+			return m_FlushDurability;
+		}
+		// Milliseconds a sync waits for more callers to share it
+		void SetCommitDelay(uint32_t MaxDelay);
+		// The group commit of the open file; its Sync may be called without
+		// the owner's lock and stays valid after the file is closed
+		std::shared_ptr<GroupCommit> GetGroupCommit()
+		{
+			return m_Commit;
+		}
 	protected: // Low-level routines
 		hid_t  InitDriver(void);
 		static void TerminateDriver(void);
@@ -158,6 +223,8 @@ namespace XHdf5
 		int DoReadUserBlock(void * Buffer, unsigned int Size);
 		int DoBlockRead(int FileHandle, void * Buffer, unsigned int Size);
 		int DoBlockWrite(int FileHandle, void * Buffer, unsigned int Size);
+		int DoBeforeOverwrite(haddr_t Addr, haddr_t Size);
+		file_offset_t DoSeek(int FileHandle, file_offset_t Offset, int Origin);
 	protected: // Callbacks
 		static void*   fapl_get(H5FD_t *_file);
 		static void*   fapl_copy(const void *_old_fa);
@@ -177,11 +244,197 @@ namespace XHdf5
 	private:
 		static hid_t    m_DriverID;    // The driver identification number, initialized at runtime
 		DriverCallback* m_Callback;    // User defined callbacks optionally used by the driver
+		ReplicationLog* m_ReplLog;     // Receives the written blocks, not owned
+		uint64_t        m_ReplEpoch;   // Kept at the end of the user block, see ReplicationLog
+		BlockCache*     m_Cache;       // Shared by the drivers of a process, not owned
+		BlockCache::client_t m_CacheClient;
+		IoCounters*     m_Stats;       // Kept by the owner, not owned
+		FaultInjector*  m_Faults;      // Not owned
+		std::shared_ptr<GroupCommit> m_Commit;  // Syncs of the open file
+		uint32_t        m_CommitDelay;
+		int             m_FlushDurability;
+		size_t          m_Prefetch;    // Read ahead at the open
 		FileHandle_t*   m_File;
 		size_t          m_UBlockSize;  // User block size
 		size_t          m_BlockSize;   // File block size
 		size_t          m_MemBufSize;  // Memory to be allocated for copying data
 	};
+
+	// A point-in-time copy of a file written through the BlockDriver. Open
+	// reflinks the whole file where the file system can share the extents.
+	// Otherwise the blocks are copied in the background by CopyNext, and
+	// the owner of the driver calls Preserve from OnH5BeforeOverwrite so
+	// that a block still pending is copied before it changes. When the
+	// target holds an older snapshot only the blocks that differ are written.
+	class BlockSnapshot
+	{
+	public:
+		BlockSnapshot(size_t BlockSize);
+		virtual ~BlockSnapshot();
+		int  Open(const char* Source, const char* Target);
+		int  Preserve(haddr_t Addr, haddr_t Size);
+		int  CopyNext(size_t MaxBytes, size_t* Copied);
+		int  CopyAll();
+		int  Close();
+		bool IsCloned(){return m_Cloned;}
+		bool IsDone();
+		bool IsFailed();
+		uint64_t GetWrittenBytes(){return m_Written;}
+	protected:
+		int  CopyRun(size_t First, size_t Count);
+	private:
+		std::mutex        m_Mutex;
+		int               m_Source;
+		int               m_Target;
+		size_t            m_BlockSize;
+		haddr_t           m_Size;         // The source size at the snapshot point
+		std::vector<bool> m_Copied;       // By block
+		size_t            m_Next;         // The background copy is done below this block
+		size_t            m_Pending;      // Blocks not copied yet
+		bool              m_Incremental;  // The target held an older snapshot
+		bool              m_Cloned;
+		bool              m_Failed;       // A block was lost, the snapshot is useless
+		uint64_t          m_Written;      // Bytes actually written to the target
+		std::vector<char> m_Buffer;
+		std::vector<char> m_Existing;
+	};
+
+	#pragma pack(push, 1)
+	struct ReplicationLogHeader
+	{
+		char     Signature[8];   // "XDXRLOG" - The replication log signature
+		uint32_t Version;
+		uint32_t Reserved;
+		uint64_t Epoch;          // Of the copies the log applies to
+		uint64_t EpochAddr;      // Where a copy keeps its epoch
+	};
+	struct ReplicationRecord
+	{
+		uint32_t Type;           // ReplicationLog::enRecordTypes
+		uint32_t Size;           // Bytes following the record
+		uint64_t Addr;           // Where they go, the new file size for REC_SIZE
+		uint64_t Sequence;       // Of the record in the log, from 1
+		uint32_t Checksum;       // CRC-32 of the record with this field zeroed and the bytes
+		uint32_t Reserved;
+	};
+	#pragma pack(pop)
+
+	// The redo log of a file written through the BlockDriver. Every block is
+	// recorded as it goes to the disk, that is after OnH5BeforeBlockWrite, so
+	// an encrypted container ships only the ciphertext. The records hold the
+	// absolute addresses, so Apply rolls any copy of the file taken after the
+	// log was started forward, and a log may be applied more than once. A
+	// torn record at the end of the log ends it, a bad one before fails Apply.
+	// Every log starts a new epoch, stamped into the user block of the file,
+	// the previous log records the stamp. Apply takes only a copy of the same
+	// epoch, that is one taken after the start or rolled forward to it, so a
+	// copy missing the writes between two logs is refused.
+	class ReplicationLog
+	{
+	public:
+		enum enRecordTypes
+		{
+			REC_WRITE = 1,
+			REC_SIZE  = 2,
+		};
+		enum enLimits
+		{
+			LOG_VERSION     = 2,
+			MAX_RECORD_SIZE = 64*1024*1024
+		};
+		enum enApplyErrors
+		{
+			APPLY_FAILED  = -1,
+			APPLY_EPOCH   = -2,   // The copy is of another epoch
+			APPLY_CORRUPT = -3,   // A bad record before the end of the log
+		};
+		ReplicationLog();
+		virtual ~ReplicationLog();
+		int  Open(const char* LogName, uint64_t Epoch, haddr_t EpochAddr);
+		int  Append(haddr_t Addr, const void* Buffer, size_t Size);
+		int  SetSize(haddr_t Size);
+		int  Flush();
+		int  Close();
+		uint64_t GetSequence(){return m_Sequence;}
+		static int Apply(const char* LogName, const char* Target, uint64_t* Applied);
+	protected:
+		int  AppendRecord(uint32_t Type, haddr_t Addr, const void* Buffer, size_t Size);
+		static int ReadHeader(int FileHandle, ReplicationLogHeader& Header);
+		static int ReadRecord(int FileHandle, file_offset_t& Offset, ReplicationRecord& Record, std::vector<char>& Payload);
+	private:
+		int               m_File;
+		file_offset_t     m_End;        // Where the next record goes
+		uint64_t          m_Sequence;   // Of the last record
+		std::vector<char> m_Record;
+	};
+
+	#pragma pack(push, 1)
+	struct RekeyJournalSlot
+	{
+		char     Signature[8];   // "XDXREKY" - The rekey journal signature
+		uint32_t Version;
+		uint32_t BlockSize;
+		uint64_t Sequence;       // Of the slot, the later of the two valid slots is in effect
+		uint64_t Mark;           // The blocks below are recoded
+		uint32_t BatchSize;      // Bytes at Mark held by the journal for this slot, 0 - none or applied
+		uint32_t BatchChecksum;  // CRC-32 of the batch
+		uint32_t RecordSize;
+		uint32_t Checksum;       // CRC-32 of the slot with this field zeroed
+		char     Record[1024];   // Kept for the owner, e.g. the new key as wrapped
+	};
+	#pragma pack(pop)
+
+	// Recodes a file written through the BlockDriver in place, block by
+	// block from Start to the end, e.g. under a new key. The blocks below
+	// the mark are recoded and the rest are not, so the owner picks the
+	// codec of a block by its address and keeps the driver idle while Next
+	// runs. A batch is synced to the journal before it is written over the
+	// file, and once the file is synced a slot with the mark past it and no
+	// batch marks it applied. Open writes again only a batch not marked
+	// applied, so the blocks written after the batch are never reverted.
+	// The two slots of the journal are written in turn, each with its own
+	// batch area: a torn slot leaves the other one, and its batch, in effect.
+	// A batch that cannot be applied breaks the rekey: the blocks at the
+	// mark are under either key until Open replays it, so the owner stops
+	// the I/O on IsBroken.
+	class BlockRekey
+	{
+	public:
+		enum enLimits
+		{
+			JOURNAL_VERSION = 1,
+			SLOT_SIZE       = 4096,
+			MAX_RECORD_SIZE = 1024,
+			MAX_BATCH_SIZE  = 16*1024*1024
+		};
+		// Recodes Count blocks read from Addr in place, negative to fail
+		typedef std::function<int(haddr_t Addr, char* Blocks, size_t Count)> Recoder;
+		BlockRekey();
+		virtual ~BlockRekey();
+		int  Create(const char* Target, const char* JournalName, size_t BlockSize, haddr_t Start, const void* Record, size_t RecordSize);
+		int  Open(const char* Target, const char* JournalName);
+		int  Next(size_t MaxBytes, const Recoder& Recode, size_t* Done);
+		int  Close();
+		int  Remove();
+		haddr_t GetMark(){return m_Mark;}
+		bool    IsBroken(){return m_Broken;}
+		const std::vector<char>& GetRecord(){return m_Record;}
+	protected:
+		int  WriteSlot(uint32_t BatchSize, uint32_t BatchChecksum);
+		int  ApplyBatch(size_t Size);
+		static int ReadSlot(int FileHandle, int Slot, RekeyJournalSlot& Header);
+		static file_offset_t BatchOffset(int Slot){return (file_offset_t)2*SLOT_SIZE + (file_offset_t)Slot*MAX_BATCH_SIZE;}
+	private:
+		int               m_Target;
+		int               m_Journal;
+		std::string       m_JournalName;
+		size_t            m_BlockSize;
+		haddr_t           m_Mark;
+		uint64_t          m_Sequence;   // Of the last slot written
+		bool              m_Broken;     // A batch is in the journal and not applied
+		std::vector<char> m_Record;
+		std::vector<char> m_Buffer;
+	};
 }
 
 
@@ -0,0 +1,155 @@
+#include "stdafx.h"
+#include "H5FDcache.h"
+#include <cstring>
+
+namespace XHdf5
+{
+BlockCache::BlockCache(uint64_t Budget)
+{
+	m_NextClient = 1;
+	m_Budget     = Budget;
+	m_Used       = 0;
+	m_Hits       = 0;
+	m_Misses     = 0;
+	m_Evictions  = 0;
+}
+BlockCache::~BlockCache()
+{
+}
+BlockCache::client_t BlockCache::Register(uint64_t Quota)
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	client_t Id = m_NextClient++;
+	Client& Item = m_Clients[Id];
+	Item.quota = (Quota>0 && Quota<m_Budget)?Quota:m_Budget;
+	Item.used  = 0;
+	return Id;
+}
+void BlockCache::Unregister(client_t Client)
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	auto iiClient = m_Clients.find(Client);
+	if(iiClient==m_Clients.end())
+		return;
+	m_Used -= iiClient->second.used;
+	m_Clients.erase(iiClient);
+}
+bool BlockCache::Lookup(client_t Client, uint64_t Addr, void* Buffer, size_t Size, size_t BlockSize)
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	auto iiClient = m_Clients.find(Client);
+	if(iiClient==m_Clients.end() || BlockSize==0 || Size==0 || Addr % BlockSize || Size % BlockSize)
+		return false;
+	BlockCache::Client& Owner = iiClient->second;
+
+	// All or nothing, so a miss costs the caller a single read
+	std::vector<BlockList::iterator> Found;
+	Found.reserve(Size / BlockSize);
+	for(uint64_t Pos = Addr; Pos < Addr + Size; Pos += BlockSize)
+	{
+		auto iiBlock = Owner.index.find(Pos);
+		if(iiBlock==Owner.index.end() || iiBlock->second->data.size()!=BlockSize)
+		{
+			m_Misses++;
+			return false;
+		}
+		Found.push_back(iiBlock->second);
+	}
+	char* Out = (char*)Buffer;
+	for(auto Item: Found)
+	{
+		memcpy(Out, Item->data.data(), BlockSize);
+		Out += BlockSize;
+		Owner.lru.splice(Owner.lru.begin(), Owner.lru, Item);
+	}
+	m_Hits++;
+	return true;
+}
+void BlockCache::Insert(client_t Client, uint64_t Addr, const void* Buffer, size_t Size, size_t BlockSize)
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	auto iiClient = m_Clients.find(Client);
+	if(iiClient==m_Clients.end() || BlockSize==0 || Addr % BlockSize)
+		return;
+	BlockCache::Client& Owner = iiClient->second;
+	const char* In = (const char*)Buffer;
+	for(size_t Pos = 0; Pos < Size; Pos += BlockSize)
+	{
+		auto iiBlock = Owner.index.find(Addr + Pos);
+		if(Size - Pos < BlockSize)
+		{
+			// The tail block changed only in part
+			if(iiBlock!=Owner.index.end())
+				Drop(Owner, iiBlock->second);
+			break;
+		}
+		if(iiBlock!=Owner.index.end())
+		{
+			memcpy(iiBlock->second->data.data(), In + Pos, BlockSize);
+			Owner.lru.splice(Owner.lru.begin(), Owner.lru, iiBlock->second);
+			continue;
+		}
+		Block Item;
+		Item.addr = Addr + Pos;
+		Item.data.assign(In + Pos, In + Pos + BlockSize);
+		Owner.lru.push_front(std::move(Item));
+		Owner.index[Addr + Pos] = Owner.lru.begin();
+		Owner.used += BlockSize;
+		m_Used     += BlockSize;
+	}
+	Evict(Owner);
+}
+void BlockCache::Invalidate(client_t Client, uint64_t From, uint64_t To)
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	auto iiClient = m_Clients.find(Client);
+	if(iiClient==m_Clients.end())
+		return;
+	BlockCache::Client& Owner = iiClient->second;
+	auto iiBlock = Owner.index.lower_bound(From);
+	while(iiBlock!=Owner.index.end() && iiBlock->first < To)
+	{
+		auto Item = (iiBlock++)->second;
+		Drop(Owner, Item);
+	}
+}
+void BlockCache::GetStats(BlockCacheStats& Stats)
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	Stats.Budget    = m_Budget;
+	Stats.Used      = m_Used;
+	Stats.Hits      = m_Hits;
+	Stats.Misses    = m_Misses;
+	Stats.Evictions = m_Evictions;
+	Stats.Clients   = (uint32_t)m_Clients.size();
+}
+void BlockCache::Drop(Client& Owner, BlockList::iterator Item)
+{
+	Owner.used -= Item->data.size();
+	m_Used     -= Item->data.size();
+	Owner.index.erase(Item->addr);
+	Owner.lru.erase(Item);
+}
+// Called with the mutex held after Owner grew
+void BlockCache::Evict(Client& Owner)
+{
+	while(Owner.used > Owner.quota && !Owner.lru.empty())
+	{
+		Drop(Owner, std::prev(Owner.lru.end()));
+		m_Evictions++;
+	}
+	while(m_Used > m_Budget)
+	{
+		Client* Victim = nullptr;
+		for(auto& iiClient: m_Clients)
+		{
+			if(!iiClient.second.lru.empty() && (Victim==nullptr || iiClient.second.used > Victim->used))
+				Victim = &iiClient.second;
+		}
+		if(Victim==nullptr)
+			break;
+		Drop(*Victim, std::prev(Victim->lru.end()));
+		m_Evictions++;
+	}
+}
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "H5FDmem.h"
+
+namespace XHdf5
+{
+	struct BlockCacheStats
+	{
+		uint64_t Budget;       // Bytes the cache may hold
+		uint64_t Used;         // Bytes held
+		uint64_t Hits;         // Reads served from the cache
+		uint64_t Misses;
+		uint64_t Evictions;    // Blocks dropped for the budget or a quota
+		uint32_t Clients;
+	};
+
+	////////////////////////////////////////////////////////////////
+	// The decrypted blocks of many files under one memory budget.
+	// Every BlockDriver using the cache registers as a client with
+	// a quota of its own. A client over its quota drops its least
+	// recently used blocks; when the cache is over the budget the
+	// client holding the most bytes gives up its oldest one.
+	//
+	// The blocks are kept as the driver returns them from a read,
+	// so the writes update them before they are encrypted.
+	////////////////////////////////////////////////////////////////
+	class BlockCache
+	{
+	public:
+		typedef uint32_t client_t;
+
+		BlockCache(uint64_t Budget);
+		virtual ~BlockCache();
+		client_t Register(uint64_t Quota);
+		void     Unregister(client_t Client);
+		// Copies the blocks of [Addr, Addr+Size) when every one of them is cached
+		bool     Lookup(client_t Client, uint64_t Addr, void* Buffer, size_t Size, size_t BlockSize);
+		// Keeps the whole blocks of [Addr, Addr+Size), a partial tail block is dropped
+		void     Insert(client_t Client, uint64_t Addr, const void* Buffer, size_t Size, size_t BlockSize);
+		// Drops the blocks starting in [From, To)
+		void     Invalidate(client_t Client, uint64_t From, uint64_t To);
+		void     GetStats(BlockCacheStats& Stats);
+	private:
+		struct Block
+		{
+			uint64_t          addr;
+			std::vector<char, DataAllocator<char>> data;   // Off the node of the thread that read it
+		};
+		typedef std::list<Block> BlockList;
+		struct Client
+		{
+			uint64_t quota;
+			uint64_t used;
+			BlockList lru;                                   // The most recent first
+			std::map<uint64_t, BlockList::iterator> index;   // By the address
+		};
+		void Drop(Client& Owner, BlockList::iterator Item);
+		void Evict(Client& Owner);
+	private:
+		std::mutex                              m_Mutex;
+		std::unordered_map<client_t, Client>    m_Clients;
+		client_t                                m_NextClient;
+		uint64_t                                m_Budget;
+		uint64_t                                m_Used;
+		uint64_t                                m_Hits;
+		uint64_t                                m_Misses;
+		uint64_t                                m_Evictions;
+	};
+}
@@ -0,0 +1,101 @@
+#include "stdafx.h"
+#include "H5FDfault.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+namespace XHdf5
+{
+FaultInjector::FaultInjector(uint64_t Seed)
+{
+	for(int i = 0; i < FAULT_OPERATIONS; i++)
+	{
+		m_Streams[i].random.seed(Seed * FAULT_OPERATIONS + i);
+		memset(&m_Streams[i].profile, 0, sizeof(FaultProfile));
+	}
+	m_Operations = 0;
+	m_Errors     = 0;
+	m_ShortReads = 0;
+	m_DelayedUs  = 0;
+	m_CrashPoint = CRASH_NONE;
+}
+FaultInjector::~FaultInjector()
+{
+}
+void FaultInjector::SetProfile(int Operation, const FaultProfile& Profile)
+{
+	if(Operation<0 || Operation>=FAULT_OPERATIONS)
+		return;
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	m_Streams[Operation].profile = Profile;
+}
+// Called with the mutex held
+bool FaultInjector::Draw(Stream& From, double Rate)
+{
+	// Drawn whatever the rate, so a profile change does not shift the rest of the stream
+	double Value = std::uniform_real_distribution<double>(0.0, 1.0)(From.random);
+	return Value < Rate;
+}
+int FaultInjector::Before(int Operation)
+{
+	if(Operation<0 || Operation>=FAULT_OPERATIONS)
+		return 0;
+	uint64_t DelayUs = 0;
+	bool     Fail    = false;
+	{
+		std::lock_guard<std::mutex> Lock(m_Mutex);
+		Stream& From = m_Streams[Operation];
+		double Jitter = std::exponential_distribution<double>(1.0)(From.random);
+		DelayUs = From.profile.LatencyUs + (uint64_t)(Jitter * From.profile.JitterUs);
+		if(Draw(From, From.profile.SpikeRate))
+			DelayUs += From.profile.SpikeUs;
+		Fail = Draw(From, From.profile.ErrorRate);
+	}
+	m_Operations++;
+	if(DelayUs>0)
+	{
+		std::this_thread::sleep_for(std::chrono::microseconds(DelayUs));
+		m_DelayedUs += DelayUs;
+	}
+	if(Fail)
+	{
+		m_Errors++;
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+size_t FaultInjector::ReadLength(size_t Size)
+{
+	if(Size<2)
+		return Size;
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	Stream& From = m_Streams[FAULT_READ];
+	size_t Length = std::uniform_int_distribution<size_t>(1, Size - 1)(From.random);
+	if(!Draw(From, From.profile.ShortReadRate))
+		return Size;
+	m_ShortReads++;
+	return Length;
+}
+void FaultInjector::GetStats(FaultStats& Stats)
+{
+	Stats.Operations = m_Operations;
+	Stats.Errors     = m_Errors;
+	Stats.ShortReads = m_ShortReads;
+	Stats.DelayedUs  = m_DelayedUs;
+}
+void FaultInjector::SetCrashPoint(int Point)
+{
+	m_CrashPoint = Point;
+}
+bool FaultInjector::AtCrashPoint(int Point) const
+{
+	return Point!=CRASH_NONE && m_CrashPoint==Point;
+}
+void FaultInjector::Crash()
+{
+	std::_Exit(CRASH_EXIT_CODE);
+}
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <random>
+
+namespace XHdf5
+{
+	// The disk behaviour injected into one kind of operation. The delay
+	// is LatencyUs, plus an exponential part of the mean JitterUs, plus
+	// SpikeUs for SpikeRate of the operations. The rates are 0..1.
+	struct FaultProfile
+	{
+		uint32_t LatencyUs;
+		uint32_t JitterUs;
+		uint32_t SpikeUs;
+		double   SpikeRate;
+		double   ErrorRate;       // The operation fails with EIO
+		double   ShortReadRate;   // A read returns only a part, reads only
+	};
+	struct FaultStats
+	{
+		uint64_t Operations;      // Passed through the injector
+		uint64_t Errors;
+		uint64_t ShortReads;
+		uint64_t DelayedUs;       // Slept in total
+	};
+
+	////////////////////////////////////////////////////////////////
+	// A slow and flaky disk for the tests and the benchmarks. The
+	// BlockDriver calls Before ahead of each of its reads, writes,
+	// flushes and truncates, and asks ReadLength how much of a read
+	// the disk returns. Each kind of operation draws from a stream
+	// of its own, seeded by the Seed and the kind, so a run repeats
+	// the same delays and faults in the same order of operations.
+	////////////////////////////////////////////////////////////////
+	class FaultInjector
+	{
+	public:
+		enum enOperations
+		{
+			FAULT_READ     = 0,
+			FAULT_WRITE    = 1,
+			FAULT_FLUSH    = 2,
+			FAULT_TRUNCATE = 3,
+			FAULT_OPERATIONS
+		};
+		// The points at which a test may end the process, as a power cut would
+		enum enCrashPoints
+		{
+			CRASH_NONE     = 0,
+			CRASH_TX_PURGE = 1,   // A commit is on the disk, its trash is not purged
+		};
+		static const int CRASH_EXIT_CODE = 86;
+		FaultInjector(uint64_t Seed);
+		virtual ~FaultInjector();
+		void SetProfile(int Operation, const FaultProfile& Profile);
+		// Sleeps the delay of the operation, -1 with errno EIO to fail it
+		int  Before(int Operation);
+		// The bytes a read of Size returns, 1..Size
+		size_t ReadLength(size_t Size);
+		void GetStats(FaultStats& Stats);
+		void SetCrashPoint(int Point);
+		// True if the owner is to flush its state and call Crash at Point
+		bool AtCrashPoint(int Point) const;
+		// Ends the process at once, nothing is flushed or closed
+		void Crash();
+	private:
+		struct Stream
+		{
+			std::mt19937_64 random;
+			FaultProfile    profile;
+		};
+		bool Draw(Stream& From, double Rate);
+	private:
+		std::mutex            m_Mutex;
+		Stream                m_Streams[FAULT_OPERATIONS];
+		std::atomic<uint64_t> m_Operations;
+		std::atomic<uint64_t> m_Errors;
+		std::atomic<uint64_t> m_ShortReads;
+		std::atomic<uint64_t> m_DelayedUs;
+		std::atomic<int>      m_CrashPoint;
+	};
+}
@@ -0,0 +1,197 @@
+#include "stdafx.h"
+#include "H5FDmem.h"
+#ifdef _WIN32
+#	include <windows.h>
+#else
+#	include <sys/mman.h>
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#endif
+
+namespace
+{
+#if !defined(_WIN32) && defined(SYS_mbind)
+	const int MPOL_PREFERRED_MODE = 1;   // MPOL_PREFERRED of numaif.h
+#endif
+	int SizeClass(size_t Size)
+	{
+		int Class = XHdf5::DataMemory::MIN_CLASS;
+		while(Class <= XHdf5::DataMemory::MAX_CLASS && ((size_t)1 << Class) < Size)
+			Class++;
+		return Class;
+	}
+}
+
+namespace XHdf5
+{
+DataMemory::DataMemory()
+{
+	m_HugePages = HUGE_TRANSPARENT;
+	m_Nodes     = 1;
+	for(int i = 0; i < MAX_NODES; i++)
+	{
+		m_Heaps[i].usage.Mapped = 0;
+		m_Heaps[i].usage.Huge   = 0;
+		m_Heaps[i].usage.InUse  = 0;
+	}
+}
+DataMemory& DataMemory::Instance()
+{
+	// Never destroyed, the buffers may be freed during the static destruction
+	static DataMemory* Memory = new DataMemory();
+	return *Memory;
+}
+void DataMemory::SetHugePages(int Mode)
+{
+	Instance().m_HugePages = Mode;
+}
+int DataMemory::CurrentNode()
+{
+	int Node = 0;
+#ifdef _WIN32
+	PROCESSOR_NUMBER Processor;
+	USHORT           NodeNumber = 0;
+	GetCurrentProcessorNumberEx(&Processor);
+	if(GetNumaProcessorNodeEx(&Processor, &NodeNumber))
+		Node = NodeNumber;
+#elif defined(SYS_getcpu)
+	unsigned Cpu = 0, CpuNode = 0;
+	if(syscall(SYS_getcpu, &Cpu, &CpuNode, nullptr)==0)
+		Node = (int)CpuNode;
+#endif
+	return (Node < MAX_NODES)?Node:MAX_NODES - 1;
+}
+// Called with no lock held, the system call may take a while
+void* DataMemory::Map(size_t Size, int Node, bool& Huge)
+{
+	void* Mem = nullptr;
+	int   Mode = m_HugePages;
+	Huge = false;
+#ifdef _WIN32
+	// 0 - the processor has no large pages
+	SIZE_T LargePage = GetLargePageMinimum();
+	if(Mode==HUGE_EXPLICIT && LargePage>0 && Size % LargePage==0)
+		Mem = VirtualAllocExNuma(GetCurrentProcess(), NULL, Size, MEM_RESERVE|MEM_COMMIT|MEM_LARGE_PAGES, PAGE_READWRITE, Node);
+	Huge = (Mem!=nullptr);
+	if(Mem==nullptr)
+		Mem = VirtualAllocExNuma(GetCurrentProcess(), NULL, Size, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE, Node);
+#else
+#	ifdef MAP_HUGETLB
+	if(Mode==HUGE_EXPLICIT)
+	{
+		Mem = mmap(nullptr, Size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if(Mem==MAP_FAILED)
+			Mem = nullptr;
+		Huge = (Mem!=nullptr);
+	}
+#	endif
+	if(Mem==nullptr)
+	{
+		Mem = mmap(nullptr, Size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if(Mem==MAP_FAILED)
+			return nullptr;
+#	ifdef MADV_HUGEPAGE
+		if(Mode!=HUGE_NONE && Size >= CHUNK_SIZE)
+			Huge = (madvise(Mem, Size, MADV_HUGEPAGE)==0);
+#	endif
+	}
+#	ifdef SYS_mbind
+	// Preferred rather than bound: a full node lends its neighbour's memory.
+	// Set before the first touch, which is where the pages are placed.
+	unsigned long Mask = 1UL << Node;
+	syscall(SYS_mbind, Mem, Size, MPOL_PREFERRED_MODE, &Mask, sizeof(Mask)*8, 0);
+#	endif
+#endif
+	return Mem;
+}
+// Called with no lock held. Two threads refilling the same list at
+// once both map, the second chunk just stays on the list.
+bool DataMemory::Refill(int Node, int SizeClass)
+{
+	size_t Piece = (size_t)1 << SizeClass;
+	size_t Size  = (Piece < CHUNK_SIZE)?(size_t)CHUNK_SIZE:Piece;
+	bool   Huge  = false;
+	char*  Mem   = (char*)Map(Size, Node, Huge);
+	if(Mem==nullptr)
+		return false;
+	Mapping Item = {Size, Node, SizeClass};
+	{
+		std::lock_guard<std::mutex> Lock(m_MapMutex);
+		m_Mappings[(uintptr_t)Mem] = Item;
+	}
+	Heap& Local = m_Heaps[Node];
+	std::lock_guard<std::mutex> Lock(Local.mutex);
+	Local.usage.Mapped += Size;
+	if(Huge)
+		Local.usage.Huge += Size;
+	// Handed out from the start of the chunk
+	std::vector<void*>& List = Local.free[SizeClass - MIN_CLASS];
+	for(size_t Pos = Size; Pos >= Piece; Pos -= Piece)
+		List.push_back(Mem + Pos - Piece);
+	return true;
+}
+void* DataMemory::Alloc(size_t Size)
+{
+	int Class = SizeClass(Size);
+	if(Class > MAX_CLASS)
+		return nullptr;
+	int Node = CurrentNode();
+	DataMemory& Me = Instance();
+	Heap& Local = Me.m_Heaps[Node];
+	std::vector<void*>& List = Local.free[Class - MIN_CLASS];
+	void* Mem = nullptr;
+	// Another thread may take the refill first, then it is mapped again
+	while(Mem==nullptr)
+	{
+		{
+			std::lock_guard<std::mutex> Lock(Local.mutex);
+			if(!List.empty())
+			{
+				Mem = List.back();
+				List.pop_back();
+				Local.usage.InUse += (size_t)1 << Class;
+				continue;
+			}
+		}
+		if(!Me.Refill(Node, Class))
+			return nullptr;
+	}
+	int Nodes = Me.m_Nodes;
+	while(Node >= Nodes && !Me.m_Nodes.compare_exchange_weak(Nodes, Node + 1))
+		;
+	return Mem;
+}
+void DataMemory::Free(void* Mem)
+{
+	if(Mem==nullptr)
+		return;
+	DataMemory& Me = Instance();
+	Mapping Item;
+	{
+		std::lock_guard<std::mutex> Lock(Me.m_MapMutex);
+		auto iiMapping = Me.m_Mappings.upper_bound((uintptr_t)Mem);
+		if(iiMapping==Me.m_Mappings.begin())
+			return;
+		iiMapping--;
+		if((uintptr_t)Mem >= iiMapping->first + iiMapping->second.size)
+			return;
+		Item = iiMapping->second;
+	}
+	// Back to the node it came from
+	Heap& Owner = Me.m_Heaps[Item.node];
+	std::lock_guard<std::mutex> Lock(Owner.mutex);
+	Owner.free[Item.size_class - MIN_CLASS].push_back(Mem);
+	Owner.usage.InUse -= (size_t)1 << Item.size_class;
+}
+void DataMemory::GetUsage(std::vector<NodeUsage>& Usage)
+{
+	DataMemory& Me = Instance();
+	int Nodes = Me.m_Nodes;
+	Usage.resize(Nodes);
+	for(int i = 0; i < Nodes; i++)
+	{
+		std::lock_guard<std::mutex> Lock(Me.m_Heaps[i].mutex);
+		Usage[i] = Me.m_Heaps[i].usage;
+	}
+}
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include <cstddef>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace XHdf5
+{
+	// The memory of the data path on one NUMA node, in bytes
+	struct NodeUsage
+	{
+		uint64_t Mapped;       // Taken from the OS, never given back
+		uint64_t Huge;         // Of Mapped, backed or advised to be backed by huge pages
+		uint64_t InUse;        // Handed out, rounded up to the size classes
+	};
+
+	////////////////////////////////////////////////////////////////
+	// The buffers of the data path: the copy buffers of the driver,
+	// the blocks of the block cache and the blocks decrypted in bulk.
+	// A buffer comes from the NUMA node of the thread allocating it
+	// and goes back to the same node when freed, from any thread.
+	//
+	// The sizes are rounded up to powers of two. The classes below
+	// CHUNK_SIZE are carved from chunks of CHUNK_SIZE, the larger
+	// ones are mapped each on its own; either way the memory is kept
+	// on free lists, so a 16 MB copy buffer is faulted in only once.
+	// Every node has its own lists and lock; the memory is mapped
+	// with no lock held. The mappings use the huge pages as set by
+	// SetHugePages, the explicit ones fall back to the transparent
+	// ones when the OS has none reserved.
+	////////////////////////////////////////////////////////////////
+	class DataMemory
+	{
+	public:
+		enum enHugePages
+		{
+			HUGE_NONE        = 0,
+			HUGE_TRANSPARENT = 1,   // Advised, the kernel may back them
+			HUGE_EXPLICIT    = 2    // Reserved huge pages (MAP_HUGETLB, MEM_LARGE_PAGES)
+		};
+		enum enLimits
+		{
+			MIN_CLASS  = 12,        // 4 KB
+			MAX_CLASS  = 34,        // 16 GB
+			CHUNK_SIZE = 2*1024*1024,
+			MAX_NODES  = 16
+		};
+		static void* Alloc(size_t Size);
+		static void  Free(void* Mem);
+		static void  SetHugePages(int Mode);
+		// The node of the calling thread, 0 without NUMA
+		static int   CurrentNode();
+		// By the node, up to the highest node used
+		static void  GetUsage(std::vector<NodeUsage>& Usage);
+	private:
+		struct Mapping
+		{
+			size_t size;
+			int    node;
+			int    size_class;
+		};
+		struct Heap
+		{
+			std::mutex         mutex;
+			std::vector<void*> free[MAX_CLASS - MIN_CLASS + 1];
+			NodeUsage          usage;
+		};
+		DataMemory();
+		static DataMemory& Instance();
+		void* Map(size_t Size, int Node, bool& Huge);
+		bool  Refill(int Node, int SizeClass);
+	private:
+		std::atomic<int>       m_HugePages;
+		std::atomic<int>       m_Nodes;        // The highest node used + 1
+		std::mutex             m_MapMutex;     // Guards m_Mappings only
+		std::map<uintptr_t, Mapping> m_Mappings;   // By the start address
+		Heap                   m_Heaps[MAX_NODES];
+	};
+
+	// A DataMemory buffer held for a scope, it is freed on every way out
+	class DataBuffer
+	{
+	public:
+		explicit DataBuffer(size_t Size) {m_Mem = DataMemory::Alloc(Size);}
+		~DataBuffer() {DataMemory::Free(m_Mem);}
+		void* Get() const {return m_Mem;}
+	private:
+		DataBuffer(const DataBuffer&) = delete;
+		DataBuffer& operator=(const DataBuffer&) = delete;
+		void* m_Mem;
+	};
+
+	// A standard allocator over DataMemory, for the containers of the data path
+	template<class T> struct DataAllocator
+	{
+		typedef T value_type;
+		DataAllocator() {}
+		template<class U> DataAllocator(const DataAllocator<U>&) {}
+		T* allocate(size_t Count)
+		{
+			void* Mem = DataMemory::Alloc(Count*sizeof(T));
+			if(Mem==nullptr)
+				throw std::bad_alloc();
+			return (T*)Mem;
+		}
+		void deallocate(T* Mem, size_t) {DataMemory::Free(Mem);}
+		template<class U> bool operator==(const DataAllocator<U>&) const {return true;}
+		template<class U> bool operator!=(const DataAllocator<U>&) const {return false;}
+	};
+}
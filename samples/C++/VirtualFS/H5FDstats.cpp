@@ -0,0 +1,88 @@
+#include "stdafx.h"
+#include "H5FDstats.h"
+#include <cmath>
+
+namespace XHdf5
+{
+LatencyHistogram::LatencyHistogram()
+{
+	Reset();
+}
+void LatencyHistogram::Reset()
+{
+	for(size_t i = 0; i < BUCKETS; i++)
+		m_Buckets[i].store(0, std::memory_order_relaxed);
+	m_Count.store(0, std::memory_order_relaxed);
+	m_Total.store(0, std::memory_order_relaxed);
+	m_Max.store(0, std::memory_order_relaxed);
+}
+size_t LatencyHistogram::BucketOf(uint64_t Value)
+{
+	if(Value < SUB_BUCKETS)
+		return (size_t)Value;
+	// The highest bit set picks the power of two, the next SUB_BITS the bucket in it
+	unsigned Msb = 0;
+	uint64_t Rest = Value;
+	for(unsigned Step = 32; Step > 0; Step >>= 1)
+	{
+		if(Rest >> Step)
+		{
+			Rest >>= Step;
+			Msb += Step;
+		}
+	}
+	unsigned Shift = Msb - SUB_BITS;
+	return (size_t)(Shift + 1) * SUB_BUCKETS + (size_t)((Value >> Shift) & (SUB_BUCKETS - 1));
+}
+uint64_t LatencyHistogram::BucketTop(size_t Bucket)
+{
+	size_t Magnitude = Bucket / SUB_BUCKETS;
+	uint64_t Sub = Bucket % SUB_BUCKETS;
+	if(Magnitude==0)
+		return Sub;
+	unsigned Shift = (unsigned)Magnitude - 1;
+	return ((SUB_BUCKETS + Sub) << Shift) + (((uint64_t)1 << Shift) - 1);
+}
+void LatencyHistogram::Record(uint64_t Value)
+{
+	m_Buckets[BucketOf(Value)].fetch_add(1, std::memory_order_relaxed);
+	m_Count.fetch_add(1, std::memory_order_relaxed);
+	m_Total.fetch_add(Value, std::memory_order_relaxed);
+	uint64_t Max = m_Max.load(std::memory_order_relaxed);
+	while(Value > Max && !m_Max.compare_exchange_weak(Max, Value, std::memory_order_relaxed))
+		;
+}
+uint64_t LatencyHistogram::GetPercentile(double Percent) const
+{
+	uint64_t Count = GetCount();
+	if(Count==0)
+		return 0;
+	uint64_t Target = (uint64_t)std::ceil(Count * Percent / 100.0);
+	if(Target==0)
+		Target = 1;
+	uint64_t Seen = 0;
+	for(size_t i = 0; i < BUCKETS; i++)
+	{
+		Seen += m_Buckets[i].load(std::memory_order_relaxed);
+		if(Seen >= Target)
+			return (BucketTop(i) < GetMax())?BucketTop(i):GetMax();
+	}
+	return GetMax();
+}
+
+IoCounters::IoCounters()
+{
+	Reset();
+}
+void IoCounters::Reset()
+{
+	std::atomic<uint64_t>* Counters[] = {&BlockReads, &BlockWrites, &BytesRead, &BytesWritten, &CacheHits,
+		&BytesDecrypted, &BytesEncrypted, &Seeks, &Allocs, &AllocBytes, &Flushes, &Truncates};
+	for(auto iiCounter: Counters)
+		iiCounter->store(0, std::memory_order_relaxed);
+	ReadTime.Reset();
+	WriteTime.Reset();
+	FlushTime.Reset();
+	LockWait.Reset();
+}
+}
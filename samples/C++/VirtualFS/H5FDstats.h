@@ -0,0 +1,82 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace XHdf5
+{
+	////////////////////////////////////////////////////////////////
+	// Latencies in the manner of HdrHistogram: the values below 16
+	// have a bucket each and every power of two above them is split
+	// into 16 buckets, so a value is known to within 1/16 of itself
+	// at any magnitude in under 8 KB. Record is a few relaxed atomic
+	// adds and may be called from any thread; a reader racing with
+	// it sees every sample either counted or not yet.
+	////////////////////////////////////////////////////////////////
+	class LatencyHistogram
+	{
+	public:
+		enum
+		{
+			SUB_BITS    = 4,
+			SUB_BUCKETS = 1 << SUB_BITS,
+			BUCKETS     = (64 - SUB_BITS + 1) * SUB_BUCKETS
+		};
+		LatencyHistogram();
+		void     Record(uint64_t Value);
+		void     Reset();
+		uint64_t GetCount() const {return m_Count.load(std::memory_order_relaxed);}
+		uint64_t GetTotal() const {return m_Total.load(std::memory_order_relaxed);}
+		uint64_t GetMax() const {return m_Max.load(std::memory_order_relaxed);}
+		// The value Percent of the samples do not exceed, the top of its bucket
+		uint64_t GetPercentile(double Percent) const;
+		// Nanoseconds of the monotonic clock
+		static uint64_t Now()
+		{
+			return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+	private:
+		static size_t   BucketOf(uint64_t Value);
+		static uint64_t BucketTop(size_t Bucket);
+	private:
+		std::atomic<uint64_t> m_Buckets[BUCKETS];
+		std::atomic<uint64_t> m_Count;
+		std::atomic<uint64_t> m_Total;
+		std::atomic<uint64_t> m_Max;
+	};
+
+	////////////////////////////////////////////////////////////////
+	// What a file does through the BlockDriver. The owner of the
+	// driver keeps the counters, so they outlive the driver, and
+	// passes them with SetStats; it adds the bytes its callbacks
+	// encrypt and decrypt and the waits for its own lock. The times
+	// are in nanoseconds.
+	////////////////////////////////////////////////////////////////
+	struct IoCounters
+	{
+		std::atomic<uint64_t> BlockReads;      // Blocks read from the disk
+		std::atomic<uint64_t> BlockWrites;     // Blocks written to the disk
+		std::atomic<uint64_t> BytesRead;
+		std::atomic<uint64_t> BytesWritten;
+		std::atomic<uint64_t> CacheHits;       // Blocks served by the block cache
+		std::atomic<uint64_t> BytesDecrypted;
+		std::atomic<uint64_t> BytesEncrypted;
+		std::atomic<uint64_t> Seeks;
+		std::atomic<uint64_t> Allocs;
+		std::atomic<uint64_t> AllocBytes;
+		std::atomic<uint64_t> Flushes;
+		std::atomic<uint64_t> Truncates;
+		LatencyHistogram      ReadTime;        // Of a read request, the cache hits included
+		LatencyHistogram      WriteTime;
+		LatencyHistogram      FlushTime;       // The sync included when it is waited for
+		LatencyHistogram      LockWait;
+
+		IoCounters();
+		void Reset();
+		static void Add(std::atomic<uint64_t>& Counter, uint64_t Value = 1)
+		{
+			Counter.fetch_add(Value, std::memory_order_relaxed);
+		}
+	};
+}
@@ -0,0 +1,87 @@
+#include "stdafx.h"
+#include "platform.h"
+#include "H5FDsync.h"
+#include <chrono>
+
+namespace XHdf5
+{
+GroupCommit::GroupCommit(int FileHandle, uint32_t MaxDelay)
+{
+	m_File      = FileHandle;
+	m_MaxDelay  = MaxDelay;
+	m_Requested = 0;
+	m_Completed = 0;
+	m_Syncs     = 0;
+	m_Failed    = false;
+	m_Stop      = false;
+	m_Thread    = std::thread(&GroupCommit::Run, this);
+}
+GroupCommit::~GroupCommit()
+{
+	Detach();
+}
+int GroupCommit::Sync()
+{
+	std::unique_lock<std::mutex> Lock(m_Mutex);
+	if(m_Stop)
+		return m_Failed?-1:0;
+	uint64_t Ticket = ++m_Requested;
+	m_Wake.notify_one();
+	m_Done.wait(Lock, [this, Ticket](){return m_Completed >= Ticket;});
+	return m_Failed?-1:0;
+}
+int GroupCommit::Detach()
+{
+	{
+		std::lock_guard<std::mutex> Lock(m_Mutex);
+		if(m_Stop && !m_Thread.joinable())
+			return m_Failed?-1:0;
+		m_Stop = true;
+	}
+	m_Wake.notify_one();
+	if(m_Thread.joinable())
+		m_Thread.join();
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	m_File = -1;
+	return m_Failed?-1:0;
+}
+void GroupCommit::SetMaxDelay(uint32_t MaxDelay)
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	m_MaxDelay = MaxDelay;
+}
+uint64_t GroupCommit::GetRequests()
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	return m_Requested;
+}
+uint64_t GroupCommit::GetSyncs()
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	return m_Syncs;
+}
+void GroupCommit::Run()
+{
+	std::unique_lock<std::mutex> Lock(m_Mutex);
+	for(;;)
+	{
+		m_Wake.wait(Lock, [this](){return m_Stop || m_Requested > m_Completed;});
+		if(m_Requested==m_Completed)
+			return;  // Stopped with nobody waiting
+
+		// The window: the callers arriving meanwhile share the sync
+		if(m_MaxDelay>0 && !m_Stop)
+			m_Wake.wait_for(Lock, std::chrono::milliseconds(m_MaxDelay), [this](){return m_Stop;});
+		uint64_t Batch = m_Requested;
+		int      File  = m_File;
+		Lock.unlock();
+		int res = XDX::Platform::FileSync(File);
+		Lock.lock();
+		if(res!=0)
+			m_Failed = true;
+		m_Completed = Batch;
+		m_Syncs++;
+		m_Done.notify_all();
+	}
+}
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace XHdf5
+{
+	// How far a write goes before the call returns
+	enum enDurability
+	{
+		DURABILITY_NONE = 0,   // Kept in the HDF5 caches
+		DURABILITY_OS   = 1,   // Handed to the OS, survives the process
+		DURABILITY_DISK = 2,   // Synced to the disk, survives the machine
+	};
+
+	////////////////////////////////////////////////////////////////
+	// Group commit of the disk syncs of one file. Sync enqueues the
+	// caller and blocks; a single thread waits up to MaxDelay for
+	// more callers to join, issues one sync for all of them and
+	// releases them together. A caller arriving while a sync runs
+	// waits for the next one, as its writes may have missed it.
+	//
+	// A failed sync is sticky: the OS may have dropped the dirty
+	// pages, so no later sync can vouch for them.
+	////////////////////////////////////////////////////////////////
+	class GroupCommit
+	{
+	public:
+		GroupCommit(int FileHandle, uint32_t MaxDelay);
+		virtual ~GroupCommit();
+		int  Sync();
+		// Syncs what is pending and stops, the file may be closed after
+		int  Detach();
+		void SetMaxDelay(uint32_t MaxDelay);
+		uint64_t GetRequests();
+		uint64_t GetSyncs();
+	private:
+		void Run();
+	private:
+		std::mutex              m_Mutex;
+		std::condition_variable m_Wake;
+		std::condition_variable m_Done;
+		std::thread             m_Thread;
+		int                     m_File;
+		uint32_t                m_MaxDelay;    // Milliseconds a sync waits for more callers
+		uint64_t                m_Requested;   // Ticket of the last caller
+		uint64_t                m_Completed;   // Callers up to this ticket are synced
+		uint64_t                m_Syncs;
+		bool                    m_Failed;
+		bool                    m_Stop;
+	};
+}
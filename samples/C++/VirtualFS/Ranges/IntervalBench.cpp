@@ -0,0 +1,408 @@
+// IntervalBench.cpp : Compares IntervalIndex with the recursive IntervalTree.
+//
+// Both structures index the same random set of 64-bit intervals spread over
+// a 1 TiB offset space and answer the same overlap queries. The reported
+// numbers are nanoseconds per build and per query.
+//
+// The second table runs dense queries, where most of the scanned buckets
+// hold hits, with the scalar and the runtime-selected bucket scanners.
+// The third one answers sorted probe batches one query at a time and with
+// a single overlappingBatch call.
+//
+// Before the tables the answers of the index and of its image are checked
+// against a plain scan after random inserts, erases and merges; a failed
+// check makes the benchmark exit with 1.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include "IntervalTree.h"
+#include "IntervalIndex.h"
+#include "IntervalImage.h"
+
+namespace
+{
+	typedef std::chrono::high_resolution_clock bench_clock;
+
+	struct Sample
+	{
+		int64_t  start;
+		int64_t  stop;
+		uint32_t value;
+	};
+
+	int64_t elapsed_ns(bench_clock::time_point since)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - since).count();
+	}
+
+	// The values of the matches, sorted, as the index and the scan report them in different orders
+	typedef std::vector<uint32_t> match_list;
+
+	template <class Range>
+	match_list collect(const Range& Found)
+	{
+		match_list values;
+		for(const auto& hit: Found)
+			values.push_back(hit.value);
+		std::sort(values.begin(), values.end());
+		return values;
+	}
+
+	match_list scan_overlapping(const std::vector<Sample>& Live, int64_t Start, int64_t Stop)
+	{
+		match_list values;
+		for(const auto& s: Live)
+		{
+			if(s.start <= Stop && s.stop >= Start)
+				values.push_back(s.value);
+		}
+		std::sort(values.begin(), values.end());
+		return values;
+	}
+
+	match_list scan_contained(const std::vector<Sample>& Live, int64_t Start, int64_t Stop)
+	{
+		match_list values;
+		for(const auto& s: Live)
+		{
+			if(s.start >= Start && s.stop <= Stop)
+				values.push_back(s.value);
+		}
+		std::sort(values.begin(), values.end());
+		return values;
+	}
+
+	// Compares every query kind of Index and of its image with the scan of Live
+	bool check_queries(IntervalIndex<uint32_t, int64_t>& Index, const std::vector<Sample>& Live,
+					   std::mt19937_64& Rnd, int64_t Space)
+	{
+		std::uniform_int_distribution<int64_t> pos(1, Space);
+		std::uniform_int_distribution<int64_t> len(0, Space / 8);
+		std::vector<Sample> probes(64);
+		for(auto& p: probes)
+		{
+			p.start = pos(Rnd);
+			p.stop  = p.start + len(Rnd);
+		}
+		for(const auto& p: probes)
+		{
+			if(collect(Index.overlapping(p.start, p.stop))!=scan_overlapping(Live, p.start, p.stop) ||
+				collect(Index.contained(p.start, p.stop))!=scan_contained(Live, p.start, p.stop) ||
+				collect(Index.stabbing(p.start))!=scan_overlapping(Live, p.start, p.start))
+				return false;
+		}
+
+		// The batch as given, which is looked up probe by probe, and sorted, which may be swept
+		for(int sorted = 0; sorted < 2; sorted++)
+		{
+			if(sorted)
+				std::sort(probes.begin(), probes.end(), [](const Sample& a, const Sample& b){return a.start < b.start;});
+			std::vector<IntervalIndexHit> hits;
+			Index.overlappingBatch(probes.begin(), probes.end(), hits);
+			std::vector<match_list> perProbe(probes.size());
+			for(const auto& h: hits)
+				perProbe[h.probe].push_back(Index[h.slot].value);
+			for(size_t i = 0; i < probes.size(); i++)
+			{
+				std::sort(perProbe[i].begin(), perProbe[i].end());
+				if(perProbe[i]!=scan_overlapping(Live, probes[i].start, probes[i].stop))
+					return false;
+			}
+		}
+
+		// The image is queried in place, compacting the index on the way
+		std::vector<uint64_t> block;
+		IntervalImage<uint32_t, int64_t>::store(Index, block);
+		IntervalImage<uint32_t, int64_t> image;
+		if(!image.attach(block.data(), block.size()*sizeof(uint64_t)) || image.size()!=Live.size())
+			return false;
+		for(const auto& p: probes)
+		{
+			if(collect(image.overlapping(p.start, p.stop))!=scan_overlapping(Live, p.start, p.stop) ||
+				collect(image.contained(p.start, p.stop))!=scan_contained(Live, p.start, p.stop))
+				return false;
+		}
+		return true;
+	}
+
+	// An image cut short, moved off its alignment or claiming too many intervals must not attach
+	bool check_image_input(IntervalIndex<uint32_t, int64_t>& Index)
+	{
+		std::vector<uint64_t> block;
+		IntervalImage<uint32_t, int64_t>::store(Index, block);
+		size_t size = block.size()*sizeof(uint64_t);
+		IntervalImage<uint32_t, int64_t> image;
+		if(!image.attach(block.data(), size))
+			return false;
+		for(size_t cut = 0; cut < size; cut += (cut < 64)?1:61)
+		{
+			if(image.attach(block.data(), cut))
+				return false;
+		}
+		std::vector<uint64_t> shifted(block.size() + 1);
+		for(size_t offset = 1; offset < sizeof(uint64_t); offset++)
+		{
+			memcpy((char*)shifted.data() + offset, block.data(), size);
+			if(image.attach((char*)shifted.data() + offset, size))
+				return false;
+		}
+		IntervalImageHeader* header = (IntervalImageHeader*)block.data();
+		header->Count++;
+		if(image.attach(block.data(), size))
+			return false;
+		header->Count--;
+		header->MaxLevel++;
+		if(image.attach(block.data(), size))
+			return false;
+		return !image.attached();
+	}
+
+	// Drives an index through inserts, erases and merges next to a plain list
+	bool run_check(size_t intervals,    // Number of intervals inserted over the run
+				   size_t rounds)       // Number of query checks on the way
+	{
+		const int64_t space = (int64_t)intervals * 64;
+		std::mt19937_64 rnd(intervals * 31 + rounds);
+		std::uniform_int_distribution<int64_t> pos(1, space);
+		std::uniform_int_distribution<int64_t> len(0, space / 16);
+
+		IntervalIndex<uint32_t, int64_t> index;
+		std::vector<Sample> live;
+		uint32_t next = 0;
+		bool ok = true;
+		for(size_t round = 0; round < rounds && ok; round++)
+		{
+			for(size_t i = 0; i < intervals / rounds; i++)
+			{
+				Sample s;
+				s.start = pos(rnd);
+				s.stop  = s.start + len(rnd);
+				s.value = next++;
+				// Some duplicates of an existing key, which erase tells apart by value
+				if(!live.empty() && rnd() % 8==0)
+				{
+					s.start = live[rnd() % live.size()].start;
+					s.stop  = live[rnd() % live.size()].stop;
+					if(s.stop < s.start)
+						std::swap(s.start, s.stop);
+				}
+				index.insert(s.start, s.stop, s.value);
+				live.push_back(s);
+			}
+			for(size_t i = 0; i < intervals / rounds / 3 && !live.empty(); i++)
+			{
+				size_t victim = rnd() % live.size();
+				Sample s = live[victim];
+				if(rnd() % 4==0)
+				{
+					// Every interval with that key
+					size_t erased = index.erase(s.start, s.stop);
+					size_t before = live.size();
+					live.erase(std::remove_if(live.begin(), live.end(), [&s](const Sample& l){return l.start==s.start && l.stop==s.stop;}), live.end());
+					ok = ok && erased==before - live.size();
+				}
+				else
+				{
+					ok = ok && index.erase(s.start, s.stop, [&s](uint32_t v){return v==s.value;})==1;
+					live.erase(live.begin() + victim);
+				}
+			}
+			ok = ok && index.size()==live.size() && check_queries(index, live, rnd, space);
+			if(round % 4==3)
+				index.compact();
+		}
+		ok = ok && check_image_input(index);
+		printf("%zu\t%zu\t%zu\t%s\n", intervals, rounds, live.size(), ok?"ok":"MISMATCH");
+		return ok;
+	}
+
+	void run_test(size_t intervals,    // Number of indexed intervals
+				  size_t queries)      // Number of overlap queries
+	{
+		const int64_t space = (int64_t)1 << 40;
+		std::mt19937_64 rnd(intervals);
+		std::uniform_int_distribution<int64_t> pos(1, space);
+		std::uniform_int_distribution<int64_t> len(1, space / intervals * 4);
+
+		std::vector<Sample> samples(intervals);
+		for(size_t i = 0; i < intervals; i++)
+		{
+			samples[i].start = pos(rnd);
+			samples[i].stop  = samples[i].start + len(rnd);
+			samples[i].value = (uint32_t)i;
+		}
+		std::vector<Sample> probes(queries);
+		for(size_t i = 0; i < queries; i++)
+		{
+			probes[i].start = pos(rnd);
+			probes[i].stop  = probes[i].start + len(rnd);
+		}
+
+		// 1. The recursive tree
+		IntervalTree<uint32_t, int64_t>::intervalVector ivals;
+		for(size_t i = 0; i < intervals; i++)
+			ivals.push_back(Interval<uint32_t, int64_t>(samples[i].start, samples[i].stop, samples[i].value));
+		bench_clock::time_point timer = bench_clock::now();
+		IntervalTree<uint32_t, int64_t> tree(ivals);
+		int64_t treeBuild = elapsed_ns(timer);
+
+		size_t treeHits = 0;
+		IntervalTree<uint32_t, int64_t>::intervalVector found;
+		timer = bench_clock::now();
+		for(size_t i = 0; i < queries; i++)
+		{
+			found.clear();
+			tree.findOverlapping(probes[i].start, probes[i].stop, found);
+			treeHits += found.size();
+		}
+		int64_t treeQuery = elapsed_ns(timer);
+
+		// 2. The flat index
+		timer = bench_clock::now();
+		IntervalIndex<uint32_t, int64_t> index;
+		index.assign(samples.begin(), samples.end());
+		int64_t indexBuild = elapsed_ns(timer);
+
+		size_t indexHits = 0;
+		timer = bench_clock::now();
+		for(size_t i = 0; i < queries; i++)
+		{
+			for(const auto& hit: index.overlapping(probes[i].start, probes[i].stop))
+				indexHits += (hit.value!=UINT32_MAX);
+		}
+		int64_t indexQuery = elapsed_ns(timer);
+
+		// 3. The flat index filled incrementally
+		IntervalIndex<uint32_t, int64_t> dynamic;
+		timer = bench_clock::now();
+		for(size_t i = 0; i < intervals; i++)
+			dynamic.insert(samples[i].start, samples[i].stop, samples[i].value);
+		int64_t dynamicInsert = elapsed_ns(timer);
+
+		printf("%zu\t%zu\t%lld\t%lld\t%lld\t%lld\t%lld\t%s\n", intervals, queries,
+			(long long)treeBuild, (long long)indexBuild, (long long)(dynamicInsert / intervals),
+			(long long)(treeQuery / queries), (long long)(indexQuery / queries),
+			(treeHits==indexHits)?"ok":"MISMATCH");
+	}
+
+	void run_scan(size_t intervals,    // Number of indexed intervals
+				  size_t queries)      // Number of overlap queries
+	{
+		// Long intervals over a small space: every query hits a large share of them
+		const int64_t space = (int64_t)intervals * 16;
+		std::mt19937_64 rnd(intervals);
+		std::uniform_int_distribution<int64_t> pos(1, space);
+		std::uniform_int_distribution<int64_t> len(1, space / 4);
+
+		std::vector<Sample> samples(intervals);
+		for(size_t i = 0; i < intervals; i++)
+		{
+			samples[i].start = pos(rnd);
+			samples[i].stop  = samples[i].start + len(rnd);
+			samples[i].value = (uint32_t)i;
+		}
+		IntervalIndex<uint32_t, int64_t> index;
+		index.assign(samples.begin(), samples.end());
+
+		IntervalScan::scan_fn scanners[2] = {IntervalScan::scanScalar<int64_t>, IntervalScan::detectScanner()};
+		int64_t spent[2];
+		size_t  hits[2] = {0, 0};
+		for(int s = 0; s < 2; s++)
+		{
+			std::mt19937_64 probe(queries);
+			IntervalScan::activeScanner() = scanners[s];
+			bench_clock::time_point timer = bench_clock::now();
+			for(size_t i = 0; i < queries; i++)
+			{
+				int64_t start = pos(probe);
+				for(const auto& hit: index.overlapping(start, start + 64))
+					hits[s] += (hit.value!=UINT32_MAX);
+			}
+			spent[s] = elapsed_ns(timer);
+		}
+		IntervalScan::activeScanner() = scanners[1];
+
+		printf("%zu\t%zu\t%zu\t%lld\t%lld\t%s\n", intervals, queries, hits[1] / queries,
+			(long long)(spent[0] / queries), (long long)(spent[1] / queries),
+			(hits[0]==hits[1])?"ok":"MISMATCH");
+	}
+
+	void run_batch(size_t intervals,    // Number of indexed intervals
+				   size_t probes)       // Number of probes in the batch
+	{
+		const int64_t space = (int64_t)1 << 40;
+		std::mt19937_64 rnd(intervals + probes);
+		std::uniform_int_distribution<int64_t> pos(1, space);
+		std::uniform_int_distribution<int64_t> len(1, space / intervals * 4);
+
+		std::vector<Sample> samples(intervals);
+		for(size_t i = 0; i < intervals; i++)
+		{
+			samples[i].start = pos(rnd);
+			samples[i].stop  = samples[i].start + len(rnd);
+			samples[i].value = (uint32_t)i;
+		}
+		std::vector<Sample> batch(probes);
+		for(size_t i = 0; i < probes; i++)
+		{
+			batch[i].start = pos(rnd);
+			batch[i].stop  = batch[i].start + len(rnd);
+		}
+		std::sort(batch.begin(), batch.end(), [](const Sample& a, const Sample& b){return a.start < b.start;});
+
+		IntervalIndex<uint32_t, int64_t> index;
+		index.assign(samples.begin(), samples.end());
+
+		std::vector<IntervalIndexHit> loopHits, batchHits;
+		bench_clock::time_point timer = bench_clock::now();
+		for(size_t i = 0; i < probes; i++)
+		{
+			auto found = index.overlapping(batch[i].start, batch[i].stop);
+			for(auto it = found.begin(); it!=found.end(); ++it)
+			{
+				IntervalIndexHit h = {i, it.position()};
+				loopHits.push_back(h);
+			}
+		}
+		int64_t loopQuery = elapsed_ns(timer);
+
+		timer = bench_clock::now();
+		index.overlappingBatch(batch.begin(), batch.end(), batchHits);
+		int64_t batchQuery = elapsed_ns(timer);
+
+		printf("%zu\t%zu\t%lld\t%lld\t%s\n", intervals, probes,
+			(long long)(loopQuery / probes), (long long)(batchQuery / probes),
+			(loopHits.size()==batchHits.size())?"ok":"MISMATCH");
+	}
+}
+
+int main()
+{
+	printf("intervals\trounds\tlive\tcheck\n");
+	bool ok = run_check(64, 8);
+	ok = run_check(1024, 16) && ok;
+	ok = run_check(16384, 32) && ok;
+	if(!ok)
+		return 1;
+
+	printf("\nintervals\tqueries\ttree_build\tindex_build\tinsert_per_item\ttree_query\tindex_query\tcheck\n");
+	run_test(64, 100000);
+	run_test(1024, 100000);
+	run_test(65536, 100000);
+	run_test(1048576, 100000);
+
+	printf("\nintervals\tqueries\thits_per_query\tscalar_query\tsimd_query\tcheck\n");
+	run_scan(1024, 100000);
+	run_scan(65536, 10000);
+
+	printf("\nintervals\tprobes\tloop_query\tbatch_query\tcheck\n");
+	run_batch(65536, 256);
+	run_batch(65536, 65536);
+	run_batch(1048576, 4096);
+	run_batch(1048576, 262144);
+	return 0;
+}
@@ -0,0 +1,148 @@
+#pragma once
+#include <vector>
+#include <cstring>
+#include <type_traits>
+#include "IntervalIndex.h"
+
+////////////////////////////////////////////////////////////////
+// IntervalImage is the serialized form of an IntervalIndex: one
+// contiguous block holding a header followed by the start[],
+// stop[], maxStop[] and value[] arrays of the compacted index,
+// each padded to 8 bytes. The arrays are already laid out as the
+// implicit tree, so an image is queried in place: attaching only
+// validates the header and points the query arrays into the block.
+//
+// The values are copied bytewise, so T must be trivially copyable.
+// The image uses the native byte order.
+////////////////////////////////////////////////////////////////
+#pragma pack(push, 1)
+struct IntervalImageHeader
+{
+	char     Signature[8];   // "XDXRNG" - The interval image signature
+	uint32_t Version;
+	uint16_t KeySize;        // sizeof(K)
+	uint16_t ValueSize;      // sizeof(T)
+	uint64_t Count;          // Number of intervals
+	int32_t  MaxLevel;       // Level of the implicit tree root
+	uint32_t Reserved;
+};
+#pragma pack(pop)
+
+template <class T, typename K = int64_t>
+class IntervalImage
+{
+	static_assert(std::is_trivially_copyable<T>::value, "IntervalImage values are stored bytewise");
+public:
+	typedef IntervalIndexEntry<T,K> entry;
+	typedef IntervalArrays<T,K>     arrays;
+	typedef IntervalQuery<T,K>      const_iterator;
+	typedef IntervalQueryRange<T,K> query_range;
+
+	enum enFormat
+	{
+		IMAGE_VERSION = 1,
+		IMAGE_ALIGN   = 8,
+	};
+
+	IntervalImage(): m_Arrays() {}
+
+	// Serializes the index into Image, which is 8-byte aligned by its type.
+	// The index is compacted first, as the image keeps no unindexed tail.
+	static void store(IntervalIndex<T,K>& Index, std::vector<uint64_t>& Image)
+	{
+		Index.compact();
+		arrays a = Index.view();
+		size_t keys   = padded(a.count*sizeof(K));
+		size_t values = padded(a.count*sizeof(T));
+		Image.assign((sizeof(IntervalImageHeader) + keys*3 + values)/sizeof(uint64_t), 0);
+
+		uint8_t* out = (uint8_t*)Image.data();
+		IntervalImageHeader* h = (IntervalImageHeader*)out;
+		memcpy(h->Signature, signature(), sizeof(h->Signature));
+		h->Version   = IMAGE_VERSION;
+		h->KeySize   = sizeof(K);
+		h->ValueSize = sizeof(T);
+		h->Count     = a.count;
+		h->MaxLevel  = a.maxLevel;
+		if(a.count==0)
+			return;
+		out += sizeof(IntervalImageHeader);
+		memcpy(out, a.start, a.count*sizeof(K));   out += keys;
+		memcpy(out, a.stop, a.count*sizeof(K));    out += keys;
+		memcpy(out, a.maxStop, a.count*sizeof(K)); out += keys;
+		memcpy(out, a.value, a.count*sizeof(T));
+	}
+
+	// Attaches to an image produced by store(). The block is not copied and
+	// must stay alive and unchanged while attached. Returns false when the
+	// block is misaligned, truncated or not an image of this type.
+	bool attach(const void* Data, size_t Size)
+	{
+		detach();
+		if(Data==nullptr || ((uintptr_t)Data % IMAGE_ALIGN)!=0 || Size < sizeof(IntervalImageHeader))
+			return false;
+		const IntervalImageHeader* h = (const IntervalImageHeader*)Data;
+		if(memcmp(h->Signature, signature(), sizeof(h->Signature))!=0 ||
+			h->Version!=IMAGE_VERSION || h->KeySize!=sizeof(K) || h->ValueSize!=sizeof(T))
+			return false;
+		// The count must fit the block and agree with the tree height
+		uint64_t count = h->Count;
+		if(count > (Size - sizeof(IntervalImageHeader))/(sizeof(K)*3 + sizeof(T)))
+			return false;
+		if(h->MaxLevel < 0 || h->MaxLevel >= 63 ||
+			(count==0 && h->MaxLevel!=0) ||
+			(count>0 && ((count >> h->MaxLevel)==0 || (count >> h->MaxLevel) > 1)))
+			return false;
+		size_t keys   = padded((size_t)count*sizeof(K));
+		size_t values = padded((size_t)count*sizeof(T));
+		if(sizeof(IntervalImageHeader) + keys*3 + values > Size)
+			return false;
+
+		const uint8_t* in = (const uint8_t*)Data + sizeof(IntervalImageHeader);
+		m_Arrays.start    = (const K*)in;
+		m_Arrays.stop     = (const K*)(in + keys);
+		m_Arrays.maxStop  = (const K*)(in + keys*2);
+		m_Arrays.value    = (const T*)(in + keys*3);
+		m_Arrays.indexed  = (size_t)count;
+		m_Arrays.count    = (size_t)count;
+		m_Arrays.maxLevel = h->MaxLevel;
+		return true;
+	}
+	void detach()
+	{
+		m_Arrays = arrays();
+	}
+	bool attached() const {return m_Arrays.start!=nullptr;}
+
+	size_t size() const {return m_Arrays.count;}
+	bool   empty() const {return size()==0;}
+
+	query_range overlapping(K Start, K Stop) const
+	{
+		return query_range(const_iterator(m_Arrays, const_iterator::QUERY_OVERLAP, Start, Stop));
+	}
+	query_range stabbing(K Point) const
+	{
+		return overlapping(Point, Point);
+	}
+	query_range contained(K Start, K Stop) const
+	{
+		return query_range(const_iterator(m_Arrays, const_iterator::QUERY_CONTAINED, Start, Stop));
+	}
+	bool overlaps(K Start, K Stop) const
+	{
+		return !overlapping(Start, Stop).empty();
+	}
+	entry operator[](size_t Pos) const
+	{
+		return m_Arrays[Pos];
+	}
+private:
+	static const char* signature() {return "XDXRNG\0";}
+	static size_t padded(size_t Bytes)
+	{
+		return (Bytes + IMAGE_ALIGN - 1)/IMAGE_ALIGN*IMAGE_ALIGN;
+	}
+private:
+	arrays m_Arrays;
+};
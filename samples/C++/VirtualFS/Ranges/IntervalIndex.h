@@ -0,0 +1,719 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <cstddef>
+#include <cstdint>
+#include "IntervalScan.h"
+
+////////////////////////////////////////////////////////////////
+// IntervalIndex keeps closed intervals [start, stop] in flat arrays
+// sorted by start: the keys are stored as separate start[], stop[]
+// and maxStop[] arrays next to the values. The indexed part of the
+// arrays is an implicit balanced tree (the slot i has level k when
+// i has exactly k trailing one bits) where every slot also keeps
+// the maximal stop of its subtree, so no child pointers exist.
+// Small subtrees and the tail are scanned as buckets with the
+// vectorized scanners of IntervalScan.h.
+//
+// New intervals are appended to a small sorted tail of the same
+// arrays and merged into the indexed part once the tail outgrows
+// sqrt(N), which keeps insert and erase amortized O(sqrt(N)).
+// Erased intervals of the indexed part become tombstones (stop is
+// set to the minimal K value) until the next merge.
+//
+// Queries return lazy ranges: iterating them walks the tree with
+// a fixed-size stack and allocates nothing.
+//
+// Keys are full-width K values, the minimal K value is reserved.
+////////////////////////////////////////////////////////////////
+template <class T, typename K = int64_t>
+struct IntervalIndexEntry
+{
+	K        start;
+	K        stop;
+	const T& value;
+};
+
+// The arrays of an index as seen by the queries. The indexed part
+// [0, indexed) is the implicit tree, the rest up to count is sorted.
+template <class T, typename K = int64_t>
+struct IntervalArrays
+{
+	const K* start;
+	const K* stop;
+	const K* maxStop;
+	const T* value;
+	size_t   indexed;
+	size_t   count;
+	int32_t  maxLevel;
+
+	IntervalIndexEntry<T,K> operator[](size_t Pos) const
+	{
+		IntervalIndexEntry<T,K> e = {start[Pos], stop[Pos], value[Pos]};
+		return e;
+	}
+	// The first position in [First, Last) having start >= Key
+	size_t lowerBound(size_t First, size_t Last, K Key) const
+	{
+		while(First < Last)
+		{
+			size_t mid = First + (Last - First)/2;
+			if(start[mid] < Key)
+				First = mid + 1;
+			else
+				Last = mid;
+		}
+		return First;
+	}
+};
+
+// One answer of a batch query: the probe number and the slot of an interval
+struct IntervalIndexHit
+{
+	size_t probe;
+	size_t slot;
+};
+
+// The lazy query over the arrays of an IntervalIndex or an IntervalImage
+template <class T, typename K = int64_t>
+class IntervalQuery
+{
+	template <class, typename> friend class IntervalIndex;
+	template <class, typename> friend class IntervalImage;
+public:
+	typedef IntervalIndexEntry<T,K> entry;
+	typedef IntervalArrays<T,K>     arrays;
+	enum enQueryMode
+	{
+		QUERY_OVERLAP   = 0,  // Intervals sharing at least one point with the query
+		QUERY_CONTAINED = 1,  // Intervals lying entirely inside the query
+	};
+	enum enLimits
+	{
+		LEAF_LEVEL   = 5,     // Subtrees up to 2^(LEAF_LEVEL+1)-1 slots are scanned as one bucket
+		MAX_DEPTH    = 64,
+	};
+private:
+	enum enPhase
+	{
+		PH_TREE = 0,
+		PH_SCAN = 1,
+		PH_TAIL = 2,
+		PH_END  = 3,
+	};
+	struct frame
+	{
+		size_t  x;   // Slot position
+		int32_t k;   // Slot level
+		int32_t w;   // Left subtree already visited
+	};
+	struct arrow
+	{
+		entry e;
+		const entry* operator->() const {return &e;}
+	};
+public:
+	typedef std::input_iterator_tag iterator_category;
+	typedef entry                   value_type;
+	typedef ptrdiff_t               difference_type;
+	typedef arrow                   pointer;
+	typedef entry                   reference;
+
+	IntervalQuery(): m_Arrays(), m_Mode(QUERY_OVERLAP), m_Start(0), m_Stop(0), m_StopHi(0),
+		m_Phase(PH_END), m_Depth(0), m_Pos(0), m_ScanEnd(0), m_Base(0), m_Mask(0), m_Current(0) {}
+	// Only the used part of the stack is copied
+	IntervalQuery(const IntervalQuery& other) {*this = other;}
+	IntervalQuery& operator=(const IntervalQuery& other)
+	{
+		m_Arrays  = other.m_Arrays;
+		m_Mode    = other.m_Mode;
+		m_Start   = other.m_Start;
+		m_Stop    = other.m_Stop;
+		m_StopHi  = other.m_StopHi;
+		m_Phase   = other.m_Phase;
+		m_Depth   = other.m_Depth;
+		m_Pos     = other.m_Pos;
+		m_ScanEnd = other.m_ScanEnd;
+		m_Base    = other.m_Base;
+		m_Mask    = other.m_Mask;
+		m_Current = other.m_Current;
+		std::copy(other.m_Stack, other.m_Stack + other.m_Depth, m_Stack);
+		return *this;
+	}
+
+	reference operator*() const {return m_Arrays[m_Current];}
+	pointer operator->() const {arrow a = {m_Arrays[m_Current]}; return a;}
+	IntervalQuery& operator++() {advance(); return *this;}
+	IntervalQuery operator++(int) {IntervalQuery tmp(*this); advance(); return tmp;}
+	bool operator==(const IntervalQuery& other) const
+	{
+		if(m_Phase==PH_END || other.m_Phase==PH_END)
+			return m_Phase==other.m_Phase;
+		return m_Arrays.start==other.m_Arrays.start && m_Current==other.m_Current;
+	}
+	bool operator!=(const IntervalQuery& other) const {return !(*this==other);}
+	// Position of the current interval in the index arrays
+	size_t position() const {return m_Current;}
+private:
+	IntervalQuery(const arrays& Arrays, enQueryMode Mode, K Start, K Stop):
+		m_Arrays(Arrays), m_Mode(Mode), m_Start(Start), m_Stop(Stop), m_StopHi(Stop),
+		m_Phase(PH_TREE), m_Depth(0), m_Pos(0), m_ScanEnd(0), m_Base(0), m_Mask(0), m_Current(0)
+	{
+		// No live interval stops at the reserved minimum, the tombstones do
+		if(m_Start==std::numeric_limits<K>::min())
+			m_Start++;
+		// Overlapping intervals may stop anywhere past the query start
+		if(m_Mode==QUERY_OVERLAP)
+			m_StopHi = std::numeric_limits<K>::max();
+
+		size_t indexed = m_Arrays.indexed;
+		if(indexed==0)
+		{
+			startTail();
+		}
+		else if(m_Mode==QUERY_CONTAINED)
+		{
+			// Contained intervals start inside the query, so a binary search is enough
+			m_Phase   = PH_SCAN;
+			m_Pos     = m_Arrays.lowerBound(0, indexed, m_Start);
+			m_ScanEnd = indexed;
+		}
+		else
+		{
+			m_Stack[0].k = m_Arrays.maxLevel;
+			m_Stack[0].x = ((size_t)1 << m_Stack[0].k) - 1;
+			m_Stack[0].w = 0;
+			m_Depth = 1;
+		}
+		advance();
+	}
+	void startTail()
+	{
+		m_Phase   = PH_TAIL;
+		m_Pos     = m_Arrays.indexed;
+		m_ScanEnd = m_Arrays.count;
+		if(m_Mode==QUERY_CONTAINED)
+			m_Pos = m_Arrays.lowerBound(m_Pos, m_ScanEnd, m_Start);
+	}
+	// Scans [m_Pos, m_ScanEnd), which is sorted by start, bucket by bucket
+	bool scan()
+	{
+		for(;;)
+		{
+			if(m_Mask!=0)
+			{
+				m_Current = m_Base + IntervalScan::lowestBit(m_Mask);
+				m_Mask &= m_Mask - 1;
+				return true;
+			}
+			if(m_Pos >= m_ScanEnd)
+				return false;
+			size_t count  = std::min<size_t>(m_ScanEnd - m_Pos, IntervalScan::MAX_BUCKET);
+			size_t prefix = 0;
+			m_Base = m_Pos;
+			m_Mask = IntervalScan::Scanner<K>::scan(m_Arrays.start + m_Pos, m_Arrays.stop + m_Pos,
+				count, m_Stop, m_Start, m_StopHi, &prefix);
+			m_Pos  = (prefix < count)?m_ScanEnd:m_Pos + count;
+		}
+	}
+	// Walks the implicit tree until a matching slot or a small subtree
+	// to be scanned is found. Returns true when positioned on a match.
+	bool walk()
+	{
+		const K* starts = m_Arrays.start;
+		const K* stops  = m_Arrays.stop;
+		const K* maxs   = m_Arrays.maxStop;
+		size_t  n     = m_Arrays.indexed;
+		frame*  stack = m_Stack;
+		int32_t depth = m_Depth;
+		const K qs = m_Start, qe = m_Stop, qhi = m_StopHi; // locals, as K may alias the keys
+		while(depth > 0)
+		{
+			frame z = stack[--depth];
+			if(z.k <= LEAF_LEVEL)
+			{
+				// Small subtree: scan its slots in order
+				size_t i0 = z.x >> z.k << z.k;
+				size_t i1 = i0 + ((size_t)1 << (z.k + 1)) - 1;
+				m_Pos     = i0;
+				m_ScanEnd = (i1 < n)?i1:n;
+				m_Phase   = PH_SCAN;
+				m_Depth   = depth;
+				return false;
+			}
+			else if(z.w==0)
+			{
+				// Revisit the slot after its left subtree
+				size_t y = z.x - ((size_t)1 << (z.k - 1));
+				stack[depth].x = z.x; stack[depth].k = z.k; stack[depth++].w = 1;
+				if(y >= n || maxs[y] >= qs)
+				{
+					stack[depth].x = y; stack[depth].k = z.k - 1; stack[depth++].w = 0;
+				}
+			}
+			else if(z.x < n && starts[z.x] <= qe)
+			{
+				stack[depth].x = z.x + ((size_t)1 << (z.k - 1)); stack[depth].k = z.k - 1; stack[depth++].w = 0;
+				if(stops[z.x] >= qs && stops[z.x] <= qhi)
+				{
+					m_Current = z.x;
+					m_Depth   = depth;
+					return true;
+				}
+			}
+		}
+		m_Depth = 0;
+		startTail();
+		return false;
+	}
+	void advance()
+	{
+		for(;;)
+		{
+			switch(m_Phase)
+			{
+			case PH_SCAN:
+				if(scan())
+					return;
+				if(m_Mode==QUERY_CONTAINED)
+					startTail();
+				else
+					m_Phase = PH_TREE;
+				break;
+			case PH_TREE:
+				if(walk())
+					return;
+				break;
+			case PH_TAIL:
+				if(scan())
+					return;
+				m_Phase = PH_END;
+				break;
+			default:
+				return;
+			}
+		}
+	}
+private:
+	arrays      m_Arrays;
+	enQueryMode m_Mode;
+	K           m_Start;
+	K           m_Stop;
+	K           m_StopHi;   // The upper bound for the stops of the matches
+	int32_t     m_Phase;
+	int32_t     m_Depth;
+	size_t      m_Pos;
+	size_t      m_ScanEnd;
+	size_t      m_Base;     // The first slot of the last scanned bucket
+	uint64_t    m_Mask;     // Matches of the last scanned bucket not visited yet
+	size_t      m_Current;
+	frame       m_Stack[MAX_DEPTH];
+};
+
+// A lazily evaluated query result usable in range-based for loops
+template <class T, typename K = int64_t>
+class IntervalQueryRange
+{
+public:
+	IntervalQueryRange(const IntervalQuery<T,K>& First): m_First(First) {}
+	IntervalQuery<T,K> begin() const {return m_First;}
+	IntervalQuery<T,K> end() const {return IntervalQuery<T,K>();}
+	bool empty() const {return m_First==IntervalQuery<T,K>();}
+private:
+	IntervalQuery<T,K> m_First;
+};
+
+template <class T, typename K = int64_t>
+class IntervalIndex
+{
+public:
+	typedef IntervalIndexEntry<T,K> entry;
+	typedef IntervalIndexHit        hit;
+	typedef IntervalArrays<T,K>     arrays;
+	typedef IntervalQuery<T,K>      const_iterator;
+	typedef IntervalQueryRange<T,K> query_range;
+
+	enum enLimits
+	{
+		MIN_TAIL     = 32,    // The unindexed tail may always hold that many intervals
+		SWEEP_RATIO  = 2,     // A batch is swept when probes*depth*SWEEP_RATIO reach the slot count
+	};
+
+public:
+	IntervalIndex(): m_Indexed(0), m_MaxLevel(0), m_Dead(0) {}
+
+	size_t size() const {return m_Start.size() - m_Dead;}
+	bool   empty() const {return size()==0;}
+	void   clear()
+	{
+		m_Start.clear();
+		m_Stop.clear();
+		m_Max.clear();
+		m_Values.clear();
+		m_Indexed  = 0;
+		m_MaxLevel = 0;
+		m_Dead     = 0;
+	}
+	void reserve(size_t Count)
+	{
+		m_Start.reserve(Count);
+		m_Stop.reserve(Count);
+		m_Max.reserve(Count);
+		m_Values.reserve(Count);
+	}
+
+	// Replaces the content with the given intervals. Input which is
+	// already sorted by start is indexed in O(N) without sorting.
+	template <class Iter>
+	void assign(Iter First, Iter Last)
+	{
+		clear();
+		bool sorted = true;
+		for(; First!=Last; ++First)
+		{
+			if(First->start > First->stop || First->start==std::numeric_limits<K>::min())
+				continue;
+			size_t n = m_Start.size();
+			if(n>0 && less(First->start, First->stop, m_Start[n-1], m_Stop[n-1]))
+				sorted = false;
+			m_Start.push_back(First->start);
+			m_Stop.push_back(First->stop);
+			m_Values.push_back(First->value);
+		}
+		m_Max.resize(m_Start.size());
+		if(!sorted)
+		{
+			std::vector<size_t> order(m_Start.size());
+			for(size_t i = 0; i < order.size(); i++)
+				order[i] = i;
+			std::sort(order.begin(), order.end(), [this](size_t a, size_t b){return less(m_Start[a], m_Stop[a], m_Start[b], m_Stop[b]);});
+			permute(order);
+		}
+		reindex();
+	}
+
+	bool insert(K Start, K Stop, const T& Value)
+	{
+		if(Start > Stop || Start==std::numeric_limits<K>::min())
+			return false;
+		// Keep the unindexed tail sorted
+		size_t first = m_Indexed, last = m_Start.size();
+		while(first < last)
+		{
+			size_t mid = first + (last - first)/2;
+			if(less(Start, Stop, m_Start[mid], m_Stop[mid]))
+				last = mid;
+			else
+				first = mid + 1;
+		}
+		m_Start.insert(m_Start.begin() + first, Start);
+		m_Stop.insert(m_Stop.begin() + first, Stop);
+		m_Max.insert(m_Max.begin() + first, Stop);
+		m_Values.insert(m_Values.begin() + first, Value);
+		if(m_Start.size() - m_Indexed > tailLimit())
+			compact();
+		return true;
+	}
+
+	// Erases all intervals exactly matching [Start, Stop] and accepted by Pred
+	template <class Pred>
+	size_t erase(K Start, K Stop, Pred Accept)
+	{
+		size_t erased = 0;
+		// The indexed part: mark as tombstones
+		for(size_t i = lowerBound(0, m_Indexed, Start); i<m_Indexed && m_Start[i]==Start; i++)
+		{
+			if(m_Stop[i]==Stop && Accept(m_Values[i]))
+			{
+				m_Stop[i] = std::numeric_limits<K>::min();
+				m_Dead++;
+				erased++;
+			}
+		}
+		// The tail: remove in place
+		size_t first = lowerBound(m_Indexed, m_Start.size(), Start), last = first, keep = first;
+		while(last<m_Start.size() && m_Start[last]==Start)
+			last++;
+		for(size_t i = first; i < last; i++)
+		{
+			if(m_Stop[i]==Stop && Accept(m_Values[i]))
+				continue;
+			move(keep++, i);
+		}
+		if(keep < last)
+		{
+			erased += last - keep;
+			m_Start.erase(m_Start.begin() + keep, m_Start.begin() + last);
+			m_Stop.erase(m_Stop.begin() + keep, m_Stop.begin() + last);
+			m_Max.erase(m_Max.begin() + keep, m_Max.begin() + last);
+			m_Values.erase(m_Values.begin() + keep, m_Values.begin() + last);
+		}
+
+		if(m_Dead*2 > m_Indexed)
+			compact();
+		return erased;
+	}
+	size_t erase(K Start, K Stop)
+	{
+		return erase(Start, Stop, [](const T&){return true;});
+	}
+
+	// Intervals sharing at least one point with [Start, Stop]
+	query_range overlapping(K Start, K Stop) const
+	{
+		return query_range(const_iterator(view(), const_iterator::QUERY_OVERLAP, Start, Stop));
+	}
+	// Intervals containing the given point
+	query_range stabbing(K Point) const
+	{
+		return overlapping(Point, Point);
+	}
+	// Intervals lying entirely inside [Start, Stop]
+	query_range contained(K Start, K Stop) const
+	{
+		return query_range(const_iterator(view(), const_iterator::QUERY_CONTAINED, Start, Stop));
+	}
+	bool overlaps(K Start, K Stop) const
+	{
+		return !overlapping(Start, Stop).empty();
+	}
+
+	// Answers overlap queries for many probes at once: every probe
+	// [First->start, First->stop] overlapped by an interval appends
+	// {probe number, slot} to Hits, grouped by probe in probe order.
+	// Probes sorted by start are merged with the sorted intervals in
+	// one sweep, otherwise or when the probes are too sparse to pay
+	// for a sweep each one is looked up in the tree.
+	// Returns the number of appended hits; the slots stay valid until
+	// the index is modified.
+	template <class Iter>
+	size_t overlappingBatch(Iter First, Iter Last, std::vector<hit>& Hits) const
+	{
+		size_t before = Hits.size();
+		size_t count  = 0;
+		bool   sorted = true;
+		K      last   = std::numeric_limits<K>::min();
+		for(Iter it = First; it!=Last; ++it, ++count)
+		{
+			if(it->start < last)
+				sorted = false;
+			last = it->start;
+		}
+		if(count==0)
+			return 0;
+
+		if(!sorted || count*(size_t)(m_MaxLevel + 1)*SWEEP_RATIO < m_Start.size())
+		{
+			size_t probe = 0;
+			for(; First!=Last; ++First, ++probe)
+			{
+				for(const_iterator it = overlapping(First->start, First->stop).begin(), end; it!=end; ++it)
+				{
+					hit h = {probe, it.position()};
+					Hits.push_back(h);
+				}
+			}
+			return Hits.size() - before;
+		}
+
+		// The intervals which may still overlap a later probe, in start order
+		std::vector<size_t> active;
+		const K* starts  = m_Start.data();
+		const K* stops   = m_Stop.data();
+		size_t   n       = m_Start.size();
+		size_t   i       = 0;          // The next slot of the indexed part
+		size_t   j       = m_Indexed;  // The next slot of the tail
+		size_t   probe   = 0;
+		for(; First!=Last; ++First, ++probe)
+		{
+			K qs = First->start, qe = First->stop;
+			if(qs==std::numeric_limits<K>::min())
+				qs++;
+			// Take the intervals starting up to the probe stop, merging both sorted parts
+			for(;;)
+			{
+				bool   fromTree = i < m_Indexed && (j >= n || starts[i] <= starts[j]);
+				size_t next     = fromTree?i:j;
+				if(next >= n || starts[next] > qe)
+					break;
+				if(fromTree)
+					i++;
+				else
+					j++;
+				if(stops[next] >= qs)
+					active.push_back(next);
+			}
+			// Report the overlaps and drop the intervals stopping before the probe,
+			// the later probes do not start earlier
+			size_t keep = 0;
+			for(size_t a = 0; a < active.size(); a++)
+			{
+				size_t slot = active[a];
+				if(stops[slot] < qs)
+					continue;
+				active[keep++] = slot;
+				if(starts[slot] <= qe)
+				{
+					hit h = {probe, slot};
+					Hits.push_back(h);
+				}
+			}
+			active.resize(keep);
+		}
+		return Hits.size() - before;
+	}
+
+	// Merges the unindexed tail and drops the tombstones
+	void compact()
+	{
+		size_t n = m_Start.size();
+		size_t i = 0, j = m_Indexed, out = 0;
+		growMerge(n);
+		while(i < m_Indexed && j < n)
+		{
+			if(m_Stop[i] < m_Start[i])
+				i++;
+			else if(less(m_Start[j], m_Stop[j], m_Start[i], m_Stop[i]))
+				copyTo(out++, j++);
+			else
+				copyTo(out++, i++);
+		}
+		for(; i < m_Indexed; i++)
+		{
+			if(m_Stop[i] >= m_Start[i])
+				copyTo(out++, i);
+		}
+		for(; j < n; j++)
+			copyTo(out++, j);
+		m_Start.swap(m_MergeStart);
+		m_Stop.swap(m_MergeStop);
+		m_Values.swap(m_MergeValues);
+		m_Start.resize(out);
+		m_Stop.resize(out);
+		m_Values.resize(out);
+		m_Max.resize(out);
+		m_Dead = 0;
+		reindex();
+	}
+
+	// Direct access to the arrays, mainly for positions reported by iterators
+	entry operator[](size_t Pos) const
+	{
+		return view()[Pos];
+	}
+	size_t slots() const {return m_Start.size();}
+	// The arrays as they are now; valid until the index is modified
+	arrays view() const
+	{
+		arrays a = {m_Start.data(), m_Stop.data(), m_Max.data(), m_Values.data(), m_Indexed, m_Start.size(), m_MaxLevel};
+		return a;
+	}
+
+private:
+	static bool less(K StartA, K StopA, K StartB, K StopB)
+	{
+		return StartA < StartB || (StartA==StartB && StopA < StopB);
+	}
+	size_t tailLimit() const
+	{
+		size_t limit = MIN_TAIL;
+		while(limit*limit < m_Indexed)
+			limit <<= 1;
+		return limit;
+	}
+	size_t lowerBound(size_t First, size_t Last, K Key) const
+	{
+		return view().lowerBound(First, Last, Key);
+	}
+	void move(size_t To, size_t From)
+	{
+		if(To==From)
+			return;
+		m_Start[To]  = m_Start[From];
+		m_Stop[To]   = m_Stop[From];
+		m_Values[To] = std::move(m_Values[From]);
+	}
+	// Makes the merge buffers, which are reused between merges, hold Count slots
+	void growMerge(size_t Count)
+	{
+		if(m_MergeStart.size() < Count)
+		{
+			m_MergeStart.resize(Count);
+			m_MergeStop.resize(Count);
+			m_MergeValues.resize(Count);
+		}
+	}
+	void copyTo(size_t To, size_t From)
+	{
+		m_MergeStart[To]  = m_Start[From];
+		m_MergeStop[To]   = m_Stop[From];
+		m_MergeValues[To] = std::move(m_Values[From]);
+	}
+	// Reorders all the arrays so that the slot Order[i] becomes i
+	void permute(const std::vector<size_t>& Order)
+	{
+		growMerge(Order.size());
+		for(size_t i = 0; i < Order.size(); i++)
+			copyTo(i, Order[i]);
+		m_Start.swap(m_MergeStart);
+		m_Stop.swap(m_MergeStop);
+		m_Values.swap(m_MergeValues);
+		m_Start.resize(Order.size());
+		m_Stop.resize(Order.size());
+		m_Values.resize(Order.size());
+	}
+	// Builds the implicit tree over the whole arrays bottom-up in O(N)
+	void reindex()
+	{
+		const K* stops = m_Stop.data();
+		K*       maxs  = m_Max.data();
+		size_t   n     = m_Start.size();
+		m_Indexed  = n;
+		m_MaxLevel = 0;
+		if(n==0)
+			return;
+
+		size_t i, lastPos = 0;
+		K last = stops[0];
+		for(i = 0; i < n; i += 2)
+		{
+			lastPos = i;
+			last = maxs[i] = stops[i]; // leaves are at level 0
+		}
+		int32_t k;
+		for(k = 1; ((size_t)1 << k) <= n; ++k)
+		{
+			size_t x = (size_t)1 << (k - 1), i0 = (x << 1) - 1, step = x << 2;
+			for(i = i0; i < n; i += step)
+			{
+				K el = maxs[i - x];                  // the left child
+				K er = (i + x < n)?maxs[i + x]:last; // the right child, maybe out of range
+				K e  = stops[i];
+				e = (e > el)?e:el;
+				e = (e > er)?e:er;
+				maxs[i] = e;
+			}
+			// Move to the parent of the last slot in range
+			lastPos = ((lastPos >> k) & 1)?lastPos - x:lastPos + x;
+			if(lastPos < n && maxs[lastPos] > last)
+				last = maxs[lastPos];
+		}
+		m_MaxLevel = k - 1;
+	}
+private:
+	// [0, m_Indexed) is the implicit tree, the rest is a sorted tail
+	std::vector<K> m_Start;
+	std::vector<K> m_Stop;
+	std::vector<K> m_Max;
+	std::vector<T> m_Values;
+	size_t         m_Indexed;
+	int32_t        m_MaxLevel;
+	size_t         m_Dead;      // Tombstones in the indexed part
+
+	// Merge buffers kept between merges
+	std::vector<K> m_MergeStart;
+	std::vector<K> m_MergeStop;
+	std::vector<T> m_MergeValues;
+};
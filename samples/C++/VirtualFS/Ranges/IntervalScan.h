@@ -0,0 +1,183 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#if defined(_M_X64) || defined(__x86_64__)
+#	define INTERVAL_SCAN_X86
+#	include <immintrin.h>
+#	ifdef _MSC_VER
+#		include <intrin.h>
+#	endif
+#endif
+
+#ifdef _MSC_VER
+#	define INTERVAL_SCAN_TARGET(isa)
+#else
+#	define INTERVAL_SCAN_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+////////////////////////////////////////////////////////////////
+// Bucket scanners used by IntervalIndex. A scanner checks up to
+// 64 consecutive intervals kept as separate start[] and stop[]
+// arrays sorted by start and returns the bit mask of the ones with
+//     start <= StartHi  and  StopLo <= stop <= StopHi
+// As the starts are sorted, *Prefix receives the number of leading
+// intervals with start <= StartHi: the scan may stop right there.
+//
+// The AVX2 and AVX-512 versions compare 4 and 8 keys at once and
+// are picked at runtime, the scalar one is the portable fallback.
+////////////////////////////////////////////////////////////////
+namespace IntervalScan
+{
+	enum enLimits
+	{
+		MAX_BUCKET = 64,  // Intervals checked by one scanner call
+	};
+	typedef uint64_t (*scan_fn)(const int64_t* Start, const int64_t* Stop, size_t Count,
+		int64_t StartHi, int64_t StopLo, int64_t StopHi, size_t* Prefix);
+
+	inline uint32_t lowestBit(uint64_t Mask)
+	{
+	#ifdef _MSC_VER
+		unsigned long pos;
+		_BitScanForward64(&pos, Mask);
+		return pos;
+	#else
+		return __builtin_ctzll(Mask);
+	#endif
+	}
+
+	template <typename K>
+	uint64_t scanScalar(const K* Start, const K* Stop, size_t Count, K StartHi, K StopLo, K StopHi, size_t* Prefix)
+	{
+		uint64_t mask = 0;
+		size_t   i = 0;
+		for(; i < Count && Start[i] <= StartHi; i++)
+			mask |= (uint64_t)((Stop[i] >= StopLo) & (Stop[i] <= StopHi)) << i;
+		*Prefix = i;
+		return mask;
+	}
+
+#ifdef INTERVAL_SCAN_X86
+	INTERVAL_SCAN_TARGET("avx2")
+	inline uint64_t scanAvx2(const int64_t* Start, const int64_t* Stop, size_t Count,
+		int64_t StartHi, int64_t StopLo, int64_t StopHi, size_t* Prefix)
+	{
+		const __m256i hi  = _mm256_set1_epi64x(StartHi);
+		const __m256i lo  = _mm256_set1_epi64x(StopLo);
+		const __m256i shi = _mm256_set1_epi64x(StopHi);
+		uint64_t mask = 0;
+		size_t   i = 0;
+		for(; i + 4 <= Count; i += 4)
+		{
+			__m256i s    = _mm256_loadu_si256((const __m256i*)(Start + i));
+			__m256i e    = _mm256_loadu_si256((const __m256i*)(Stop + i));
+			__m256i past = _mm256_cmpgt_epi64(s, hi);
+			__m256i miss = _mm256_or_si256(past, _mm256_or_si256(_mm256_cmpgt_epi64(lo, e), _mm256_cmpgt_epi64(e, shi)));
+			uint64_t hits = ~(uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(miss)) & 0xF;
+			uint32_t pastBits = (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(past));
+			mask |= hits << i;
+			if(pastBits)
+			{
+				*Prefix = i + lowestBit(pastBits);
+				return mask;
+			}
+		}
+		// A full bucket leaves no tail, and a shift by 64 is undefined
+		size_t tail = 0;
+		if(i < Count)
+			mask |= scanScalar<int64_t>(Start + i, Stop + i, Count - i, StartHi, StopLo, StopHi, &tail) << i;
+		*Prefix = i + tail;
+		return mask;
+	}
+
+	INTERVAL_SCAN_TARGET("avx512f")
+	inline uint64_t scanAvx512(const int64_t* Start, const int64_t* Stop, size_t Count,
+		int64_t StartHi, int64_t StopLo, int64_t StopHi, size_t* Prefix)
+	{
+		const __m512i hi  = _mm512_set1_epi64(StartHi);
+		const __m512i lo  = _mm512_set1_epi64(StopLo);
+		const __m512i shi = _mm512_set1_epi64(StopHi);
+		uint64_t mask = 0;
+		for(size_t i = 0; i < Count; i += 8)
+		{
+			// The lanes past Count are loaded as zeros and reported as past the query
+			__mmask8 lanes = (Count - i >= 8)?(__mmask8)0xFF:(__mmask8)((1u << (Count - i)) - 1);
+			__m512i  s     = _mm512_maskz_loadu_epi64(lanes, Start + i);
+			__m512i  e     = _mm512_maskz_loadu_epi64(lanes, Stop + i);
+			__mmask8 past  = _mm512_cmpgt_epi64_mask(s, hi) | (__mmask8)~lanes;
+			__mmask8 hits  = _mm512_mask_cmple_epi64_mask((__mmask8)~past, lo, e) & _mm512_cmple_epi64_mask(e, shi);
+			mask |= (uint64_t)hits << i;
+			if(past)
+			{
+				*Prefix = i + lowestBit(past);
+				return mask;
+			}
+		}
+		*Prefix = Count;
+		return mask;
+	}
+
+	inline void cpuFeatures(bool* Avx2, bool* Avx512)
+	{
+		*Avx2 = *Avx512 = false;
+	#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		if(info[0] < 7)
+			return;
+		__cpuidex(info, 1, 0);
+		bool osxsave = (info[2] & (1 << 27))!=0;
+		bool avx     = (info[2] & (1 << 28))!=0;
+		if(!osxsave || !avx)
+			return;
+		unsigned long long xcr0 = _xgetbv(0);
+		__cpuidex(info, 7, 0);
+		*Avx2   = (xcr0 & 0x06)==0x06 && (info[1] & (1 << 5))!=0;
+		*Avx512 = (xcr0 & 0xE6)==0xE6 && (info[1] & (1 << 16))!=0;
+	#else
+		__builtin_cpu_init();
+		*Avx2   = __builtin_cpu_supports("avx2")!=0;
+		*Avx512 = __builtin_cpu_supports("avx512f")!=0;
+	#endif
+	}
+#endif
+
+	inline scan_fn detectScanner()
+	{
+	#ifdef INTERVAL_SCAN_X86
+		bool avx2 = false, avx512 = false;
+		cpuFeatures(&avx2, &avx512);
+		if(avx512)
+			return scanAvx512;
+		if(avx2)
+			return scanAvx2;
+	#endif
+		return scanScalar<int64_t>;
+	}
+	// The scanner in use for 64-bit keys; may be reassigned, e.g. to compare implementations
+	inline scan_fn& activeScanner()
+	{
+		static scan_fn fn = detectScanner();
+		return fn;
+	}
+
+	// Picks the vectorized scanners for 64-bit signed keys and the scalar one otherwise
+	template <typename K, bool Wide = std::is_integral<K>::value && std::is_signed<K>::value && sizeof(K)==8>
+	struct Scanner
+	{
+		static uint64_t scan(const K* Start, const K* Stop, size_t Count, K StartHi, K StopLo, K StopHi, size_t* Prefix)
+		{
+			return scanScalar<K>(Start, Stop, Count, StartHi, StopLo, StopHi, Prefix);
+		}
+	};
+	template <typename K>
+	struct Scanner<K, true>
+	{
+		static uint64_t scan(const K* Start, const K* Stop, size_t Count, K StartHi, K StopLo, K StopHi, size_t* Prefix)
+		{
+			return activeScanner()((const int64_t*)Start, (const int64_t*)Stop, Count,
+				(int64_t)StartHi, (int64_t)StopLo, (int64_t)StopHi, Prefix);
+		}
+	};
+}
@@ -22,12 +22,12 @@ public:
 };
 
 template <class T, typename K>
-int intervalStart(const Interval<T,K>& i) {
+K intervalStart(const Interval<T,K>& i) {
     return i.start;
 }
 
 template <class T, typename K>
-int intervalStop(const Interval<T,K>& i) {
+K intervalStop(const Interval<T,K>& i) {
     return i.stop;
 }
 
@@ -56,7 +56,7 @@ public:
     intervalVector intervals;
     intervalTree* left;
     intervalTree* right;
-    int center;
+    K center;
 
     IntervalTree<T,K>(void)
         : left(NULL)
@@ -68,31 +68,32 @@ public:
         center = other.center;
         intervals = other.intervals;
         if (other.left) {
-            left = (intervalTree*) malloc(sizeof(intervalTree));
-            *left = *other.left;
+            left = new intervalTree(*other.left);
         } else {
             left = NULL;
         }
         if (other.right) {
-            right = new intervalTree();
-            *right = *other.right;
+            right = new intervalTree(*other.right);
         } else {
             right = NULL;
         }
     }
 
     IntervalTree<T,K>& operator=(const intervalTree& other) {
+        if (this == &other) {
+            return *this;
+        }
+        delete left;
+        delete right;
         center = other.center;
         intervals = other.intervals;
         if (other.left) {
-            left = new intervalTree();
-            *left = *other.left;
+            left = new intervalTree(*other.left);
         } else {
             left = NULL;
         }
         if (other.right) {
-            right = new intervalTree();
-            *right = *other.right;
+            right = new intervalTree(*other.right);
         } else {
             right = NULL;
         }
@@ -103,12 +104,13 @@ public:
             intervalVector& ivals,
             unsigned int depth = 16,
             unsigned int minbucket = 64,
-            int leftextent = 0,
-            int rightextent = 0,
+            K leftextent = 0,
+            K rightextent = 0,
             unsigned int maxbucket = 512
             )
         : left(NULL)
         , right(NULL)
+        , center(0)
     {
 
         --depth;
@@ -121,9 +123,9 @@ public:
                 sort(ivals.begin(), ivals.end(), intervalStartSorter);
             }
 
-            int leftp = 0;
-            int rightp = 0;
-            int centerp = 0;
+            K leftp = 0;
+            K rightp = 0;
+            K centerp = 0;
             
             if (leftextent || rightextent) {
                 leftp = leftextent;
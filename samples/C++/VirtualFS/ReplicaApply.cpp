@@ -0,0 +1,40 @@
+// ReplicaApply.cpp : Rolls a standby container forward from replication logs.
+//
+// Usage: ReplicaApply <container> <log> [<log> ...]
+//
+// The container is a copy of the primary taken after the first log was
+// started, e.g. by VirtualFS::Snapshot. The logs are applied in the given
+// order, the blocks are copied as stored, so no keys are needed and the
+// standby is never decrypted. A log may be applied again, e.g. the current
+// log of the primary each time it is shipped. A log of another epoch than
+// the container, e.g. one started before the copy was taken, is refused.
+
+#include "stdafx.h"
+extern "C"
+{
+	#include "H5private.h"
+}
+#include "H5FDblock.h"
+
+int main(int argc, char* argv[])
+{
+	if(argc < 3)
+	{
+		printf("Usage: %s <container> <log> [<log> ...]\n", argv[0]);
+		return 2;
+	}
+	for(int i = 2; i < argc; i++)
+	{
+		uint64_t Applied = 0;
+		int res = XHdf5::ReplicationLog::Apply(argv[i], argv[1], &Applied);
+		const char* Result = (res>=0)?"ok":"FAILED";
+		if(res==XHdf5::ReplicationLog::APPLY_EPOCH)
+			Result = "FAILED, another epoch";
+		else if(res==XHdf5::ReplicationLog::APPLY_CORRUPT)
+			Result = "FAILED, the log is damaged";
+		printf("%s\t%llu records\t%s\n", argv[i], (unsigned long long)Applied, Result);
+		if(res<0)
+			return 1;
+	}
+	return 0;
+}
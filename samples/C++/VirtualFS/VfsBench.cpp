@@ -0,0 +1,406 @@
+// VfsBench.cpp : Runs fixed workloads against VirtualFS containers.
+//
+// Usage: VfsBench <folder> [<scale> [<fault seed>]]
+//
+// Every workload runs on a container of each block size, plain and AES
+// encrypted, created in <folder> and deleted afterwards. The file names,
+// sizes, offsets and contents come from generators seeded by the workload,
+// so two runs do the same I/O and the reads check what they get. The
+// container is reopened before each workload: the block cache starts cold
+// and the I/O counters of VirtualFS::GetIoStats count the workload only.
+//
+// With a fault seed the disk is made slow and flaky by an XHdf5::FaultInjector
+// seeded with it: a base latency with an exponential jitter, rare spikes
+// and short reads, the same for each run with the seed. No errors are
+// injected, the workloads must still pass their checks.
+//
+// One tab separated row per workload and container. ns_per_op and mb_per_s
+// are wall clock, the rest comes from the counters.
+
+#include "stdafx.h"
+#include "vfs.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace XDX;
+
+namespace
+{
+	typedef std::chrono::steady_clock bench_clock;
+
+	const DWORD   FOLDER_FILES = 100;       // Small files per folder
+	const DWORD   SMALL_MIN    = 64;
+	const DWORD   SMALL_MAX    = 8192;
+	const DWORD   STREAM_CHUNK = 1024*1024;
+	const DWORD   PAGE         = 4096;
+
+	int64_t elapsed_ns(bench_clock::time_point since)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - since).count();
+	}
+
+	// The content of a file is a function of its seed and the position,
+	// so any part of it can be checked on its own
+	uint8_t pattern(uint64_t seed, uint64_t pos)
+	{
+		uint64_t x = (seed + 1) * 0x9E3779B97F4A7C15ull + (pos >> 3);
+		x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+		x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+		x ^= x >> 31;
+		return (uint8_t)(x >> ((pos & 7) * 8));
+	}
+	void fill(uint64_t seed, uint64_t pos, uint8_t* buf, size_t size)
+	{
+		for(size_t i = 0; i < size; i++)
+			buf[i] = pattern(seed, pos + i);
+	}
+	bool check(uint64_t seed, uint64_t pos, const uint8_t* buf, size_t size)
+	{
+		for(size_t i = 0; i < size; i++)
+		{
+			if(buf[i]!=pattern(seed, pos + i))
+				return false;
+		}
+		return true;
+	}
+
+	struct Config
+	{
+		DWORD block_size;
+		bool  encrypted;
+		DWORD files;          // Small files
+		DWORD stream_mb;      // Size of the streamed file
+		DWORD random_reads;
+		DWORD threads;        // Of the mixed workload
+		DWORD mixed_ops;      // Per thread
+		XHdf5::FaultInjector* faults;  // nullptr - the disk as it is
+	};
+	struct Result
+	{
+		uint64_t ops;
+		uint64_t bytes;
+		int64_t  ns;
+		bool     ok;
+	};
+
+	class Bench
+	{
+	public:
+		Bench(const wchar_t* Folder, const Config& Cfg): cfg(Cfg), fs(nullptr), pwd_crypt(nullptr), data_crypt(nullptr)
+		{
+			swprintf_s(name, _countof(name), L"vfsbench_%u_%ls", cfg.block_size, cfg.encrypted?L"aes":L"plain");
+			wchar_t Path[MAX_PATH];
+			swprintf_s(Path, _countof(Path), L"%ls" XDX_PATH_SEP L"%ls.dat", Folder, name);
+			Platform::NativePath(Path, native, sizeof(native));
+			fs = new VirtualFS(name, Folder);
+			fs->SetFaultInjector(cfg.faults);
+			if(cfg.encrypted)
+			{
+				// A fixed password, the data key is made by Create
+				BYTE Key[16], IV[16];
+				for(int i = 0; i < 16; i++)
+				{
+					Key[i] = (BYTE)(0x5A ^ i);
+					IV[i]  = (BYTE)(0xA5 ^ i);
+				}
+				pwd_crypt  = new FSCryptoAES();
+				data_crypt = new FSCryptoAES();
+				pwd_crypt->SetKeyWithIV(Key, sizeof(Key), IV, sizeof(IV));
+			}
+		}
+		~Bench()
+		{
+			fs->Close();
+			fs->Release();
+			if(pwd_crypt!=nullptr)
+				pwd_crypt->Release();
+			if(data_crypt!=nullptr)
+				data_crypt->Release();
+			Platform::FileDelete(native);
+		}
+		DWORD Create()
+		{
+			Platform::FileDelete(native);
+			return fs->Create(name, name, pwd_crypt, data_crypt, cfg.block_size, 0, FS_VERSION_ID);
+		}
+		DWORD Reopen()
+		{
+			DWORD hRes = fs->Close();
+			if(hRes!=ERR_SUCCESS)
+				return hRes;
+			return fs->Open(name, pwd_crypt, data_crypt, 0);
+		}
+		void Report(const char* Workload, DWORD Threads, const Result& Res)
+		{
+			IoStats Stats;
+			fs->GetIoStats(Stats);
+			double ns_per_op = Res.ops ? (double)Res.ns / Res.ops : 0;
+			double mb_per_s  = Res.ns ? (double)Res.bytes * 1000.0 / Res.ns : 0;
+			printf("%s\t%u\t%s\t%u\t%llu\t%llu\t%.0f\t%.1f\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%s\n",
+				Workload, cfg.block_size, cfg.encrypted?"aes":"plain", Threads,
+				(unsigned long long)Res.ops, (unsigned long long)Res.bytes, ns_per_op, mb_per_s,
+				(unsigned long long)Stats.BLOCK_READS, (unsigned long long)Stats.BLOCK_WRITES,
+				(unsigned long long)Stats.CACHE_HITS, (unsigned long long)Stats.SEEKS,
+				(unsigned long long)(Stats.READ.P99_NS / 1000), (unsigned long long)(Stats.WRITE.P99_NS / 1000),
+				(unsigned long long)(Stats.LOCK_WAIT.P99_NS / 1000), Res.ok?"ok":"FAILED");
+			fflush(stdout);
+		}
+
+		// The files and folders of the small file workloads
+		void SmallFile(DWORD Index, wchar_t* Path, size_t Size, DWORD& Length)
+		{
+			swprintf_s(Path, Size, L"/d%03u/f%05u.bin", Index / FOLDER_FILES, Index);
+			std::mt19937 rnd(Index);
+			Length = std::uniform_int_distribution<DWORD>(SMALL_MIN, SMALL_MAX)(rnd);
+		}
+		Result CreateSmall()
+		{
+			Result Res = {0, 0, 0, true};
+			std::vector<uint8_t> Buf(SMALL_MAX);
+			bench_clock::time_point timer = bench_clock::now();
+			for(DWORD i = 0; i < cfg.files && Res.ok; i++)
+			{
+				wchar_t Path[64];
+				DWORD   Length = 0, Written = 0;
+				if(i % FOLDER_FILES==0)
+				{
+					swprintf_s(Path, _countof(Path), L"/d%03u", i / FOLDER_FILES);
+					if(fs->FolderCreate(Path, 1)!=ERR_SUCCESS)
+						Res.ok = false;
+				}
+				SmallFile(i, Path, _countof(Path), Length);
+				fill(i, 0, Buf.data(), Length);
+				HANDLE File = INVALID_HANDLE_VALUE;
+				if(fs->FileCreate(Path, 1, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ|FILE_SHARE_WRITE, CREATE_NEW, &File)!=ERR_SUCCESS)
+				{
+					Res.ok = false;
+					break;
+				}
+				if(fs->FileWrite(File, Buf.data(), 0, Length, &Written)!=ERR_SUCCESS || Written!=Length)
+					Res.ok = false;
+				fs->FileClose(File);
+				Res.ops++;
+				Res.bytes += Length;
+			}
+			Res.ns = elapsed_ns(timer);
+			return Res;
+		}
+		Result StatList()
+		{
+			Result Res = {0, 0, 0, true};
+			bench_clock::time_point timer = bench_clock::now();
+			for(DWORD d = 0; d * FOLDER_FILES < cfg.files; d++)
+			{
+				wchar_t Path[64];
+				swprintf_s(Path, _countof(Path), L"/d%03u", d);
+				pAttrInfo Items = nullptr;
+				DWORD     Count = 0;
+				if(fs->FolderList(Path, &Items, &Count)!=ERR_SUCCESS || Count!=min(FOLDER_FILES, cfg.files - d * FOLDER_FILES))
+					Res.ok = false;
+				if(Items!=nullptr)
+					HeapFree(GetProcessHeap(), 0, Items);
+				Res.ops++;
+			}
+			for(DWORD i = 0; i < cfg.files; i++)
+			{
+				wchar_t  Path[64];
+				DWORD    Length = 0;
+				AttrInfo Attr;
+				SmallFile(i, Path, _countof(Path), Length);
+				if(fs->GetAttributes(Path, &Attr)!=ERR_SUCCESS)
+					Res.ok = false;
+				Res.ops++;
+			}
+			Res.ns = elapsed_ns(timer);
+			return Res;
+		}
+		Result Stream(bool Write)
+		{
+			Result Res = {0, 0, 0, true};
+			std::vector<uint8_t> Buf(STREAM_CHUNK);
+			HANDLE File = INVALID_HANDLE_VALUE;
+			DWORD  Access = Write?(GENERIC_READ|GENERIC_WRITE):GENERIC_READ;
+			int64_t Unmeasured = 0;    // The pattern is made and checked off the clock
+			bench_clock::time_point timer = bench_clock::now();
+			if(fs->FileCreate(L"/stream.bin", 1, Access, FILE_SHARE_READ, Write?CREATE_NEW:OPEN_EXISTING, &File)!=ERR_SUCCESS)
+			{
+				Res.ok = false;
+				return Res;
+			}
+			for(UINT64 Pos = 0; Pos < (UINT64)cfg.stream_mb * STREAM_CHUNK && Res.ok; Pos += STREAM_CHUNK)
+			{
+				DWORD Done = 0;
+				bench_clock::time_point aside = bench_clock::now();
+				if(Write)
+				{
+					fill(0, Pos, Buf.data(), STREAM_CHUNK);
+					Unmeasured += elapsed_ns(aside);
+					Res.ok = fs->FileWrite(File, Buf.data(), Pos, STREAM_CHUNK, &Done)==ERR_SUCCESS && Done==STREAM_CHUNK;
+				}
+				else
+				{
+					Res.ok = fs->FileRead(File, Buf.data(), Pos, STREAM_CHUNK, &Done)==ERR_SUCCESS && Done==STREAM_CHUNK;
+					aside = bench_clock::now();
+					Res.ok = Res.ok && check(0, Pos, Buf.data(), STREAM_CHUNK);
+					Unmeasured += elapsed_ns(aside);
+				}
+				Res.ops++;
+				Res.bytes += Done;
+			}
+			fs->FileClose(File);
+			Res.ns = elapsed_ns(timer) - Unmeasured;
+			return Res;
+		}
+		Result RandomRead()
+		{
+			Result Res = {0, 0, 0, true};
+			uint8_t Buf[PAGE];
+			std::mt19937_64 rnd(5);
+			std::uniform_int_distribution<UINT64> page(0, (UINT64)cfg.stream_mb * STREAM_CHUNK / PAGE - 1);
+			HANDLE File = INVALID_HANDLE_VALUE;
+			if(fs->FileCreate(L"/stream.bin", 1, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, &File)!=ERR_SUCCESS)
+			{
+				Res.ok = false;
+				return Res;
+			}
+			std::vector<UINT64> Offsets(cfg.random_reads);
+			for(auto& iiOffset: Offsets)
+				iiOffset = page(rnd) * PAGE;
+			bench_clock::time_point timer = bench_clock::now();
+			for(auto iiOffset: Offsets)
+			{
+				DWORD Done = 0;
+				if(fs->FileRead(File, Buf, iiOffset, PAGE, &Done)!=ERR_SUCCESS || Done!=PAGE)
+					Res.ok = false;
+				Res.ops++;
+				Res.bytes += Done;
+			}
+			Res.ns = elapsed_ns(timer);
+			// A sample of the pages is checked off the clock
+			for(size_t i = 0; i < Offsets.size() && i < 256 && Res.ok; i++)
+			{
+				DWORD Done = 0;
+				Res.ok = fs->FileRead(File, Buf, Offsets[i], PAGE, &Done)==ERR_SUCCESS && check(0, Offsets[i], Buf, PAGE);
+			}
+			fs->FileClose(File);
+			return Res;
+		}
+		// Open, read and close of the small files from several threads, every
+		// eighth operation rewrites the file with its own content
+		Result Mixed()
+		{
+			std::atomic<uint64_t> Ops(0), Bytes(0);
+			std::atomic<bool>     Ok(true);
+			std::vector<std::thread> Threads;
+			bench_clock::time_point timer = bench_clock::now();
+			for(DWORD t = 0; t < cfg.threads; t++)
+			{
+				Threads.emplace_back([this, t, &Ops, &Bytes, &Ok]()
+				{
+					std::mt19937 rnd(1000 + t);
+					std::uniform_int_distribution<DWORD> pick(0, cfg.files - 1);
+					std::vector<uint8_t> Buf(SMALL_MAX);
+					for(DWORD n = 0; n < cfg.mixed_ops; n++)
+					{
+						wchar_t Path[64];
+						DWORD   Index = pick(rnd), Length = 0, Done = 0;
+						bool    Write = (n % 8)==7;
+						SmallFile(Index, Path, _countof(Path), Length);
+						HANDLE File = INVALID_HANDLE_VALUE;
+						if(fs->FileCreate(Path, 1, Write?(GENERIC_READ|GENERIC_WRITE):GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE, OPEN_EXISTING, &File)!=ERR_SUCCESS)
+						{
+							Ok = false;
+							continue;
+						}
+						if(Write)
+						{
+							fill(Index, 0, Buf.data(), Length);
+							if(fs->FileWrite(File, Buf.data(), 0, Length, &Done)!=ERR_SUCCESS || Done!=Length)
+								Ok = false;
+						}
+						else if(fs->FileRead(File, Buf.data(), 0, Length, &Done)!=ERR_SUCCESS || Done!=Length || !check(Index, 0, Buf.data(), Length))
+							Ok = false;
+						fs->FileClose(File);
+						Ops++;
+						Bytes += Done;
+					}
+				});
+			}
+			for(auto& iiThread: Threads)
+				iiThread.join();
+			Result Res = {Ops, Bytes, elapsed_ns(timer), Ok};
+			return Res;
+		}
+		void Run()
+		{
+			if(Create()!=ERR_SUCCESS)
+			{
+				Result Failed = {0, 0, 0, false};
+				Report("create", 1, Failed);
+				return;
+			}
+			Report("create_small", 1, CreateSmall());
+			Reopen();
+			Report("stat_list", 1, StatList());
+			Reopen();
+			Report("stream_write", 1, Stream(true));
+			Reopen();
+			Report("stream_read", 1, Stream(false));
+			Reopen();
+			Report("random_read_4k", 1, RandomRead());
+			Reopen();
+			Report("mixed", cfg.threads, Mixed());
+		}
+	private:
+		Config      cfg;
+		VirtualFS*  fs;
+		ICrypto*    pwd_crypt;
+		ICrypto*    data_crypt;
+		wchar_t     name[64];
+		char        native[MAX_PATH];
+	};
+}
+
+int main(int argc, char* argv[])
+{
+	if(argc < 2)
+	{
+		printf("Usage: %s <folder> [<scale> [<fault seed>]]\n", argv[0]);
+		return 2;
+	}
+	wchar_t Folder[MAX_PATH] = {0};
+	mbstowcs(Folder, argv[1], MAX_PATH - 1);
+	DWORD Scale = (argc > 2)?(DWORD)atoi(argv[2]):1;
+	if(Scale==0)
+		Scale = 1;
+	uint64_t FaultSeed = (argc > 3)?strtoull(argv[3], nullptr, 10):0;
+
+	printf("workload\tblock_size\tcrypto\tthreads\tops\tbytes\tns_per_op\tmb_per_s\tblock_reads\tblock_writes\tcache_hits\tseeks\tread_p99_us\twrite_p99_us\tlock_wait_p99_us\tcheck\n");
+	const DWORD BlockSizes[] = {4096, 16384, 65536};
+	for(DWORD BlockSize: BlockSizes)
+	{
+		for(int Encrypted = 0; Encrypted < 2; Encrypted++)
+		{
+			// Every container sees the same disk
+			std::unique_ptr<XHdf5::FaultInjector> Faults;
+			if(FaultSeed!=0)
+			{
+				XHdf5::FaultProfile Read  = {50, 100, 20000, 0.001, 0.0, 0.01};
+				XHdf5::FaultProfile Write = {20, 50, 20000, 0.001, 0.0, 0.0};
+				XHdf5::FaultProfile Flush = {500, 1000, 50000, 0.01, 0.0, 0.0};
+				Faults.reset(new XHdf5::FaultInjector(FaultSeed));
+				Faults->SetProfile(XHdf5::FaultInjector::FAULT_READ, Read);
+				Faults->SetProfile(XHdf5::FaultInjector::FAULT_WRITE, Write);
+				Faults->SetProfile(XHdf5::FaultInjector::FAULT_FLUSH, Flush);
+			}
+			Config Cfg = {BlockSize, Encrypted!=0, 2000*Scale, 64*Scale, 20000*Scale, 4, 2000*Scale, Faults.get()};
+			Bench(Folder, Cfg).Run();
+		}
+	}
+	return 0;
+}
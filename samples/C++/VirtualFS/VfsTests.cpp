@@ -0,0 +1,571 @@
+// VfsTests.cpp : Checks the recovery and concurrency paths of VirtualFS and its driver.
+//
+// Usage: VfsTests <folder>
+//
+// Every test works on containers and files of its own in <folder>, made
+// anew and deleted afterwards. A test prints one line, ok or FAILED with
+// the first check that did not hold; the exit code is the number of the
+// failed tests, so ctest reports any of them. A test that needs a crash
+// runs VfsTests <folder> crash in a process of its own.
+
+#include "stdafx.h"
+#include "vfs.h"
+#include "vpool.h"
+#include "H5FDfault.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace XDX;
+
+namespace
+{
+	// Leaves the test with the failed condition and its line
+	#define TEST_CHECK(cond) do { if(!(cond)) { printf("  check failed at line %d: %s\n", __LINE__, #cond); return false; } } while(0)
+
+	const wchar_t* g_Folder    = nullptr;
+	const char*    g_Self      = nullptr;
+	const char*    g_FolderArg = nullptr;
+
+	class Container
+	{
+	public:
+		Container(const wchar_t* Name): fs(nullptr)
+		{
+			wcscpy_s(name, _countof(name), Name);
+			wchar_t Path[MAX_PATH];
+			swprintf_s(Path, _countof(Path), L"%ls" XDX_PATH_SEP L"%ls.dat", g_Folder, name);
+			Platform::NativePath(Path, native, sizeof(native));
+			fs = new VirtualFS(name, g_Folder);
+		}
+		~Container()
+		{
+			fs->Close();
+			fs->Release();
+			Platform::FileDelete(native);
+		}
+		DWORD Create()
+		{
+			Platform::FileDelete(native);
+			return fs->Create(name, name, nullptr, nullptr, 4096, 0, FS_VERSION_ID);
+		}
+		DWORD Reopen()
+		{
+			DWORD hRes = fs->Close();
+			if(hRes!=ERR_SUCCESS)
+				return hRes;
+			return fs->Open(name, nullptr, nullptr, 0);
+		}
+		DWORD WriteFile(LPCWSTR Path, DWORD Length, BYTE Fill)
+		{
+			std::vector<BYTE> Buf(Length, Fill);
+			HANDLE File  = INVALID_HANDLE_VALUE;
+			DWORD Written = 0;
+			DWORD hRes = fs->FileCreate(Path, 1, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ|FILE_SHARE_WRITE, CREATE_ALWAYS, &File);
+			if(hRes!=ERR_SUCCESS)
+				return hRes;
+			hRes = fs->FileWrite(File, Buf.data(), 0, Length, &Written);
+			fs->FileClose(File);
+			return (hRes==ERR_SUCCESS && Written!=Length)?ERR_DISK_WRITE:hRes;
+		}
+		// ERR_ERROR_PARAM when the file is not Length bytes of Fill
+		DWORD CheckFile(LPCWSTR Path, DWORD Length, BYTE Fill)
+		{
+			std::vector<BYTE> Buf(Length + 1);
+			HANDLE File = INVALID_HANDLE_VALUE;
+			DWORD  Read = 0;
+			DWORD hRes = fs->FileCreate(Path, 1, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE, OPEN_EXISTING, &File);
+			if(hRes!=ERR_SUCCESS)
+				return hRes;
+			hRes = fs->FileRead(File, Buf.data(), 0, Length + 1, &Read);
+			fs->FileClose(File);
+			if(hRes!=ERR_SUCCESS)
+				return hRes;
+			if(Read!=Length)
+				return ERR_ERROR_PARAM;
+			for(DWORD i = 0; i < Length; i++)
+			{
+				if(Buf[i]!=Fill)
+					return ERR_ERROR_PARAM;
+			}
+			return ERR_SUCCESS;
+		}
+		VirtualFS* fs;
+		wchar_t    name[64];
+		char       native[MAX_PATH];
+	};
+
+	// The callbacks change the tree they are handed, on the walking thread
+	// and on a pool: a callback taking the write lock must not wait for
+	// the walk, which holds the read lock only while it lists a group
+	bool WalkCallbackMutates()
+	{
+		WorkerPool Pool(2);
+		for(int Pass = 0; Pass < 2; Pass++)
+		{
+			Container c(L"vfstest_walk");
+			TEST_CHECK(c.Create()==ERR_SUCCESS);
+			for(int d = 0; d < 4; d++)
+			{
+				wchar_t Path[64];
+				swprintf_s(Path, _countof(Path), L"/d%d", d);
+				TEST_CHECK(c.fs->FolderCreate(Path, 1)==ERR_SUCCESS);
+				for(int f = 0; f < 16; f++)
+				{
+					swprintf_s(Path, _countof(Path), L"/d%d/f%02d", d, f);
+					TEST_CHECK(c.WriteFile(Path, 100, (BYTE)f)==ERR_SUCCESS);
+				}
+			}
+			std::atomic<int> Files(0), Folders(0), Failed(0);
+			WalkOptions Options;
+			Options.BatchSize = 3;
+			Options.Pool      = (Pass==0)?nullptr:&Pool;
+			DWORD hRes = c.fs->Walk(L"/", [&](const WalkEntry* Entries, size_t Count)
+			{
+				for(size_t i = 0; i < Count; i++)
+				{
+					if(Entries[i].Info.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+					{
+						AttrInfo Attr;
+						if(c.fs->GetAttributes(Entries[i].Path.c_str(), &Attr)!=ERR_SUCCESS)
+							Failed++;
+						Attr.LastWriteTime++;
+						if(c.fs->SetAttributes(Entries[i].Path.c_str(), &Attr)!=ERR_SUCCESS)
+							Failed++;
+						Folders++;
+					}
+					else
+					{
+						if(c.fs->Delete(Entries[i].Path.c_str())!=ERR_SUCCESS)
+							Failed++;
+						Files++;
+					}
+				}
+				return true;
+			}, Options);
+			TEST_CHECK(hRes==ERR_SUCCESS);
+			TEST_CHECK(Failed==0);
+			TEST_CHECK(Folders==4);
+			TEST_CHECK(Files==64);
+			for(int d = 0; d < 4; d++)
+			{
+				wchar_t Path[64];
+				swprintf_s(Path, _countof(Path), L"/d%d", d);
+				pAttrInfo Items = nullptr;
+				DWORD     Count = 0;
+				hRes = c.fs->FolderList(Path, &Items, &Count);
+				if(Items!=nullptr)
+					HeapFree(GetProcessHeap(), 0, Items);
+				TEST_CHECK((hRes==ERR_SUCCESS || hRes==ERR_EMPTY) && Count==0);
+			}
+		}
+		return true;
+	}
+
+	// A commit that reached the disk but not the purge of its trash leaves
+	// the chunk maps of the deleted files. The open after the crash drops
+	// them with the trash, the chunks they referenced are released.
+	const DWORD PurgeChunk = 4096 * 16;
+
+	// The process half, ends in FaultInjector::Crash at the purge
+	int TrashPurgeCrash()
+	{
+		XHdf5::FaultInjector Faults(1);
+		Container c(L"vfstest_purge");
+		if(c.fs->SetFaultInjector(&Faults)!=ERR_SUCCESS || c.fs->Open(c.name, nullptr, nullptr, 0)!=ERR_SUCCESS)
+			return 1;
+		if(c.fs->BeginTransaction()!=ERR_SUCCESS || c.fs->Delete(L"/a")!=ERR_SUCCESS || c.fs->Delete(L"/b")!=ERR_SUCCESS)
+			return 1;
+		Faults.SetCrashPoint(XHdf5::FaultInjector::CRASH_TX_PURGE);
+		c.fs->Commit();
+		return 1;
+	}
+	bool TrashPurgeAfterCrash()
+	{
+		Container c(L"vfstest_purge");
+		UINT64 Chunks = 0, References = 0, Saved = 0;
+		TEST_CHECK(c.Create()==ERR_SUCCESS);
+		TEST_CHECK(c.fs->SetDedup(TRUE)==ERR_SUCCESS);
+		TEST_CHECK(c.WriteFile(L"/a", PurgeChunk * 4, 1)==ERR_SUCCESS);
+		TEST_CHECK(c.WriteFile(L"/b", PurgeChunk * 4, 2)==ERR_SUCCESS);
+		TEST_CHECK(c.WriteFile(L"/c", PurgeChunk * 2, 1)==ERR_SUCCESS);
+		TEST_CHECK(c.fs->GetDedupStats(Chunks, References, Saved)==ERR_SUCCESS);
+		TEST_CHECK(Chunks==2 && References==10);
+		TEST_CHECK(c.fs->Close()==ERR_SUCCESS);
+
+		std::string Command = std::string("\"") + g_Self + "\" \"" + g_FolderArg + "\" crash";
+		std::system(Command.c_str());
+
+		for(int Pass = 0; Pass < 2; Pass++)
+		{
+			DWORD hRes = (Pass==0)?c.fs->Open(c.name, nullptr, nullptr, 0):c.Reopen();
+			TEST_CHECK(hRes==ERR_SUCCESS);
+			AttrInfo Attr;
+			TEST_CHECK(c.fs->GetAttributes(L"/a", &Attr)!=ERR_SUCCESS);
+			TEST_CHECK(c.fs->GetAttributes(L"/b", &Attr)!=ERR_SUCCESS);
+			// Reading the file opens the store
+			TEST_CHECK(c.CheckFile(L"/c", PurgeChunk * 2, 1)==ERR_SUCCESS);
+			TEST_CHECK(c.fs->GetDedupStats(Chunks, References, Saved)==ERR_SUCCESS);
+			TEST_CHECK(Chunks==1 && References==2);
+		}
+		return true;
+	}
+
+	// Plain files in <folder> for the tests below the container
+	std::string TestPath(const char* Name)
+	{
+		return std::string(g_FolderArg) + "/" + Name;
+	}
+	bool WriteAt(const std::string& Path, long Offset, const void* Data, size_t Size)
+	{
+		FILE* File = fopen(Path.c_str(), "r+b");
+		if(File==nullptr)
+			return false;
+		bool Ok = fseek(File, Offset, SEEK_SET)==0 && fwrite(Data, 1, Size, File)==Size;
+		return (fclose(File)==0) && Ok;
+	}
+	bool ReadAt(const std::string& Path, long Offset, void* Data, size_t Size)
+	{
+		FILE* File = fopen(Path.c_str(), "rb");
+		if(File==nullptr)
+			return false;
+		bool Ok = fseek(File, Offset, SEEK_SET)==0 && fread(Data, 1, Size, File)==Size;
+		fclose(File);
+		return Ok;
+	}
+	// Keeps the first Size bytes of the file
+	bool CutFile(const std::string& Path, size_t Size)
+	{
+		std::vector<char> Head(Size);
+		if(!ReadAt(Path, 0, Head.data(), Size))
+			return false;
+		FILE* File = fopen(Path.c_str(), "wb");
+		if(File==nullptr)
+			return false;
+		bool Ok = fwrite(Head.data(), 1, Size, File)==Size;
+		return (fclose(File)==0) && Ok;
+	}
+
+	// A rekey of RekeyBlocks blocks, block b holds b+1 and is recoded by
+	// a xor with RekeyXor. Every test drives it to a state on the disk,
+	// tears or cuts the journal as a crash would and checks the reopen.
+	const size_t RekeyBlock  = 4096;
+	const int    RekeyBlocks = 8;
+	const BYTE   RekeyXor    = 0x5A;
+
+	class Rekey
+	{
+	public:
+		Rekey(): target(TestPath("vfstest_rekey.dat")), journal(TestPath("vfstest_rekey.jnl")) {}
+		~Rekey()
+		{
+			rekey.Close();
+			Platform::FileDelete(target.c_str());
+			Platform::FileDelete(journal.c_str());
+		}
+		bool Create()
+		{
+			std::vector<char> Data(RekeyBlock * RekeyBlocks);
+			for(int b = 0; b < RekeyBlocks; b++)
+				memset(Data.data() + b * RekeyBlock, b + 1, RekeyBlock);
+			FILE* File = fopen(target.c_str(), "wb");
+			if(File==nullptr)
+				return false;
+			bool Ok = fwrite(Data.data(), 1, Data.size(), File)==Data.size();
+			if(fclose(File)!=0 || !Ok)
+				return false;
+			return rekey.Create(target.c_str(), journal.c_str(), RekeyBlock, 0, "key", 3)==0;
+		}
+		// Recodes the next Blocks blocks
+		bool Next(int Blocks)
+		{
+			size_t Done = 0;
+			int hRes = rekey.Next(Blocks * RekeyBlock, [](haddr_t, char* Data, size_t Count)
+			{
+				for(size_t i = 0; i < Count * RekeyBlock; i++)
+					Data[i] ^= RekeyXor;
+				return 0;
+			}, &Done);
+			return hRes==0 && Done==Blocks * RekeyBlock;
+		}
+		bool Reopen()
+		{
+			return rekey.Close()==0 && rekey.Open(target.c_str(), journal.c_str())==0;
+		}
+		// Block b holds Value in full
+		bool BlockIs(int b, BYTE Value)
+		{
+			std::vector<BYTE> Data(RekeyBlock);
+			if(!ReadAt(target, (long)(b * RekeyBlock), Data.data(), RekeyBlock))
+				return false;
+			for(size_t i = 0; i < RekeyBlock; i++)
+			{
+				if(Data[i]!=Value)
+					return false;
+			}
+			return true;
+		}
+		// The blocks below Blocks are recoded, the rest are not
+		bool RecodedTo(int Blocks)
+		{
+			if(rekey.GetMark()!=(haddr_t)(Blocks * RekeyBlock) || rekey.IsBroken() ||
+				rekey.GetRecord().size()!=3 || memcmp(rekey.GetRecord().data(), "key", 3)!=0)
+				return false;
+			for(int b = 0; b < RekeyBlocks; b++)
+			{
+				if(!BlockIs(b, (BYTE)((b + 1) ^ ((b < Blocks)?RekeyXor:0))))
+					return false;
+			}
+			return true;
+		}
+		// Writes Value over block b, as the file or its owner would
+		bool SetBlock(int b, BYTE Value)
+		{
+			std::vector<BYTE> Data(RekeyBlock, Value);
+			return WriteAt(target, (long)(b * RekeyBlock), Data.data(), RekeyBlock);
+		}
+		// Tears the slot of the journal, as a crash in its write would
+		bool TearSlot(int Slot)
+		{
+			char Garbage[64];
+			memset(Garbage, 0xEE, sizeof(Garbage));
+			return WriteAt(journal, (long)(Slot * XHdf5::BlockRekey::SLOT_SIZE + 32), Garbage, sizeof(Garbage));
+		}
+		std::string        target;
+		std::string        journal;
+		XHdf5::BlockRekey rekey;
+	};
+
+	// The slot of sequence n is n % 2. Create writes sequence 1, every
+	// Next the batch slot and then the applied one: the first Next leaves
+	// 2 with the batch in slot 0 and 3 with the mark past it in slot 1.
+
+	// The crash came after the batch reached the journal, the file got
+	// a part of it and the slot marking it applied was torn
+	bool RekeyReplaysBatch()
+	{
+		Rekey r;
+		TEST_CHECK(r.Create());
+		TEST_CHECK(r.Next(2));
+		TEST_CHECK(r.rekey.Close()==0);
+		TEST_CHECK(r.TearSlot(1));
+		TEST_CHECK(r.SetBlock(0, 1));
+		TEST_CHECK(r.SetBlock(1, 0xEE));
+		TEST_CHECK(r.Reopen());
+		TEST_CHECK(r.RecodedTo(2));
+		TEST_CHECK(r.Next(3));
+		TEST_CHECK(r.Reopen());
+		TEST_CHECK(r.RecodedTo(5));
+		return true;
+	}
+	// A batch marked applied is not written again, it would revert the
+	// writes to its blocks made after it
+	bool RekeyKeepsAppliedBatch()
+	{
+		Rekey r;
+		TEST_CHECK(r.Create());
+		TEST_CHECK(r.Next(2));
+		TEST_CHECK(r.SetBlock(1, 0x77));
+		TEST_CHECK(r.Reopen());
+		TEST_CHECK(r.rekey.GetMark()==(haddr_t)(2 * RekeyBlock));
+		TEST_CHECK(r.BlockIs(0, 1 ^ RekeyXor));
+		TEST_CHECK(r.BlockIs(1, 0x77));
+		TEST_CHECK(r.BlockIs(2, 3));
+		return true;
+	}
+	// A torn newer slot leaves the older one in effect, two torn fail the open
+	bool RekeyTornSlot()
+	{
+		Rekey r;
+		TEST_CHECK(r.Create());
+		TEST_CHECK(r.Next(2));
+		TEST_CHECK(r.Next(2));
+		TEST_CHECK(r.rekey.Close()==0);
+		// Sequence 5 in slot 1 is torn, 4 in slot 0 holds the batch of blocks 2 and 3
+		TEST_CHECK(r.TearSlot(1));
+		TEST_CHECK(r.Reopen());
+		TEST_CHECK(r.RecodedTo(4));
+		TEST_CHECK(r.rekey.Close()==0);
+		TEST_CHECK(r.TearSlot(0));
+		TEST_CHECK(r.TearSlot(1));
+		TEST_CHECK(r.rekey.Open(r.target.c_str(), r.journal.c_str())<0);
+		return true;
+	}
+	// A batch cut off the journal by the crash never reached the file,
+	// the mark stays before it and the file is left as it is
+	bool RekeyCutBatch()
+	{
+		Rekey r;
+		TEST_CHECK(r.Create());
+		TEST_CHECK(r.Next(2));
+		TEST_CHECK(r.rekey.Close()==0);
+		TEST_CHECK(r.TearSlot(1));
+		TEST_CHECK(r.SetBlock(0, 1));
+		TEST_CHECK(r.SetBlock(1, 2));
+		TEST_CHECK(CutFile(r.journal, 2 * XHdf5::BlockRekey::SLOT_SIZE + RekeyBlock));
+		TEST_CHECK(r.Reopen());
+		TEST_CHECK(r.RecodedTo(0));
+		TEST_CHECK(r.Next(RekeyBlocks));
+		TEST_CHECK(r.Reopen());
+		TEST_CHECK(r.RecodedTo(RekeyBlocks));
+		return true;
+	}
+
+	// A copy of ReplicaBlocks blocks of zeros with the epoch in its first
+	// bytes, and a log of the epoch writing blocks 1 to 3 with 0x11, 0x22
+	// and 0x33. Every test damages the log or the copy before Apply.
+	const size_t   ReplicaBlock  = 4096;
+	const int      ReplicaBlocks = 4;
+	const uint64_t ReplicaEpoch  = 7;
+
+	class Replica
+	{
+	public:
+		Replica(): copy(TestPath("vfstest_replica.dat")), log(TestPath("vfstest_replica.log")) {}
+		~Replica()
+		{
+			Platform::FileDelete(copy.c_str());
+			Platform::FileDelete(log.c_str());
+		}
+		bool Create(uint64_t CopyEpoch)
+		{
+			std::vector<char> Data(ReplicaBlock * ReplicaBlocks, 0);
+			memcpy(Data.data(), &CopyEpoch, sizeof(CopyEpoch));
+			FILE* File = fopen(copy.c_str(), "wb");
+			if(File==nullptr)
+				return false;
+			bool Ok = fwrite(Data.data(), 1, Data.size(), File)==Data.size();
+			if(fclose(File)!=0 || !Ok)
+				return false;
+			XHdf5::ReplicationLog Log;
+			if(Log.Open(log.c_str(), ReplicaEpoch, 0)!=0)
+				return false;
+			for(int b = 1; b < ReplicaBlocks; b++)
+			{
+				std::vector<char> Block(ReplicaBlock, (char)(b * 0x11));
+				if(Log.Append(b * ReplicaBlock, Block.data(), Block.size())!=0)
+					return false;
+			}
+			return Log.Close()==0;
+		}
+		// Where the record of block b starts in the log
+		static long RecordOffset(int b)
+		{
+			return (long)(sizeof(XHdf5::ReplicationLogHeader) + (b - 1) * (sizeof(XHdf5::ReplicationRecord) + ReplicaBlock));
+		}
+		// The blocks 1 to Written are rolled forward, the rest are zeros
+		bool RolledTo(int Written)
+		{
+			std::vector<BYTE> Data(ReplicaBlock);
+			for(int b = 1; b < ReplicaBlocks; b++)
+			{
+				if(!ReadAt(copy, (long)(b * ReplicaBlock), Data.data(), ReplicaBlock))
+					return false;
+				BYTE Value = (b <= Written)?(BYTE)(b * 0x11):0;
+				for(size_t i = 0; i < ReplicaBlock; i++)
+				{
+					if(Data[i]!=Value)
+						return false;
+				}
+			}
+			return true;
+		}
+		std::string copy;
+		std::string log;
+	};
+
+	bool ReplicaApplies()
+	{
+		Replica r;
+		uint64_t Applied = 0;
+		TEST_CHECK(r.Create(ReplicaEpoch));
+		TEST_CHECK(XHdf5::ReplicationLog::Apply(r.log.c_str(), r.copy.c_str(), &Applied)==0);
+		TEST_CHECK(Applied==3 && r.RolledTo(3));
+		// Applied again to the rolled forward copy it changes nothing
+		TEST_CHECK(XHdf5::ReplicationLog::Apply(r.log.c_str(), r.copy.c_str(), &Applied)==0);
+		TEST_CHECK(Applied==3 && r.RolledTo(3));
+		return true;
+	}
+	// The record written last was torn by a crash, it ends the log
+	bool ReplicaTornTail()
+	{
+		Replica r;
+		uint64_t Applied = 0;
+		TEST_CHECK(r.Create(ReplicaEpoch));
+		TEST_CHECK(CutFile(r.log, (size_t)r.RecordOffset(3) + 100));
+		TEST_CHECK(XHdf5::ReplicationLog::Apply(r.log.c_str(), r.copy.c_str(), &Applied)==0);
+		TEST_CHECK(Applied==2 && r.RolledTo(2));
+		return true;
+	}
+	// A bad record with more after it is a damaged log, Apply stops before it
+	bool ReplicaCorruptRecord()
+	{
+		Replica r;
+		uint64_t Applied = 0;
+		char     Byte = 0x7F;
+		TEST_CHECK(r.Create(ReplicaEpoch));
+		TEST_CHECK(WriteAt(r.log, r.RecordOffset(2) + (long)sizeof(XHdf5::ReplicationRecord) + 10, &Byte, 1));
+		TEST_CHECK(XHdf5::ReplicationLog::Apply(r.log.c_str(), r.copy.c_str(), &Applied)==XHdf5::ReplicationLog::APPLY_CORRUPT);
+		TEST_CHECK(Applied==1 && r.RolledTo(1));
+		return true;
+	}
+	// A copy of another epoch is refused before any record is applied
+	bool ReplicaOtherEpoch()
+	{
+		Replica r;
+		uint64_t Applied = 0;
+		TEST_CHECK(r.Create(ReplicaEpoch - 1));
+		TEST_CHECK(XHdf5::ReplicationLog::Apply(r.log.c_str(), r.copy.c_str(), &Applied)==XHdf5::ReplicationLog::APPLY_EPOCH);
+		TEST_CHECK(Applied==0 && r.RolledTo(0));
+		return true;
+	}
+
+	struct Test
+	{
+		const char* name;
+		bool      (*run)();
+	};
+	const Test Tests[] =
+	{
+		{"walk_callback_mutates",   WalkCallbackMutates},
+		{"trash_purge_after_crash", TrashPurgeAfterCrash},
+		{"rekey_replays_batch",     RekeyReplaysBatch},
+		{"rekey_keeps_applied",     RekeyKeepsAppliedBatch},
+		{"rekey_torn_slot",         RekeyTornSlot},
+		{"rekey_cut_batch",         RekeyCutBatch},
+		{"replica_applies",         ReplicaApplies},
+		{"replica_torn_tail",       ReplicaTornTail},
+		{"replica_corrupt_record",  ReplicaCorruptRecord},
+		{"replica_other_epoch",     ReplicaOtherEpoch},
+	};
+}
+
+int main(int argc, char* argv[])
+{
+	if(argc < 2)
+	{
+		printf("Usage: %s <folder>\n", argv[0]);
+		return 1;
+	}
+	wchar_t Folder[MAX_PATH];
+	mbstowcs(Folder, argv[1], MAX_PATH - 1);
+	Folder[MAX_PATH - 1] = 0;
+	g_Folder    = Folder;
+	g_Self      = argv[0];
+	g_FolderArg = argv[1];
+	if(argc > 2 && strcmp(argv[2], "crash")==0)
+		return TrashPurgeCrash();
+	int Failed = 0;
+	for(const Test& iiTest: Tests)
+	{
+		bool Ok = iiTest.run();
+		printf("%s\t%s\n", iiTest.name, Ok?"ok":"FAILED");
+		fflush(stdout);
+		if(!Ok)
+			Failed++;
+	}
+	return Failed;
+}
@@ -10,10 +10,32 @@ namespace XDX
 		//USERBLOCK_SIZE = 1024,
 		MASTER_KEY_LEN = 128,
 		DATA_IV_LEN = 16,
-		FILE_CHUNK_BLOCKS = 16  // Number of Data Blocks per allocation chunk
+		FILE_CHUNK_BLOCKS = 16, // Number of Data Blocks per allocation chunk
+		INLINE_FILE_MIN   = 256,   // The smallest compact dataset of an inline file
+		INLINE_FILE_LIMIT = 2048,  // Files up to this size are inline by default
+		INLINE_FILE_MAX   = 32768  // A compact dataset must fit an object header message
+	};
+	// The meta records of the container itself, numbered apart from the FSMF_* fields
+	enum enOwnMeta
+	{
+		FSMF_QW_PATHS_GEN = 1000   // The generation of a valid stored path index, see VirtualFS::_ArmPathIndex
 	};
 	
 	#define XDX_SIGNATURE "XDX FS"
+	#define XDX_REKEY_SIGNATURE "XDXREKY"   // RawFileHeader::Rekey while the data key is rotated
+
+	// The reserved group holding the container's own records, hidden from the FS paths
+	#define XDX_SYSTEM_NAME   L".xdx"
+	#define XDX_SYSTEM_GROUP  "/.xdx"
+	#define XDX_RANGES_GROUP  "/.xdx/ranges"   // Persistent range images named by the object address
+	#define XDX_TRASH_GROUP   "/.xdx/trash"    // Objects deleted by an uncommitted transaction
+	#define XDX_TXLOG         "/.xdx/txlog"    // The undo records of an uncommitted transaction
+	#define XDX_TYPES_GROUP   "/.xdx/types"    // Committed datatypes shared by the object headers
+	#define XDX_CHUNKS_GROUP  "/.xdx/chunks"   // The unique chunks of the deduplicated files
+	#define XDX_MAPS_GROUP    "/.xdx/chunkmaps" // The chunk lists of the deduplicated files named by the object address
+	#define XDX_PATHS         "/.xdx/paths"    // The path index, see PathIndex
+	#define XDX_DOS_TYPE      "/.xdx/types/attributes_dos"
+	#define XDX_DOS_ATTR      "1"              // FILE_ATTRIBUTES_DOS as an attribute name
 	struct RawFileHeader
 	{
 		char     Signature[8];              // 'X','D','X',' ','F', 'S' - The XDX block file signature
@@ -29,6 +51,14 @@ namespace XDX
 		byte     MKey[MASTER_KEY_LEN];            
 		byte     MKeyHash[16];       
 		byte     IV[MASTER_KEY_LEN]; 
+		char     Rekey[8];                  // XDX_REKEY_SIGNATURE during VirtualFS::RotateDataKey
+	};
+	// The new data key kept in the rotation journal, wrapped as the one in the header
+	struct RawRekeyRecord
+	{
+		byte     MKey[MASTER_KEY_LEN];            
+		byte     MKeyHash[16];       
+		byte     IV[MASTER_KEY_LEN]; 
 	};
 	struct FSInfo
 	{
@@ -50,6 +80,50 @@ namespace XDX
 		DWORD  DAT_ENC_MODE;    
 		DWORD  DAT_ENC_APARAM;  
 		DWORD  DAT_ENC_BPARAM; 
+		DWORD  DAT_REKEY;       // The data key is being rotated
+	};
+	// Where the bytes of a container go, see VirtualFS::GetSpaceStats
+	struct SpaceStats
+	{
+		UINT64 FILE_BYTES;       // Size of the container file
+		UINT64 DATA_BYTES;       // Allocated to the file contents
+		UINT64 LOGICAL_BYTES;    // Logical size of the files
+		UINT64 META_BYTES;       // User block, object headers, indexes and heaps
+		UINT64 FREE_BYTES;       // Known to the HDF5 free space manager in this session
+		UINT64 FREE_SECTIONS;    // Number of free sections
+		UINT64 LARGEST_FREE;     // Largest free section
+		UINT64 DEAD_BYTES;       // Neither of the above: lost to the earlier sessions, reclaimed by Compact
+	};
+	// Latencies of one kind of operation in nanoseconds, see IoStats
+	struct LatencyStats
+	{
+		UINT64 COUNT;
+		UINT64 TOTAL_NS;
+		UINT64 P50_NS;
+		UINT64 P90_NS;
+		UINT64 P99_NS;
+		UINT64 P999_NS;
+		UINT64 MAX_NS;
+	};
+	// What a container did since it was opened, see VirtualFS::GetIoStats
+	struct IoStats
+	{
+		UINT64 BLOCK_READS;      // Blocks read from the disk
+		UINT64 BLOCK_WRITES;     // Blocks written to the disk
+		UINT64 BYTES_READ;
+		UINT64 BYTES_WRITTEN;
+		UINT64 CACHE_HITS;       // Blocks served by the block cache instead of the disk
+		UINT64 BYTES_DECRYPTED;
+		UINT64 BYTES_ENCRYPTED;
+		UINT64 SEEKS;
+		UINT64 ALLOCS;           // File space allocations
+		UINT64 ALLOC_BYTES;
+		UINT64 FLUSHES;
+		UINT64 TRUNCATES;
+		LatencyStats READ;       // Read requests of the HDF5 library, the cache hits included
+		LatencyStats WRITE;
+		LatencyStats FLUSH;
+		LatencyStats LOCK_WAIT;  // For the container lock, every call takes it
 	};
 	enum enFileAttributes
 	{
@@ -66,7 +140,10 @@ namespace XDX
 		uint64_t QW_CREATION_TIME;
 		uint64_t QW_ACCESS_TIME;
 		uint64_t QW_WRITE_TIME;
+		uint64_t QW_FILE_SIZE;       // Logical size of a file, 0 for a folder
 	};
+	// The records written before the size was kept in them
+	const uint64_t FILE_SIZE_UNKNOWN = UINT64_MAX;
 	/*
 	enum class FSRecords: BYTE
 	{
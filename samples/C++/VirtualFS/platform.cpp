@@ -0,0 +1,89 @@
+#include "stdafx.h"
+#include "platform.h"
+#ifdef _WIN32
+#	include <io.h>
+#else
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
+namespace XDX
+{
+void Platform::NativePath(const wchar_t* Path, char* Native, size_t Size)
+{
+	if(Size==0)
+		return;
+#ifdef _WIN32
+	int Len = WideCharToMultiByte(CP_ACP, 0, Path, lstrlenW(Path), Native, (int)Size - 1, NULL, NULL);
+	Native[(Len>0)?Len:0] = 0;
+#else
+	// wchar_t holds UTF-32 here
+	size_t Pos = 0;
+	for(; *Path; Path++)
+	{
+		uint32_t c = (uint32_t)*Path;
+		char Bytes[4];
+		size_t Count;
+		if(c < 0x80)
+		{
+			Bytes[0] = (char)c;
+			Count = 1;
+		}
+		else if(c < 0x800)
+		{
+			Bytes[0] = (char)(0xC0 | (c >> 6));
+			Bytes[1] = (char)(0x80 | (c & 0x3F));
+			Count = 2;
+		}
+		else if(c < 0x10000)
+		{
+			Bytes[0] = (char)(0xE0 | (c >> 12));
+			Bytes[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+			Bytes[2] = (char)(0x80 | (c & 0x3F));
+			Count = 3;
+		}
+		else
+		{
+			Bytes[0] = (char)(0xF0 | (c >> 18));
+			Bytes[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+			Bytes[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+			Bytes[3] = (char)(0x80 | (c & 0x3F));
+			Count = 4;
+		}
+		if(Pos + Count >= Size)
+			break;
+		memcpy(Native + Pos, Bytes, Count);
+		Pos += Count;
+	}
+	Native[Pos] = 0;
+#endif
+}
+bool Platform::FileExists(const char* Path)
+{
+#ifdef _WIN32
+	DWORD Attributes = GetFileAttributesA(Path);
+	return Attributes!=INVALID_FILE_ATTRIBUTES && !(Attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	struct stat sb;
+	return stat(Path, &sb)==0 && !S_ISDIR(sb.st_mode);
+#endif
+}
+bool Platform::FileDelete(const char* Path)
+{
+#ifdef _WIN32
+	return DeleteFileA(Path)!=FALSE;
+#else
+	return unlink(Path)==0;
+#endif
+}
+int Platform::FileSync(int FileHandle)
+{
+#ifdef _WIN32
+	return _commit(FileHandle);
+#elif defined(__APPLE__)
+	return fsync(FileHandle);
+#else
+	return fdatasync(FileHandle);
+#endif
+}
+}
@@ -0,0 +1,128 @@
+#pragma once
+////////////////////////////////////////////////////////////////
+// The thin platform layer of VirtualFS. On Windows it is only
+// the Platform helpers below. Elsewhere it also supplies the few
+// Win32 types and calls the sources use, mapped onto POSIX, and
+// is force-included ahead of everything else by CMakeLists.txt.
+////////////////////////////////////////////////////////////////
+#ifdef _WIN32
+#	define XDX_PATH_SEP L"\\"
+#else
+#	include <cerrno>
+#	include <cstdint>
+#	include <cstdio>
+#	include <cstdlib>
+#	include <cstring>
+#	include <cwchar>
+#	include <strings.h>
+#	include <time.h>
+#	include <type_traits>
+
+#	define XDX_PATH_SEP L"/"
+
+typedef uint8_t        BYTE, *PBYTE;
+typedef uint16_t       WORD;
+typedef uint32_t       DWORD, *LPDWORD;
+typedef int            BOOL;
+typedef int64_t        INT64;
+typedef uint64_t       UINT64;
+typedef size_t         SIZE_T;
+typedef wchar_t        WCHAR, *LPWSTR;
+typedef const wchar_t* LPCWSTR;
+typedef void           VOID, *LPVOID, *HANDLE;
+
+#	define WINAPI
+#	define TRUE           1
+#	define FALSE          0
+#	define MAX_PATH       1024
+#	define MAXDWORD       0xFFFFFFFF
+#	define ERROR_SUCCESS  0
+
+#	define ZeroMemory(Dst, Size)  memset((Dst), 0, (Size))
+#	define swprintf_s             swprintf
+#	define sprintf_s              snprintf
+#	define _stricmp               strcasecmp
+#	define lstrlenW(Str)          ((int)wcslen(Str))
+#	define _snprintf_s(Buf, Size, Count, ...) snprintf((Buf), (Size), __VA_ARGS__)
+// In elements, wchar_t is 4 bytes here
+#	define _countof(Array)        (sizeof(Array)/sizeof((Array)[0]))
+
+// The min and max macros of windows.h, in XDX where the sources call them, so
+// they do not clash with std::min and std::max in the code including this one
+namespace XDX
+{
+template <class A, class B> inline typename std::common_type<A,B>::type min(A a, B b) {return (b < a)?b:a;}
+template <class A, class B> inline typename std::common_type<A,B>::type max(A a, B b) {return (a < b)?b:a;}
+}
+
+// Size is in elements. As with MSVC a string that does not fit leaves Dst empty.
+inline int wcscpy_s(wchar_t* Dst, size_t Size, const wchar_t* Src)
+{
+	if(Dst==nullptr || Size==0)
+		return EINVAL;
+	size_t Len = (Src!=nullptr)?wcsnlen(Src, Size):Size;
+	if(Len==Size)
+	{
+		Dst[0] = 0;
+		return (Src!=nullptr)?ERANGE:EINVAL;
+	}
+	wmemcpy(Dst, Src, Len);
+	Dst[Len] = 0;
+	return 0;
+}
+inline int wcsncpy_s(wchar_t* Dst, size_t Size, const wchar_t* Src, size_t Count)
+{
+	if(Size==0 || Count >= Size)
+		return -1;
+	wcsncpy(Dst, Src, Count);
+	Dst[Count] = 0;
+	return 0;
+}
+inline int strcat_s(char* Dst, size_t Size, const char* Src)
+{
+	size_t Len = strnlen(Dst, Size);
+	if(Len==Size)
+		return -1;
+	strncat(Dst, Src, Size - Len - 1);
+	return 0;
+}
+inline int memcpy_s(void* Dst, size_t DstSize, const void* Src, size_t Count)
+{
+	if(Count > DstSize)
+		return -1;
+	memcpy(Dst, Src, Count);
+	return 0;
+}
+inline long InterlockedIncrement(volatile long* Value) {return __atomic_add_fetch(Value, 1, __ATOMIC_SEQ_CST);}
+inline long InterlockedDecrement(volatile long* Value) {return __atomic_sub_fetch(Value, 1, __ATOMIC_SEQ_CST);}
+inline UINT64 GetTickCount64()
+{
+	timespec Now;
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return (UINT64)Now.tv_sec*1000 + Now.tv_nsec/1000000;
+}
+inline void Sleep(DWORD Milliseconds)
+{
+	timespec Delay = {(time_t)(Milliseconds/1000), (long)(Milliseconds%1000)*1000000};
+	// Only a signal cuts it short, the rest of the delay is slept then
+	while(nanosleep(&Delay, &Delay)!=0 && errno==EINTR)
+		;
+}
+inline HANDLE GetProcessHeap() {return nullptr;}
+inline LPVOID HeapAlloc(HANDLE, DWORD, SIZE_T Bytes) {return malloc(Bytes);}
+inline BOOL   HeapFree(HANDLE, DWORD, LPVOID Mem) {free(Mem); return TRUE;}
+#endif
+
+namespace XDX
+{
+class Platform
+{
+public:
+	// The path as the C runtime takes it: the ANSI code page on Windows, UTF-8 elsewhere
+	static void NativePath(const wchar_t* Path, char* Native, size_t Size);
+	static bool FileExists(const char* Path);
+	static bool FileDelete(const char* Path);
+	// The data of the file reaches the disk, the metadata only as needed to read it back
+	static int  FileSync(int FileHandle);
+};
+}
@@ -0,0 +1,369 @@
+#include "stdafx.h"
+#include "vdedup.h"
+#include <cstring>
+
+namespace
+{
+	const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+	const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+	const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+	const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+	const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+	const hsize_t  INDEX_CHUNK_ROWS = 512;
+
+	inline uint64_t Rotl(uint64_t Value, int Bits)
+	{
+		return (Value << Bits) | (Value >> (64 - Bits));
+	}
+	inline uint64_t Read64(const unsigned char* Ptr)
+	{
+		uint64_t Value;
+		memcpy(&Value, Ptr, sizeof(Value));
+		return Value;
+	}
+	inline uint64_t Round(uint64_t Acc, uint64_t Input)
+	{
+		Acc += Input * PRIME64_2;
+		return Rotl(Acc, 31) * PRIME64_1;
+	}
+	inline uint64_t Merge(uint64_t Acc, uint64_t Value)
+	{
+		Acc ^= Round(0, Value);
+		return Acc * PRIME64_1 + PRIME64_4;
+	}
+	bool IsZero(const void* Data, size_t Size)
+	{
+		const unsigned char* Ptr = (const unsigned char*)Data;
+		for(; Size >= sizeof(uint64_t); Size -= sizeof(uint64_t), Ptr += sizeof(uint64_t))
+		{
+			if(Read64(Ptr)!=0)
+				return false;
+		}
+		for(; Size > 0; Size--, Ptr++)
+		{
+			if(*Ptr!=0)
+				return false;
+		}
+		return true;
+	}
+}
+
+namespace XDX
+{
+ChunkStore::ChunkStore()
+{
+	m_Data      = -1;
+	m_Index     = -1;
+	m_ChunkSize = 0;
+	Close();
+}
+ChunkStore::~ChunkStore()
+{
+	Close();
+}
+DWORD ChunkStore::Open(hid_t GroupId, size_t ChunkSize)
+{
+	static_assert(sizeof(Slot)==2*sizeof(uint64_t), "A slot is a row of the index");
+	DWORD   hRes = ERR_SUCCESS;
+	hid_t   space = -1, dcpl = -1;
+	hsize_t dims[2] = {0, 0};
+	Close();
+	m_ChunkSize = ChunkSize;
+	m_Probe.resize(ChunkSize);
+
+	if(H5Lexists(GroupId, "data", H5P_DEFAULT)>0)
+	{
+		// The chunk size is fixed when the store is made
+		if((m_Data = H5Dopen2(GroupId, "data", H5P_DEFAULT))<0 ||
+			(m_Index = H5Dopen2(GroupId, "index", H5P_DEFAULT))<0 ||
+			(space = H5Dget_space(m_Data))<0 ||
+			H5Sget_simple_extent_dims(space, dims, NULL)!=2 || dims[1]!=ChunkSize)
+			{hRes = ERR_DISK_READ; goto L_DONE;}
+		m_DataRows = dims[0];
+		H5Sclose(space);
+		if((space = H5Dget_space(m_Index))<0 || H5Sget_simple_extent_dims(space, dims, NULL)!=2 || dims[1]!=2)
+			{hRes = ERR_DISK_READ; goto L_DONE;}
+		m_Slots.resize((size_t)dims[0]);
+		if(dims[0]>0 && H5Dread(m_Index, H5T_NATIVE_UINT64, H5S_ALL, H5S_ALL, H5P_DEFAULT, m_Slots.data())<0)
+			{hRes = ERR_DISK_READ; goto L_DONE;}
+	}
+	else
+	{
+		// One row is one HDF5 chunk, a chunk of a file is read and written at once
+		hsize_t maxdims[2] = {H5S_UNLIMITED, ChunkSize};
+		hsize_t chunk[2]   = {1, ChunkSize};
+		dims[1] = ChunkSize;
+		if((space = H5Screate_simple(2, dims, maxdims))<0 ||
+			(dcpl = H5Pcreate(H5P_DATASET_CREATE))<0 || H5Pset_chunk(dcpl, 2, chunk)<0 ||
+			(m_Data = H5Dcreate2(GroupId, "data", H5T_NATIVE_SCHAR, space, H5P_DEFAULT, dcpl, H5P_DEFAULT))<0)
+			{hRes = ERR_DISK_WRITE; goto L_DONE;}
+		H5Sclose(space);
+		H5Pclose(dcpl);
+		space = dcpl = -1;
+		maxdims[1] = dims[1] = 2;
+		chunk[0] = INDEX_CHUNK_ROWS;
+		chunk[1] = 2;
+		if((space = H5Screate_simple(2, dims, maxdims))<0 ||
+			(dcpl = H5Pcreate(H5P_DATASET_CREATE))<0 || H5Pset_chunk(dcpl, 2, chunk)<0 ||
+			(m_Index = H5Dcreate2(GroupId, "index", H5T_NATIVE_UINT64, space, H5P_DEFAULT, dcpl, H5P_DEFAULT))<0)
+			{hRes = ERR_DISK_WRITE; goto L_DONE;}
+	}
+	for(uint64_t Row = 0; Row < m_Slots.size(); Row++)
+	{
+		if(m_Slots[Row].refs==0)
+			m_Free.push_back(Row);
+		else
+		{
+			m_ByHash.insert(std::make_pair(m_Slots[Row].hash, Row));
+			m_Chunks++;
+			m_References += m_Slots[Row].refs;
+		}
+	}
+L_DONE:
+	if(dcpl>=0)
+		H5Pclose(dcpl);
+	if(space>=0)
+		H5Sclose(space);
+	if(hRes!=ERR_SUCCESS)
+		Close();
+	return hRes;
+}
+void ChunkStore::Close()
+{
+	if(m_Index>=0)
+		H5Dclose(m_Index);
+	if(m_Data>=0)
+		H5Dclose(m_Data);
+	m_Data         = -1;
+	m_Index        = -1;
+	m_DataRows     = 0;
+	m_DirtyFrom    = UINT64_MAX;
+	m_DirtyTo      = 0;
+	m_Chunks       = 0;
+	m_References   = 0;
+	m_Deduplicated = 0;
+	m_Slots.clear();
+	m_ByHash.clear();
+	m_Free.clear();
+}
+DWORD ChunkStore::Put(const void* Chunk, uint64_t& Ref)
+{
+	DWORD hRes = ERR_SUCCESS;
+	Ref = 0;
+	if(!IsOpen())
+		return ERR_NOT_READY;
+	if(IsZero(Chunk, m_ChunkSize))
+		return ERR_SUCCESS;
+
+	// The hash only points at the candidates, the content decides
+	uint64_t Hash = ChunkStore::Hash(Chunk, m_ChunkSize);
+	auto Candidates = m_ByHash.equal_range(Hash);
+	for(auto iiRow = Candidates.first; iiRow != Candidates.second; iiRow++)
+	{
+		if((hRes=ReadSlot(iiRow->second, m_Probe.data()))!=ERR_SUCCESS)
+			return hRes;
+		if(memcmp(m_Probe.data(), Chunk, m_ChunkSize)!=0)
+			continue;
+		m_Slots[(size_t)iiRow->second].refs++;
+		Touch(iiRow->second);
+		m_References++;
+		m_Deduplicated++;
+		Ref = iiRow->second + 1;
+		return ERR_SUCCESS;
+	}
+
+	// A new chunk takes a free row or a new one
+	uint64_t Row = m_Slots.size();
+	if(!m_Free.empty())
+		Row = m_Free.back();
+	if((hRes=WriteSlot(Row, Chunk))!=ERR_SUCCESS)
+		return hRes;
+	if(Row==m_Slots.size())
+		m_Slots.push_back(Slot());
+	else
+		m_Free.pop_back();
+	m_Slots[(size_t)Row].hash = Hash;
+	m_Slots[(size_t)Row].refs = 1;
+	m_ByHash.insert(std::make_pair(Hash, Row));
+	Touch(Row);
+	m_Chunks++;
+	m_References++;
+	Ref = Row + 1;
+	return ERR_SUCCESS;
+}
+DWORD ChunkStore::Get(uint64_t Ref, void* Chunk)
+{
+	if(Ref==0)
+	{
+		memset(Chunk, 0, m_ChunkSize);
+		return ERR_SUCCESS;
+	}
+	if(!IsOpen())
+		return ERR_NOT_READY;
+	if(Ref > m_Slots.size() || m_Slots[(size_t)(Ref - 1)].refs==0)
+		return ERR_NOT_FOUND;
+	return ReadSlot(Ref - 1, Chunk);
+}
+DWORD ChunkStore::Release(uint64_t Ref)
+{
+	if(Ref==0)
+		return ERR_SUCCESS;
+	if(!IsOpen())
+		return ERR_NOT_READY;
+	uint64_t Row = Ref - 1;
+	if(Row >= m_Slots.size() || m_Slots[(size_t)Row].refs==0)
+		return ERR_NOT_FOUND;
+	Slot& Item = m_Slots[(size_t)Row];
+	Touch(Row);
+	m_References--;
+	if(--Item.refs > 0)
+		return ERR_SUCCESS;
+
+	// The last reference is gone, the row is free for another chunk
+	auto Candidates = m_ByHash.equal_range(Item.hash);
+	for(auto iiRow = Candidates.first; iiRow != Candidates.second; iiRow++)
+	{
+		if(iiRow->second==Row)
+		{
+			m_ByHash.erase(iiRow);
+			break;
+		}
+	}
+	m_Free.push_back(Row);
+	m_Chunks--;
+	return ERR_SUCCESS;
+}
+DWORD ChunkStore::Flush()
+{
+	if(!IsOpen() || m_DirtyFrom >= m_DirtyTo)
+		return ERR_SUCCESS;
+	hsize_t dims[2]  = {m_Slots.size(), 2};
+	hsize_t start[2] = {m_DirtyFrom, 0};
+	hsize_t count[2] = {m_DirtyTo - m_DirtyFrom, 2};
+	hid_t   FileSpace = -1, MemSpace = -1;
+	DWORD   hRes = ERR_SUCCESS;
+	if(H5Dset_extent(m_Index, dims)<0 ||
+		(FileSpace = H5Dget_space(m_Index))<0 ||
+		H5Sselect_hyperslab(FileSpace, H5S_SELECT_SET, start, NULL, count, NULL)<0 ||
+		(MemSpace = H5Screate_simple(2, count, NULL))<0 ||
+		H5Dwrite(m_Index, H5T_NATIVE_UINT64, MemSpace, FileSpace, H5P_DEFAULT, &m_Slots[(size_t)m_DirtyFrom])<0)
+		hRes = ERR_DISK_WRITE;
+	else
+	{
+		m_DirtyFrom = UINT64_MAX;
+		m_DirtyTo   = 0;
+	}
+	if(MemSpace>=0)
+		H5Sclose(MemSpace);
+	if(FileSpace>=0)
+		H5Sclose(FileSpace);
+	return hRes;
+}
+void ChunkStore::GetStats(uint64_t& Chunks, uint64_t& References, uint64_t& Deduplicated)
+{
+	Chunks       = m_Chunks;
+	References   = m_References;
+	Deduplicated = m_Deduplicated;
+}
+uint64_t ChunkStore::Hash(const void* Data, size_t Size)
+{
+	const unsigned char* Ptr = (const unsigned char*)Data;
+	const unsigned char* End = Ptr + Size;
+	uint64_t h;
+	if(Size >= 32)
+	{
+		uint64_t v1 = PRIME64_1 + PRIME64_2;
+		uint64_t v2 = PRIME64_2;
+		uint64_t v3 = 0;
+		uint64_t v4 = 0 - PRIME64_1;
+		const unsigned char* Limit = End - 32;
+		do
+		{
+			v1 = Round(v1, Read64(Ptr));
+			v2 = Round(v2, Read64(Ptr + 8));
+			v3 = Round(v3, Read64(Ptr + 16));
+			v4 = Round(v4, Read64(Ptr + 24));
+			Ptr += 32;
+		}
+		while(Ptr <= Limit);
+		h = Rotl(v1, 1) + Rotl(v2, 7) + Rotl(v3, 12) + Rotl(v4, 18);
+		h = Merge(h, v1);
+		h = Merge(h, v2);
+		h = Merge(h, v3);
+		h = Merge(h, v4);
+	}
+	else
+		h = PRIME64_5;
+	h += (uint64_t)Size;
+	for(; Ptr + 8 <= End; Ptr += 8)
+	{
+		h ^= Round(0, Read64(Ptr));
+		h  = Rotl(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if(Ptr + 4 <= End)
+	{
+		uint32_t Value;
+		memcpy(&Value, Ptr, sizeof(Value));
+		h ^= (uint64_t)Value * PRIME64_1;
+		h  = Rotl(h, 23) * PRIME64_2 + PRIME64_3;
+		Ptr += 4;
+	}
+	for(; Ptr < End; Ptr++)
+	{
+		h ^= (uint64_t)*Ptr * PRIME64_5;
+		h  = Rotl(h, 11) * PRIME64_1;
+	}
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+DWORD ChunkStore::ReadSlot(uint64_t Row, void* Chunk)
+{
+	hsize_t start[2] = {Row, 0};
+	hsize_t count[2] = {1, m_ChunkSize};
+	hid_t   FileSpace = -1, MemSpace = -1;
+	DWORD   hRes = ERR_SUCCESS;
+	if((FileSpace = H5Dget_space(m_Data))<0 ||
+		H5Sselect_hyperslab(FileSpace, H5S_SELECT_SET, start, NULL, count, NULL)<0 ||
+		(MemSpace = H5Screate_simple(2, count, NULL))<0 ||
+		H5Dread(m_Data, H5T_NATIVE_SCHAR, MemSpace, FileSpace, H5P_DEFAULT, Chunk)<0)
+		hRes = ERR_DISK_READ;
+	if(MemSpace>=0)
+		H5Sclose(MemSpace);
+	if(FileSpace>=0)
+		H5Sclose(FileSpace);
+	return hRes;
+}
+DWORD ChunkStore::WriteSlot(uint64_t Row, const void* Chunk)
+{
+	hsize_t start[2] = {Row, 0};
+	hsize_t count[2] = {1, m_ChunkSize};
+	hid_t   FileSpace = -1, MemSpace = -1;
+	DWORD   hRes = ERR_SUCCESS;
+	if(Row >= m_DataRows)
+	{
+		hsize_t dims[2] = {Row + 1, m_ChunkSize};
+		if(H5Dset_extent(m_Data, dims)<0)
+			return ERR_DISK_WRITE;
+		m_DataRows = Row + 1;
+	}
+	if((FileSpace = H5Dget_space(m_Data))<0 ||
+		H5Sselect_hyperslab(FileSpace, H5S_SELECT_SET, start, NULL, count, NULL)<0 ||
+		(MemSpace = H5Screate_simple(2, count, NULL))<0 ||
+		H5Dwrite(m_Data, H5T_NATIVE_SCHAR, MemSpace, FileSpace, H5P_DEFAULT, Chunk)<0)
+		hRes = ERR_DISK_WRITE;
+	if(MemSpace>=0)
+		H5Sclose(MemSpace);
+	if(FileSpace>=0)
+		H5Sclose(FileSpace);
+	return hRes;
+}
+void ChunkStore::Touch(uint64_t Row)
+{
+	m_DirtyFrom = (Row < m_DirtyFrom)?Row:m_DirtyFrom;
+	m_DirtyTo   = (Row + 1 > m_DirtyTo)?Row + 1:m_DirtyTo;
+}
+}
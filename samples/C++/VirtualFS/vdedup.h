@@ -0,0 +1,68 @@
+#pragma once
+#include "platform.h"
+#include <Hdf5.h>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace XDX
+{
+////////////////////////////////////////////////////////////////
+// The unique chunks of the deduplicated files of a container.
+// Every chunk is kept once, a row of the "data" dataset, and the
+// "index" dataset holds its hash and the number of references
+// next to it. A reference to a chunk is its row + 1; 0 stands for
+// a chunk of zeros which is never stored. Put finds the twin of
+// a chunk by the hash and confirms it by the content, so a write
+// of the content already known is only a reference. A row left
+// without references is reused for the next new chunk.
+//
+// The index is kept in memory and written by Flush, the data
+// rows are written at once.
+////////////////////////////////////////////////////////////////
+class ChunkStore
+{
+public:
+	ChunkStore();
+	virtual ~ChunkStore();
+	// Opens the store in GroupId, or creates it there, for ChunkSize byte chunks
+	DWORD Open(hid_t GroupId, size_t ChunkSize);
+	void  Close();
+	bool  IsOpen(){return m_Data>=0;}
+	size_t GetChunkSize(){return m_ChunkSize;}
+	// Stores the ChunkSize bytes of Chunk, or takes a reference to their twin
+	DWORD Put(const void* Chunk, uint64_t& Ref);
+	DWORD Get(uint64_t Ref, void* Chunk);
+	// Drops a reference. The row of the last one is reused at once, so no list
+	// on the disk may hold the reference any more, see VirtualFS::_ReleaseChunks
+	DWORD Release(uint64_t Ref);
+	DWORD Flush();
+	// Chunks stored, references to them, and the puts that stored nothing
+	void  GetStats(uint64_t& Chunks, uint64_t& References, uint64_t& Deduplicated);
+	// XXH64 with the seed 0
+	static uint64_t Hash(const void* Data, size_t Size);
+private:
+	struct Slot
+	{
+		uint64_t hash;
+		uint64_t refs;    // 0 - free
+	};
+	DWORD ReadSlot(uint64_t Row, void* Chunk);
+	DWORD WriteSlot(uint64_t Row, const void* Chunk);
+	void  Touch(uint64_t Row);
+private:
+	hid_t                 m_Data;        // Rows of ChunkSize bytes
+	hid_t                 m_Index;       // Rows of {hash, refs}
+	size_t                m_ChunkSize;
+	uint64_t              m_DataRows;    // The extent of m_Data
+	std::vector<Slot>     m_Slots;
+	std::unordered_multimap<uint64_t, uint64_t> m_ByHash;  // The rows in use by the hash
+	std::vector<uint64_t> m_Free;
+	uint64_t              m_DirtyFrom;   // The rows of the index to write
+	uint64_t              m_DirtyTo;
+	std::vector<char>     m_Probe;       // A stored chunk compared with the new one
+	uint64_t              m_Chunks;
+	uint64_t              m_References;
+	uint64_t              m_Deduplicated;
+};
+}
@@ -1,11 +1,16 @@
 #pragma once
 #include "defines.h"
 #include "H5FDBlock.h"
-#include "Ranges/IntervalTree.h"
+#include "Ranges/IntervalIndex.h"
+#include "Ranges/IntervalImage.h"
+#include <functional>
+#include <memory>
+#include <unordered_set>
 
 using namespace XDX::Objects;
 namespace XDX
 {
+	class WorkerPool;
 	typedef hid_t  RawHandle;
 	typedef HANDLE XHandle;
 	struct LockInfo
@@ -15,30 +20,123 @@ namespace XDX
 		bool    isExclusive;
 		XHandle UserHandle;
 	};
-	typedef IntervalTree<file_offset_t, LockInfo> Ranges;
+	typedef IntervalIndex<LockInfo, file_offset_t> Ranges;
+
+	// Persistent ranges of a file (extents, annotations) tagged with a 64-bit value
+	struct TaggedRange
+	{
+		file_offset_t start;
+		file_offset_t stop;
+		uint64_t      value;
+	};
+	typedef IntervalIndex<uint64_t, file_offset_t> TaggedRanges;
+	struct RangeImage
+	{
+		std::vector<uint64_t>                  data;  // The image as stored in the container
+		IntervalImage<uint64_t, file_offset_t> view;  // Queries the data in place
+	};
+	typedef std::shared_ptr<RangeImage> RangeImagePtr;
+	// An item found by VirtualFS::Walk
+	struct WalkEntry
+	{
+		std::wstring Path;   // Full path of the item
+		DWORD        Depth;  // 1 - a child of the walk root
+		AttrInfo     Info;
+	};
+	// Gets a batch of the items, false stops the walk
+	typedef std::function<bool(const WalkEntry* Entries, size_t Count)> WalkCallback;
+	enum enWalkFlags
+	{
+		WALK_FILES   = 1,
+		WALK_FOLDERS = 2,
+	};
+	struct WalkOptions
+	{
+		WalkOptions():
+			MaxDepth(0), Flags(WALK_FILES|WALK_FOLDERS), BatchSize(256), Pool(nullptr){}
+		DWORD  MaxDepth;   // The deepest level reported, 0 - unlimited
+		DWORD  Flags;      // WALK_* - the kinds of the items reported
+		size_t BatchSize;
+		// Sees every item before it is reported. An item it rejects is
+		// skipped, a rejected folder with all its content.
+		std::function<bool(const WalkEntry&)> Filter;
+		// Runs the callbacks while the walk goes on, not owned.
+		// nullptr - the callbacks run on the walking thread, as they
+		// do when the walk itself runs on a worker of Pool.
+		WorkerPool* Pool;
+	};
+	// The chunk references of a deduplicated file, one per chunk of its data
+	typedef std::shared_ptr<std::vector<uint64_t>> ChunkMapPtr;
 	struct RealHandle
 	{
 		RealHandle():
-			rawHandle(-1), isFile(false), uReaders(0), uWriters(0), fShareMode(0){}
+			rawHandle(-1), isFile(false), uReaders(0), uWriters(0), fShareMode(0), objAddr(HADDR_UNDEF), fileSize(0), sizeDirty(false), mapDirty(false), inlineCapacity(0){}
 		RawHandle    rawHandle;
 		bool         isFile;
 		uint32_t     uReaders;
 		uint32_t     uWriters;
 		uint32_t     fShareMode;
-		std::wstring wsPath;
-		Ranges       rangeLocks;
+		std::wstring  wsPath;      // As opened, a move of the file or a folder above does not update it
+		haddr_t       objAddr;     // The identity of the file, the key of m_AddrHandles
+		Ranges        rangeLocks;
+		RangeImagePtr rangeImage;  // Loaded on open, shared by the copies of the handle
+		file_offset_t fileSize;    // The logical size, written to the attributes lazily
+		bool          sizeDirty;
+		ChunkMapPtr   chunkMap;    // Set for a deduplicated file, written with the size
+		bool          mapDirty;
+		std::vector<uint64_t> chunkReleases;  // The chunks chunkMap dropped, released once it is on the disk
+		uint64_t      inlineCapacity;  // Bytes of the compact dataset of an inline file, 0 - chunked
 	};
 	struct UserHandle
 	{
 		UserHandle():
-			oCursor(0), uCreatedBy(0), fAccessMode(0), hRealHandle(-1){}
+			oCursor(0), uCreatedBy(0), fAccessMode(0), uDurability(0), hRealHandle(-1){}
 		file_offset_t oCursor;
 		uint64_t      uCreatedBy;
 		uint32_t      fAccessMode;
+		uint32_t      uDurability;   // XHdf5::DURABILITY_* of the writes
 		RawHandle     hRealHandle;
 	};
+	// Undo record of a metadata transaction
+	enum enTxOperation
+	{
+		TX_CREATED = 0,  // Path was created
+		TX_MOVED   = 1,  // Path was moved to Target
+		TX_DELETED = 2,  // Path was moved to Target in the trash
+	};
+	struct TxRecord
+	{
+		DWORD       dwOperation;
+		std::string sPath;       // Utf8
+		std::string sTarget;     // Utf8
+		std::vector<std::string> vImageNames; // The range images of the deleted files
+		std::vector<std::string> vChunkMaps;  // The chunk lists of the deleted files
+	};
+	typedef std::vector<TxRecord> TxLogT;
+
+	// A running compaction as seen by the writers between its steps
+	struct CompactState
+	{
+		CompactState():
+			chunks(false), target(-1) {AnsiPath[0] = 0;}
+		std::unordered_set<haddr_t> changed;  // The objects written since the compaction copied them
+		bool   chunks;                        // The chunk store changed
+		hid_t  target;                        // The new container, closed by Close if it comes first
+		char   AnsiPath[MAX_PATH];
+	};
+
+	// An open meta attribute of the root group
+	struct MetaAttr
+	{
+		hid_t  attr;
+		hid_t  type;   // The stored type, used for reads and writes
+		size_t size;
+	};
+	typedef std::unordered_map<DWORD, MetaAttr> MetaAttrsT;
+	typedef std::unordered_map<size_t, hid_t> StrTypesT;
+
 	typedef std::unordered_map<RawHandle, RealHandle> RealHandlesT;
 	typedef std::unordered_map<XHandle, UserHandle> UserHandlesT;
-	typedef std::unordered_map<std::wstring, RawHandle> NamedHandlesT;
+	typedef std::unordered_map<haddr_t, RawHandle> AddrHandlesT;
 
 }
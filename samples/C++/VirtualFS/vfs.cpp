@@ -1,7 +1,32 @@
 #include "stdafx.h"
 #include "vfs.h"
 #include "md5.h"
+#include <algorithm>
+#include <random>
+#include <map>
+#include <set>
 
+namespace
+{
+	// Takes the container lock as AutoLock does and records the wait for it
+	template<class AutoLock> class CTimedLock
+	{
+	public:
+		CTimedLock(IRWLock* Lock, XHdf5::LatencyHistogram& Wait):
+			m_Started(XHdf5::LatencyHistogram::Now()), m_Lock(Lock)
+		{
+			Wait.Record(XHdf5::LatencyHistogram::Now() - m_Started);
+		}
+	private:
+		uint64_t m_Started;   // Initialized before m_Lock is taken
+		AutoLock m_Lock;
+	};
+	typedef CTimedLock<CAutoReadLock>  CTimedReadLock;
+	typedef CTimedLock<CAutoWriteLock> CTimedWriteLock;
+
+	// Chunk releases held back for the maps not on the disk, more force a flush
+	const size_t MaxHeldChunks = 4096;
+}
 
 namespace XDX
 {
@@ -9,11 +34,21 @@ VirtualFS::VirtualFS(LPCWSTR Alias, LPCWSTR DataFolder)
 {
 	_ClearMem();
 	ZeroMemory(m_DataFolder, sizeof(m_DataFolder));
-	wcscpy_s(m_DataFolder, sizeof(m_DataFolder)/2, DataFolder);
+	wcscpy_s(m_DataFolder, _countof(m_DataFolder), DataFolder);
 	m_Alias     = Alias;
 	m_Logger    = nullptr;
 	m_RefCount  = 1;
 	m_HandlesCounter = 0;
+	m_Cache      = nullptr;
+	m_CacheQuota = 0;
+	m_Durability = XHdf5::DURABILITY_NONE;
+	m_CommitDelay = 0;
+	m_Prefetch   = 0;
+	m_PrefetchPool = nullptr;
+	m_Faults     = nullptr;
+	m_Rekeying   = false;
+	m_Dedup      = FALSE;
+	m_InlineLimit = INLINE_FILE_LIMIT;
 
 	// Disable printing errors
 	H5Eset_auto (H5E_DEFAULT, nullptr, nullptr);
@@ -58,6 +93,9 @@ VOID  WINAPI VirtualFS::GetLastErrorDesc(LPWSTR Buf, DWORD Size)
 	sResult = _msg;
 	//convert codepages
 	wsResult.assign(sResult.begin(), sResult.end()); 
+	// Cut to fit, wcscpy_s leaves nothing of a string too long
+	if(Size>0 && wsResult.size() >= Size)
+		wsResult.resize(Size - 1);
 	wcscpy_s(Buf, Size, wsResult.c_str());
 }
 VOID  WINAPI VirtualFS::SetLogger(pILog Logger)
@@ -86,21 +124,19 @@ DWORD WINAPI VirtualFS::Create(LPCWSTR FileName, LPCWSTR Name, ICrypto* PwdCrypt
 		return ERR_ERROR_PARAM;
 	}
 		
-	CAutoWriteLock l(m_Lock);
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
 
 	// Close the FS first, if it was open
 	CheckXErr(Close());
 
 	// Make sure that the file doesn't exist
-	wchar_t DataFilePath[MAX_PATH];
-	swprintf_s(DataFilePath, sizeof(DataFilePath)/2, L"%s\\%s.dat", m_DataFolder, FileName);
-
-	DWORD attributes = GetFileAttributes(DataFilePath);
-	bool FileExists = !(attributes == INVALID_FILE_ATTRIBUTES || (attributes & FILE_ATTRIBUTE_DIRECTORY));
-	if(FileExists)
+	wchar_t DataFilePath[MAX_PATH]={0};
+	char AnsiPath[MAX_PATH]={0};
+	_ContainerPath(FileName, DataFilePath, _countof(DataFilePath), AnsiPath, sizeof(AnsiPath));
+	if(Platform::FileExists(AnsiPath))
 	{
 		wchar_t Msg[512] = {0};
-		swprintf_s(Msg, sizeof(Msg)/2, L"Failed to create the file system \"%s\": index file already exists", FileName);
+		swprintf_s(Msg, _countof(Msg), L"Failed to create the file system \"%ls\": index file already exists", FileName);
 		ToLog(Logs::EV_ERROR, Msg);
 		//Close();
 		return ERR_DUPLICATE;
@@ -110,7 +146,7 @@ DWORD WINAPI VirtualFS::Create(LPCWSTR FileName, LPCWSTR Name, ICrypto* PwdCrypt
 	if((hRes = _Init(FileName, Name, PwdCrypt, DataCrypt, BlockSize, Version, TRUE))!=ERR_SUCCESS)
 	{
 		wchar_t Msg[512] = {0};
-		swprintf_s(Msg, sizeof(Msg)/2, L"Failed to create the file system \"%s\": %s", FileName, ErrorTexts::GetErrorDesc(hRes));
+		swprintf_s(Msg, _countof(Msg), L"Failed to create the file system \"%ls\": %ls", FileName, ErrorTexts::GetErrorDesc(hRes));
 		ToLog(Logs::EV_ERROR, Msg);
 		Close();
 		return hRes;
@@ -123,7 +159,7 @@ DWORD WINAPI VirtualFS::Open(LPCWSTR FileName, ICrypto* PwdCrypt, ICrypto* DataC
 	if(FileName==nullptr)
 		return ERR_ERROR_PARAM;
 
-	CAutoWriteLock l(m_Lock);
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
 
 	// Close the FS first, if it was open
 	CheckXErr(Close());
@@ -131,7 +167,7 @@ DWORD WINAPI VirtualFS::Open(LPCWSTR FileName, ICrypto* PwdCrypt, ICrypto* DataC
 	if((hRes = _Init(FileName, nullptr, PwdCrypt, DataCrypt, 0, FS_VERSION_ID, FALSE))!=ERR_SUCCESS)
 	{
 		wchar_t Msg[512] = {0};
-		swprintf_s(Msg, sizeof(Msg)/2, L"Failed to open the file system \"%s\": %s", FileName, ErrorTexts::GetErrorDesc(hRes));
+		swprintf_s(Msg, _countof(Msg), L"Failed to open the file system \"%ls\": %ls", FileName, ErrorTexts::GetErrorDesc(hRes));
 		ToLog(Logs::EV_ERROR, Msg);
 		Close();
 		return hRes;
@@ -141,23 +177,71 @@ DWORD WINAPI VirtualFS::Open(LPCWSTR FileName, ICrypto* PwdCrypt, ICrypto* DataC
 DWORD WINAPI VirtualFS::Close()
 {
 	DWORD hError = ERROR_SUCCESS;
-	CAutoWriteLock l(m_Lock);
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
 
+	// A transaction left open is not committed
+	if(m_hFile>0 && m_TxActive)
+	{
+		m_TxActive = false;
+		_TxUndo(0);
+	}
+	// A compaction between its steps loses the target, it is closed with the keys still there
+	if(m_Compacting!=nullptr)
+	{
+		if(m_Compacting->target>=0)
+			H5Fclose(m_Compacting->target);
+		Platform::FileDelete(m_Compacting->AnsiPath);
+		m_Compacting->target = -1;
+		m_Compacting = nullptr;
+	}
+	// A snapshot being streamed is completed before the last writes
+	if(m_Snapshot!=nullptr)
+	{
+		if(m_Snapshot->CopyAll()<0)
+			ToLog(Logs::EV_ERROR, L"Failed to complete the snapshot on close");
+		m_Snapshot = nullptr;
+	}
+	// The sizes and the counters are persisted lazily
+	if(m_hFile>0 && _FlushFileSizes()!=ERR_SUCCESS)
+		hError = ERR_DISK_WRITE;
+	if(m_hFile>0 && _FlushMeta()!=ERR_SUCCESS)
+		hError = ERR_DISK_WRITE;
+	// The path index is stored only here, a session ending otherwise leaves it stale
+	if(m_hFile>0 && m_Paths.IsEnabled() && _StorePathIndex(false)!=ERR_SUCCESS)
+		hError = ERR_DISK_WRITE;
+	// The chunks the maps dropped are released once the maps are on the disk
+	if(m_hFile>0 && hError==ERROR_SUCCESS && !m_ChunkReleases.empty() &&
+		(_ReleaseChunks(true)!=ERR_SUCCESS || m_Chunks.Flush()!=ERR_SUCCESS))
+		hError = ERR_DISK_WRITE;
+	_CloseMetaCache();
+	m_Chunks.Close();
+	m_Paths.Disable();
 
-	if( m_hFile>0 && H5Fflush(m_hFile, H5F_SCOPE_GLOBAL)<0 || 
-		m_hFile>0 && H5Fclose(m_hFile)<0 || 
+	// The close flushes and syncs once, the driver is still at DURABILITY_DISK
+	if( m_hFile>0 && H5Fclose(m_hFile)<0 || 
 		m_hFapl!=H5P_DEFAULT && H5Pclose(m_hFapl)<0|| 
 		m_hFcpl!=H5P_DEFAULT && H5Pclose(m_hFcpl)<0)		
 	{
 		wchar_t H5Msg[512] = {0};
-		GetLastErrorDesc(H5Msg, sizeof(H5Msg)/2-1);
+		GetLastErrorDesc(H5Msg, _countof(H5Msg)-1);
 		wchar_t Msg[512] = {0};
-		swprintf_s(Msg, sizeof(Msg)/2, L"Failed to close the file system: %ls", H5Msg);
+		swprintf_s(Msg, _countof(Msg), L"Failed to close the file system: %ls", H5Msg);
 		ToLog(Logs::EV_ERROR, Msg);
 		hError = ERR_DISK_WRITE;
 	}
+	// The log ends with the last writes of the close
+	if(m_ReplLog!=nullptr)
+	{
+		if(m_ReplLog->Close()<0)
+			hError = ERR_DISK_WRITE;
+		delete m_ReplLog;
+	}
+	// An unfinished key rotation is left to the journal
+	_RekeyClose();
 	if(m_Driver)
 		delete m_Driver;
+	if(m_Cache!=nullptr && m_CacheClient!=0)
+		m_Cache->Unregister(m_CacheClient);
 
 	// Release crypto providers
 	if(m_PwdCrypt!=nullptr && m_DataCrypt!=nullptr)
@@ -177,7 +261,7 @@ DWORD WINAPI VirtualFS::GetMeta(DWORD FieldId, PBYTE ByteVal, DWORD *MaxSize)
 	if(*MaxSize==0)
 		return ERR_ERROR_PARAM;
 
-	CAutoReadLock l(m_Lock);
+	CTimedReadLock l(m_Lock, m_Io.LockWait);
 	if(!IsOpen())
 		return ERR_NOT_READY; // the fs is not open
 	switch(FieldId)
@@ -189,10 +273,10 @@ DWORD WINAPI VirtualFS::GetMeta(DWORD FieldId, PBYTE ByteVal, DWORD *MaxSize)
 			*MaxSize=sizeof(DWORD);
 			break;
 		case FSMF_SZ_NAME: 
-			if(*MaxSize<3)
+			if(*MaxSize<(wcslen(INFO.NAME) + 1)*sizeof(wchar_t))
 				return ERR_LIMITS;
-			wcscpy_s((wchar_t*)ByteVal, *MaxSize/2, INFO.NAME);
-			*MaxSize=wcslen(INFO.NAME)*2;
+			wcscpy_s((wchar_t*)ByteVal, *MaxSize/sizeof(wchar_t), INFO.NAME);
+			*MaxSize=wcslen(INFO.NAME)*sizeof(wchar_t);
 			break;            
 		case FSMF_DW_BLOCK_SIZE: 
 			if(*MaxSize<sizeof(DWORD))
@@ -213,18 +297,18 @@ DWORD WINAPI VirtualFS::GetMeta(DWORD FieldId, PBYTE ByteVal, DWORD *MaxSize)
 			*MaxSize=sizeof(DWORD);
 			break;
 		case FSMF_DW_USED_BLOCKS: 
-			if(*MaxSize<sizeof(DWORD))
-				return ERR_LIMITS;
-			*(DWORD*)ByteVal = INFO.USED_BLOCKS;
-			*MaxSize=sizeof(DWORD);
-			break;
 		case FSMF_DW_FREE_BLOCKS: 
 			{
 			if(*MaxSize<sizeof(DWORD))
 				return ERR_LIMITS;
-			hsize_t FreeSpace = H5Fget_freespace(m_hFile);
-
-			*(DWORD*)ByteVal = FreeSpace;
+			// Counted in blocks and saturated, GetSpaceStats has the exact bytes
+			hsize_t  FileSize  = 0;
+			hssize_t FreeSpace = H5Fget_freespace(m_hFile);
+			if(FreeSpace<0 || H5Fget_filesize(m_hFile, &FileSize)<0)
+				return ERR_DISK_READ;
+			UINT64 Bytes = (FieldId==FSMF_DW_FREE_BLOCKS)?(UINT64)FreeSpace:(UINT64)FileSize - min((UINT64)FreeSpace, (UINT64)FileSize);
+			UINT64 Blocks = Bytes / max(INFO.BLOCK_SIZE, (DWORD)1);
+			*(DWORD*)ByteVal = (DWORD)min(Blocks, (UINT64)MAXDWORD);
 			*MaxSize=sizeof(DWORD);
 			}
 			break;
@@ -299,7 +383,7 @@ DWORD WINAPI VirtualFS::SetMeta(DWORD FieldId, PBYTE ByteVal, DWORD Size)
 	if(ByteVal==nullptr || Size<3)
 		return ERR_ERROR_PARAM;
 
-	CAutoWriteLock l(m_Lock);
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
 	if(!IsOpen())
 		return ERR_NOT_READY; // the fs is not open
 	DWORD NameSize = max(Size, FS_MAX_ALIAS);
@@ -314,6 +398,9 @@ DWORD WINAPI VirtualFS::ChangeAccessPassword(PBYTE Password, DWORD Length)
 		return ERR_NOT_READY; // the fs is not open
 	if(!_IsCrypto())
 		return ERR_EMPTY;
+	// The journal keeps the new data key wrapped with the current password
+	if(m_Rekey!=nullptr)
+		return ERR_IN_USE;
 
 	// 1. As password here is passed as plain text, we must hash it first	
 	MD5 hasher;
@@ -342,7 +429,7 @@ DWORD WINAPI VirtualFS::FileCreate(LPCWSTR FileName, UINT64 CreatedBy, DWORD Des
 		return ERR_ERROR_PARAM;
 	*File = INVALID_HANDLE_VALUE;
 
-	CAutoWriteLock l(m_Lock);
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
 	if(!IsOpen())
 		return ERR_NOT_READY; // the fs is not open
 	
@@ -358,6 +445,7 @@ DWORD WINAPI VirtualFS::FileCreate(LPCWSTR FileName, UINT64 CreatedBy, DWORD Des
 	hUser.oCursor     = (DesiredAccess & FILE_APPEND_DATA)?0:0;//TODO: place cursor at the end of file
 	hUser.uCreatedBy  = CreatedBy;
 	hUser.fAccessMode = DesiredAccess;
+	hUser.uDurability = m_Durability;
 
 	// 3. Insert it to the user handles store
 	m_UserHandles[*File] = hUser;
@@ -366,37 +454,198 @@ DWORD WINAPI VirtualFS::FileCreate(LPCWSTR FileName, UINT64 CreatedBy, DWORD Des
 }
 DWORD WINAPI VirtualFS::FileLock(HANDLE File, BOOL Exclusive, UINT64 Offset, UINT64 Length)
 {
-	CAutoWriteLock l(m_Lock);
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
 	if(!IsOpen())
 		return ERR_NOT_READY; // the fs is not open
 	return ERR_SUCCESS;
 }
 DWORD WINAPI VirtualFS::FileUnlock(HANDLE File, UINT64 Offset, UINT64 Length)
 {
-	CAutoWriteLock l(m_Lock);
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
 	if(!IsOpen()) return ERR_NOT_READY; // the fs is not open
 	return ERR_SUCCESS;
 }
 DWORD WINAPI VirtualFS::FileRead(HANDLE File, LPVOID Buffer, UINT64 Offset, DWORD LengthToRead, LPDWORD LengthRead)
 {
-	CAutoReadLock l(m_Lock);
+	DWORD hRes = ERR_SUCCESS;
+	if(Buffer==nullptr || LengthRead==nullptr)
+		return ERR_ERROR_PARAM;
+	*LengthRead = 0;
+	CTimedReadLock l(m_Lock, m_Io.LockWait);
 	if(!IsOpen()) return ERR_NOT_READY; // the fs is not open
-	return ERR_SUCCESS;
+
+	// 1. Find the real handle of a file open for reading
+	auto iiUserHandle = m_UserHandles.find(File);
+	if(iiUserHandle == m_UserHandles.end())
+		return ERR_ERROR_PARAM;
+	if((iiUserHandle->second.fAccessMode & GENERIC_READ)==0)
+		return ERR_ACCESS_DENIED;
+	auto iiRealHandle = m_RealHandles.find(iiUserHandle->second.hRealHandle);
+	if(iiRealHandle == m_RealHandles.end())
+		return ERR_EXTERNAL;
+
+	// 2. Nothing is read past the logical end
+	UINT64 FileSize = (UINT64)iiRealHandle->second.fileSize;
+	if(Offset >= FileSize || LengthToRead==0)
+		return ERR_SUCCESS;
+	hsize_t Start[1] = {Offset};
+	hsize_t Count[1] = {min((UINT64)LengthToRead, FileSize - Offset)};
+
+	// A deduplicated file is assembled from its chunks
+	if(iiRealHandle->second.chunkMap)
+	{
+		if((hRes=_ChunkRead(iiRealHandle->second, Buffer, Offset, (size_t)Count[0]))==ERR_SUCCESS)
+			*LengthRead = (DWORD)Count[0];
+		return hRes;
+	}
+
+	// 3. Read the selected part of the dataset
+	hid_t FileSpace = -1, MemSpace = -1;
+	if((FileSpace = H5Dget_space(iiRealHandle->second.rawHandle))<0 ||
+		H5Sselect_hyperslab(FileSpace, H5S_SELECT_SET, Start, NULL, Count, NULL)<0 ||
+		(MemSpace = H5Screate_simple(1, Count, NULL))<0 ||
+		H5Dread(iiRealHandle->second.rawHandle, H5T_NATIVE_SCHAR, MemSpace, FileSpace, H5P_DEFAULT, Buffer)<0)
+		hRes = ERR_DISK_READ;
+	else
+		*LengthRead = (DWORD)Count[0];
+	CloseH5handle(MemSpace, H5I_DATASPACE);
+	CloseH5handle(FileSpace, H5I_DATASPACE);
+	return hRes;
 }
 DWORD WINAPI VirtualFS::FileWrite(HANDLE File, LPVOID Buffer, UINT64 Offset, DWORD LengthToWrite, LPDWORD LengthWritten)
 {
+	std::shared_ptr<XHdf5::GroupCommit> Commit;
+	DWORD hRes = _FileWrite(File, Buffer, Offset, LengthToWrite, LengthWritten, Commit);
+	// Out of the lock, so that the writers coming meanwhile share the sync
+	if(hRes==ERR_SUCCESS && Commit && Commit->Sync()<0)
+		hRes = ERR_DISK_WRITE;
+	return hRes;
+}
+DWORD VirtualFS::_FileWrite(HANDLE File, LPVOID Buffer, UINT64 Offset, DWORD LengthToWrite, LPDWORD LengthWritten, std::shared_ptr<XHdf5::GroupCommit>& Commit)
+{
+	DWORD hRes = ERR_SUCCESS;
+	if(Buffer==nullptr || LengthWritten==nullptr)
+		return ERR_ERROR_PARAM;
+	*LengthWritten = 0;
+	if(Offset > (UINT64)XHDF5_MAXADDR - LengthToWrite)
+		return ERR_ERROR_PARAM;
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
 	if(!IsOpen()) return ERR_NOT_READY; // the fs is not open
-	return ERR_SUCCESS;
+
+	// 1. Find the real handle of a file open for writing
+	auto iiUserHandle = m_UserHandles.find(File);
+	if(iiUserHandle == m_UserHandles.end())
+		return ERR_ERROR_PARAM;
+	if((iiUserHandle->second.fAccessMode & GENERIC_WRITE)==0)
+		return ERR_ACCESS_DENIED;
+	auto iiRealHandle = m_RealHandles.find(iiUserHandle->second.hRealHandle);
+	if(iiRealHandle == m_RealHandles.end())
+		return ERR_EXTERNAL;
+	if(LengthToWrite==0)
+		return ERR_SUCCESS;
+
+	// 2. An inline file outgrowing its dataset moves to a bigger one
+	UINT64 End = Offset + LengthToWrite;
+	if(iiRealHandle->second.inlineCapacity>0 && End > iiRealHandle->second.inlineCapacity)
+	{
+		RawHandle Key = iiRealHandle->first;
+		if((hRes=_ReshapeFile(Key, _InlineCapacity(End)))!=ERR_SUCCESS)
+			return hRes;
+		iiRealHandle = m_RealHandles.find(Key);
+	}
+	RealHandle& hFile = iiRealHandle->second;
+
+	// 3. Write the data, a deduplicated file goes through the chunk store
+	if(hFile.chunkMap)
+		hRes = _ChunkWrite(hFile, Buffer, Offset, LengthToWrite);
+	else
+		hRes = _DatasetWrite(hFile, Buffer, Offset, LengthToWrite);
+	_CompactTouch(hFile.objAddr);
+	if(hFile.chunkMap && m_Compacting!=nullptr)
+		m_Compacting->chunks = true;
+	if(hRes==ERR_SUCCESS)
+		*LengthWritten = LengthToWrite;
+
+	// 4. Take the write as far as the handle asks, the disk sync is left to the caller
+	DWORD Level = iiUserHandle->second.uDurability;
+	if(hRes==ERR_SUCCESS && Level>=XHdf5::DURABILITY_OS)
+		hRes = _FlushToOS(hFile, (Level>=XHdf5::DURABILITY_DISK)?&Commit:nullptr);
+	return hRes;
+}
+DWORD VirtualFS::_DatasetWrite(RealHandle& hFile, LPVOID Buffer, UINT64 Offset, DWORD Length)
+{
+	DWORD hRes = ERR_SUCCESS;
+
+	// 1. Extend the dataset, the new size reaches the attributes later.
+	//    An inline file has room up to its capacity already
+	hsize_t End[1] = {Offset + Length};
+	if(End[0] > (UINT64)hFile.fileSize)
+	{
+		if(hFile.inlineCapacity==0 && H5Dset_extent(hFile.rawHandle, End)<0)
+			return ERR_DISK_WRITE;
+		hFile.fileSize  = (file_offset_t)End[0];
+		hFile.sizeDirty = true;
+	}
+
+	// 2. Write the selected part of the dataset
+	hsize_t Start[1] = {Offset};
+	hsize_t Count[1] = {Length};
+	hid_t FileSpace = -1, MemSpace = -1;
+	if((FileSpace = H5Dget_space(hFile.rawHandle))<0 ||
+		H5Sselect_hyperslab(FileSpace, H5S_SELECT_SET, Start, NULL, Count, NULL)<0 ||
+		(MemSpace = H5Screate_simple(1, Count, NULL))<0 ||
+		H5Dwrite(hFile.rawHandle, H5T_NATIVE_SCHAR, MemSpace, FileSpace, H5P_DEFAULT, Buffer)<0)
+		hRes = ERR_DISK_WRITE;
+	CloseH5handle(MemSpace, H5I_DATASPACE);
+	CloseH5handle(FileSpace, H5I_DATASPACE);
+	return hRes;
 }
 DWORD WINAPI VirtualFS::FileFlush(HANDLE File)
 {
-	if(!IsOpen()) return ERR_NOT_READY; // the fs is not open
+	DWORD hRes = ERR_SUCCESS;
+	std::shared_ptr<XHdf5::GroupCommit> Commit;
+	{
+		CTimedWriteLock l(m_Lock, m_Io.LockWait);
+		if(!IsOpen()) return ERR_NOT_READY; // the fs is not open
+
+		auto iiUserHandle = m_UserHandles.find(File);
+		if(iiUserHandle == m_UserHandles.end())
+			return ERR_ERROR_PARAM;
+		auto iiRealHandle = m_RealHandles.find(iiUserHandle->second.hRealHandle);
+		if(iiRealHandle == m_RealHandles.end())
+			return ERR_EXTERNAL;
+		if((hRes=_FlushToOS(iiRealHandle->second, &Commit))!=ERR_SUCCESS)
+			return hRes;
+	}
+	if(Commit->Sync()<0)
+		return ERR_DISK_WRITE;
+	return ERR_SUCCESS;
+}
+////////////////////////////////////////////////////////////////
+// Writes the data of the HDF5 caches out to the OS together with
+// the size of hFile and the counters changed meanwhile. The sync
+// is not done here: Commit receives the group commit to sync with
+// once the lock is released.
+////////////////////////////////////////////////////////////////
+DWORD VirtualFS::_FlushToOS(RealHandle& hFile, std::shared_ptr<XHdf5::GroupCommit>* Commit)
+{
+	DWORD hRes = ERR_SUCCESS;
+	if((hRes=_FlushFileSize(hFile))!=ERR_SUCCESS || (hRes=_FlushMeta())!=ERR_SUCCESS)
+		return hRes;
+	int Level = m_Driver->GetFlushDurability();
+	m_Driver->SetFlushDurability(XHdf5::DURABILITY_OS);
+	herr_t res = H5Fflush(m_hFile, H5F_SCOPE_LOCAL);
+	m_Driver->SetFlushDurability(Level);
+	if(res<0)
+		return ERR_DISK_WRITE;
+	if(Commit!=nullptr)
+		*Commit = m_Driver->GetGroupCommit();
 	return ERR_SUCCESS;
 }
 DWORD WINAPI VirtualFS::FileClose(HANDLE File)
 {
 	DWORD hRes = ERR_SUCCESS;
-	CAutoWriteLock l(m_Lock);
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
 	if(!IsOpen()) 
 		return ERR_NOT_READY; // the fs is not open
 
@@ -410,7 +659,7 @@ DWORD WINAPI VirtualFS::FileClose(HANDLE File)
 DWORD WINAPI VirtualFS::FilesCloseAll(UINT64 CreatedBy)
 {
 	DWORD hRes = ERR_SUCCESS;
-	CAutoWriteLock l(m_Lock);
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
 	if(!IsOpen()) 
 		return ERR_NOT_READY; // the fs is not open
 
@@ -444,7 +693,7 @@ DWORD WINAPI VirtualFS::Move(LPCWSTR ExistingName, LPCWSTR NewName)
 	if(!_IsPathValid(ExistingName) || !_IsPathValid(NewName))
 		return ERR_ERROR_PARAM;
 
-	CAutoWriteLock l(m_Lock);
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
 
 
 	// 1. Make sure that the old name exists
@@ -474,7 +723,7 @@ DWORD WINAPI VirtualFS::Move(LPCWSTR ExistingName, LPCWSTR NewName)
 		CopyLength = wsNewItemName - NewName;
 	else
 		CopyLength = 1;
-	wcsncpy_s(PathCopy, sizeof(PathCopy)/2, NewName, CopyLength);	
+	wcsncpy_s(PathCopy, _countof(PathCopy), NewName, CopyLength);	
 
 	hid_t parent_item_id = -1;
 	H5I_type_t parent_item_type = H5I_UNINIT;
@@ -487,21 +736,29 @@ DWORD WINAPI VirtualFS::Move(LPCWSTR ExistingName, LPCWSTR NewName)
 	std::string oldNameUtf8 = TICUtils::WStringToUtf8(ExistingName);
 	std::string newNameUtf8 = TICUtils::WStringToUtf8(NewName);
 
-	// Check that if it's a group
-	if(old_item_type == H5I_GROUP) // It's a group
-	{
-		if(H5Gmove(m_hFile, oldNameUtf8.c_str(), newNameUtf8.c_str())<0)
-			return ERR_DISK_WRITE;
-	}
-	else
-	if(old_item_type == H5I_DATASET) // It's a file
+	// Only folders and files can be moved
+	if(old_item_type != H5I_GROUP && old_item_type != H5I_DATASET)
+		return ERR_ERROR_PARAM;
+
+	// 4. Move the link keeping the new name in Utf8
+	size_t Savepoint = _TxSavepoint();
+	hid_t lcpl_id = H5Pcreate(H5P_LINK_CREATE);
+	if(lcpl_id<0 || H5Pset_char_encoding(lcpl_id, H5T_CSET_UTF8)<0 ||
+		H5Lmove(m_hFile, oldNameUtf8.c_str(), m_hFile, newNameUtf8.c_str(), lcpl_id, H5P_DEFAULT)<0)
 	{
+		hRes = ERR_DISK_WRITE;
 	}
 	else
 	{
-		return ERR_ERROR_PARAM;
+		TxRecord Moved;
+		Moved.dwOperation = TX_MOVED;
+		Moved.sPath       = oldNameUtf8;
+		Moved.sTarget     = newNameUtf8;
+		m_TxLog.push_back(Moved);
+		m_Paths.Move(oldNameUtf8, newNameUtf8);
 	}
-	return ERR_SUCCESS;
+	CloseH5handle(lcpl_id, H5I_GENPROP_LST);
+	return _TxStatementEnd(hRes, Savepoint);
 }
 DWORD WINAPI VirtualFS::Delete(LPCWSTR Name)
 {
@@ -515,25 +772,80 @@ DWORD WINAPI VirtualFS::Delete(LPCWSTR Name)
 	if(!_IsPathValid(Name))
 		return ERR_ERROR_PARAM;
 
-	CAutoWriteLock l(m_Lock);
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
 
 
 	// 1. Make sure that the name exists and identify if it's a file
 	hid_t old_item_id = -1;
 	H5I_type_t old_item_type = H5I_UNINIT;
 	hRes=_FollowPath(Name, old_item_type, old_item_id);
+	// The files take their persistent ranges along
+	std::vector<std::string> ImageNames;
+	if(hRes==ERR_SUCCESS)
+		hRes = _CollectRangeImages(old_item_id, ImageNames);
+	// The deduplicated files give their chunks back
+	std::vector<std::string> ChunkMaps;
+	if(hRes==ERR_SUCCESS)
+		hRes = _CollectChunkMaps(old_item_id, ChunkMaps);
+	// Everything under a folder goes away with it
+	DWORD Files = 0, Folders = 0;
+	if(hRes==ERR_SUCCESS)
+		hRes = _CountObjects(old_item_id, Files, Folders);
 	CloseH5handle(old_item_id, old_item_type);
 	if(hRes!=ERR_SUCCESS)
 		return ERR_NOT_FOUND;
+	// An open file keeps using its chunks
+	for(auto iiRealHandle = m_RealHandles.begin(); iiRealHandle != m_RealHandles.end() && !ChunkMaps.empty(); iiRealHandle++)
+	{
+		H5O_info_t info;
+		char MapName[64];
+		if(!iiRealHandle->second.chunkMap || H5Oget_info(iiRealHandle->second.rawHandle, &info)<0)
+			continue;
+		_ChunkMapName(info.addr, MapName, sizeof(MapName));
+		if(std::find(ChunkMaps.begin(), ChunkMaps.end(), MapName)!=ChunkMaps.end())
+			return ERR_IN_USE;
+	}
 
 	// 2. Convert the name to UTF8
 	std::string NameUtf8 = TICUtils::WStringToUtf8(Name);
 	
-	// 3. Actually delete
-	if(H5Ldelete(m_hFile, NameUtf8.c_str(), H5P_DEFAULT)<0)
-		return ERR_IN_USE;
+	size_t Savepoint = _TxSavepoint();
+	if(!m_TxActive)
+	{
+		// 3. Actually delete
+		if(H5Ldelete(m_hFile, NameUtf8.c_str(), H5P_DEFAULT)<0)
+			return ERR_IN_USE;
+		for(size_t i = 0; i < ImageNames.size(); i++)
+			_DeleteRangeImage(ImageNames[i].c_str());
+		for(size_t i = 0; i < ChunkMaps.size(); i++)
+			_DeleteChunkMap(ChunkMaps[i].c_str());
+		m_Paths.Erase(NameUtf8);
+	}
+	else
+	{
+		// 3. Keep it in the trash until the transaction commits
+		hid_t trash_id = -1;
+		if((hRes=_OpenSystemGroup(XDX_TRASH_GROUP, trash_id))!=ERR_SUCCESS)
+			return hRes;
+		CloseH5handle(trash_id, H5I_GROUP);
+		char TrashName[64];
+		sprintf_s(TrashName, sizeof(TrashName), "%s/%llx", XDX_TRASH_GROUP, (unsigned long long)++m_TxTrashCounter);
+		if(H5Lmove(m_hFile, NameUtf8.c_str(), m_hFile, TrashName, H5P_DEFAULT, H5P_DEFAULT)<0)
+			return ERR_IN_USE;
+
+		TxRecord Deleted;
+		Deleted.dwOperation = TX_DELETED;
+		Deleted.sPath       = NameUtf8;
+		Deleted.sTarget     = TrashName;
+		Deleted.vImageNames = ImageNames;
+		Deleted.vChunkMaps  = ChunkMaps;
+		m_TxLog.push_back(Deleted);
+		m_Paths.Move(NameUtf8, TrashName);
+	}
+	INFO.FILES_COUNT -= min(INFO.FILES_COUNT, Files);
+	INFO.DIR_COUNT   -= min(INFO.DIR_COUNT, Folders);
 
-	return ERR_SUCCESS;
+	return _TxStatementEnd(ERR_SUCCESS, Savepoint);
 }
 DWORD WINAPI VirtualFS::GetAttributes(LPCWSTR Name, pAttrInfo Attr)
 {
@@ -550,7 +862,7 @@ DWORD WINAPI VirtualFS::GetAttributes(LPCWSTR Name, pAttrInfo Attr)
 	ZeroMemory(Attr, sizeof(AttrInfo));
 	Attr->FileSize = 0;
 
-	CAutoReadLock l(m_Lock);
+	CTimedReadLock l(m_Lock, m_Io.LockWait);
 	if(!IsOpen()) 
 		return ERR_NOT_READY; // the fs is not open
 
@@ -575,11 +887,15 @@ DWORD WINAPI VirtualFS::GetAttributes(LPCWSTR Name, pAttrInfo Attr)
 	if( (hRes=_GetAttributesById(item_id, Attr, (item_type == H5I_GROUP)))!=ERR_SUCCESS)
 	{
 		wchar_t Msg[512] = {0};
-		swprintf_s(Msg, sizeof(Msg)/2, L"Failed to read the iNODE attributes: %ls", ErrorTexts::GetErrorDesc(hRes));
+		swprintf_s(Msg, _countof(Msg), L"Failed to read the iNODE attributes: %ls", ErrorTexts::GetErrorDesc(hRes));
 		ToLog(EV_ERROR, Msg);
 		goto L_DONE;
 	}
-	wcscpy_s(Attr->FileName, sizeof(Attr->FileName)/2, wsItemName);
+	wcscpy_s(Attr->FileName, _countof(Attr->FileName), wsItemName);
+
+	// A file open for writing may have grown since its size was persisted
+	if(item_type == H5I_DATASET)
+		_OpenFileSize(item_id, ".", Attr->FileSize);
 
 
 L_DONE:
@@ -597,34 +913,24 @@ DWORD VirtualFS::_GetAttributesById(hid_t ObjId, pAttrInfo Attr, bool IsGroup)
 	ZeroMemory(Attr, sizeof(AttrInfo));
 	Attr->FileSize = 0;
 
-	if(!IsGroup)
-	{
-		//TODO: Get the size
-		Attr->FileSize = H5Dget_storage_size(ObjId); /// !!! Size rounded to chunks
-	}
 	// If we are here then either a file or folder with such a name exists
 
 	// Prepare the result
 	FileAttributesDos attr;
 	
-	if( (hRes=_ReadAttributeBytes(ObjId, FILE_ATTRIBUTES_DOS, (PBYTE)&attr, sizeof(attr)))!=ERR_SUCCESS)
+	if( (hRes=_ReadFileAttributes(ObjId, ".", attr))!=ERR_SUCCESS)
 		return hRes;
+	if(!IsGroup)
+	{
+		Attr->FileSize = attr.QW_FILE_SIZE;
+		if(attr.QW_FILE_SIZE==FILE_SIZE_UNKNOWN && (hRes=_DatasetSize(ObjId, ".", Attr->FileSize))!=ERR_SUCCESS)
+			return hRes;
+	}
 	Attr->FileAttributes = attr.DW_FILE_ATTRIBUTES;
 	Attr->CreatedBy = attr.QW_CREATED_BY;
 	Attr->CreationTime = attr.QW_CREATION_TIME;
 	Attr->LastAccessTime = attr.QW_ACCESS_TIME;
 	Attr->LastWriteTime = attr.QW_WRITE_TIME;
-	/*
-	if( (hRes=_ReadAttributeBytes(ObjId, DW_FILE_ATTRIBUTES, (PBYTE)&Attr->FileAttributes, sizeof(Attr->FileAttributes)))!=ERR_SUCCESS ||
-		(hRes=_ReadAttributeBytes(ObjId, QW_CREATED_BY, (PBYTE)&Attr->CreatedBy, sizeof(Attr->CreatedBy)))!=ERR_SUCCESS ||
-		(hRes=_ReadAttributeBytes(ObjId, QW_CREATION_TIME, (PBYTE)&Attr->CreationTime, sizeof(Attr->CreationTime)))!=ERR_SUCCESS ||
-		(hRes=_ReadAttributeBytes(ObjId, QW_ACCESS_TIME, (PBYTE)&Attr->LastAccessTime, sizeof(Attr->LastAccessTime)))!=ERR_SUCCESS ||
-		(hRes=_ReadAttributeBytes(ObjId, QW_WRITE_TIME, (PBYTE)&Attr->LastWriteTime, sizeof(Attr->LastWriteTime)))!=ERR_SUCCESS)
-	{
-		return hRes;
-	}*/
-
-
 	return hRes;
 }
 DWORD WINAPI VirtualFS::SetAttributes(LPCWSTR Name, pAttrInfo Attr)
@@ -638,7 +944,7 @@ DWORD WINAPI VirtualFS::FolderCreate(LPCWSTR DirName, UINT64 CreatedBy)
 	std::string Utf8Name;
 	if(DirName == nullptr)
 		return ERR_ERROR_PARAM;
-	CAutoWriteLock l(m_Lock);
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
 	if(!IsOpen()) 
 		return ERR_NOT_READY; // the fs is not open
 
@@ -648,9 +954,9 @@ DWORD WINAPI VirtualFS::FolderCreate(LPCWSTR DirName, UINT64 CreatedBy)
 	if(hRes != ERR_SUCCESS)
 	{
 		wchar_t H5Msg[512] = {0};
-		GetLastErrorDesc(H5Msg, sizeof(H5Msg)/2-1);
+		GetLastErrorDesc(H5Msg, _countof(H5Msg)-1);
 		wchar_t Msg[512] = {0};
-		swprintf_s(Msg, sizeof(Msg)/2, L"Failed to create a folder: %ls", H5Msg);
+		swprintf_s(Msg, _countof(Msg), L"Failed to create a folder: %ls", H5Msg);
 		ToLog(EV_ERROR, Msg);
 		return hRes;
 	}
@@ -671,20 +977,38 @@ DWORD WINAPI VirtualFS::FolderList(LPCWSTR DirName, pAttrInfo *Items, DWORD* Ite
 			if(group_name.length()>0 && group_name[group_name.length()-1]!=L'/')
 				group_name += L"/";
 		}	
-		static herr_t file_info(hid_t loc_id, const char *name, void *opdata)
+		static herr_t file_info(hid_t group_id, const char *name, const H5L_info_t *link, void *opdata)
 		{
 			if(opdata == nullptr)
 				return -1;
 			GroupIterator *me = (GroupIterator *)opdata;
+
+			// The system group is not a part of the FS
+			if(me->group_name==L"/" && strcmp(name, XDX_SYSTEM_GROUP + 1)==0)
+				return 0;
 			
-			// Convert key and value to an AttrInfo record
-			AttrInfo info;
+			// The attributes are read through the link, without resolving the child's path
+			FileAttributesDos attr;
+			if(me->parent->_ReadFileAttributes(group_id, name, attr)!=ERR_SUCCESS)
+				return -1;
 
-			// Convert the name to Unicode
-			std::wstring Utf16Name = me->group_name + TICUtils::Utf8ToWString(name);
+			AttrInfo info;
+			ZeroMemory(&info, sizeof(info));
+			info.FileAttributes = attr.DW_FILE_ATTRIBUTES;
+			info.CreatedBy      = attr.QW_CREATED_BY;
+			info.CreationTime   = attr.QW_CREATION_TIME;
+			info.LastAccessTime = attr.QW_ACCESS_TIME;
+			info.LastWriteTime  = attr.QW_WRITE_TIME;
+			std::wstring Utf16Name = TICUtils::Utf8ToWString(name);
+			wcscpy_s(info.FileName, _countof(info.FileName), Utf16Name.c_str());
+			if(!(attr.DW_FILE_ATTRIBUTES & FILE_ATTRIBUTE_DIRECTORY))
+			{
+				info.FileSize = attr.QW_FILE_SIZE;
+				if(attr.QW_FILE_SIZE==FILE_SIZE_UNKNOWN && me->parent->_DatasetSize(group_id, name, info.FileSize)!=ERR_SUCCESS)
+					return -1;
+				me->parent->_OpenFileSize(group_id, name, info.FileSize);
+			}
 
-			if(me->parent->GetAttributes(Utf16Name.c_str(), &info)!=ERR_SUCCESS)
-				return -1;
 			me->results->push_back(info);
 			return 0;
 		};
@@ -697,7 +1021,7 @@ DWORD WINAPI VirtualFS::FolderList(LPCWSTR DirName, pAttrInfo *Items, DWORD* Ite
 	*ItemCount = 0;
 	*Items     = nullptr;
 
-	CAutoReadLock l(m_Lock);
+	CTimedReadLock l(m_Lock, m_Io.LockWait);
 	
 	if(!IsOpen()) 
 		return ERR_NOT_READY; // the fs is not open
@@ -705,24 +1029,27 @@ DWORD WINAPI VirtualFS::FolderList(LPCWSTR DirName, pAttrInfo *Items, DWORD* Ite
 	// Check that the given name exists
 	hid_t item_id = -1;
 	H5I_type_t item_type = H5I_UNINIT;
-	hRes=_FollowPath(DirName, item_type, item_id);
-	CloseH5handle(item_id, item_type);
-	if(hRes!=ERR_SUCCESS)
+	if((hRes=_FollowPath(DirName, item_type, item_id))!=ERR_SUCCESS)
+	{
+		CloseH5handle(item_id, item_type);
 		return hRes;
+	}
 
 	// Check that it's a group
 	if(item_type != H5I_GROUP)
+	{
+		CloseH5handle(item_id, item_type);
 		return ERR_ERROR_PARAM;
-
-	// Convert the name to utf8
-	std::string Utf8Name = TICUtils::WStringToUtf8(DirName);
+	}
 	
 	// Temporary vector for storing the results
 	std::vector<AttrInfo> Results;
 
-	// Iterate 
+	// Iterate the links of the opened group
 	GroupIterator iterator(this, &Results, DirName);
-	if(H5Giterate(m_hFile, Utf8Name.c_str(), NULL, GroupIterator::file_info, &iterator)<0)
+	herr_t Iterated = H5Literate(item_id, H5_INDEX_NAME, H5_ITER_NATIVE, NULL, GroupIterator::file_info, &iterator);
+	CloseH5handle(item_id, item_type);
+	if(Iterated<0)
 	{
 		hRes = ERR_EMPTY;
 		return hRes;
@@ -747,55 +1074,1225 @@ DWORD WINAPI VirtualFS::FolderList(LPCWSTR DirName, pAttrInfo *Items, DWORD* Ite
 		hRes = ERR_EMPTY;
 	return hRes;
 }
+DWORD VirtualFS::Walk(LPCWSTR Root, WalkCallback Callback, const WalkOptions& Options)
+{
+	// A group stays open while its children wait to be entered
+	// The lock is released between the groups: one left open by a Close meanwhile is gone
+	struct GroupRef
+	{
+		hid_t id;
+		GroupRef(hid_t Id):id(Id){}
+		~GroupRef(){if(id>=0 && H5Iis_valid(id)>0) H5Gclose(id);}
+	};
+	struct Pending
+	{
+		std::shared_ptr<GroupRef> self;    // Set for the root of the walk, opened when it is listed
+		std::shared_ptr<GroupRef> parent;
+		std::string               name;    // Utf8, relative to the parent
+		std::wstring              path;    // With the trailing slash
+		DWORD                     depth;
+	};
+	class Lister
+	{
+	public:
+		VirtualFS*             parent;
+		bool                   is_root;
+		std::vector<WalkEntry> entries;
+		std::vector<std::string> names;
+		DWORD                  result;
+		static herr_t visit(hid_t group_id, const char *name, const H5L_info_t *link, void *opdata)
+		{
+			Lister *me = (Lister *)opdata;
+			// The system group is not a part of the FS
+			if(me->is_root && strcmp(name, XDX_SYSTEM_GROUP + 1)==0)
+				return 0;
+			FileAttributesDos attr;
+			if((me->result=me->parent->_ReadFileAttributes(group_id, name, attr))!=ERR_SUCCESS)
+				return -1;
+			WalkEntry entry;
+			ZeroMemory(&entry.Info, sizeof(entry.Info));
+			entry.Info.FileAttributes = attr.DW_FILE_ATTRIBUTES;
+			entry.Info.CreatedBy      = attr.QW_CREATED_BY;
+			entry.Info.CreationTime   = attr.QW_CREATION_TIME;
+			entry.Info.LastAccessTime = attr.QW_ACCESS_TIME;
+			entry.Info.LastWriteTime  = attr.QW_WRITE_TIME;
+			entry.Path = TICUtils::Utf8ToWString(name);
+			wcscpy_s(entry.Info.FileName, _countof(entry.Info.FileName), entry.Path.c_str());
+			if(!(attr.DW_FILE_ATTRIBUTES & FILE_ATTRIBUTE_DIRECTORY))
+			{
+				entry.Info.FileSize = attr.QW_FILE_SIZE;
+				if(attr.QW_FILE_SIZE==FILE_SIZE_UNKNOWN && (me->result=me->parent->_DatasetSize(group_id, name, entry.Info.FileSize))!=ERR_SUCCESS)
+					return -1;
+			}
+			me->entries.push_back(entry);
+			me->names.push_back(name);
+			return 0;
+		}
+	};
+	// Hands the batches to the callback, a bounded number of them in flight
+	class Dispatcher
+	{
+	public:
+		WalkCallback            callback;
+		WorkerPool*             pool;
+		size_t                  limit;
+		size_t                  in_flight;
+		std::mutex              mutex;
+		std::condition_variable idle;
+		std::atomic<bool>       stop;
+		void post(std::vector<WalkEntry>& Batch)
+		{
+			if(Batch.empty() || stop)
+				return;
+			if(pool==nullptr)
+			{
+				if(!callback(Batch.data(), Batch.size()))
+					stop = true;
+				Batch.clear();
+				return;
+			}
+			auto Shared = std::make_shared<std::vector<WalkEntry>>();
+			Shared->swap(Batch);
+			{
+				std::unique_lock<std::mutex> Lock(mutex);
+				idle.wait(Lock, [this](){return in_flight < limit;});
+				in_flight++;
+			}
+			pool->Submit([this, Shared]()
+			{
+				if(!stop && !callback(Shared->data(), Shared->size()))
+					stop = true;
+				std::lock_guard<std::mutex> Lock(mutex);
+				in_flight--;
+				idle.notify_all();
+			});
+		}
+		void drain()
+		{
+			std::unique_lock<std::mutex> Lock(mutex);
+			idle.wait(Lock, [this](){return in_flight==0;});
+		}
+	};
+	DWORD hRes = ERR_SUCCESS;
+	if(Root==nullptr || !Callback || Options.BatchSize==0)
+		return ERR_ERROR_PARAM;
 
-//***********************************************************************************
-int VirtualFS::OnH5WriteUserBlock(void * Buffer, unsigned int Size)
+	// On a worker of the pool the batches could wait for that very worker, they run inline
+	Dispatcher dispatcher;
+	dispatcher.callback  = Callback;
+	dispatcher.pool      = (Options.Pool!=nullptr && !Options.Pool->IsWorkerThread())?Options.Pool:nullptr;
+	dispatcher.limit     = (dispatcher.pool!=nullptr)?dispatcher.pool->GetThreads()*2:0;
+	dispatcher.in_flight = 0;
+	dispatcher.stop      = false;
+	std::vector<WalkEntry> Batch;
+	std::vector<std::vector<WalkEntry>> Ready;
+	std::vector<Pending> Stack;
+	{
+		CTimedReadLock l(m_Lock, m_Io.LockWait);
+		if(!IsOpen()) 
+			return ERR_NOT_READY; // the fs is not open
+
+		// 1. The root must be a folder
+		hid_t root_id = -1;
+		H5I_type_t root_type = H5I_UNINIT;
+		if((hRes=_FollowPath(Root, root_type, root_id))!=ERR_SUCCESS)
+		{
+			CloseH5handle(root_id, root_type);
+			return hRes;
+		}
+		if(root_type != H5I_GROUP)
+		{
+			CloseH5handle(root_id, root_type);
+			return ERR_ERROR_PARAM;
+		}
+		Pending First;
+		First.self  = std::make_shared<GroupRef>(root_id);
+		First.path  = Root;
+		First.depth = 0;
+		if(First.path.empty() || First.path[First.path.length()-1]!=L'/')
+			First.path += L"/";
+		Stack.push_back(First);
+	}
+
+	// 2. Depth first, so only the groups on the way down stay open. A group is
+	//    listed under the lock and its batches go out without it, so a callback
+	//    may call back into the fs and a writer gets in between the groups.
+	while(!Stack.empty() && !dispatcher.stop)
+	{
+		{
+			CTimedReadLock l(m_Lock, m_Io.LockWait);
+			if(!IsOpen())
+				{hRes = ERR_NOT_READY; break;}
+			Pending Group = Stack.back();
+			Stack.pop_back();
+			// Opened from the parent, which stayed open, even if a callback moved it meanwhile
+			if(!Group.self)
+			{
+				hid_t group_id = H5Gopen2(Group.parent->id, Group.name.c_str(), H5P_DEFAULT);
+				if(group_id<0)
+				{
+					// Deleted by a callback since it was listed
+					if(H5Lexists(Group.parent->id, Group.name.c_str(), H5P_DEFAULT)==0)
+						continue;
+					hRes = ERR_DISK_READ;
+					break;
+				}
+				Group.self = std::make_shared<GroupRef>(group_id);
+			}
+			Group.parent.reset();
+			hid_t group_id = Group.self->id;
+
+			Lister lister;
+			lister.parent  = this;
+			lister.is_root = (Group.path==L"/");
+			lister.result  = ERR_SUCCESS;
+			if(H5Literate(group_id, H5_INDEX_NAME, H5_ITER_NATIVE, NULL, Lister::visit, &lister)<0)
+				{hRes = (lister.result!=ERR_SUCCESS)?lister.result:ERR_DISK_READ; break;}
+
+			DWORD Depth = Group.depth + 1;
+			for(size_t i = 0; i < lister.entries.size(); i++)
+			{
+				WalkEntry& Entry = lister.entries[i];
+				bool IsFolder = (Entry.Info.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)!=0;
+				Entry.Path  = Group.path + Entry.Path;
+				Entry.Depth = Depth;
+				if(!IsFolder)
+					_OpenFileSize(group_id, lister.names[i].c_str(), Entry.Info.FileSize);
+				if(Options.Filter && !Options.Filter(Entry))
+					continue;
+				if(IsFolder && (Options.MaxDepth==0 || Depth < Options.MaxDepth))
+				{
+					Pending Child;
+					Child.parent = Group.self;
+					Child.name   = lister.names[i];
+					Child.path   = Entry.Path + L"/";
+					Child.depth  = Depth;
+					Stack.push_back(Child);
+				}
+				if((Options.Flags & (IsFolder?WALK_FOLDERS:WALK_FILES))==0)
+					continue;
+				Batch.push_back(std::move(Entry));
+				if(Batch.size() >= Options.BatchSize)
+				{
+					Ready.push_back(std::vector<WalkEntry>());
+					Ready.back().swap(Batch);
+				}
+			}
+		}
+		for(auto& iiReady: Ready)
+			dispatcher.post(iiReady);
+		Ready.clear();
+	}
+	{
+		// 3. The groups close with the last references to them, under the lock
+		CTimedReadLock l(m_Lock, m_Io.LockWait);
+		Stack.clear();
+	}
+	dispatcher.post(Batch);
+	dispatcher.drain();
+	return hRes;
+}
+DWORD VirtualFS::RangesStore(HANDLE File, TaggedRanges& Ranges)
 {
-	// This method is called when the userblock is to be written to the H5 file
-	// Here we assume that the INFO struct has the initialized fields, so we read
-	// them and copy AS IS to the H5 driver buffer
+	DWORD hRes = ERR_SUCCESS;
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
+	if(!IsOpen()) 
+		return ERR_NOT_READY; // the fs is not open
 
-	// Make sure that we have enough space
-	if(Size<sizeof(RawFileHeader))
-		return -1;
+	// 1. Find the real handle of a file open for writing
+	auto iiUserHandle = m_UserHandles.find(File);
+	if(iiUserHandle == m_UserHandles.end())
+		return ERR_ERROR_PARAM;
+	if((iiUserHandle->second.fAccessMode & GENERIC_WRITE)==0)
+		return ERR_ACCESS_DENIED;
+	auto iiRealHandle = m_RealHandles.find(iiUserHandle->second.hRealHandle);
+	if(iiRealHandle == m_RealHandles.end())
+		return ERR_EXTERNAL;
 
-	// Fill the block with random data
-	std::srand(static_cast<int>(time(NULL)*(DWORD)Buffer));
-	std::generate((char*)Buffer, (char*)Buffer + Size, std::rand);
+	// 2. Serialize the ranges and store the image
+	RangeImagePtr Image = std::make_shared<RangeImage>();
+	IntervalImage<uint64_t, file_offset_t>::store(Ranges, Image->data);
+	if((hRes=_WriteRangeImage(iiRealHandle->second.rawHandle, Image->data))!=ERR_SUCCESS)
+	{
+		wchar_t Msg[512] = {0};
+		swprintf_s(Msg, _countof(Msg), L"Failed to store the file ranges: %ls", ErrorTexts::GetErrorDesc(hRes));
+		ToLog(EV_ERROR, Msg);
+		return hRes;
+	}
 
-	// Prepare the data
-	RawFileHeader fh;
-	// Fill the struct with dummydata
-	ZeroMemory(&fh, sizeof(RawFileHeader));
-	//std::generate((char*)&fh, (char*)&fh + sizeof(RawFileHeader), std::rand);
+	_CompactTouch(iiRealHandle->second.objAddr);
 
-	// Copy the the INFO struct fields to raw header
-	fh.Version          = FS_VERSION_ID;
-	fh.Version          = INFO.FS_VERSION; 
-	fh.BlockSize        = INFO.BLOCK_SIZE; 
-	fh.IsEncrypted      = INFO.IS_ENCRYPTED; 
-	fh.KeyEncodeMode    = INFO.KEY_ENC_MODE; 
-	fh.KeyEncodeAParam  = INFO.KEY_ENC_APARAM; 
-	fh.KeyEncodeBParam  = INFO.KEY_ENC_BPARAM; 
-	fh.DataEncodeMode   = INFO.DAT_ENC_MODE; 
-	fh.DataEncodeAParam = INFO.DAT_ENC_APARAM; 
-	fh.DataEncodeBParam = INFO.DAT_ENC_BPARAM; 
-	strcpy(fh.Signature,  XDX_SIGNATURE);
-	memcpy(fh.MKey,       INFO.MKEY,      MASTER_KEY_LEN);
-	memcpy(fh.MKeyHash,   INFO.MKEY_HASH, 16);       
-	memcpy(fh.IV,         INFO.IV,        MASTER_KEY_LEN); 
+	// 3. The stored image replaces the loaded one
+	if(!Image->view.attach(Image->data.data(), Image->data.size()*sizeof(uint64_t)))
+		return ERR_EXTERNAL;
+	iiRealHandle->second.rangeImage = Image;
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::RangesFind(HANDLE File, UINT64 Offset, UINT64 Length, std::vector<TaggedRange>& Found)
+{
+	Found.clear();
+	if(Length==0 || Offset > (UINT64)XHDF5_MAXADDR)
+		return ERR_ERROR_PARAM;
+	CTimedReadLock l(m_Lock, m_Io.LockWait);
+	if(!IsOpen()) 
+		return ERR_NOT_READY; // the fs is not open
 
-	// Copy it to the driver buffer
-	memcpy(Buffer, &fh, sizeof(RawFileHeader));
+	auto iiUserHandle = m_UserHandles.find(File);
+	if(iiUserHandle == m_UserHandles.end())
+		return ERR_ERROR_PARAM;
+	auto iiRealHandle = m_RealHandles.find(iiUserHandle->second.hRealHandle);
+	if(iiRealHandle == m_RealHandles.end())
+		return ERR_EXTERNAL;
+	RangeImagePtr Image = iiRealHandle->second.rangeImage;
+	if(!Image)
+		return ERR_EMPTY;
 
-	return 0;
+	// The image is queried in place, the ranges are closed intervals
+	file_offset_t Start = (file_offset_t)Offset;
+	file_offset_t Stop  = (Length - 1 > (UINT64)XHDF5_MAXADDR - Offset)?(file_offset_t)XHDF5_MAXADDR:(file_offset_t)(Offset + Length - 1);
+	for(const auto& Range: Image->view.overlapping(Start, Stop))
+	{
+		TaggedRange Item = {Range.start, Range.stop, Range.value};
+		Found.push_back(Item);
+	}
+	return Found.empty()?ERR_EMPTY:ERR_SUCCESS;
 }
-int VirtualFS::OnH5ReadUserBlock(void * Buffer, unsigned int Size)
-{	
-	// Make sure that we have enough data to parse
-	if(Size<sizeof(RawFileHeader))
-		return -1;	
-	// Read the data
+DWORD VirtualFS::GetSpaceStats(SpaceStats& Stats)
+{
+	class SpaceCounter
+	{
+	public:
+		VirtualFS*  parent;
+		SpaceStats* stats;
+		static herr_t visit(hid_t obj_id, const char *name, const H5O_info_t *info, void *opdata)
+		{
+			SpaceCounter *me = (SpaceCounter *)opdata;
+			me->stats->META_BYTES += info->hdr.space.total +
+				info->meta_size.obj.index_size + info->meta_size.obj.heap_size +
+				info->meta_size.attr.index_size + info->meta_size.attr.heap_size;
+			if(info->type!=H5O_TYPE_DATASET)
+				return 0;
+			hid_t dataset_id = H5Dopen2(obj_id, name, H5P_DEFAULT);
+			if(dataset_id<0)
+				return -1;
+			me->stats->DATA_BYTES += H5Dget_storage_size(dataset_id);
+			// The data of an inline file is a part of its header
+			UINT64 Inline = 0;
+			if(me->parent->_InlineLayout(dataset_id, Inline)==ERR_SUCCESS && Inline>0)
+				me->stats->META_BYTES -= min(me->stats->META_BYTES, (UINT64)H5Dget_storage_size(dataset_id));
+			// The range images and other system datasets have no attributes record
+			FileAttributesDos attr;
+			UINT64 FileSize = 0;
+			if(me->parent->_ReadFileAttributes(dataset_id, ".", attr)==ERR_SUCCESS)
+			{
+				FileSize = attr.QW_FILE_SIZE;
+				if(FileSize==FILE_SIZE_UNKNOWN && me->parent->_DatasetSize(dataset_id, ".", FileSize)!=ERR_SUCCESS)
+					FileSize = 0;
+			}
+			me->stats->LOGICAL_BYTES += FileSize;
+			H5Dclose(dataset_id);
+			return 0;
+		}
+	};
+	ZeroMemory(&Stats, sizeof(Stats));
+	CTimedReadLock l(m_Lock, m_Io.LockWait);
+	if(!IsOpen()) 
+		return ERR_NOT_READY; // the fs is not open
+
+	// 1. The file and the free space manager
+	hsize_t  FileSize  = 0;
+	hssize_t FreeSpace = H5Fget_freespace(m_hFile);
+	if(FreeSpace<0 || H5Fget_filesize(m_hFile, &FileSize)<0)
+		return ERR_DISK_READ;
+	Stats.FILE_BYTES = FileSize;
+	Stats.FREE_BYTES = FreeSpace;
+	hssize_t Sections = H5Fget_free_sections(m_hFile, H5FD_MEM_DEFAULT, 0, NULL);
+	if(Sections>0)
+	{
+		std::vector<H5F_sect_info_t> Info((size_t)Sections);
+		Sections = H5Fget_free_sections(m_hFile, H5FD_MEM_DEFAULT, Info.size(), Info.data());
+		for(hssize_t i = 0; i < Sections; i++)
+			Stats.LARGEST_FREE = max(Stats.LARGEST_FREE, (UINT64)Info[(size_t)i].size);
+		Stats.FREE_SECTIONS = max(Sections, (hssize_t)0);
+	}
+
+	// 2. Every object, including the system ones
+	SpaceCounter counter;
+	counter.parent = this;
+	counter.stats  = &Stats;
+	Stats.META_BYTES = INFO.BLOCK_SIZE; // The user block
+	if(H5Ovisit(m_hRoot, H5_INDEX_NAME, H5_ITER_NATIVE, SpaceCounter::visit, &counter)<0)
+		return ERR_DISK_READ;
+
+	// 3. The rest is not reachable from any object
+	UINT64 Accounted = Stats.DATA_BYTES + Stats.META_BYTES + Stats.FREE_BYTES;
+	Stats.DEAD_BYTES = (Stats.FILE_BYTES > Accounted)?Stats.FILE_BYTES - Accounted:0;
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::GetIoStats(IoStats& Stats)
+{
+	Stats.BLOCK_READS     = m_Io.BlockReads.load(std::memory_order_relaxed);
+	Stats.BLOCK_WRITES    = m_Io.BlockWrites.load(std::memory_order_relaxed);
+	Stats.BYTES_READ      = m_Io.BytesRead.load(std::memory_order_relaxed);
+	Stats.BYTES_WRITTEN   = m_Io.BytesWritten.load(std::memory_order_relaxed);
+	Stats.CACHE_HITS      = m_Io.CacheHits.load(std::memory_order_relaxed);
+	Stats.BYTES_DECRYPTED = m_Io.BytesDecrypted.load(std::memory_order_relaxed);
+	Stats.BYTES_ENCRYPTED = m_Io.BytesEncrypted.load(std::memory_order_relaxed);
+	Stats.SEEKS           = m_Io.Seeks.load(std::memory_order_relaxed);
+	Stats.ALLOCS          = m_Io.Allocs.load(std::memory_order_relaxed);
+	Stats.ALLOC_BYTES     = m_Io.AllocBytes.load(std::memory_order_relaxed);
+	Stats.FLUSHES         = m_Io.Flushes.load(std::memory_order_relaxed);
+	Stats.TRUNCATES       = m_Io.Truncates.load(std::memory_order_relaxed);
+	_LatencyStats(m_Io.ReadTime,  Stats.READ);
+	_LatencyStats(m_Io.WriteTime, Stats.WRITE);
+	_LatencyStats(m_Io.FlushTime, Stats.FLUSH);
+	_LatencyStats(m_Io.LockWait,  Stats.LOCK_WAIT);
+	return ERR_SUCCESS;
+}
+void VirtualFS::DumpIoStats()
+{
+	IoStats Stats;
+	GetIoStats(Stats);
+	// The latencies as p50/p99/max in microseconds
+	wchar_t Msg[1024];
+	swprintf_s(Msg, _countof(Msg),
+		L"I/O: %llu blocks read (%llu cached), %llu written, %llu/%llu bytes read/written, "
+		L"%llu/%llu bytes decrypted/encrypted, %llu seeks, %llu allocs (%llu bytes), %llu flushes, %llu truncates; "
+		L"read %llu/%llu/%llu us, write %llu/%llu/%llu us, flush %llu/%llu/%llu us, lock wait %llu/%llu/%llu us",
+		(unsigned long long)Stats.BLOCK_READS, (unsigned long long)Stats.CACHE_HITS, (unsigned long long)Stats.BLOCK_WRITES,
+		(unsigned long long)Stats.BYTES_READ, (unsigned long long)Stats.BYTES_WRITTEN,
+		(unsigned long long)Stats.BYTES_DECRYPTED, (unsigned long long)Stats.BYTES_ENCRYPTED,
+		(unsigned long long)Stats.SEEKS, (unsigned long long)Stats.ALLOCS, (unsigned long long)Stats.ALLOC_BYTES,
+		(unsigned long long)Stats.FLUSHES, (unsigned long long)Stats.TRUNCATES,
+		(unsigned long long)Stats.READ.P50_NS/1000, (unsigned long long)Stats.READ.P99_NS/1000, (unsigned long long)Stats.READ.MAX_NS/1000,
+		(unsigned long long)Stats.WRITE.P50_NS/1000, (unsigned long long)Stats.WRITE.P99_NS/1000, (unsigned long long)Stats.WRITE.MAX_NS/1000,
+		(unsigned long long)Stats.FLUSH.P50_NS/1000, (unsigned long long)Stats.FLUSH.P99_NS/1000, (unsigned long long)Stats.FLUSH.MAX_NS/1000,
+		(unsigned long long)Stats.LOCK_WAIT.P50_NS/1000, (unsigned long long)Stats.LOCK_WAIT.P99_NS/1000, (unsigned long long)Stats.LOCK_WAIT.MAX_NS/1000);
+	ToLog(Logs::EV_INFO, Msg);
+}
+DWORD VirtualFS::Compact(LPCWSTR FileName, UINT64 BytesPerSecond)
+{
+	const UINT64 Step = 4*1024*1024; // Copied per locked step, the writers go on in between
+	class Compactor
+	{
+	public:
+		struct Item
+		{
+			H5O_type_t type;
+			haddr_t    addr;   // In the source
+		};
+		typedef std::vector<std::pair<std::string, Item>> ListT;
+		typedef std::map<std::string, Item>               CopiedT;
+		VirtualFS*    parent;
+		CompactState* state;
+		hid_t         ocpypl;
+		hid_t         lcpl;
+		hid_t         dos_type;
+		UINT64        bytes;
+		ListT         listed;   // The objects of the source, parents first
+		CopiedT       copied;   // The objects of the target as they were copied
+		std::unordered_map<haddr_t, std::string> names;  // The names of the copies by the source address
+
+		static herr_t list(hid_t obj_id, const char *name, const H5O_info_t *info, void *opdata)
+		{
+			Compactor *me = (Compactor *)opdata;
+			// The root is copied by the caller, the system group is rebuilt
+			size_t SystemLen = strlen(XDX_SYSTEM_GROUP + 1);
+			if(strcmp(name, ".")==0 ||
+				strncmp(name, XDX_SYSTEM_GROUP + 1, SystemLen)==0 && (name[SystemLen]==0 || name[SystemLen]=='/'))
+				return 0;
+			if(info->type!=H5O_TYPE_GROUP && info->type!=H5O_TYPE_DATASET)
+				return 0;
+			Item item = {info->type, info->addr};
+			me->listed.push_back(std::make_pair(std::string(name), item));
+			return 0;
+		}
+		// Copies a listed object as it is now, one gone meanwhile is left to catchUp
+		DWORD copy(const std::string& Name, const Item& Listed)
+		{
+			DWORD hRes = ERR_SUCCESS;
+			hid_t target = state->target;
+			H5O_info_t info;
+			if(H5Oget_info_by_name(parent->m_hRoot, Name.c_str(), &info, H5P_DEFAULT)<0 || info.addr!=Listed.addr || info.type!=Listed.type)
+				return ERR_SUCCESS;
+			if(Listed.type==H5O_TYPE_GROUP)
+			{
+				// The members follow one by one, so only the group and its attributes are made here.
+				// A group copied before takes the attributes again.
+				hid_t src = H5Gopen2(parent->m_hRoot, Name.c_str(), H5P_DEFAULT);
+				hid_t dst = -1;
+				if(src>=0)
+					dst = (copied.count(Name)>0)?H5Gopen2(target, Name.c_str(), H5P_DEFAULT):H5Gcreate2(target, Name.c_str(), lcpl, H5P_DEFAULT, H5P_DEFAULT);
+				hRes = (dst<0)?ERR_DISK_WRITE:parent->_CopyAttributes(src, dst, dos_type);
+				if(dst>=0)
+					H5Gclose(dst);
+				if(src>=0)
+					H5Gclose(src);
+			}
+			else
+			{
+				// A file is rewritten into freshly allocated chunks, over its previous copy
+				if(copied.count(Name)>0 && (hRes=remove(Name))!=ERR_SUCCESS)
+					return hRes;
+				if(H5Ocopy(parent->m_hRoot, Name.c_str(), target, Name.c_str(), ocpypl, lcpl)<0)
+					return ERR_DISK_WRITE;
+				hid_t src = H5Dopen2(parent->m_hRoot, Name.c_str(), H5P_DEFAULT);
+				hid_t dst = H5Dopen2(target, Name.c_str(), H5P_DEFAULT);
+				if(src<0 || dst<0)
+					hRes = ERR_DISK_READ;
+				else
+				{
+					bytes += H5Dget_storage_size(src);
+					hRes = moveRanges(src, dst);
+				}
+				if(dst>=0)
+					H5Dclose(dst);
+				if(src>=0)
+					H5Dclose(src);
+			}
+			if(hRes!=ERR_SUCCESS)
+				return hRes;
+			// Whatever the writers did before is in the copy now
+			copied[Name] = Listed;
+			names[Listed.addr] = Name;
+			state->changed.erase(Listed.addr);
+			return ERR_SUCCESS;
+		}
+		// Drops the copy of Name, a folder with everything under it
+		DWORD remove(const std::string& Name)
+		{
+			hid_t target = state->target;
+			H5O_info_t info;
+			if(H5Oget_info_by_name(target, Name.c_str(), &info, H5P_DEFAULT)>=0)
+			{
+				if(H5Ovisit_by_name(target, Name.c_str(), H5_INDEX_NAME, H5_ITER_NATIVE, dropRanges, this, H5P_DEFAULT)<0 ||
+					H5Ldelete(target, Name.c_str(), H5P_DEFAULT)<0)
+					return ERR_DISK_WRITE;
+			}
+			std::vector<std::string> Gone;
+			subtree(Name, Gone);
+			for(size_t i = 0; i < Gone.size(); i++)
+			{
+				auto iiName = names.find(copied[Gone[i]].addr);
+				if(iiName!=names.end() && iiName->second==Gone[i])
+					names.erase(iiName);
+				copied.erase(Gone[i]);
+			}
+			return ERR_SUCCESS;
+		}
+		// Moves the copy of From to To with everything under it
+		DWORD move(const std::string& From, const std::string& To)
+		{
+			hid_t target = state->target;
+			if(H5Lmove(target, From.c_str(), target, To.c_str(), lcpl, H5P_DEFAULT)<0)
+				return ERR_DISK_WRITE;
+			std::vector<std::string> Moved;
+			subtree(From, Moved);
+			for(size_t i = 0; i < Moved.size(); i++)
+			{
+				std::string NewName = To + Moved[i].substr(From.length());
+				Item item = copied[Moved[i]];
+				copied.erase(Moved[i]);
+				copied[NewName] = item;
+				names[item.addr] = NewName;
+			}
+			return ERR_SUCCESS;
+		}
+		// The copied names of Name and of everything under it
+		void subtree(const std::string& Name, std::vector<std::string>& Names)
+		{
+			if(copied.count(Name)>0)
+				Names.push_back(Name);
+			std::string Prefix = Name + "/";
+			for(auto iiCopied = copied.lower_bound(Prefix); iiCopied!=copied.end() && iiCopied->first.compare(0, Prefix.length(), Prefix)==0; iiCopied++)
+				Names.push_back(iiCopied->first);
+		}
+		// Brings the changes made since the objects were copied, called with the writers held
+		DWORD catchUp()
+		{
+			DWORD hRes = ERR_SUCCESS;
+			listed.clear();
+			if(H5Ovisit(parent->m_hRoot, H5_INDEX_NAME, H5_ITER_INC, list, this)<0)
+				return ERR_DISK_READ;
+			std::set<std::string> live;
+			for(size_t i = 0; i < listed.size(); i++)
+				live.insert(listed[i].first);
+			for(size_t i = 0; i < listed.size() && hRes==ERR_SUCCESS; i++)
+			{
+				const std::string& Name = listed[i].first;
+				const Item&        Live = listed[i].second;
+				auto iiCopied = copied.find(Name);
+				// Another object took the name
+				if(iiCopied!=copied.end() && (iiCopied->second.type!=Live.type || iiCopied->second.addr!=Live.addr))
+				{
+					if((hRes=remove(Name))!=ERR_SUCCESS)
+						break;
+					iiCopied = copied.end();
+				}
+				// A moved object takes its copy along
+				auto iiName = names.find(Live.addr);
+				if(iiCopied==copied.end() && iiName!=names.end() && live.count(iiName->second)==0 && copied[iiName->second].type==Live.type)
+				{
+					if((hRes=move(std::string(iiName->second), Name))!=ERR_SUCCESS)
+						break;
+					iiCopied = copied.find(Name);
+				}
+				if(iiCopied==copied.end() || state->changed.count(Live.addr)>0)
+					hRes = copy(Name, Live);
+			}
+			// The deleted objects go, a folder with its content
+			std::vector<std::string> Gone;
+			for(auto iiCopied = copied.begin(); iiCopied != copied.end(); iiCopied++)
+			{
+				if(live.count(iiCopied->first)==0)
+					Gone.push_back(iiCopied->first);
+			}
+			for(size_t i = 0; i < Gone.size() && hRes==ERR_SUCCESS; i++)
+			{
+				if(copied.count(Gone[i])>0)
+					hRes = remove(Gone[i]);
+			}
+			return hRes;
+		}
+		static herr_t dropRanges(hid_t obj_id, const char *name, const H5O_info_t *info, void *opdata)
+		{
+			Compactor *me = (Compactor *)opdata;
+			if(info->type!=H5O_TYPE_DATASET)
+				return 0;
+			char Name[64];
+			sprintf_s(Name, sizeof(Name), "%s/%llx", XDX_RANGES_GROUP, (unsigned long long)info->addr);
+			if(!me->drop(XDX_RANGES_GROUP, Name))
+				return -1;
+			me->parent->_ChunkMapName(info->addr, Name, sizeof(Name));
+			return me->drop(XDX_MAPS_GROUP, Name)?0:-1;
+		}
+		bool drop(const char* Group, const char* Name)
+		{
+			hid_t target = state->target;
+			if(H5Lexists(target, XDX_SYSTEM_GROUP, H5P_DEFAULT)<=0 ||
+				H5Lexists(target, Group, H5P_DEFAULT)<=0 ||
+				H5Lexists(target, Name, H5P_DEFAULT)<=0)
+				return true;
+			return H5Ldelete(target, Name, H5P_DEFAULT)>=0;
+		}
+		DWORD moveRanges(hid_t src, hid_t dst)
+		{
+			// The images are named by the object address, which the copy changes
+			char SrcImage[64], DstImage[64];
+			DWORD hRes = ERR_SUCCESS;
+			if((hRes=parent->_RangeImageName(src, SrcImage, sizeof(SrcImage)))!=ERR_SUCCESS ||
+				(hRes=parent->_RangeImageName(dst, DstImage, sizeof(DstImage)))!=ERR_SUCCESS)
+				return hRes;
+			if((hRes=moveByAddress(XDX_RANGES_GROUP, SrcImage, DstImage))!=ERR_SUCCESS)
+				return hRes;
+			// So are the chunk lists
+			H5O_info_t SrcInfo, DstInfo;
+			if(H5Oget_info(src, &SrcInfo)<0 || H5Oget_info(dst, &DstInfo)<0)
+				return ERR_DISK_READ;
+			parent->_ChunkMapName(SrcInfo.addr, SrcImage, sizeof(SrcImage));
+			parent->_ChunkMapName(DstInfo.addr, DstImage, sizeof(DstImage));
+			return moveByAddress(XDX_MAPS_GROUP, SrcImage, DstImage);
+		}
+		DWORD moveByAddress(const char* Group, const char* SrcName, const char* DstName)
+		{
+			if(H5Lexists(parent->m_hFile, XDX_SYSTEM_GROUP, H5P_DEFAULT)<=0 ||
+				H5Lexists(parent->m_hFile, Group, H5P_DEFAULT)<=0 ||
+				H5Lexists(parent->m_hFile, SrcName, H5P_DEFAULT)<=0)
+				return ERR_SUCCESS;
+			return (H5Ocopy(parent->m_hFile, SrcName, state->target, DstName, ocpypl, lcpl)<0)?ERR_DISK_WRITE:ERR_SUCCESS;
+		}
+		// Copies a whole system record over its previous copy
+		DWORD copyRecord(const char* Name)
+		{
+			hid_t target = state->target;
+			if(H5Lexists(target, XDX_SYSTEM_GROUP, H5P_DEFAULT)>0 && H5Lexists(target, Name, H5P_DEFAULT)>0 &&
+				H5Ldelete(target, Name, H5P_DEFAULT)<0)
+				return ERR_DISK_WRITE;
+			if(H5Lexists(parent->m_hFile, XDX_SYSTEM_GROUP, H5P_DEFAULT)<=0 ||
+				H5Lexists(parent->m_hFile, Name, H5P_DEFAULT)<=0)
+				return ERR_SUCCESS;
+			return (H5Ocopy(parent->m_hFile, Name, target, Name, ocpypl, lcpl)<0)?ERR_DISK_WRITE:ERR_SUCCESS;
+		}
+	};
+	DWORD hRes = ERR_SUCCESS;
+	if(FileName==nullptr || wcslen(FileName)<3)
+		return ERR_ERROR_PARAM;
+	wchar_t UnicodePath[MAX_PATH]={0};
+	CompactState Track;
+	std::unique_ptr<XHdf5::BlockDriver> Driver;
+	hid_t fcpl = -1, fapl = -1, root = -1;
+	size_t Next = 0;
+	UINT64 Started = GetTickCount64();
+	bool   Chunks  = false, Done = false;
+	Compactor compactor;
+	compactor.parent   = this;
+	compactor.state    = &Track;
+	compactor.ocpypl   = -1;
+	compactor.lcpl     = -1;
+	compactor.dos_type = -1;
+	compactor.bytes    = 0;
+	{
+		// 1. Whatever is kept in memory goes to the source first
+		CTimedWriteLock w(m_Lock, m_Io.LockWait);
+		if(!IsOpen()) 
+			return ERR_NOT_READY; // the fs is not open
+		// The copy would get the blocks of a rotation under either key
+		if(m_TxActive || m_Compacting!=nullptr || m_Rekey!=nullptr)
+			return ERR_IN_USE;
+		if((hRes=_FlushFileSizes())!=ERR_SUCCESS || (hRes=_FlushMeta())!=ERR_SUCCESS)
+			return hRes;
+
+		// 2. The new container must not exist
+		_ContainerPath(FileName, UnicodePath, _countof(UnicodePath), Track.AnsiPath, sizeof(Track.AnsiPath));
+		if(Platform::FileExists(Track.AnsiPath))
+			return ERR_DUPLICATE;
+
+		// 3. Create it with the same header, so it opens with the same password and keys.
+		//    A Close between the steps closes it with all its objects.
+		Driver.reset(new XHdf5::BlockDriver(INFO.BLOCK_SIZE, 0, this));
+		if((fcpl = H5Pcreate(H5P_FILE_CREATE))<0 || H5Pset_userblock(fcpl, INFO.BLOCK_SIZE)<0 ||
+			(fapl = H5Pcreate(H5P_FILE_ACCESS))<0 || H5Pset_fclose_degree(fapl, H5F_CLOSE_STRONG)<0 || Driver->Attach(fapl)<0)
+			{hRes = ERR_EXTERNAL; goto L_SETUP;}
+		if((Track.target = H5Fcreate(Track.AnsiPath, H5F_ACC_EXCL, fcpl, fapl))<0)
+			{hRes = ERR_DISK_WRITE; goto L_SETUP;}
+
+		// 4. The shared attribute type comes first, the copies merge into it
+		if((compactor.lcpl = H5Pcreate(H5P_LINK_CREATE))<0 ||
+			H5Pset_char_encoding(compactor.lcpl, H5T_CSET_UTF8)<0 ||
+			H5Pset_create_intermediate_group(compactor.lcpl, 1)<0 ||
+			(compactor.dos_type = H5Tcopy(m_hDosType))<0 ||
+			H5Tcommit2(Track.target, XDX_DOS_TYPE, compactor.dos_type, compactor.lcpl, H5P_DEFAULT, H5P_DEFAULT)<0 ||
+			(compactor.ocpypl = H5Pcreate(H5P_OBJECT_COPY))<0 ||
+			H5Pset_copy_object(compactor.ocpypl, H5O_COPY_MERGE_COMMITTED_DTYPE_FLAG)<0 ||
+			H5Padd_merge_committed_dtype_path(compactor.ocpypl, XDX_DOS_TYPE)<0)
+			{hRes = ERR_DISK_WRITE; goto L_SETUP;}
+
+		// 5. The objects to copy, the writers coming later are tracked
+		if(H5Ovisit(m_hRoot, H5_INDEX_NAME, H5_ITER_INC, Compactor::list, &compactor)<0)
+			{hRes = ERR_DISK_READ; goto L_SETUP;}
+		m_Compacting = &Track;
+	L_SETUP:
+		if(hRes!=ERR_SUCCESS && Track.target>=0)
+		{
+			if(compactor.dos_type>=0)
+				H5Tclose(compactor.dos_type);
+			H5Fclose(Track.target);
+			Platform::FileDelete(Track.AnsiPath);
+			Track.target = -1;
+		}
+	}
+	if(hRes!=ERR_SUCCESS)
+		goto L_DONE;
+
+	// 6. Every live object in steps, the chunk store first as it is shared by the files
+	while(hRes==ERR_SUCCESS && !Done)
+	{
+		{
+			CTimedReadLock l(m_Lock, m_Io.LockWait);
+			if(m_Compacting!=&Track)
+				{hRes = ERR_NOT_READY; break;}
+			UINT64 StepEnd = compactor.bytes + Step;
+			if(!Chunks)
+			{
+				hRes   = compactor.copyRecord(XDX_CHUNKS_GROUP);
+				Chunks = true;
+			}
+			for(; hRes==ERR_SUCCESS && Next < compactor.listed.size() && compactor.bytes < StepEnd; Next++)
+				hRes = compactor.copy(compactor.listed[Next].first, compactor.listed[Next].second);
+			Done = (Next==compactor.listed.size());
+		}
+		_Throttle(Started, compactor.bytes, BytesPerSecond);
+	}
+
+	// 7. The changes made meanwhile and the records of the whole container, with the writers held
+	{
+		CTimedWriteLock w(m_Lock, m_Io.LockWait);
+		if(m_Compacting!=&Track)
+		{
+			// Closed meanwhile together with the target
+			if(hRes==ERR_SUCCESS)
+				hRes = ERR_NOT_READY;
+			goto L_DONE;
+		}
+		if(hRes==ERR_SUCCESS)
+			hRes = _FlushFileSizes();
+		if(hRes==ERR_SUCCESS)
+			hRes = _FlushMeta();
+		if(hRes==ERR_SUCCESS)
+			hRes = compactor.catchUp();
+		if(hRes==ERR_SUCCESS && Track.chunks)
+			hRes = compactor.copyRecord(XDX_CHUNKS_GROUP);
+		// The path index is the same, the paths do not change. It goes over stored
+		// with its record, the source is armed again once the record is copied.
+		bool Stored = false;
+		if(hRes==ERR_SUCCESS && m_Paths.IsEnabled() && (hRes=_StorePathIndex(false))==ERR_SUCCESS)
+		{
+			Stored = true;
+			hRes   = compactor.copyRecord(XDX_PATHS);
+		}
+		if(hRes==ERR_SUCCESS && ((root = H5Gopen2(Track.target, "/", H5P_DEFAULT))<0 ||
+			(hRes=_CopyAttributes(m_hRoot, root, compactor.dos_type))!=ERR_SUCCESS))
+		{
+			if(hRes==ERR_SUCCESS)
+				hRes = ERR_DISK_WRITE;
+		}
+		CloseH5handle(root, H5I_GROUP);
+		if(Stored && _ArmPathIndex(m_PathsGen)!=ERR_SUCCESS && hRes==ERR_SUCCESS)
+			hRes = ERR_DISK_WRITE;
+		if(hRes==ERR_SUCCESS && H5Fflush(Track.target, H5F_SCOPE_LOCAL)<0)
+			hRes = ERR_DISK_WRITE;
+		m_Compacting = nullptr;
+		// Closed with the keys of the source still there
+		if(compactor.dos_type>=0)
+			H5Tclose(compactor.dos_type);
+		if(Track.target>=0 && H5Fclose(Track.target)<0 && hRes==ERR_SUCCESS)
+			hRes = ERR_DISK_WRITE;
+		if(hRes!=ERR_SUCCESS && Track.target>=0)
+			Platform::FileDelete(Track.AnsiPath);
+		Track.target = -1;
+	}
+L_DONE:
+	CloseH5handle(compactor.ocpypl, H5I_GENPROP_LST);
+	CloseH5handle(compactor.lcpl, H5I_GENPROP_LST);
+	CloseH5handle(fapl, H5I_GENPROP_LST);
+	CloseH5handle(fcpl, H5I_GENPROP_LST);
+	if(hRes!=ERR_SUCCESS)
+	{
+		wchar_t Msg[512] = {0};
+		swprintf_s(Msg, _countof(Msg), L"Failed to compact the file system into \"%ls\": %ls", FileName, ErrorTexts::GetErrorDesc(hRes));
+		ToLog(EV_ERROR, Msg);
+	}
+	return hRes;
+}
+DWORD VirtualFS::Snapshot(LPCWSTR FileName, UINT64 BytesPerSecond)
+{
+	const size_t Step = 1024*1024; // Copied per step, the writers preserve their blocks in between
+	DWORD hRes = ERR_SUCCESS;
+	if(FileName==nullptr || wcslen(FileName)<3)
+		return ERR_ERROR_PARAM;
+	wchar_t UnicodePath[MAX_PATH]={0};
+	char AnsiPath[MAX_PATH]={0};
+	char SourcePath[MAX_PATH]={0};
+	std::unique_ptr<XHdf5::BlockSnapshot> Snapshot;
+	{
+		// 1. The point in time: whatever is kept in memory goes to the disk, then the image is taken
+		CTimedWriteLock w(m_Lock, m_Io.LockWait);
+		if(!IsOpen()) 
+			return ERR_NOT_READY; // the fs is not open
+		// Mid-rotation the image would need the journal as well
+		if(m_TxActive || m_Snapshot!=nullptr || m_Rekey!=nullptr)
+			return ERR_IN_USE;
+		_ContainerPath(FileName, UnicodePath, _countof(UnicodePath), AnsiPath, sizeof(AnsiPath));
+		if(H5Fget_name(m_hFile, SourcePath, sizeof(SourcePath))<0)
+			return ERR_EXTERNAL;
+		if(_stricmp(SourcePath, AnsiPath)==0)
+			return ERR_ERROR_PARAM;
+		if((hRes=_FlushFileSizes())!=ERR_SUCCESS || (hRes=_FlushMeta())!=ERR_SUCCESS)
+			return hRes;
+		if(H5Fflush(m_hFile, H5F_SCOPE_GLOBAL)<0)
+			return ERR_DISK_WRITE;
+		Snapshot.reset(new XHdf5::BlockSnapshot(INFO.BLOCK_SIZE));
+		if(Snapshot->Open(SourcePath, AnsiPath)<0)
+			hRes = ERR_DISK_WRITE;
+		else if(!Snapshot->IsCloned())
+			m_Snapshot = Snapshot.get();
+	}
+
+	// 2. Streamed without the lock, unless the file system did it already
+	UINT64 Started = GetTickCount64(), Bytes = 0;
+	while(hRes==ERR_SUCCESS && !Snapshot->IsDone())
+	{
+		size_t Copied = 0;
+		if(Snapshot->CopyNext(Step, &Copied)<0)
+			hRes = ERR_DISK_WRITE;
+		Bytes += Copied;
+		_Throttle(Started, Bytes, BytesPerSecond);
+	}
+	if(hRes==ERR_SUCCESS && Snapshot->IsFailed())
+		hRes = ERR_DISK_WRITE;
+	{
+		CTimedWriteLock w(m_Lock, m_Io.LockWait);
+		if(m_Snapshot==Snapshot.get())
+			m_Snapshot = nullptr;
+	}
+	if(Snapshot && Snapshot->Close()<0 && hRes==ERR_SUCCESS)
+		hRes = ERR_DISK_WRITE;
+	if(hRes!=ERR_SUCCESS)
+	{
+		wchar_t Msg[512] = {0};
+		swprintf_s(Msg, _countof(Msg), L"Failed to snapshot the file system into \"%ls\": %ls", FileName, ErrorTexts::GetErrorDesc(hRes));
+		ToLog(EV_ERROR, Msg);
+	}
+	return hRes;
+}
+DWORD VirtualFS::ReplicationStart(LPCWSTR LogName)
+{
+	DWORD hRes = ERR_SUCCESS;
+	if(LogName==nullptr || wcslen(LogName)<3)
+		return ERR_ERROR_PARAM;
+	wchar_t UnicodePath[MAX_PATH]={0};
+	char AnsiPath[MAX_PATH]={0};
+	_ContainerPath(LogName, UnicodePath, _countof(UnicodePath), AnsiPath, sizeof(AnsiPath), L"xlog");
+
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
+	if(!IsOpen()) 
+		return ERR_NOT_READY; // the fs is not open
+	// The recoded blocks bypass the driver, a replica would miss them
+	if(m_Rekey!=nullptr)
+		return ERR_IN_USE;
+	// The previous log ends with everything cached so far
+	if((hRes=_FlushFileSizes())!=ERR_SUCCESS || (hRes=_FlushMeta())!=ERR_SUCCESS)
+		return hRes;
+	if(H5Fflush(m_hFile, H5F_SCOPE_GLOBAL)<0)
+		return ERR_DISK_WRITE;
+	// A new epoch, a copy taken before it is refused by the new log
+	std::random_device Random;
+	uint64_t Epoch = 0;
+	while(Epoch==0)
+		Epoch = ((uint64_t)Random() << 32) | Random();
+	XHdf5::ReplicationLog* Log = new XHdf5::ReplicationLog();
+	if(m_Driver->StartReplication(Log, AnsiPath, Epoch)<0)
+	{
+		delete Log;
+		wchar_t Msg[512] = {0};
+		swprintf_s(Msg, _countof(Msg), L"Failed to start the replication log \"%ls\"", UnicodePath);
+		ToLog(EV_ERROR, Msg);
+		return ERR_DISK_WRITE;
+	}
+	if(m_ReplLog!=nullptr)
+	{
+		m_ReplLog->Close();
+		delete m_ReplLog;
+	}
+	m_ReplLog = Log;
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::ReplicationStop()
+{
+	DWORD hRes = ERR_SUCCESS;
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
+	if(!IsOpen()) 
+		return ERR_NOT_READY; // the fs is not open
+	if(m_ReplLog==nullptr)
+		return ERR_EMPTY;
+	// The log ends with everything cached so far
+	if((hRes=_FlushFileSizes())!=ERR_SUCCESS || (hRes=_FlushMeta())!=ERR_SUCCESS)
+		return hRes;
+	if(H5Fflush(m_hFile, H5F_SCOPE_GLOBAL)<0)
+		hRes = ERR_DISK_WRITE;
+	m_Driver->SetReplicationLog(nullptr);
+	if(m_ReplLog->Close()<0)
+		hRes = ERR_DISK_WRITE;
+	delete m_ReplLog;
+	m_ReplLog = nullptr;
+	return hRes;
+}
+DWORD VirtualFS::RotateDataKey(UINT64 BytesPerSecond)
+{
+	const size_t Step = 4*1024*1024; // Recoded per batch, the container is locked for each
+	DWORD hRes = ERR_SUCCESS;
+	{
+		// 1. A new key, or the one of the rotation left unfinished
+		CTimedWriteLock w(m_Lock, m_Io.LockWait);
+		if(!IsOpen()) 
+			return ERR_NOT_READY; // the fs is not open
+		if(!_IsCrypto())
+			return ERR_EMPTY;
+		if(!m_NewDataCrypt)
+			return ERR_ERROR_PARAM;
+		// A snapshot, a replica or a compacted copy would get the blocks under either key
+		if(m_Rekeying || m_Snapshot!=nullptr || m_ReplLog!=nullptr || m_Compacting!=nullptr)
+			return ERR_IN_USE;
+		if(m_Rekey==nullptr)
+			hRes = _RekeyStart();
+		if(hRes==ERR_SUCCESS)
+			m_Rekeying = true;
+	}
+
+	// 2. Batch by batch, the readers and the writers get in between
+	UINT64 Started = GetTickCount64(), Bytes = 0;
+	bool   Done    = false;
+	while(hRes==ERR_SUCCESS && !Done)
+	{
+		{
+			CTimedWriteLock w(m_Lock, m_Io.LockWait);
+			size_t Recoded = 0;
+			if(!IsOpen() || m_Rekey==nullptr)
+				hRes = ERR_NOT_READY;
+			else if(m_Rekey->Next(Step, [this](haddr_t Addr, char* Blocks, size_t Count){return _Recode(Addr, Blocks, Count);}, &Recoded)<0)
+			{
+				hRes = ERR_DISK_WRITE;
+				if(m_Rekey->IsBroken())
+					ToLog(EV_ERROR, L"A batch of the key rotation is not applied, the I/O is stopped until the container is reopened");
+			}
+			else if(Recoded==0)
+			{
+				// 3. The end of the file: the header takes the new key
+				hRes = _RekeyFinish();
+				Done = true;
+			}
+			Bytes += Recoded;
+		}
+		_Throttle(Started, Bytes, BytesPerSecond);
+	}
+	{
+		CTimedWriteLock w(m_Lock, m_Io.LockWait);
+		m_Rekeying = false;
+	}
+	if(hRes!=ERR_SUCCESS)
+	{
+		wchar_t Msg[512] = {0};
+		swprintf_s(Msg, _countof(Msg), L"Failed to rotate the data key: %ls", ErrorTexts::GetErrorDesc(hRes));
+		ToLog(EV_ERROR, Msg);
+	}
+	return hRes;
+}
+DWORD VirtualFS::SetBlockCache(XHdf5::BlockCache* Cache, UINT64 Quota)
+{
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
+	if(IsOpen())
+		return ERR_ACCESS_DENIED;
+	m_Cache      = Cache;
+	m_CacheQuota = Quota;
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::SetPrefetch(UINT64 Bytes, WorkerPool* Pool, std::function<ICrypto*()> NewDataCrypt)
+{
+	if(Bytes > (UINT64)INT_MAX)
+		return ERR_ERROR_PARAM;  // The driver reads it at once
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
+	if(IsOpen())
+		return ERR_ACCESS_DENIED;
+	m_Prefetch     = Bytes;
+	m_PrefetchPool = Pool;
+	m_NewDataCrypt = NewDataCrypt;
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::SetFaultInjector(XHdf5::FaultInjector* Faults)
+{
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
+	if(IsOpen())
+		return ERR_ACCESS_DENIED;
+	m_Faults = Faults;
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::SetDedup(BOOL Enable)
+{
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
+	m_Dedup = Enable;
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::GetDedupStats(UINT64& Chunks, UINT64& References, UINT64& Deduplicated)
+{
+	Chunks = References = Deduplicated = 0;
+	CTimedReadLock l(m_Lock, m_Io.LockWait);
+	if(!IsOpen())
+		return ERR_NOT_READY; // the fs is not open
+	uint64_t Stored = 0, Refs = 0, Saved = 0;
+	m_Chunks.GetStats(Stored, Refs, Saved);
+	Chunks       = Stored;
+	References   = Refs;
+	Deduplicated = Saved;
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::SetInlineLimit(DWORD Bytes)
+{
+	if(Bytes > INLINE_FILE_MAX)
+		return ERR_ERROR_PARAM;
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
+	m_InlineLimit = Bytes;
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::SetPathIndex(BOOL Enable)
+{
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
+	if(!IsOpen())
+		return ERR_NOT_READY; // the fs is not open
+	// The trash of a transaction is not in the tree the index is built from
+	if(m_TxActive)
+		return ERR_IN_USE;
+	if(!Enable)
+	{
+		m_Paths.Disable();
+		if(H5Lexists(m_hFile, XDX_SYSTEM_GROUP, H5P_DEFAULT)>0 &&
+			H5Lexists(m_hFile, XDX_PATHS, H5P_DEFAULT)>0 &&
+			H5Ldelete(m_hFile, XDX_PATHS, H5P_DEFAULT)<0)
+			return ERR_DISK_WRITE;
+		return ERR_SUCCESS;
+	}
+	if(m_Paths.IsEnabled())
+		return ERR_SUCCESS;
+	// Stored at once, so the index survives a crash as one to rebuild
+	DWORD hRes = ERR_SUCCESS;
+	if((hRes=_BuildPathIndex())!=ERR_SUCCESS || (hRes=_ArmPathIndex(m_PathsGen))!=ERR_SUCCESS ||
+		(hRes=_StorePathIndex(true))!=ERR_SUCCESS)
+	{
+		m_Paths.Disable();
+		return hRes;
+	}
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::PathFind(LPCWSTR Pattern, DWORD Flags, std::vector<std::wstring>& Paths)
+{
+	Paths.clear();
+	if(Pattern==nullptr || Pattern[0]!=L'/')
+		return ERR_ERROR_PARAM;
+	CTimedReadLock l(m_Lock, m_Io.LockWait);
+	if(!IsOpen())
+		return ERR_NOT_READY; // the fs is not open
+	if(!m_Paths.IsEnabled())
+		return ERR_NOT_READY;
+	std::vector<std::string> Found;
+	m_Paths.Find(TICUtils::WStringToUtf8(Pattern), (Flags & WALK_FILES)!=0, (Flags & WALK_FOLDERS)!=0, Found);
+	// The trash of the transaction is indexed too, it is not a part of the FS
+	size_t SystemLen = strlen(XDX_SYSTEM_GROUP);
+	for(size_t i = 0; i < Found.size(); i++)
+	{
+		if(Found[i].compare(0, SystemLen, XDX_SYSTEM_GROUP)==0 && (Found[i].length()==SystemLen || Found[i][SystemLen]=='/'))
+			continue;
+		Paths.push_back(TICUtils::Utf8ToWString(Found[i].c_str()));
+	}
+	return Paths.empty()?ERR_EMPTY:ERR_SUCCESS;
+}
+DWORD VirtualFS::SetDurability(HANDLE File, DWORD Level)
+{
+	if(Level > XHdf5::DURABILITY_DISK)
+		return ERR_ERROR_PARAM;
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
+	if(File==nullptr)
+	{
+		m_Durability = Level;
+		return ERR_SUCCESS;
+	}
+	if(!IsOpen())
+		return ERR_NOT_READY; // the fs is not open
+	auto iiUserHandle = m_UserHandles.find(File);
+	if(iiUserHandle == m_UserHandles.end())
+		return ERR_ERROR_PARAM;
+	iiUserHandle->second.uDurability = Level;
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::SetCommitDelay(DWORD Milliseconds)
+{
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
+	m_CommitDelay = Milliseconds;
+	if(m_Driver!=nullptr)
+		m_Driver->SetCommitDelay(Milliseconds);
+	return ERR_SUCCESS;
+}
+void VirtualFS::_Throttle(UINT64 Started, UINT64 Bytes, UINT64 BytesPerSecond)
+{
+	if(BytesPerSecond==0)
+		return;
+	UINT64 Due   = Bytes*1000/BytesPerSecond;
+	UINT64 Spent = GetTickCount64() - Started;
+	if(Due > Spent)
+		Sleep((DWORD)min(Due - Spent, (UINT64)MAXDWORD));
+}
+void VirtualFS::_LatencyStats(const XHdf5::LatencyHistogram& Histogram, LatencyStats& Stats)
+{
+	Stats.COUNT    = Histogram.GetCount();
+	Stats.TOTAL_NS = Histogram.GetTotal();
+	Stats.P50_NS   = Histogram.GetPercentile(50);
+	Stats.P90_NS   = Histogram.GetPercentile(90);
+	Stats.P99_NS   = Histogram.GetPercentile(99);
+	Stats.P999_NS  = Histogram.GetPercentile(99.9);
+	Stats.MAX_NS   = Histogram.GetMax();
+}
+DWORD VirtualFS::BeginTransaction()
+{
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
+	if(!IsOpen()) 
+		return ERR_NOT_READY; // the fs is not open
+	if(m_TxActive)
+		return ERR_IN_USE;
+	m_TxActive = true;
+	m_TxLog.clear();
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::Commit()
+{
+	DWORD hRes = ERR_SUCCESS;
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
+	if(!IsOpen()) 
+		return ERR_NOT_READY; // the fs is not open
+	if(!m_TxActive)
+		return ERR_EMPTY;
+	m_TxActive = false;
+
+	// Purge the trash and write the counters, then flush it all at once
+	if((hRes=_TxApply())!=ERR_SUCCESS || (hRes=_FlushFileSizes())!=ERR_SUCCESS || (hRes=_FlushMeta())!=ERR_SUCCESS || H5Fflush(m_hFile, H5F_SCOPE_LOCAL)<0)
+	{
+		wchar_t H5Msg[512] = {0};
+		GetLastErrorDesc(H5Msg, _countof(H5Msg)-1);
+		wchar_t Msg[512] = {0};
+		swprintf_s(Msg, _countof(Msg), L"Failed to commit a transaction: %ls", H5Msg);
+		ToLog(EV_ERROR, Msg);
+		return ERR_DISK_WRITE;
+	}
+	return _ReleaseChunks(false);
+}
+DWORD VirtualFS::Rollback()
+{
+	CTimedWriteLock l(m_Lock, m_Io.LockWait);
+	if(!IsOpen()) 
+		return ERR_NOT_READY; // the fs is not open
+	if(!m_TxActive)
+		return ERR_EMPTY;
+	m_TxActive = false;
+	return _TxUndo(0);
+}
+
+//***********************************************************************************
+int VirtualFS::OnH5WriteUserBlock(void * Buffer, unsigned int Size)
+{
+	// This method is called when the userblock is to be written to the H5 file
+	// Here we assume that the INFO struct has the initialized fields, so we read
+	// them and copy AS IS to the H5 driver buffer
+
+	// Make sure that we have enough space, the driver keeps the last 8 bytes
+	if(Size<sizeof(RawFileHeader) + sizeof(uint64_t))
+		return -1;
+
+	// Fill the block with random data
+	std::srand(static_cast<int>(time(NULL)*(DWORD)(uintptr_t)Buffer));
+	std::generate((char*)Buffer, (char*)Buffer + Size, std::rand);
+
+	// Prepare the data
+	RawFileHeader fh;
+	// Fill the struct with dummydata
+	ZeroMemory(&fh, sizeof(RawFileHeader));
+	//std::generate((char*)&fh, (char*)&fh + sizeof(RawFileHeader), std::rand);
+
+	// Copy the the INFO struct fields to raw header
+	fh.Version          = FS_VERSION_ID;
+	fh.Version          = INFO.FS_VERSION; 
+	fh.BlockSize        = INFO.BLOCK_SIZE; 
+	fh.IsEncrypted      = INFO.IS_ENCRYPTED; 
+	fh.KeyEncodeMode    = INFO.KEY_ENC_MODE; 
+	fh.KeyEncodeAParam  = INFO.KEY_ENC_APARAM; 
+	fh.KeyEncodeBParam  = INFO.KEY_ENC_BPARAM; 
+	fh.DataEncodeMode   = INFO.DAT_ENC_MODE; 
+	fh.DataEncodeAParam = INFO.DAT_ENC_APARAM; 
+	fh.DataEncodeBParam = INFO.DAT_ENC_BPARAM; 
+	strcpy(fh.Signature,  XDX_SIGNATURE);
+	memcpy(fh.MKey,       INFO.MKEY,      MASTER_KEY_LEN);
+	memcpy(fh.MKeyHash,   INFO.MKEY_HASH, 16);       
+	memcpy(fh.IV,         INFO.IV,        MASTER_KEY_LEN); 
+	if(INFO.DAT_REKEY)
+		memcpy(fh.Rekey,  XDX_REKEY_SIGNATURE, sizeof(fh.Rekey));
+
+	// Copy it to the driver buffer
+	memcpy(Buffer, &fh, sizeof(RawFileHeader));
+
+	return 0;
+}
+int VirtualFS::OnH5ReadUserBlock(void * Buffer, unsigned int Size)
+{	
+	// Make sure that we have enough data to parse
+	if(Size<sizeof(RawFileHeader))
+		return -1;	
+	// Read the data
 	RawFileHeader fh;
 	// Copy it from the buffer
 	memcpy(&fh, Buffer, sizeof(RawFileHeader));
@@ -807,849 +2304,2377 @@ int VirtualFS::OnH5ReadUserBlock(void * Buffer, unsigned int Size)
 		return -1;
 	// Check the rest of the data
 
-	// Copy the raw header fields to the INFO struct
-	INFO.FS_VERSION      = fh.Version;          
-	INFO.BLOCK_SIZE      = fh.BlockSize; 
-	INFO.IS_ENCRYPTED    = fh.IsEncrypted;      
-	INFO.KEY_ENC_MODE    = fh.KeyEncodeMode;    
-	INFO.KEY_ENC_APARAM  = fh.KeyEncodeAParam;  
-	INFO.KEY_ENC_BPARAM  = fh.KeyEncodeBParam;  
-	INFO.DAT_ENC_MODE    = fh.DataEncodeMode;    
-	INFO.DAT_ENC_APARAM  = fh.DataEncodeAParam;  
-	INFO.DAT_ENC_BPARAM  = fh.DataEncodeBParam; 
-	memcpy(INFO.MKEY,      fh.MKey,     MASTER_KEY_LEN);
-	memcpy(INFO.MKEY_HASH, fh.MKeyHash, 16);       
-	memcpy(INFO.IV,        fh.IV,       MASTER_KEY_LEN); 
-	m_Driver->SetBlockSize(INFO.BLOCK_SIZE);
+	// Copy the raw header fields to the INFO struct
+	INFO.FS_VERSION      = fh.Version;          
+	INFO.BLOCK_SIZE      = fh.BlockSize; 
+	INFO.IS_ENCRYPTED    = fh.IsEncrypted;      
+	INFO.KEY_ENC_MODE    = fh.KeyEncodeMode;    
+	INFO.KEY_ENC_APARAM  = fh.KeyEncodeAParam;  
+	INFO.KEY_ENC_BPARAM  = fh.KeyEncodeBParam;  
+	INFO.DAT_ENC_MODE    = fh.DataEncodeMode;    
+	INFO.DAT_ENC_APARAM  = fh.DataEncodeAParam;  
+	INFO.DAT_ENC_BPARAM  = fh.DataEncodeBParam; 
+	memcpy(INFO.MKEY,      fh.MKey,     MASTER_KEY_LEN);
+	memcpy(INFO.MKEY_HASH, fh.MKeyHash, 16);       
+	memcpy(INFO.IV,        fh.IV,       MASTER_KEY_LEN); 
+	INFO.DAT_REKEY       = (memcmp(fh.Rekey, XDX_REKEY_SIGNATURE, sizeof(fh.Rekey))==0);
+	m_Driver->SetBlockSize(INFO.BLOCK_SIZE);
+
+	// Check the encryptor is set up if it's required
+	if(!_IsCrypto() && INFO.IS_ENCRYPTED)
+	{
+		ToLog(EV_ERROR, L"No crypto factory provided");
+		if((m_LastErr=Close())!=ERR_SUCCESS) 
+			return -1;
+		m_LastErr = ERR_ACCESS_DENIED;
+		return -1;
+	}
+	if(_IsCrypto())
+	{
+		// Set the parameters of the encryptors
+		m_PwdCrypt->SetParams(INFO.KEY_ENC_MODE, INFO.KEY_ENC_APARAM, INFO.KEY_ENC_BPARAM);
+		m_DataCrypt->SetParams(INFO.DAT_ENC_MODE, INFO.DAT_ENC_APARAM, INFO.DAT_ENC_BPARAM);
+
+		// Check that the key encryptor has a correct password
+	
+		// 1. Use the access cryptor to decrypt the master key, in place of a copy
+		BYTE MKeyDec[MASTER_KEY_LEN];
+		memcpy(MKeyDec, INFO.MKEY, sizeof(MKeyDec));
+		if(m_PwdCrypt->Decrypt(MKeyDec, sizeof(MKeyDec), TRUE)!=ERR_SUCCESS)
+		{
+			ToLog(EV_ERROR, L"Failed to decrypt the meta key");
+			if((m_LastErr=Close())!=ERR_SUCCESS) 
+				return -1;
+			m_LastErr = ERR_EXTERNAL;
+			return -1;
+		}
+		// 2. Calculate hash of the master key just decrypted
+		MD5 hasher;
+		hasher.update(MKeyDec, sizeof(MKeyDec));
+		hasher.finalize();
+
+		// 3. The resulting hash must match the master key's stored hash
+		if(memcmp(hasher.digest, INFO.MKEY_HASH, 16)!=0)
+		{
+			ToLog(EV_ERROR, L"File System: Wrong password. Access denied");
+			if((m_LastErr=Close())!=ERR_SUCCESS) 
+				return -1;
+			m_LastErr = ERR_ACCESS_DENIED;
+			return -1;
+		}
+	
+		// 4. Use the access cryptor to decrypt the IV
+		BYTE IVDec[MASTER_KEY_LEN];
+		memcpy(IVDec, INFO.IV, sizeof(IVDec));
+		if(m_PwdCrypt->Decrypt(IVDec, sizeof(IVDec), TRUE)!=ERR_SUCCESS)
+		{
+			ToLog(EV_ERROR, L"Failed to encrypt the iv");	
+			if((m_LastErr=Close())!=ERR_SUCCESS) 
+				return -1;
+			m_LastErr = ERR_EXTERNAL;
+			return -1;
+		}
+	
+		// 5. Pass the decrypted master password and the decrypted IV to the data crypto object
+		m_DataCrypt->SetKeyWithIV(MKeyDec, sizeof(MKeyDec), IVDec, DATA_IV_LEN);
+
+		// 6. Save the decrypted data key and IV just for the case when we want to change the access password
+		memcpy(MasterKey, MKeyDec, sizeof(MKeyDec));
+		memcpy(IV, IVDec, sizeof(IVDec));
+		ZeroMemory(MKeyDec, sizeof(MKeyDec));
+		ZeroMemory(IVDec, sizeof(IVDec));
+	}
+	// 7. A key rotation left unfinished goes on with the new key below the mark
+	DWORD hRes = _RekeyLoad();
+	if(hRes!=ERR_SUCCESS)
+	{
+		if((m_LastErr=Close())!=ERR_SUCCESS) 
+			return -1;
+		m_LastErr = hRes;
+		return -1;
+	}
+	return 0;
+}
+int VirtualFS::OnH5FillEmptyBlock(void * Buffer, unsigned int Size)
+{
+	std::srand(static_cast<int>(time(NULL)*(DWORD)(uintptr_t)Buffer));
+	std::generate((char*)Buffer, (char*)Buffer + Size, std::rand);
+	return 0;
+}
+int VirtualFS::OnH5AfterBlockRead(haddr_t Addr, void * Buffer, unsigned int Size)
+{
+	if(_IsRekeyBroken())
+		return -1;
+	_MayBeDecrypt(Addr, Buffer, Size);
+	return 0;
+}
+int VirtualFS::OnH5AfterBlocksRead(haddr_t Addr, void * Buffer, unsigned int BlockSize, unsigned int Count)
+{
+	if(!_IsCrypto())
+		return 0;
+	if(_IsRekeyBroken())
+		return -1;
+	// A part is worth a provider of its own only when it is large enough
+	const size_t MinPartBlocks = 64;
+	size_t Parts = 1;
+	if(m_PrefetchPool!=nullptr && m_NewDataCrypt)
+		Parts = min(m_PrefetchPool->GetThreads() + 1, (Count + MinPartBlocks - 1)/MinPartBlocks);
+	if(Parts<=1)
+	{
+		for(unsigned int i = 0; i < Count; i++)
+		{
+			if(_DataCryptAt(Addr + (haddr_t)i*BlockSize)->Decrypt((PBYTE)Buffer + (size_t)i*BlockSize, BlockSize, TRUE)!=ERR_SUCCESS)
+				return -1;
+		}
+		XHdf5::IoCounters::Add(m_Io.BytesDecrypted, (UINT64)Count*BlockSize);
+		return 0;
+	}
+	std::atomic<bool> Failed(false);
+	m_PrefetchPool->ParallelFor(Parts, [&](size_t Part)
+	{
+		// One provider per key in use, the new one is below the mark of a rotation
+		ICrypto* DataCrypt[2] = {nullptr, nullptr};
+		for(size_t i = Count*Part/Parts; i < Count*(Part + 1)/Parts && !Failed; i++)
+		{
+			int Key = (_DataCryptAt(Addr + (haddr_t)i*BlockSize)==m_DataCrypt)?0:1;
+			if(DataCrypt[Key]==nullptr)
+				DataCrypt[Key] = (Key==0)?_NewDataCrypt(MasterKey, IV):_NewDataCrypt(NewMasterKey, NewIV);
+			if(DataCrypt[Key]==nullptr || DataCrypt[Key]->Decrypt((PBYTE)Buffer + i*BlockSize, BlockSize, TRUE)!=ERR_SUCCESS)
+				Failed = true;
+		}
+		for(auto iiCrypt: DataCrypt)
+		{
+			if(iiCrypt!=nullptr)
+				iiCrypt->Release();
+		}
+	});
+	if(Failed)
+		return -1;
+	XHdf5::IoCounters::Add(m_Io.BytesDecrypted, (UINT64)Count*BlockSize);
+	return 0;
+}
+int VirtualFS::OnH5BeforeBlockWrite(haddr_t Addr, void * Buffer, unsigned int Size)
+{
+	if(_IsRekeyBroken())
+		return -1;
+	_MayBeEncrypt(Addr, Buffer, Size);
+	return 0;
+}
+int VirtualFS::OnH5BeforeOverwrite(haddr_t Addr, haddr_t Size)
+{
+	// The write goes on regardless, a failed snapshot is reported by Snapshot
+	if(m_Snapshot!=nullptr && m_Snapshot->Preserve(Addr, Size)<0)
+		ToLog(EV_ERROR, L"Failed to preserve the snapshot blocks, the snapshot is abandoned");
+	return 0;
+}
+void VirtualFS::OnH5ToLog(DWORD Event, LPCWSTR Message)
+{
+	ToLog(Event, Message);
+}
+
+//***********************************************************************************
+herr_t VirtualFS::_WalkErrorCallback(unsigned n, const H5E_error2_t *err_desc, void *udata)
+{
+	char* MsgBuffer = (char*)udata;
+	size_t BufferSize = 512;	
+    // Get descriptions for the major and minor error numbers */
+    char *maj_str = H5Eget_major (err_desc->maj_num);
+    char *min_str = H5Eget_minor (err_desc->min_num);
+
+	char ShortMsg[128];
+	_snprintf_s(ShortMsg, sizeof(ShortMsg), sizeof(ShortMsg)-1, "%s (%s, %s); ", err_desc->desc, maj_str, min_str);
+
+	strcat_s(MsgBuffer, BufferSize, ShortMsg);
+    free(maj_str);
+    free(min_str);
+    return 0;
+}
+VOID  VirtualFS::_ClearMem()
+{
+	m_LastErr   = 0;
+	m_hFile     = -1;
+	m_hFapl     = H5P_DEFAULT;
+	m_hFcpl     = H5P_DEFAULT;
+	m_Driver    = nullptr;
+	m_Snapshot  = nullptr;
+	m_Compacting = nullptr;
+	m_ReplLog   = nullptr;
+	m_CacheClient = 0;
+	m_PwdCrypt  = nullptr;
+	m_DataCrypt = nullptr;
+	ZeroMemory(MasterKey, sizeof(MasterKey));
+	ZeroMemory(IV, sizeof(IV));
+	m_Rekey      = nullptr;
+	m_RekeyCrypt = nullptr;
+	ZeroMemory(m_RekeyPath, sizeof(m_RekeyPath));
+	ZeroMemory(NewMasterKey, sizeof(NewMasterKey));
+	ZeroMemory(NewIV, sizeof(NewIV));
+	//ZeroMemory(m_DataFolder, sizeof(m_DataFolder));
+	ZeroMemory(&INFO, sizeof(INFO));
+
+	m_HandlesCounter = 0;
+
+	m_hRoot          = -1;
+	m_hAttrSpace     = -1;
+	m_MetaAttrs.clear();
+	m_StrTypes.clear();
+	m_hDosType       = -1;
+	m_DosTypeCommitted = false;
+	m_MetaFilesCount = 0;
+	m_MetaDirCount   = 0;
+
+	m_TxActive       = false;
+	m_TxLog.clear();
+	m_TxLogEnds.clear();
+	m_ChunkReleases.clear();
+	m_PathsGen       = 0;
+	m_TxFilesCount   = 0;
+	m_TxDirCount     = 0;
+	m_TxTrashCounter = 0;
+}
+time_t VirtualFS::GetTime()
+{
+	return time(NULL);
+}
+LPVOID VirtualFS::MemAlloc(SIZE_T Bytes)
+{
+	return HeapAlloc(GetProcessHeap(), 0, Bytes);
+} 
+DWORD VirtualFS::_Init(LPCWSTR FileName, LPCWSTR Name, ICrypto* PwdCrypt, ICrypto* DataCrypt, DWORD BlockSize, DWORD Version, BOOL Create)
+{
+	DWORD hRes = ERR_SUCCESS;
+	if(IsOpen())
+		return ERR_ACCESS_DENIED;
+
+	// Init the H5 block driver, the counters start over with it
+	m_Io.Reset();
+	m_Driver = new XHdf5::BlockDriver(BlockSize, 0, this);
+	m_Driver->SetStats(&m_Io);
+	m_Driver->SetCommitDelay(m_CommitDelay);
+	m_Driver->SetPrefetch((size_t)m_Prefetch);
+	m_Driver->SetFaultInjector(m_Faults);
+	if(m_Cache!=nullptr)
+	{
+		m_CacheClient = m_Cache->Register(m_CacheQuota);
+		m_Driver->SetBlockCache(m_Cache, m_CacheClient);
+	}
+
+	// Either both encryptors must be provided or neither
+	if((PwdCrypt==nullptr)!=(DataCrypt==nullptr))
+		return ERR_ERROR_PARAM;	
+	m_PwdCrypt  = PwdCrypt;
+	m_DataCrypt = DataCrypt;
+	
+	// Retain crypto providers
+	if(m_PwdCrypt!=nullptr && m_DataCrypt!=nullptr)
+	{
+		m_PwdCrypt->AddRef();
+		m_DataCrypt->AddRef();
+	}
+
+	
+	// Prepare to open the data file
+	m_LastErr = ERROR_SUCCESS;
+	
+	// Optionally define the File Create Property List
+	if(Create==TRUE)
+	{
+		// Define some fields for the user block as the HDF5 block
+		// driver will expect us to provide it
+		if((hRes = _DefineRawHeader(BlockSize, Version))!=ERR_SUCCESS)
+			return hRes;
+		// Initialize the create property list
+		m_hFcpl = H5Pcreate(H5P_FILE_CREATE);
+		// Set the user block size
+		if( m_hFcpl<0 || 
+			H5Pset_userblock(m_hFcpl, BlockSize)<0
+			// || H5Pset_alignment(fapl, 0, BlockSize)<0 // Set the alignment
+			)
+		{
+			CheckXErr(Close());
+			return ERR_EXTERNAL;
+		}
+	}
+	// Define the Access property list	
+	m_hFapl = H5Pcreate(H5P_FILE_ACCESS);
+	if(m_hFapl<0)
+	{
+		wchar_t H5Msg[512] = {0};
+		GetLastErrorDesc(H5Msg, _countof(H5Msg)-1);
+		wchar_t Msg[512] = {0};
+		swprintf_s(Msg, _countof(Msg), L"Failed to open the file system: %ls", H5Msg);
+		ToLog(EV_ERROR, Msg);
+		CheckXErr(Close());
+		return ERR_EXTERNAL;
+	}
+	// Init the driver with this fapl
+	m_Driver->Attach(m_hFapl);	
+
+	// Convert the filename to ansi
+	wchar_t UnicodePath[MAX_PATH]={0};
+	char AnsiPath[MAX_PATH]={0};
+	_ContainerPath(FileName, UnicodePath, _countof(UnicodePath), AnsiPath, sizeof(AnsiPath));
+
+	// A key rotation cut short is brought to its mark before anything is read
+	_RekeyOpen(FileName, AnsiPath, Create);
+
+	// Open or create the data file
+	if(Create==TRUE)
+		m_hFile = H5Fcreate(AnsiPath, 
+							H5F_ACC_EXCL,
+							m_hFcpl, 
+							m_hFapl);
+	else // Open
+		m_hFile = H5Fopen  (AnsiPath, 
+							H5F_ACC_RDWR,
+							m_hFapl);
+
+	if(m_hFile < 0)
+	{
+		wchar_t Msg[512] = {0};
+		if(m_LastErr != ERR_ACCESS_DENIED)
+		{
+			wchar_t H5Msg[512] = {0};
+			GetLastErrorDesc(H5Msg, _countof(H5Msg)-1);
+			swprintf_s(Msg, _countof(Msg), L"Failed to open the file system: %ls", H5Msg);
+		}
+		else
+			swprintf_s(Msg, _countof(Msg), L"Failed to open the file system: Access denied");
+
+		ToLog(EV_ERROR, Msg);
+		DWORD hRet = m_LastErr?m_LastErr:ERR_EXTERNAL;
+		CheckXErr(Close());
+		return hRet;
+	}
+	
+	// Keep the root group and the attribute space open
+	if((hRes=_OpenMetaCache())!=ERR_SUCCESS)
+	{
+		CheckXErr(Close());
+		return hRes;
+	}
+
+	// If it's create then initialize the meta records and check the results
+	if(Create && (hRes=_CreateMetaRecords(Name, BlockSize, Version))!=ERR_SUCCESS)
+	{
+		CheckXErr(Close());
+		return hRes;
+	}
 
-	// Check the encryptor is set up if it's required
-	if(!_IsCrypto() && INFO.IS_ENCRYPTED)
+	// By now it must be created, so start the normal open routine
+	
+	// Read the file system header
+	CheckXErr(_ReadMetaRecords());	
+	m_TxFilesCount   = m_MetaFilesCount = INFO.FILES_COUNT;
+	m_TxDirCount     = m_MetaDirCount   = INFO.DIR_COUNT;
+
+	// A session ended inside a transaction left its undo records, the transaction is rolled back
+	bool Recovered = false;
+	if((hRes=_TxRecover(Recovered))!=ERR_SUCCESS)
 	{
-		ToLog(EV_ERROR, L"No crypto factory provided");
-		if((m_LastErr=Close())!=ERR_SUCCESS) 
-			return -1;
-		m_LastErr = ERR_ACCESS_DENIED;
-		return -1;
+		CheckXErr(Close());
+		return hRes;
+	}
+
+	// The path index is loaded if the container keeps one, the trash it may list is gone.
+	// A record missing is generation 0, as is an index stored without one.
+	DWORD MetaSize = sizeof(m_PathsGen);
+	if(_ReadMeta(FSMF_QW_PATHS_GEN, (PBYTE)&m_PathsGen, &MetaSize)!=ERR_SUCCESS)
+		m_PathsGen = 0;
+	if(H5Lexists(m_hFile, XDX_SYSTEM_GROUP, H5P_DEFAULT)>0 &&
+		H5Lexists(m_hFile, XDX_PATHS, H5P_DEFAULT)>0)
+	{
+		uint64_t Stored = 0;
+		if(m_Paths.Load(m_hFile, XDX_PATHS, Stored)==ERR_SUCCESS)
+		{
+			m_Paths.Erase(XDX_SYSTEM_GROUP);
+			// Stale after a session not closed, or holding the paths of the rolled back transaction
+			if((Stored!=m_PathsGen || Recovered) && _BuildPathIndex()!=ERR_SUCCESS)
+			{
+				ToLog(Logs::EV_ERROR, L"Failed to rebuild the path index, it is disabled");
+				m_Paths.Disable();
+			}
+			if(m_Paths.IsEnabled())
+				_ArmPathIndex(max(Stored, m_PathsGen));
+		}
+		else
+			ToLog(Logs::EV_ERROR, L"Failed to load the path index, it is disabled");
 	}
+	return ERR_SUCCESS;
+}
+void VirtualFS::_ContainerPath(LPCWSTR FileName, wchar_t* UnicodePath, DWORD UnicodeSize, char* AnsiPath, DWORD AnsiSize, LPCWSTR Extension)
+{
+	swprintf_s(UnicodePath, UnicodeSize, L"%ls" XDX_PATH_SEP L"%ls.%ls", m_DataFolder, FileName, Extension);	 
+	Platform::NativePath(UnicodePath, AnsiPath, AnsiSize);
+}
+DWORD VirtualFS::_DefineRawHeader(DWORD BlockSize, DWORD Version)
+{
+	DWORD hRes = ERR_SUCCESS;
+	// Generate the master key even if the FS is not 
+	std::srand(static_cast<int>(time(NULL)));
+	std::generate(MasterKey, MasterKey + sizeof(MasterKey), std::rand);
+
+	// Calculate the hash of the unencrypted master key
+	MD5 hasher;
+	hasher.update(MasterKey, sizeof(MasterKey));
+	hasher.finalize();
+
+	//Generate random IV even if the FS is not encrypted
+	std::generate(IV, IV + sizeof(IV), std::rand);
+
+	INFO.FS_VERSION   = Version;
+	INFO.BLOCK_SIZE   = BlockSize;
+	INFO.IS_ENCRYPTED = _IsCrypto();   
 	if(_IsCrypto())
+	{		
+		DWORD PwMode=0, PwAParam=0, PwBParam=0;
+		m_PwdCrypt->GetParams(&PwMode, &PwAParam, &PwBParam);
+		DWORD DataMode=0, DataAParam=0, DataBParam=0;
+		m_DataCrypt->GetParams(&DataMode, &DataAParam, &DataBParam);
+		
+
+		INFO.KEY_ENC_MODE   = PwMode;                   //     Mode for the master key encryptor
+		INFO.KEY_ENC_APARAM = PwAParam;                 // (A) Param  for the master key encryptor
+		INFO.KEY_ENC_BPARAM = PwBParam;                 // (B) Param  for the master key encryptor
+		INFO.DAT_ENC_MODE   = DataMode;                 //     Mode for the data blocks encryptor
+		INFO.DAT_ENC_APARAM = DataAParam;               // (A) Param  for the data blocks encryptor
+		INFO.DAT_ENC_BPARAM = DataBParam;               // (B) Param  for the data blocks encryptor
+		memcpy(INFO.MKEY_HASH, hasher.digest, 16);      // 16 byte hash of unencrypted master key used for its verification when access password is given.
+
+		if((hRes = _AssignAccessPassword())!=ERR_SUCCESS)
+		{
+			ToLog(EV_ERROR, L"Failed to write the master key");
+			return ERR_EXTERNAL;
+		}
+	}
+	else
 	{
-		// Set the parameters of the encryptors
-		m_PwdCrypt->SetParams(INFO.KEY_ENC_MODE, INFO.KEY_ENC_APARAM, INFO.KEY_ENC_BPARAM);
-		m_DataCrypt->SetParams(INFO.DAT_ENC_MODE, INFO.DAT_ENC_APARAM, INFO.DAT_ENC_BPARAM);
+		// When the FS in not encrpyted we write all the same meta fields, but we set them zeros
+		// and leave the keys unencrypted
+		INFO.KEY_ENC_MODE   = 0;                         //     Mode for the master key encryptor
+		INFO.KEY_ENC_APARAM = 0;                         // (A) Param  for the master key encryptor
+		INFO.KEY_ENC_BPARAM = 0;                         // (B) Param  for the master key encryptor
+		INFO.DAT_ENC_MODE   = 0;                         //     Mode for the data blocks encryptor
+		INFO.DAT_ENC_APARAM = 0;                         // (A) Param  for the data blocks encryptor
+		INFO.DAT_ENC_BPARAM = 0;                         // (B) Param  for the data blocks encryptor
 
-		// Check that the key encryptor has a correct password
-	
-		// 1. Use the access cryptor to decrypt the master key
-		PBYTE MKeyDec       = nullptr;
-		DWORD MKeyDecLength = 0;
-		if(m_PwdCrypt->DecryptAlloc(INFO.MKEY, sizeof(INFO.MKEY), TRUE, &MKeyDec, &MKeyDecLength)!=ERR_SUCCESS)
+
+		memcpy(INFO.MKEY, MasterKey, sizeof(MasterKey)); // 128 byte master key encrypted with access password. Its decrypted form is used for data encyption.
+		memcpy(INFO.MKEY_HASH, hasher.digest, 16);       // 16 byte hash of unencrypted master key used for its verification when access password is given.
+		memcpy(INFO.IV, IV, sizeof(IV));                 // 16 byte IV vector encrypted with access password. Its decrypted form is used for data encyption.
+	}
+	return hRes;
+}
+DWORD VirtualFS::_AssignAccessPassword()
+{	
+	return _WrapDataKey(MasterKey, IV, INFO.MKEY, INFO.IV);
+}
+// Encrypts the data key and its IV with the access password into KeyEnc and IVEnc, MASTER_KEY_LEN each
+DWORD VirtualFS::_WrapDataKey(PBYTE Key, PBYTE KeyIV, PBYTE KeyEnc, PBYTE IVEnc)
+{	
+	// The correct password be already assigned to PwdCrypt
+	DWORD hRes = ERR_SUCCESS;
+
+	// 1. Use the access encryptor to encrypt the master key
+	PBYTE MKeyEnc = nullptr;
+	DWORD MKeyEncLength = 0;
+	if((hRes = m_PwdCrypt->EncryptAlloc(Key, MASTER_KEY_LEN, TRUE, &MKeyEnc, &MKeyEncLength))!=ERR_SUCCESS)
+	{
+		ToLog(EV_ERROR, L"Failed to encrypt the meta key");
+		return ERR_EXTERNAL;
+	}
+	XDXAutoMem AutoMKey(MKeyEnc); // Auto delete using heapfree
+
+	// 2. Use the access encryptor to encrypt the IV
+	PBYTE IVBuf = nullptr;
+	DWORD IVEncLength = 0;
+	if((hRes = m_PwdCrypt->EncryptAlloc(KeyIV, MASTER_KEY_LEN, TRUE, &IVBuf, &IVEncLength))!=ERR_SUCCESS)
+	{
+		ToLog(EV_ERROR, L"Failed to encrypt the iv");
+		return ERR_EXTERNAL;
+	}
+	XDXAutoMem AutoIV(IVBuf); // Auto delete using heapfree
+
+	memcpy(KeyEnc, (PBYTE)MKeyEnc, MKeyEncLength); // 128 byte master key encrypted with access password. Its decrypted form is used for data encyption.
+	memcpy(IVEnc, (PBYTE)IVBuf, IVEncLength);      // 16 byte IV vector encrypted with access password. Its decrypted form is used for data encyption.
+	return ERR_SUCCESS;
+}
+// A data crypto of its own for a worker, with the given key
+ICrypto* VirtualFS::_NewDataCrypt(PBYTE Key, PBYTE KeyIV)
+{
+	ICrypto* DataCrypt = m_NewDataCrypt?m_NewDataCrypt():nullptr;
+	if(DataCrypt==nullptr)
+		return nullptr;
+	DataCrypt->SetParams(INFO.DAT_ENC_MODE, INFO.DAT_ENC_APARAM, INFO.DAT_ENC_BPARAM);
+	DataCrypt->SetKeyWithIV(Key, MASTER_KEY_LEN, KeyIV, DATA_IV_LEN);
+	return DataCrypt;
+}
+// Opens the key rotation journal of the container before the container itself.
+// Whether the journal is in effect is up to the header: a journal outliving its
+// rotation, or its container, is deleted unread.
+void VirtualFS::_RekeyOpen(LPCWSTR FileName, const char* ContainerPath, BOOL Create)
+{
+	wchar_t UnicodePath[MAX_PATH]={0};
+	_ContainerPath(FileName, UnicodePath, _countof(UnicodePath), m_RekeyPath, sizeof(m_RekeyPath), L"xkey");
+	if(!Platform::FileExists(m_RekeyPath))
+		return;
+	RawFileHeader fh;
+	ZeroMemory(&fh, sizeof(fh));
+	if(!Create)
+	{
+		FILE* Container = fopen(ContainerPath, "rb");
+		if(Container!=nullptr)
 		{
-			ToLog(EV_ERROR, L"Failed to decrypt the meta key");
-			if((m_LastErr=Close())!=ERR_SUCCESS) 
-				return -1;
-			m_LastErr = ERR_EXTERNAL;
-			return -1;
+			if(fread(&fh, sizeof(fh), 1, Container)!=1)
+				ZeroMemory(&fh, sizeof(fh));
+			fclose(Container);
 		}
-		XDXAutoMem AutoMKey(MKeyDec); // Auto delete using heapfree
-		// 2. Calculate hash of the master key just decrypted
-		MD5 hasher;
-		hasher.update((PBYTE)MKeyDec, MKeyDecLength);
-		hasher.finalize();
+	}
+	if(memcmp(fh.Rekey, XDX_REKEY_SIGNATURE, sizeof(fh.Rekey))!=0)
+	{
+		Platform::FileDelete(m_RekeyPath);
+		return;
+	}
+	m_Rekey = new XHdf5::BlockRekey();
+	if(m_Rekey->Open(ContainerPath, m_RekeyPath)<0)
+	{
+		// Reported by _RekeyLoad, the header needs the journal
+		delete m_Rekey;
+		m_Rekey = nullptr;
+	}
+}
+// Starts a rotation: the journal with the new key goes to the disk first,
+// then the header marking the rotation, only then a block may change
+DWORD VirtualFS::_RekeyStart()
+{
+	DWORD hRes = ERR_SUCCESS;
+	char ContainerPath[MAX_PATH]={0};
+	if(H5Fget_name(m_hFile, ContainerPath, sizeof(ContainerPath))<0)
+		return ERR_EXTERNAL;
 
-		// 3. The resulting hash must match the master key's stored hash
-		if(memcmp(hasher.digest, INFO.MKEY_HASH, 16)!=0)
+	// 1. The new key and IV, wrapped with the access password as the current ones
+	std::random_device Random;
+	std::generate(NewMasterKey, NewMasterKey + sizeof(NewMasterKey), [&Random](){return (BYTE)Random();});
+	std::generate(NewIV, NewIV + sizeof(NewIV), [&Random](){return (BYTE)Random();});
+	MD5 hasher;
+	hasher.update(NewMasterKey, sizeof(NewMasterKey));
+	hasher.finalize();
+	RawRekeyRecord Record;
+	ZeroMemory(&Record, sizeof(Record));
+	memcpy(Record.MKeyHash, hasher.digest, 16);
+	if((hRes = _WrapDataKey(NewMasterKey, NewIV, Record.MKey, Record.IV))!=ERR_SUCCESS)
+		return hRes;
+	if((m_RekeyCrypt = _NewDataCrypt(NewMasterKey, NewIV))==nullptr)
+		return ERR_EXTERNAL;
+
+	// 2. The journal, the blocks are recoded from past the user block on
+	m_Rekey = new XHdf5::BlockRekey();
+	if(m_Rekey->Create(ContainerPath, m_RekeyPath, INFO.BLOCK_SIZE, INFO.BLOCK_SIZE, &Record, sizeof(Record))<0)
+	{
+		m_Rekey->Remove();
+		_RekeyClose();
+		return ERR_DISK_WRITE;
+	}
+
+	// 3. The header
+	INFO.DAT_REKEY = TRUE;
+	if(m_Driver->UpdateUserBlock()<0 || m_Driver->GetGroupCommit()->Sync()<0)
+	{
+		INFO.DAT_REKEY = FALSE;
+		m_Driver->UpdateUserBlock();
+		m_Rekey->Remove();
+		_RekeyClose();
+		return ERR_DISK_WRITE;
+	}
+	return ERR_SUCCESS;
+}
+// Called by the open after the header is read and the current key is set
+DWORD VirtualFS::_RekeyLoad()
+{
+	if(!INFO.DAT_REKEY)
+		return ERR_SUCCESS;
+	if(m_Rekey==nullptr)
+	{
+		ToLog(EV_ERROR, L"The data key is being rotated, but the journal of the rotation is missing or damaged");
+		return ERR_DISK_READ;
+	}
+	if(!m_NewDataCrypt)
+	{
+		ToLog(EV_ERROR, L"The data key is being rotated, the file system needs a NewDataCrypt to open");
+		return ERR_ERROR_PARAM;
+	}
+	// The new key is unwrapped and checked as the current one
+	RawRekeyRecord Record;
+	const std::vector<char>& Stored = m_Rekey->GetRecord();
+	if(Stored.size()!=sizeof(Record))
+	{
+		ToLog(EV_ERROR, L"The journal of the data key rotation is damaged");
+		return ERR_DISK_READ;
+	}
+	memcpy(&Record, Stored.data(), sizeof(Record));
+	memcpy(NewMasterKey, Record.MKey, sizeof(NewMasterKey));
+	memcpy(NewIV, Record.IV, sizeof(NewIV));
+	if(m_PwdCrypt->Decrypt(NewMasterKey, sizeof(NewMasterKey), TRUE)!=ERR_SUCCESS ||
+		m_PwdCrypt->Decrypt(NewIV, sizeof(NewIV), TRUE)!=ERR_SUCCESS)
+	{
+		ToLog(EV_ERROR, L"Failed to decrypt the new data key");
+		return ERR_EXTERNAL;
+	}
+	MD5 hasher;
+	hasher.update(NewMasterKey, sizeof(NewMasterKey));
+	hasher.finalize();
+	if(memcmp(hasher.digest, Record.MKeyHash, 16)!=0)
+	{
+		ToLog(EV_ERROR, L"The new data key does not match its hash");
+		return ERR_DISK_READ;
+	}
+	if((m_RekeyCrypt = _NewDataCrypt(NewMasterKey, NewIV))==nullptr)
+		return ERR_EXTERNAL;
+	return ERR_SUCCESS;
+}
+// Every block is under the new key: it goes to the header, then the journal goes
+DWORD VirtualFS::_RekeyFinish()
+{
+	RawRekeyRecord Record;
+	memcpy(&Record, m_Rekey->GetRecord().data(), sizeof(Record));
+	FSInfo Previous = INFO;
+	memcpy(INFO.MKEY,      Record.MKey,     MASTER_KEY_LEN);
+	memcpy(INFO.MKEY_HASH, Record.MKeyHash, 16);
+	memcpy(INFO.IV,        Record.IV,       MASTER_KEY_LEN);
+	INFO.DAT_REKEY = FALSE;
+	if(m_Driver->UpdateUserBlock()<0 || m_Driver->GetGroupCommit()->Sync()<0)
+	{
+		// The header is rewritten on the next call
+		INFO = Previous;
+		return ERR_DISK_WRITE;
+	}
+	memcpy(MasterKey, NewMasterKey, sizeof(MasterKey));
+	memcpy(IV, NewIV, sizeof(IV));
+	m_DataCrypt->SetKeyWithIV(MasterKey, sizeof(MasterKey), IV, DATA_IV_LEN);
+	// A journal left behind is deleted by the next open
+	if(m_Rekey->Remove()<0)
+		ToLog(EV_ERROR, L"Failed to delete the journal of the data key rotation");
+	_RekeyClose();
+	return ERR_SUCCESS;
+}
+void VirtualFS::_RekeyClose()
+{
+	if(m_Rekey!=nullptr)
+	{
+		m_Rekey->Close();
+		delete m_Rekey;
+		m_Rekey = nullptr;
+	}
+	if(m_RekeyCrypt!=nullptr)
+	{
+		m_RekeyCrypt->Release();
+		m_RekeyCrypt = nullptr;
+	}
+	ZeroMemory(NewMasterKey, sizeof(NewMasterKey));
+	ZeroMemory(NewIV, sizeof(NewIV));
+}
+// Re-encrypts the blocks of a batch from the old key to the new one, on the pool when it is worth it
+int VirtualFS::_Recode(haddr_t Addr, char* Blocks, size_t Count)
+{
+	const size_t MinPartBlocks = 64;
+	size_t BlockSize = INFO.BLOCK_SIZE;
+	size_t Parts = 1;
+	if(m_PrefetchPool!=nullptr)
+		Parts = min(m_PrefetchPool->GetThreads() + 1, (Count + MinPartBlocks - 1)/MinPartBlocks);
+	std::atomic<bool> Failed(false);
+	auto Recode = [&](ICrypto* OldCrypt, ICrypto* NewCrypt, size_t First, size_t Last)
+	{
+		for(size_t i = First; i < Last && !Failed; i++)
 		{
-			ToLog(EV_ERROR, L"File System: Wrong password. Access denied");
-			if((m_LastErr=Close())!=ERR_SUCCESS) 
-				return -1;
-			m_LastErr = ERR_ACCESS_DENIED;
-			return -1;
+			PBYTE Block = (PBYTE)Blocks + i*BlockSize;
+			if(OldCrypt->Decrypt(Block, (DWORD)BlockSize, TRUE)!=ERR_SUCCESS ||
+				NewCrypt->Encrypt(Block, (DWORD)BlockSize, TRUE)!=ERR_SUCCESS)
+				Failed = true;
 		}
+	};
+	if(Parts<=1)
+		Recode(m_DataCrypt, m_RekeyCrypt, 0, Count);
+	else
+	{
+		m_PrefetchPool->ParallelFor(Parts, [&](size_t Part)
+		{
+			ICrypto* OldCrypt = _NewDataCrypt(MasterKey, IV);
+			ICrypto* NewCrypt = _NewDataCrypt(NewMasterKey, NewIV);
+			if(OldCrypt==nullptr || NewCrypt==nullptr)
+				Failed = true;
+			else
+				Recode(OldCrypt, NewCrypt, Count*Part/Parts, Count*(Part + 1)/Parts);
+			if(OldCrypt!=nullptr)
+				OldCrypt->Release();
+			if(NewCrypt!=nullptr)
+				NewCrypt->Release();
+		});
+	}
+	if(Failed)
+	{
+		wchar_t Msg[256] = {0};
+		swprintf_s(Msg, _countof(Msg), L"Failed to re-encrypt the blocks at %llu", (unsigned long long)Addr);
+		ToLog(EV_ERROR, Msg);
+		return -1;
+	}
+	XHdf5::IoCounters::Add(m_Io.BytesDecrypted, (UINT64)Count*BlockSize);
+	XHdf5::IoCounters::Add(m_Io.BytesEncrypted, (UINT64)Count*BlockSize);
+	return 0;
+}
+DWORD VirtualFS::_CreateMetaRecords(LPCWSTR Name, DWORD BlockSize, DWORD Version)
+{
+	DWORD hRes = ERR_SUCCESS;
 	
-		// 4. Use the access cryptor to decrypt the IV
-		PBYTE IVDec = nullptr;
-		DWORD IVDecLength = 0;
-		if(m_PwdCrypt->DecryptAlloc(INFO.IV, sizeof(INFO.IV), TRUE, &IVDec, &IVDecLength)!=ERR_SUCCESS)
+	//Fill the file system meta fields
+	CheckXErr(_WriteMetaBytes(FSMF_SZ_NAME, (PBYTE)Name, wcslen(Name)*2+2, FS_MAX_ALIAS));    // The alias of the file system
+	CheckXErr(_WriteMetaDW(FSMF_DW_FILES_COUNT, 0));                                          // The overall number of files
+	CheckXErr(_WriteMetaDW(FSMF_DW_DIR_COUNT, 0));                                            // The overall number of folders
+
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::_ReadMetaRecords()
+{
+	DWORD hRes = ERR_SUCCESS;
+	DWORD MaxSize = 0;
+	//ZeroMemory(&INFO, sizeof(INFO));
+ 
+	MaxSize = sizeof(INFO.NAME);           CheckXErr(_ReadMeta(FSMF_SZ_NAME,           (PBYTE)INFO.NAME,            &MaxSize));     
+	MaxSize = sizeof(INFO.FILES_COUNT);    CheckXErr(_ReadMeta(FSMF_DW_FILES_COUNT,    (PBYTE)&INFO.FILES_COUNT,    &MaxSize));      
+	MaxSize = sizeof(INFO.DIR_COUNT);      CheckXErr(_ReadMeta(FSMF_DW_DIR_COUNT,      (PBYTE)&INFO.DIR_COUNT,      &MaxSize)); 
+
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::_WriteMetaDW(DWORD MetaId, DWORD Value)
+{
+	return _WriteMetaBytes(MetaId, (PBYTE)&Value, sizeof(Value), 0);
+}
+DWORD VirtualFS::_WriteMetaQW(DWORD MetaId, UINT64 Value)
+{
+	return _WriteMetaBytes(MetaId, (PBYTE)&Value, sizeof(Value), 0);
+}
+DWORD VirtualFS::_WriteMetaBytes(DWORD MetaId, PBYTE ByteVal, DWORD Size, size_t MaxLength)
+{
+	DWORD     hRes = ERR_SUCCESS;
+	MetaAttr* Attr = nullptr;
+	if(ByteVal==nullptr)
+		return ERR_ERROR_PARAM;
+	if(MaxLength==0)
+		MaxLength = Size; // for integral types
+
+	if((hRes=_MetaAttribute(MetaId, MaxLength, true, Attr))!=ERR_SUCCESS)
+		return hRes;
+	// The value is cut or padded to the stored size
+	std::vector<char> AttrValue(Attr->size, 0);
+	memcpy_s(AttrValue.data(), AttrValue.size(), ByteVal, min(Attr->size, (size_t)Size));
+	if(H5Awrite(Attr->attr, Attr->type, AttrValue.data())<0)
+		return ERR_DISK_WRITE;
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::_OpenMetaCache()
+{
+	hsize_t dims[1] = {1};
+	if((m_hRoot = H5Gopen2(m_hFile, "/", H5P_DEFAULT))<0)
+		return ERR_DISK_READ;
+	if((m_hAttrSpace = H5Screate_simple(1, dims, NULL))<0)
+		return ERR_EXTERNAL;
+	// Containers written before the compound attributes have no committed type yet
+	htri_t Exists = H5Lexists(m_hFile, XDX_SYSTEM_GROUP, H5P_DEFAULT);
+	if(Exists>0)
+		Exists = H5Lexists(m_hFile, XDX_TYPES_GROUP, H5P_DEFAULT);
+	if(Exists>0)
+		Exists = H5Lexists(m_hFile, XDX_DOS_TYPE, H5P_DEFAULT);
+	if(Exists<0)
+		return ERR_DISK_READ;
+	if(Exists>0)
+	{
+		if((m_hDosType = H5Topen2(m_hFile, XDX_DOS_TYPE, H5P_DEFAULT))<0)
+			return ERR_DISK_READ;
+		m_DosTypeCommitted = true;
+	}
+	// The packed struct is its own file layout
+	hid_t DosType = -1;
+	if((DosType = H5Tcreate(H5T_COMPOUND, sizeof(FileAttributesDos)))<0 ||
+		H5Tinsert(DosType, "attributes",  HOFFSET(FileAttributesDos, DW_FILE_ATTRIBUTES), H5T_NATIVE_UINT32)<0 ||
+		H5Tinsert(DosType, "created_by",  HOFFSET(FileAttributesDos, QW_CREATED_BY), H5T_NATIVE_UINT64)<0 ||
+		H5Tinsert(DosType, "created",     HOFFSET(FileAttributesDos, QW_CREATION_TIME), H5T_NATIVE_UINT64)<0 ||
+		H5Tinsert(DosType, "accessed",    HOFFSET(FileAttributesDos, QW_ACCESS_TIME), H5T_NATIVE_UINT64)<0 ||
+		H5Tinsert(DosType, "written",     HOFFSET(FileAttributesDos, QW_WRITE_TIME), H5T_NATIVE_UINT64)<0 ||
+		H5Tinsert(DosType, "size",        HOFFSET(FileAttributesDos, QW_FILE_SIZE), H5T_NATIVE_UINT64)<0)
+	{
+		if(DosType>=0)
+			H5Tclose(DosType);
+		return ERR_EXTERNAL;
+	}
+	if(m_hDosType>=0)
+	{
+		// A committed type of another layout is left alone and the records use their own copy
+		if(H5Tequal(m_hDosType, DosType)>0)
 		{
-			ToLog(EV_ERROR, L"Failed to encrypt the iv");	
-			if((m_LastErr=Close())!=ERR_SUCCESS) 
-				return -1;
-			m_LastErr = ERR_EXTERNAL;
-			return -1;
+			H5Tclose(DosType);
+			return ERR_SUCCESS;
 		}
-		XDXAutoMem AutoIV(IVDec); // Auto delete using heapfree
-	
-		// 5. Pass the decrypted master password and the decrypted IV to the data crypto object
-		m_DataCrypt->SetKeyWithIV((PBYTE)MKeyDec, MKeyDecLength, IVDec, DATA_IV_LEN);
-
-		// 6. Save the decrypted data key and IV just for the case when we want to change the access password
-		memcpy(MasterKey, MKeyDec, MKeyDecLength);
-		memcpy(IV, IVDec, IVDecLength);
+		H5Tclose(m_hDosType);
 	}
-	return 0;
+	m_hDosType = DosType;
+	return ERR_SUCCESS;
 }
-int VirtualFS::OnH5FillEmptyBlock(void * Buffer, unsigned int Size)
+void  VirtualFS::_CloseMetaCache()
 {
-	std::srand(static_cast<int>(time(NULL)*(DWORD)Buffer));
-	std::generate((char*)Buffer, (char*)Buffer + Size, std::rand);
-	return 0;
+	for(auto iiAttr = m_MetaAttrs.begin(); iiAttr != m_MetaAttrs.end(); iiAttr++)
+	{
+		H5Tclose(iiAttr->second.type);
+		CloseH5handle(iiAttr->second.attr, H5I_ATTR);
+	}
+	m_MetaAttrs.clear();
+	for(auto iiType = m_StrTypes.begin(); iiType != m_StrTypes.end(); iiType++)
+		H5Tclose(iiType->second);
+	m_StrTypes.clear();
+	if(m_hDosType>=0)
+		H5Tclose(m_hDosType);
+	m_hDosType = -1;
+	m_DosTypeCommitted = false;
+	if(m_hAttrSpace>=0)
+		CloseH5handle(m_hAttrSpace, H5I_DATASPACE);
+	if(m_hRoot>=0)
+		CloseH5handle(m_hRoot, H5I_GROUP);
+	m_hAttrSpace = -1;
+	m_hRoot      = -1;
 }
-int VirtualFS::OnH5AfterBlockRead(void * Buffer, unsigned int Size)
+hid_t VirtualFS::_StringType(size_t Size)
 {
-	_MayBeDecrypt(Buffer, Size);
-	return 0;
+	auto iiType = m_StrTypes.find(Size);
+	if(iiType != m_StrTypes.end())
+		return iiType->second;
+	hid_t type = H5Tcopy(H5T_C_S1);
+	if(type<0)
+		return -1;
+	if(H5Tset_size(type, Size)<0)
+	{
+		H5Tclose(type);
+		return -1;
+	}
+	m_StrTypes[Size] = type;
+	return type;
 }
-int VirtualFS::OnH5BeforeBlockWrite(void * Buffer, unsigned int Size)
+DWORD VirtualFS::_MetaAttribute(DWORD MetaId, size_t Size, bool Create, MetaAttr*& Attr)
 {
-	_MayBeEncrypt(Buffer, Size);
-	return 0;
+	Attr = nullptr;
+	auto iiAttr = m_MetaAttrs.find(MetaId);
+	if(iiAttr != m_MetaAttrs.end())
+	{
+		Attr = &iiAttr->second;
+		return ERR_SUCCESS;
+	}
+
+	// Convert the Attribute ID to a string
+	char AttrName[64];
+	sprintf_s(AttrName, sizeof(AttrName), "%d", MetaId);
+	// Open the attribute or create a missing one, the errors are not printed
+	MetaAttr NewAttr;
+	if((NewAttr.attr = H5Aopen(m_hRoot, AttrName, H5P_DEFAULT))<0)
+	{
+		hid_t type = _StringType(Size);
+		if(!Create || type<0)
+			return Create?ERR_DISK_WRITE:ERR_DISK_READ;
+		if((NewAttr.attr = H5Acreate2(m_hRoot, AttrName, type, m_hAttrSpace, H5P_DEFAULT, H5P_DEFAULT))<0)
+			return ERR_DISK_WRITE;
+	}
+	if((NewAttr.type = H5Aget_type(NewAttr.attr))<0)
+	{
+		CloseH5handle(NewAttr.attr, H5I_ATTR);
+		return ERR_DISK_READ;
+	}
+	NewAttr.size = H5Tget_size(NewAttr.type);
+	Attr = &(m_MetaAttrs[MetaId] = NewAttr);
+	return ERR_SUCCESS;
 }
-void VirtualFS::OnH5ToLog(DWORD Event, LPCWSTR Message)
+DWORD VirtualFS::_FlushMeta()
 {
-	ToLog(Event, Message);
+	DWORD hRes = ERR_SUCCESS;
+	// Inside a transaction the counters of its start are kept, it may still be rolled back on open
+	DWORD FilesCount = m_TxActive?m_TxFilesCount:INFO.FILES_COUNT;
+	DWORD DirCount   = m_TxActive?m_TxDirCount:INFO.DIR_COUNT;
+	if(FilesCount!=m_MetaFilesCount)
+	{
+		if((hRes=_WriteMetaDW(FSMF_DW_FILES_COUNT, FilesCount))!=ERR_SUCCESS)
+			return hRes;
+		m_MetaFilesCount = FilesCount;
+	}
+	if(DirCount!=m_MetaDirCount)
+	{
+		if((hRes=_WriteMetaDW(FSMF_DW_DIR_COUNT, DirCount))!=ERR_SUCCESS)
+			return hRes;
+		m_MetaDirCount = DirCount;
+	}
+	return m_Chunks.Flush();
 }
-
-//***********************************************************************************
-herr_t VirtualFS::_WalkErrorCallback(unsigned n, const H5E_error2_t *err_desc, void *udata)
+DWORD VirtualFS::_ReadMeta(DWORD MetaId, PBYTE ByteVal, DWORD *MaxSize)
 {
-	char* MsgBuffer = (char*)udata;
-	size_t BufferSize = 512;	
-    // Get descriptions for the major and minor error numbers */
-    char *maj_str = H5Eget_major (err_desc->maj_num);
-    char *min_str = H5Eget_minor (err_desc->min_num);
-
-	char ShortMsg[128];
-	_snprintf_s(ShortMsg, sizeof(ShortMsg), sizeof(ShortMsg)-1, "%s (%s, %s); ", err_desc->desc, maj_str, min_str);
+	DWORD     hRes = ERR_SUCCESS;
+	MetaAttr* Attr = nullptr;
+	if(ByteVal==nullptr || MaxSize==nullptr || *MaxSize==0)
+		return ERR_ERROR_PARAM;
 
-	strcat_s(MsgBuffer, BufferSize, ShortMsg);
-    free(maj_str);
-    free(min_str);
-    return 0;
+	if((hRes=_MetaAttribute(MetaId, 0, false, Attr))!=ERR_SUCCESS)
+		return hRes;
+	std::vector<char> AttrValue(Attr->size, 0);
+	if(H5Aread(Attr->attr, Attr->type, AttrValue.data())<0)
+		return ERR_DISK_READ;
+	memcpy_s(ByteVal, *MaxSize, AttrValue.data(), min(Attr->size, (size_t)*MaxSize));
+	return ERR_SUCCESS;
 }
-VOID  VirtualFS::_ClearMem()
+BOOL  VirtualFS::_IsPathValid(LPCWSTR Path)
 {
-	m_LastErr   = 0;
-	m_hFile     = -1;
-	m_hFapl     = H5P_DEFAULT;
-	m_hFcpl     = H5P_DEFAULT;
-	m_Driver    = nullptr;
-	m_PwdCrypt  = nullptr;
-	m_DataCrypt = nullptr;
-	ZeroMemory(MasterKey, sizeof(MasterKey));
-	ZeroMemory(IV, sizeof(IV));
-	//ZeroMemory(m_DataFolder, sizeof(m_DataFolder));
-	ZeroMemory(&INFO, sizeof(INFO));
-
-	m_HandlesCounter = 0;
+	// Pointer is valid
+	if(Path==nullptr)
+		return FALSE; 
+	size_t PathLen = wcslen(Path);
+	// Path isn't too short
+	if(PathLen<2 || PathLen >= MAX_PATH)
+		return FALSE;
+	// Path starts with a slash
+	if(Path[0]!=L'/')
+		return FALSE;
+	// No empty path components
+	if(wcsstr(Path, L"//")!=nullptr)
+		return FALSE;
+	// Path doesn't end with a slash
+	if(Path[PathLen-1]==L'/')
+		return FALSE;
+	// Path doesn't lead into the system group
+	size_t SystemLen = wcslen(XDX_SYSTEM_NAME);
+	if(wcsncmp(Path + 1, XDX_SYSTEM_NAME, SystemLen)==0 && (Path[SystemLen + 1]==L'\0' || Path[SystemLen + 1]==L'/'))
+		return FALSE;
+	return TRUE;
 }
-time_t VirtualFS::GetTime()
+DWORD VirtualFS::_FollowPath(LPCWSTR Path, H5I_type_t& ObjectType, hid_t& ObjectId)
 {
-	return time(NULL);
+	DWORD hRes = ERR_SUCCESS;
+	ObjectType = H5I_UNINIT;
+	ObjectId = -1;
+
+	// Check the given path
+	if(Path == nullptr)
+		return ERR_NOT_FOUND;
+	size_t PathLength = wcslen(Path);
+	if(PathLength==0)
+		return ERR_NOT_FOUND;
+	if(PathLength<1 || PathLength>=MAX_PATH)
+		return ERR_ERROR_PARAM;
+	if(Path[0]!=L'/')
+		return ERR_ERROR_PARAM;
+	
+	// Convert the name to utf8
+	std::string Utf8Name = TICUtils::WStringToUtf8(Path);
+
+	// Check that the given name exists
+	// first try to check it as a dataset
+	ObjectId = H5Dopen2(m_hFile, Utf8Name.c_str(), H5P_DEFAULT);
+	if(ObjectId<0)
+	{		
+		// now as a group
+		ObjectId = H5Gopen2(m_hFile, Utf8Name.c_str(), H5P_DEFAULT);
+		if(ObjectId<0)
+		{
+			hRes = ERR_NOT_FOUND;
+			return hRes;
+		}
+		// It's a group
+		ObjectType = H5I_GROUP;
+	}
+	else // it's a file
+	{
+		ObjectType = H5I_DATASET;
+	}
+
+	return hRes;
 }
-LPVOID VirtualFS::MemAlloc(SIZE_T Bytes)
-{
-	return HeapAlloc(GetProcessHeap(), 0, Bytes);
-} 
-DWORD VirtualFS::_Init(LPCWSTR FileName, LPCWSTR Name, ICrypto* PwdCrypt, ICrypto* DataCrypt, DWORD BlockSize, DWORD Version, BOOL Create)
+DWORD VirtualFS::_PathCreate(LPCWSTR Name, DWORD Attributes, UINT64 CreatedBy)
 {
 	DWORD hRes = ERR_SUCCESS;
-	if(IsOpen())
-		return ERR_ACCESS_DENIED;
+	std::string Utf8Name;
+	if(Name == nullptr)
+		return ERR_ERROR_PARAM;
 
-	// Init the H5 block driver
-	m_Driver = new XHdf5::BlockDriver(BlockSize, 0, this);
+	bool isFolder = (Attributes & FILE_ATTRIBUTE_DIRECTORY)>0;
+	
+	// Check the given path
+	if(!_IsPathValid(Name))
+		return ERR_ERROR_PARAM;
+	
+	hid_t lcpl_id = H5P_DEFAULT;
+	hid_t path_id = -1;
+	size_t Savepoint = _TxSavepoint();
 
-	// Either both encryptors must be provided or neither
-	if((PwdCrypt==nullptr)!=(DataCrypt==nullptr))
-		return ERR_ERROR_PARAM;	
-	m_PwdCrypt  = PwdCrypt;
-	m_DataCrypt = DataCrypt;
+	// Setup the group to support unicode (Utf8)
+	if((lcpl_id = H5Pcreate(H5P_LINK_CREATE)) < 0 ||
+		H5Pset_char_encoding(lcpl_id, H5T_CSET_UTF8) < 0)
+	{
+		wchar_t H5Msg[512] = {0};
+		GetLastErrorDesc(H5Msg, _countof(H5Msg)-1);
+		wchar_t Msg[512] = {0};
+		swprintf_s(Msg, _countof(Msg), L"Failed to create an FS element: %ls", H5Msg);
+		ToLog(EV_ERROR, Msg);
+		hRes = ERR_EXTERNAL;
+		goto L_DONE;
+	}
+	// Convert the name to utf8
+	Utf8Name = TICUtils::WStringToUtf8(Name);
 	
-	// Retain crypto providers
-	if(m_PwdCrypt!=nullptr && m_DataCrypt!=nullptr)
+	// Check that the given name is not used already
+	path_id = isFolder?H5Gopen2(m_hFile, Utf8Name.c_str(), H5P_DEFAULT):H5Dopen2(m_hFile, Utf8Name.c_str(), H5P_DEFAULT);
+	if(path_id>0)
 	{
-		m_PwdCrypt->AddRef();
-		m_DataCrypt->AddRef();
+		hRes = ERR_DUPLICATE;
+		goto L_DONE;
+	}
+
+	// Create a group or a dataset with the given name in the file.
+	if(isFolder)
+	{
+		path_id = H5Gcreate2(m_hFile, Utf8Name.c_str(), lcpl_id, H5P_DEFAULT, H5P_DEFAULT); // Create a group
+	}
+	else if(!m_Dedup && m_InlineLimit>0)
+	{
+		// A small file lives in its object header until it grows
+		hsize_t dims[1] = {_InlineCapacity(0)};
+		hid_t dataspace = H5Screate_simple (1, dims, NULL);
+		hid_t prop = H5Pcreate (H5P_DATASET_CREATE);
+		if(H5Pset_layout (prop, H5D_COMPACT)>=0)
+		{
+			path_id = H5Dcreate2 (m_hFile, Utf8Name.c_str(), H5T_NATIVE_SCHAR, dataspace, lcpl_id, prop, H5P_DEFAULT);
+		}
+		CloseH5handle(dataspace, H5I_DATASPACE);
+		CloseH5handle(prop, H5I_GENPROP_LST);
+	}
+	else
+	{
+		// Define a dataspace 
+		hsize_t dims[1]  = {0};           // dataset dimensions at creation time
+		hsize_t maxdims[1] = {H5S_UNLIMITED};
+		hid_t dataspace = H5Screate_simple (1, dims, maxdims); 
+
+		// Modify dataset creation properties, enable chunking 
+		hsize_t chunk_dims = m_Driver->GetBlockSize()*FILE_CHUNK_BLOCKS;
+		hid_t prop = H5Pcreate (H5P_DATASET_CREATE);
+		if(H5Pset_chunk (prop, 1, &chunk_dims)>=0)
+		{
+			path_id = H5Dcreate2 (m_hFile, Utf8Name.c_str(), H5T_NATIVE_SCHAR, dataspace, H5P_DEFAULT, prop, H5P_DEFAULT); // Create a data file
+		}
+		
+		CloseH5handle(dataspace, H5I_DATASPACE);  // close the space
+		CloseH5handle(prop, H5I_GENPROP_LST);     // close create property list
+	}
+	if(path_id<0)
+	{
+		hRes = ERR_NOT_FOUND;
+		goto L_DONE;
+	}
+	// From now on a failure must remove the object
+	{
+		TxRecord Created;
+		Created.dwOperation = TX_CREATED;
+		Created.sPath       = Utf8Name;
+		m_TxLog.push_back(Created);
+	}
+
+	// Write its attributes
+	uint64_t Time = GetTime();
+	
+	FileAttributesDos attr;
+	attr.DW_FILE_ATTRIBUTES = Attributes ; 
+	attr.QW_CREATED_BY      = CreatedBy      ; 
+	attr.QW_CREATION_TIME   = Time   ; 
+	attr.QW_ACCESS_TIME     = Time ; 
+	attr.QW_WRITE_TIME      = Time  ; 
+	attr.QW_FILE_SIZE       = 0     ; 
+	
+	if( (hRes=_WriteFileAttributes(path_id, attr, true))!=ERR_SUCCESS)
+	{
+		wchar_t Msg[512] = {0};
+		swprintf_s(Msg, _countof(Msg), L"Failed to create an FS element (iNode attributes): %ls", ErrorTexts::GetErrorDesc(hRes));
+		ToLog(EV_ERROR, Msg);
+		goto L_DONE;
 	}
 
+	// A deduplicated file starts with an empty chunk list
+	if(!isFolder && m_Dedup && (hRes=_WriteChunkMap(path_id, std::vector<uint64_t>()))!=ERR_SUCCESS)
+		goto L_DONE;
+
+	// Increment the number of directories, the counters are written when the transaction ends
+	if(isFolder)
+		INFO.DIR_COUNT++;
+	else
+		INFO.FILES_COUNT++;
+	m_Paths.Insert(Utf8Name, isFolder);
+L_DONE:
+	CloseH5handle(lcpl_id, H5I_GENPROP_LST);
+	CloseH5handle(path_id, isFolder?H5I_GROUP:H5I_DATASET);
+
+	return _TxStatementEnd(hRes, Savepoint);
+}
+DWORD VirtualFS::_AcquireRealHandle(LPCWSTR FileName, UINT64 CreatedBy, DWORD DesiredAccess, DWORD ShareMode, DWORD CreationDisposition, RealHandle& hResFile)
+{
+	DWORD hRes = ERR_SUCCESS;
 	
-	// Prepare to open the data file
-	m_LastErr = ERROR_SUCCESS;
-	
-	// Optionally define the File Create Property List
-	if(Create==TRUE)
+	// 1. Check if the file exists and has a handle already. The handles are
+	//    keyed by the object, so a path that reaches it after a move finds it
+	//    On a miss the object stays open for the new handle, it is resolved once
+	bool HandleExists = false;
+	bool FileExists = false;
+	RealHandle* hFile = nullptr;
+	hid_t item_id = -1;
+	H5I_type_t item_type = H5I_UNINIT;
+	haddr_t Addr = HADDR_UNDEF;
+	if(_FollowPath(FileName, item_type, item_id)==ERR_SUCCESS)
 	{
-		// Define some fields for the user block as the HDF5 block
-		// driver will expect us to provide it
-		if((hRes = _DefineRawHeader(BlockSize, Version))!=ERR_SUCCESS)
+		hRes = (item_type != H5I_DATASET)?ERR_NOT_FOUND:_ObjectAddr(item_id, Addr);
+		if(hRes!=ERR_SUCCESS)
+		{
+			CloseH5handle(item_id, item_type);
 			return hRes;
-		// Initialize the create property list
-		m_hFcpl = H5Pcreate(H5P_FILE_CREATE);
-		// Set the user block size
-		if( m_hFcpl<0 || 
-			H5Pset_userblock(m_hFcpl, BlockSize)<0
-			// || H5Pset_alignment(fapl, 0, BlockSize)<0 // Set the alignment
-			)
+		}
+		FileExists = true;
+		AddrHandlesT::iterator hFindAddr = m_AddrHandles.find(Addr);
+		if(hFindAddr!=m_AddrHandles.end())
 		{
-			CheckXErr(Close());
-			return ERR_EXTERNAL;
+			CloseH5handle(item_id, item_type);
+			item_id = -1;
+			RealHandlesT::iterator hFindHandle = m_RealHandles.find(hFindAddr->second);
+			if(hFindHandle == m_RealHandles.end())
+				return ERR_EXTERNAL;
+			hFile = &hFindHandle->second;
 		}
 	}
-	// Define the Access property list	
-	m_hFapl = H5Pcreate(H5P_FILE_ACCESS);
-	if(m_hFapl<0)
+	else
+		item_id = -1;
+	HandleExists = (hFile!=nullptr);
+
+	// 2. Creation mode basic checks
+	//    CREATE_NEW        - Creates, fails to overwrite
+	//    CREATE_ALWAYS     - Creates, overwrites
+	//    OPEN_EXISTING     - Opens, doesn't create
+	//    OPEN_ALWAYS       - Opens, creates
+	//    TRUNCATE_EXISTING - Opens, doesn't create, truncates to 0
+	if(!FileExists && (CreationDisposition==OPEN_EXISTING || CreationDisposition==TRUNCATE_EXISTING))
+		hRes = ERR_NOT_FOUND; // Those must fail if there's no file
+	else if(FileExists && CreationDisposition==CREATE_NEW)
+		hRes = ERR_IN_USE; // That one must fail if file already exists
+	else if(FileExists && (CreationDisposition==CREATE_ALWAYS || CreationDisposition==TRUNCATE_EXISTING) && (DesiredAccess&GENERIC_WRITE)==0)
+		hRes = ERR_ACCESS_DENIED; // That one must fail if file must be rewritten, but the write access not requested
+	else if(!FileExists && (CreationDisposition==OPEN_ALWAYS || CreationDisposition==CREATE_ALWAYS || CreationDisposition==CREATE_NEW) && (DesiredAccess&GENERIC_WRITE)==0)
+		hRes = ERR_ACCESS_DENIED; // That one must fail if file could be rewritten, but the write access not requested
+	if(hRes!=ERR_SUCCESS)
 	{
-		wchar_t H5Msg[512] = {0};
-		GetLastErrorDesc(H5Msg, sizeof(H5Msg)/2-1);
-		wchar_t Msg[512] = {0};
-		swprintf_s(Msg, sizeof(Msg)/2, L"Failed to open the file system: %ls", H5Msg);
-		ToLog(EV_ERROR, Msg);
-		CheckXErr(Close());
-		return ERR_EXTERNAL;
+		CloseH5handle(item_id, item_type);
+		return hRes;
 	}
-	// Init the driver with this fapl
-	m_Driver->Attach(m_hFapl);	
 
-	// Convert the filename to ansi
-	wchar_t UnicodePath[MAX_PATH]={0};
-	char AnsiPath[MAX_PATH]={0};
-	swprintf_s(UnicodePath, sizeof(UnicodePath)/2, L"%s\\%s.dat", m_DataFolder, FileName);	 
-	
-	WideCharToMultiByte( CP_ACP,                // ANSI Code Page
-						 0,                      // No special handling of unmapped chars
-						 UnicodePath,            // wide-character string to be converted
-						 lstrlenW( UnicodePath ),
-						 AnsiPath, 
-						 sizeof(AnsiPath),
-						 NULL, NULL );
+	// 3. If there's no handle, allocate it
+	if(!HandleExists)
+	{
+		// 3.1. If there's no file create it first
+		if(!FileExists)
+		{
+			if((hRes=_PathCreate(FileName, FILE_ATTRIBUTE_NORMAL, CreatedBy))!=ERR_SUCCESS)
+			{
+				return hRes;
+			}
+		}
+		// 3.2. A created file is opened now, an existing one is open since step 1
+		if(!FileExists)
+		{
+			if((hRes=_FollowPath(FileName, item_type, item_id))!=ERR_SUCCESS)
+				return hRes;
+			if(item_type!=H5I_DATASET || (hRes=_ObjectAddr(item_id, Addr))!=ERR_SUCCESS)
+			{
+				CloseH5handle(item_id, item_type);
+				return (hRes!=ERR_SUCCESS)?hRes:ERR_NOT_FOUND;
+			}
+		}
 
-	// Open or create the data file
-	if(Create==TRUE)
-		m_hFile = H5Fcreate(AnsiPath, 
-							H5F_ACC_EXCL,
-							m_hFcpl, 
-							m_hFapl);
-	else // Open
-		m_hFile = H5Fopen  (AnsiPath, 
-							H5F_ACC_RDWR,
-							m_hFapl);
+		// Initilialize the new real handle
+		RealHandle tmpFile;
+		tmpFile.wsPath     = FileName;
+		tmpFile.rawHandle  = item_id;
+		tmpFile.uReaders   = 0;
+		tmpFile.uWriters   = 0;
+		tmpFile.isFile     = true;
+		tmpFile.fShareMode = ShareMode;
+		tmpFile.objAddr    = Addr;
 
-	if(m_hFile < 0)
-	{
-		wchar_t Msg[512] = {0};
-		if(m_LastErr != ERR_ACCESS_DENIED)
+		// Load the persistent ranges, if there are any
+		if((hRes=_ReadRangeImage(item_id, tmpFile.rangeImage))!=ERR_SUCCESS && hRes!=ERR_NOT_FOUND)
 		{
-			wchar_t H5Msg[512] = {0};
-			GetLastErrorDesc(H5Msg, sizeof(H5Msg)/2-1);
-			swprintf_s(Msg, sizeof(Msg)/2, L"Failed to open the file system: %ls", H5Msg);
+			CloseH5handle(item_id, item_type);
+			return hRes;
 		}
-		else
-			swprintf_s(Msg, sizeof(Msg)/2, L"Failed to open the file system: Access denied");
+		// The chunk list of a deduplicated file stays in memory while it is open
+		if((hRes=_ReadChunkMap(item_id, tmpFile.chunkMap))!=ERR_SUCCESS && hRes!=ERR_NOT_FOUND)
+		{
+			CloseH5handle(item_id, item_type);
+			return hRes;
+		}
+		hRes = ERR_SUCCESS;
 
-		ToLog(EV_ERROR, Msg);
-		DWORD hRet = m_LastErr?m_LastErr:ERR_EXTERNAL;
-		CheckXErr(Close());
-		return hRet;
+		// The size is tracked in memory while the file is open
+		FileAttributesDos attr;
+		UINT64 FileSize = 0;
+		if((hRes=_ReadFileAttributes(item_id, ".", attr))!=ERR_SUCCESS ||
+			(FileSize=attr.QW_FILE_SIZE)==FILE_SIZE_UNKNOWN && (hRes=_DatasetSize(item_id, ".", FileSize))!=ERR_SUCCESS)
+		{
+			CloseH5handle(item_id, item_type);
+			return hRes;
+		}
+		tmpFile.fileSize = (file_offset_t)FileSize;
+		if((hRes=_InlineLayout(item_id, tmpFile.inlineCapacity))!=ERR_SUCCESS)
+		{
+			CloseH5handle(item_id, item_type);
+			return hRes;
+		}
+
+		// Place the new real handle into the collections
+		m_RealHandles[item_id]   = tmpFile;
+		m_AddrHandles[tmpFile.objAddr] = item_id;
+
+		// Get a reference from the collection
+		hFile = &m_RealHandles[item_id];
 	}
-	
-	// If it's create then initialize the meta records and check the results
-	if(Create && (hRes=_CreateMetaRecords(Name, BlockSize, Version))!=ERR_SUCCESS)
+
+	// 4. Increment RW lock counters
+	if(DesiredAccess & GENERIC_READ)
+		hFile->uReaders++;
+	if(DesiredAccess & GENERIC_WRITE)
+		hFile->uWriters++;
+
+	// 5. Check the share mode compatibility
+	//    Can fail only for the already opened handles
+	if((hFile->fShareMode & ShareMode) != ShareMode ||
+		HandleExists && ShareMode==0 ||
+		HandleExists && (hFile->fShareMode & FILE_SHARE_WRITE)==0 && (DesiredAccess&GENERIC_WRITE)>0 || // request write when no write share was previously set
+		HandleExists && (hFile->fShareMode & FILE_SHARE_READ)==0 && (DesiredAccess&GENERIC_READ)>0      // request read when no read share was previously set
+		)
 	{
-		CheckXErr(Close());
-		return hRes;
+		_ReleaseRealHandle(DesiredAccess, *hFile);
+		return ERR_ACCESS_DENIED;
 	}
 
-	// By now it must be created, so start the normal open routine
-	
-	// Read the file system header
-	CheckXErr(_ReadMetaRecords());	
 
+	hResFile = *hFile;
 	return ERR_SUCCESS;
 }
-DWORD VirtualFS::_DefineRawHeader(DWORD BlockSize, DWORD Version)
+DWORD VirtualFS::_ReleaseRealHandle(DWORD AccessMode, RealHandle hFile)
 {
-	DWORD hRes = ERR_SUCCESS;
-	// Generate the master key even if the FS is not 
-	std::srand(static_cast<int>(time(NULL)));
-	std::generate(MasterKey, MasterKey + sizeof(MasterKey), std::rand);
+	// 1. Find the real handle
+	RawHandle realKey = hFile.rawHandle;
+	RealHandlesT::iterator hFindHandle = m_RealHandles.find(realKey);
+	if(hFindHandle == m_RealHandles.end())
+		return ERR_NOT_FOUND;
 
-	// Calculate the hash of the unencrypted master key
-	MD5 hasher;
-	hasher.update(MasterKey, sizeof(MasterKey));
-	hasher.finalize();
+	// 2. Decrement RW lock counters	
+	if((AccessMode & GENERIC_READ) && hFile.uReaders>0)
+		hFindHandle->second.uReaders--;
+	if((AccessMode & GENERIC_WRITE) && hFile.uWriters>0)
+		hFindHandle->second.uWriters--;
 
-	//Generate random IV even if the FS is not encrypted
-	std::generate(IV, IV + sizeof(IV), std::rand);
+	// 3. Check the remaining readers/writers
+	bool SomeoneLeft = (hFindHandle->second.uReaders>0 || hFindHandle->second.uWriters>0);
+	if(SomeoneLeft)
+		return ERR_SUCCESS;
 
-	INFO.FS_VERSION   = Version;
-	INFO.BLOCK_SIZE   = BlockSize;
-	INFO.IS_ENCRYPTED = _IsCrypto();   
-	if(_IsCrypto())
-	{		
-		DWORD PwMode=0, PwAParam=0, PwBParam=0;
-		m_PwdCrypt->GetParams(&PwMode, &PwAParam, &PwBParam);
-		DWORD DataMode=0, DataAParam=0, DataBParam=0;
-		m_DataCrypt->GetParams(&DataMode, &DataAParam, &DataBParam);
-		
+	// 4. If no one uses this handle anymore then persist its size and actually close it
+	DWORD hRes = _FlushFileSize(hFindHandle->second);
+	CloseH5handle(hFile.rawHandle, hFile.isFile?H5I_DATASET:H5I_GROUP);
 
-		INFO.KEY_ENC_MODE   = PwMode;                   //     Mode for the master key encryptor
-		INFO.KEY_ENC_APARAM = PwAParam;                 // (A) Param  for the master key encryptor
-		INFO.KEY_ENC_BPARAM = PwBParam;                 // (B) Param  for the master key encryptor
-		INFO.DAT_ENC_MODE   = DataMode;                 //     Mode for the data blocks encryptor
-		INFO.DAT_ENC_APARAM = DataAParam;               // (A) Param  for the data blocks encryptor
-		INFO.DAT_ENC_BPARAM = DataBParam;               // (B) Param  for the data blocks encryptor
-		memcpy(INFO.MKEY_HASH, hasher.digest, 16);      // 16 byte hash of unencrypted master key used for its verification when access password is given.
+	// 5. Now remove it from the collections
+	m_AddrHandles.erase(hFindHandle->second.objAddr);
+	m_RealHandles.erase(realKey);
 
-		if((hRes = _AssignAccessPassword())!=ERR_SUCCESS)
-		{
-			ToLog(EV_ERROR, L"Failed to write the master key");
-			return ERR_EXTERNAL;
-		}
-	}
-	else
+	return hRes;
+}
+DWORD VirtualFS::_FileCloseInternal(UserHandlesT::iterator iiUserHandle)
+{
+	DWORD hRes = ERR_SUCCESS;
+	// Find the real handle where it points
+	UserHandle uhFile = iiUserHandle->second;
+	auto iiRealHandle = m_RealHandles.find(uhFile.hRealHandle);
+	if(iiRealHandle != m_RealHandles.end())
 	{
-		// When the FS in not encrpyted we write all the same meta fields, but we set them zeros
-		// and leave the keys unencrypted
-		INFO.KEY_ENC_MODE   = 0;                         //     Mode for the master key encryptor
-		INFO.KEY_ENC_APARAM = 0;                         // (A) Param  for the master key encryptor
-		INFO.KEY_ENC_BPARAM = 0;                         // (B) Param  for the master key encryptor
-		INFO.DAT_ENC_MODE   = 0;                         //     Mode for the data blocks encryptor
-		INFO.DAT_ENC_APARAM = 0;                         // (A) Param  for the data blocks encryptor
-		INFO.DAT_ENC_BPARAM = 0;                         // (B) Param  for the data blocks encryptor
+		RealHandle rhFile = iiRealHandle->second;
+
+		// 3. Close real handle
+		if((hRes=_ReleaseRealHandle(uhFile.fAccessMode, rhFile))!=ERR_SUCCESS)
+			return hRes;
+	}
+	// Remove user handle
+	m_UserHandles.erase(iiUserHandle);
 
+	return ERR_SUCCESS;
+}
+// Called with m_Lock held, the listings call it once per entry
+DWORD VirtualFS::_ReadFileAttributes(hid_t LocId, const char* Name, FileAttributesDos& Attr)
+{
+	// Name is relative to LocId, "." reads the attributes of LocId itself
+	DWORD hRes = ERR_SUCCESS;
+	hid_t ftype = -1;
+	std::vector<char> Legacy;
+	hid_t att = H5Aopen_by_name(LocId, Name, XDX_DOS_ATTR, H5P_DEFAULT, H5P_DEFAULT);
+	if(att<0)
+		return ERR_DISK_READ;
+	// The members are matched by name, a record written before the size was kept leaves it as is
+	Attr.QW_FILE_SIZE = FILE_SIZE_UNKNOWN;
+	if(H5Aread(att, m_hDosType, &Attr)>=0)
+		goto L_DONE;
 
-		memcpy(INFO.MKEY, MasterKey, sizeof(MasterKey)); // 128 byte master key encrypted with access password. Its decrypted form is used for data encyption.
-		memcpy(INFO.MKEY_HASH, hasher.digest, 16);       // 16 byte hash of unencrypted master key used for its verification when access password is given.
-		memcpy(INFO.IV, IV, sizeof(IV));                 // 16 byte IV vector encrypted with access password. Its decrypted form is used for data encyption.
+	// Written as the raw struct bytes in a fixed string before the compound type
+	if((ftype = H5Aget_type(att))<0 || H5Tget_class(ftype)!=H5T_STRING || H5Tget_size(ftype)<offsetof(FileAttributesDos, QW_FILE_SIZE))
+		{hRes = ERR_DISK_READ; goto L_DONE;}
+	Legacy.resize(max(H5Tget_size(ftype), sizeof(Attr)));
+	if(H5Aread(att, ftype, Legacy.data())<0)
+		{hRes = ERR_DISK_READ; goto L_DONE;}
+	memcpy(&Attr, Legacy.data(), sizeof(Attr));
+	// Those kept no size, it comes from the dataset extent
+	Attr.QW_FILE_SIZE = FILE_SIZE_UNKNOWN;
+L_DONE:
+	if(ftype>=0)
+		H5Tclose(ftype);
+	CloseH5handle(att, H5I_ATTR);
+	return hRes;
+}
+// Called with the write lock held
+DWORD VirtualFS::_WriteFileAttributes(hid_t ObjId, const FileAttributesDos& Attr, bool IsNew)
+{
+	hid_t att = -1;
+
+	// Committing the type once lets every object header refer to it instead of holding a copy
+	if(!m_DosTypeCommitted)
+	{
+		hid_t TypesId = -1;
+		DWORD hRes = _OpenSystemGroup(XDX_TYPES_GROUP, TypesId);
+		if(TypesId>=0)
+			H5Gclose(TypesId);
+		if(hRes!=ERR_SUCCESS)
+			return hRes;
+		if(H5Tcommit2(m_hFile, XDX_DOS_TYPE, m_hDosType, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT)<0)
+			return ERR_DISK_WRITE;
+		m_DosTypeCommitted = true;
+	}
+	_CompactTouchObject(ObjId);
+	if(!IsNew && (att = H5Aopen(ObjId, XDX_DOS_ATTR, H5P_DEFAULT))>=0)
+	{
+		herr_t Written = H5Awrite(att, m_hDosType, &Attr);
+		CloseH5handle(att, H5I_ATTR);
+		if(Written>=0)
+			return ERR_SUCCESS;
+		// A legacy string attribute does not convert, replace it
+		if(H5Adelete(ObjId, XDX_DOS_ATTR)<0)
+			return ERR_DISK_WRITE;
 	}
+	if((att = H5Acreate2(ObjId, XDX_DOS_ATTR, m_hDosType, m_hAttrSpace, H5P_DEFAULT, H5P_DEFAULT))<0)
+		return ERR_DISK_WRITE;
+	herr_t Written = H5Awrite(att, m_hDosType, &Attr);
+	CloseH5handle(att, H5I_ATTR);
+	return (Written<0)?ERR_DISK_WRITE:ERR_SUCCESS;
+}
+DWORD VirtualFS::_DatasetSize(hid_t LocId, const char* Name, UINT64& Size)
+{
+	// The extent of the byte dataset is the logical size
+	hsize_t dims[1] = {0};
+	hid_t DatasetId = -1, SpaceId = -1;
+	DWORD hRes = ERR_SUCCESS;
+	if((DatasetId = H5Dopen2(LocId, Name, H5P_DEFAULT))<0 ||
+		(SpaceId = H5Dget_space(DatasetId))<0 ||
+		H5Sget_simple_extent_dims(SpaceId, dims, NULL)!=1)
+		hRes = ERR_DISK_READ;
+	Size = dims[0];
+	CloseH5handle(SpaceId, H5I_DATASPACE);
+	CloseH5handle(DatasetId, H5I_DATASET);
 	return hRes;
 }
-DWORD VirtualFS::_AssignAccessPassword()
-{	
-	// The correct password be already assigned to PwdCrypt
+bool VirtualFS::_OpenFileSize(hid_t LocId, const char* Name, UINT64& Size)
+{
+	// Name is relative to LocId, as for _ReadFileAttributes
+	H5O_info_t info;
+	if(m_AddrHandles.empty() || H5Oget_info_by_name(LocId, Name, &info, H5P_DEFAULT)<0)
+		return false;
+	auto iiAddr = m_AddrHandles.find(info.addr);
+	if(iiAddr == m_AddrHandles.end())
+		return false;
+	auto iiRealHandle = m_RealHandles.find(iiAddr->second);
+	if(iiRealHandle == m_RealHandles.end())
+		return false;
+	Size = (UINT64)iiRealHandle->second.fileSize;
+	return true;
+}
+DWORD VirtualFS::_ObjectAddr(hid_t ObjId, haddr_t& Addr)
+{
+	// The address of the object header is unique in the container while the object lives
+	H5O_info_t info;
+	if(H5Oget_info(ObjId, &info)<0)
+		return ERR_DISK_READ;
+	Addr = info.addr;
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::_FlushFileSize(RealHandle& hFile)
+{
 	DWORD hRes = ERR_SUCCESS;
-
-	// 1. Use the access encryptor to encrypt the master key
-	PBYTE MKeyEnc = nullptr;
-	DWORD MKeyEncLength = 0;
-	if((hRes = m_PwdCrypt->EncryptAlloc(MasterKey, sizeof(MasterKey), TRUE, &MKeyEnc, &MKeyEncLength))!=ERR_SUCCESS)
+	// The chunk list goes first, the size must not cover the chunks it lacks
+	if(hFile.mapDirty)
 	{
-		ToLog(EV_ERROR, L"Failed to encrypt the meta key");
-		return ERR_EXTERNAL;
+		if((hRes=_WriteChunkMap(hFile.rawHandle, *hFile.chunkMap))!=ERR_SUCCESS)
+			return hRes;
+		hFile.mapDirty = false;
+		m_ChunkReleases.insert(m_ChunkReleases.end(), hFile.chunkReleases.begin(), hFile.chunkReleases.end());
+		hFile.chunkReleases.clear();
 	}
-	XDXAutoMem AutoMKey(MKeyEnc); // Auto delete using heapfree
-
-	// 2. Use the access encryptor to encrypt the IV
-	PBYTE IVEnc = nullptr;
-	DWORD IVEncLength = 0;
-	if((hRes = m_PwdCrypt->EncryptAlloc(IV, sizeof(IV), TRUE, &IVEnc, &IVEncLength))!=ERR_SUCCESS)
+	if(!hFile.sizeDirty)
+		return ERR_SUCCESS;
+	FileAttributesDos attr;
+	if((hRes=_ReadFileAttributes(hFile.rawHandle, ".", attr))!=ERR_SUCCESS)
+		return hRes;
+	attr.QW_FILE_SIZE  = (UINT64)hFile.fileSize;
+	attr.QW_WRITE_TIME = GetTime();
+	if((hRes=_WriteFileAttributes(hFile.rawHandle, attr, false))!=ERR_SUCCESS)
 	{
-		ToLog(EV_ERROR, L"Failed to encrypt the iv");
-		return ERR_EXTERNAL;
+		wchar_t Msg[512] = {0};
+		swprintf_s(Msg, _countof(Msg), L"Failed to persist the size of %ls: %ls", hFile.wsPath.c_str(), ErrorTexts::GetErrorDesc(hRes));
+		ToLog(EV_ERROR, Msg);
+		return hRes;
 	}
-	XDXAutoMem AutoIV(IVEnc); // Auto delete using heapfree
-
-	memcpy(INFO.MKEY, (PBYTE)MKeyEnc, MKeyEncLength); // 128 byte master key encrypted with access password. Its decrypted form is used for data encyption.
-	memcpy(INFO.IV, (PBYTE)IVEnc, IVEncLength);       // 16 byte IV vector encrypted with access password. Its decrypted form is used for data encyption.
+	hFile.sizeDirty = false;
 	return ERR_SUCCESS;
 }
-DWORD VirtualFS::_CreateMetaRecords(LPCWSTR Name, DWORD BlockSize, DWORD Version)
+DWORD VirtualFS::_FlushFileSizes()
 {
 	DWORD hRes = ERR_SUCCESS;
-	
-	//Fill the file system meta fields
-	CheckXErr(_WriteMetaBytes(FSMF_SZ_NAME, (PBYTE)Name, wcslen(Name)*2+2, FS_MAX_ALIAS));    // The alias of the file system
-	CheckXErr(_WriteMetaDW(FSMF_DW_FILES_COUNT, 0));                                          // The overall number of files
-	CheckXErr(_WriteMetaDW(FSMF_DW_DIR_COUNT, 0));                                            // The overall number of folders
-
-	return ERR_SUCCESS;
+	for(auto iiRealHandle = m_RealHandles.begin(); iiRealHandle != m_RealHandles.end(); iiRealHandle++)
+	{
+		DWORD hFlush = _FlushFileSize(iiRealHandle->second);
+		if(hFlush!=ERR_SUCCESS)
+			hRes = hFlush;
+	}
+	return hRes;
 }
-DWORD VirtualFS::_ReadMetaRecords()
+DWORD VirtualFS::_OpenSystemGroup(const char* Name, hid_t& GroupId)
 {
-	DWORD hRes = ERR_SUCCESS;
-	DWORD MaxSize = 0;
-	//ZeroMemory(&INFO, sizeof(INFO));
- 
-	MaxSize = sizeof(INFO.NAME);           CheckXErr(_ReadMeta(FSMF_SZ_NAME,           (PBYTE)INFO.NAME,            &MaxSize));     
-	MaxSize = sizeof(INFO.FILES_COUNT);    CheckXErr(_ReadMeta(FSMF_DW_FILES_COUNT,    (PBYTE)&INFO.FILES_COUNT,    &MaxSize));      
-	MaxSize = sizeof(INFO.DIR_COUNT);      CheckXErr(_ReadMeta(FSMF_DW_DIR_COUNT,      (PBYTE)&INFO.DIR_COUNT,      &MaxSize)); 
-
+	// The system group and its subgroups are created on the first use
+	const char* Groups[2] = {XDX_SYSTEM_GROUP, Name};
+	GroupId = -1;
+	for(int i = 0; i < 2; i++)
+	{
+		if(GroupId>=0)
+			H5Gclose(GroupId);
+		htri_t Exists = H5Lexists(m_hFile, Groups[i], H5P_DEFAULT);
+		if(Exists<0)
+			return ERR_DISK_READ;
+		GroupId = (Exists>0)?H5Gopen2(m_hFile, Groups[i], H5P_DEFAULT):H5Gcreate2(m_hFile, Groups[i], H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+		if(GroupId<0)
+			return ERR_DISK_WRITE;
+	}
 	return ERR_SUCCESS;
 }
-DWORD VirtualFS::_WriteMetaDW(DWORD MetaId, DWORD Value)
-{
-	return _WriteMetaBytes(MetaId, (PBYTE)&Value, sizeof(Value), 0);
-}
-DWORD VirtualFS::_WriteMetaQW(DWORD MetaId, UINT64 Value)
+DWORD VirtualFS::_RangeImageName(hid_t ObjId, char* Name, size_t Size)
 {
-	return _WriteMetaBytes(MetaId, (PBYTE)&Value, sizeof(Value), 0);
+	// The images are named by the object address, which survives renames
+	H5O_info_t info;
+	if(H5Oget_info(ObjId, &info)<0)
+		return ERR_DISK_READ;
+	sprintf_s(Name, Size, "%s/%llx", XDX_RANGES_GROUP, (unsigned long long)info.addr);
+	return ERR_SUCCESS;
 }
-DWORD VirtualFS::_WriteMetaBytes(DWORD MetaId, PBYTE ByteVal, DWORD Size, size_t MaxLength)
+DWORD VirtualFS::_ReadRangeImage(hid_t ObjId, RangeImagePtr& Image)
 {
-    hid_t   root;
-    DWORD   hRes = ERR_SUCCESS;
+	DWORD   hRes = ERR_SUCCESS;
+	hid_t   dataset = -1, dataspace = -1;
+	hsize_t dims[1] = {0};
+	char    ImageName[64];
+	Image.reset();
 
-	if((root = H5Gopen(m_hFile, "/", H5P_DEFAULT))<0)
-		{hRes = ERR_DISK_WRITE; goto L_DONE;}
-	if((hRes==_WriteAttributeBytes(root, MetaId, ByteVal, Size, MaxLength))!=ERR_SUCCESS)
-		{goto L_DONE;}
-L_DONE:
-    H5Gclose(root);
+	if((hRes=_RangeImageName(ObjId, ImageName, sizeof(ImageName)))!=ERR_SUCCESS)
+		return hRes;
+	// Most files have no image and the groups may be missing as well
+	if(H5Lexists(m_hFile, XDX_SYSTEM_GROUP, H5P_DEFAULT)<=0 ||
+		H5Lexists(m_hFile, XDX_RANGES_GROUP, H5P_DEFAULT)<=0 ||
+		H5Lexists(m_hFile, ImageName, H5P_DEFAULT)<=0)
+		return ERR_NOT_FOUND;
 
-    return hRes;
+	RangeImagePtr Loaded = std::make_shared<RangeImage>();
+	if((dataset = H5Dopen2(m_hFile, ImageName, H5P_DEFAULT))<0)
+		{hRes = ERR_DISK_READ; goto L_DONE;}
+	if((dataspace = H5Dget_space(dataset))<0 || H5Sget_simple_extent_dims(dataspace, dims, NULL)!=1)
+		{hRes = ERR_DISK_READ; goto L_DONE;}
+	// Read the image once, it's queried in place afterwards
+	Loaded->data.resize((size_t)dims[0]);
+	if(dims[0]>0 && H5Dread(dataset, H5T_NATIVE_UINT64, H5S_ALL, H5S_ALL, H5P_DEFAULT, Loaded->data.data())<0)
+		{hRes = ERR_DISK_READ; goto L_DONE;}
+	if(!Loaded->view.attach(Loaded->data.data(), Loaded->data.size()*sizeof(uint64_t)))
+	{
+		ToLog(EV_ERROR, L"The stored file ranges are corrupted");
+		hRes = ERR_DISK_READ;
+		goto L_DONE;
+	}
+	Image = Loaded;
+L_DONE:
+	CloseH5handle(dataspace, H5I_DATASPACE);
+	CloseH5handle(dataset, H5I_DATASET);
+	return hRes;
 }
-DWORD VirtualFS::_WriteAttributeBytes(hid_t ObjId, DWORD FieldId, PBYTE ByteVal, DWORD Size, size_t MaxLength)
+DWORD VirtualFS::_WriteRangeImage(hid_t ObjId, const std::vector<uint64_t>& Image)
 {
-	if(ByteVal==nullptr)
-		return ERR_ERROR_PARAM;
-	CAutoWriteLock l(m_Lock);
-    hid_t   dataspace, att;
-    hid_t   type;
-    DWORD   hRes = ERR_SUCCESS;
-    hsize_t dims[1] = {1};
-
-	if(MaxLength==0)
-		MaxLength = Size; // for integral types
+	DWORD   hRes = ERR_SUCCESS;
+	hid_t   group = -1, dataset = -1, dataspace = -1;
+	hsize_t dims[1] = {Image.size()};
+	char    ImageName[64];
 
-	char* AttrValue = new char[MaxLength];
-	
-    // Create a datatype to refer to
-    if((type = H5Tcopy (H5T_C_S1))<0)
+	if((hRes=_RangeImageName(ObjId, ImageName, sizeof(ImageName)))!=ERR_SUCCESS)
+		return hRes;
+	if((hRes=_OpenSystemGroup(XDX_RANGES_GROUP, group))!=ERR_SUCCESS)
+		goto L_DONE;
+	// The image size changes with every store, so the old one is replaced
+	if(H5Lexists(m_hFile, ImageName, H5P_DEFAULT)>0 && H5Ldelete(m_hFile, ImageName, H5P_DEFAULT)<0)
 		{hRes = ERR_DISK_WRITE; goto L_DONE;}
-    if(H5Tset_size (type, MaxLength)<0)
+	if((dataspace = H5Screate_simple(1, dims, NULL))<0)
 		{hRes = ERR_DISK_WRITE; goto L_DONE;}
-    if((dataspace = H5Screate_simple(1, dims, NULL))<0)
+	if((dataset = H5Dcreate2(m_hFile, ImageName, H5T_NATIVE_UINT64, dataspace, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT))<0)
 		{hRes = ERR_DISK_WRITE; goto L_DONE;}
-	// Convert the Attribute ID to a string
-	char AttrName[64];
-	sprintf_s(AttrName, sizeof(AttrName), "%d", FieldId);
-	// Create or open the attribute
-	if(!H5Aexists(ObjId, AttrName))
-	{
-		if((att = H5Acreate2(ObjId, AttrName, type, dataspace, H5P_DEFAULT, H5P_DEFAULT))<0)
-			{hRes = ERR_DISK_WRITE; goto L_DONE;}
-	}
-	else
-	{
-		if((att = H5Aopen(ObjId, AttrName, H5P_DEFAULT))<0)
-			{hRes = ERR_DISK_WRITE; goto L_DONE;}
-	}
-	// Copy to the buffer
-	memcpy_s(AttrValue, MaxLength, ByteVal, min(MaxLength, Size));
-
-	// Write attribute
-    if(H5Awrite(att, type, AttrValue)<0)
+	if(H5Dwrite(dataset, H5T_NATIVE_UINT64, H5S_ALL, H5S_ALL, H5P_DEFAULT, Image.data())<0)
 		{hRes = ERR_DISK_WRITE; goto L_DONE;}
 L_DONE:
-	CloseH5handle(att, H5I_ATTR);
-    H5Tclose(type);
+	CloseH5handle(dataset, H5I_DATASET);
 	CloseH5handle(dataspace, H5I_DATASPACE);
-	if(AttrValue!=nullptr)
-		delete [] AttrValue;
-
-    return hRes;
+	CloseH5handle(group, H5I_GROUP);
+	return hRes;
 }
-DWORD VirtualFS::_ReadMeta(DWORD MetaId, PBYTE ByteVal, DWORD *MaxSize)
+DWORD VirtualFS::_DeleteRangeImage(const char* ImageName)
 {
-    hid_t root;
-    DWORD hRes = ERR_SUCCESS;
-	
-	// Open the root group
-	if((root = H5Gopen(m_hFile, "/", H5P_DEFAULT))<0)
-		{hRes = ERR_DISK_READ; goto L_DONE;}
-	if((hRes==_ReadAttributeBytes(root, MetaId, ByteVal, *MaxSize))!=ERR_SUCCESS)
-		{goto L_DONE;}
-L_DONE:
-    H5Gclose(root);
-
-    return hRes;
+	if(H5Lexists(m_hFile, XDX_SYSTEM_GROUP, H5P_DEFAULT)<=0 ||
+		H5Lexists(m_hFile, XDX_RANGES_GROUP, H5P_DEFAULT)<=0 ||
+		H5Lexists(m_hFile, ImageName, H5P_DEFAULT)<=0)
+		return ERR_SUCCESS;
+	if(H5Ldelete(m_hFile, ImageName, H5P_DEFAULT)<0)
+		return ERR_DISK_WRITE;
+	return ERR_SUCCESS;
 }
-DWORD VirtualFS::_ReadAttributeBytes(hid_t ObjId, DWORD FieldId, PBYTE ByteVal, DWORD MaxSize)
+DWORD VirtualFS::_CollectRangeImages(hid_t ObjId, std::vector<std::string>& Names)
 {
-	if(ByteVal==nullptr)
-		return ERR_ERROR_PARAM;
-	if(MaxSize==0)
-		return ERR_ERROR_PARAM;
-	CAutoReadLock l(m_Lock);
-    hid_t att;
-    hid_t type, ftype;
-    H5T_class_t type_class;
-	char* AttrValue = nullptr;
-	size_t ValLength = 0;
-    DWORD hRes = ERR_SUCCESS;
-    hsize_t   dims[1] = {1};
+	class ImageCollector
+	{
+	public:
+		VirtualFS*                parent;
+		std::vector<std::string>* names;
+		static herr_t visit(hid_t obj_id, const char *name, const H5O_info_t *info, void *opdata)
+		{
+			ImageCollector *me = (ImageCollector *)opdata;
+			if(info->type!=H5O_TYPE_DATASET)
+				return 0;
+			char ImageName[64];
+			sprintf_s(ImageName, sizeof(ImageName), "%s/%llx", XDX_RANGES_GROUP, (unsigned long long)info->addr);
+			if(H5Lexists(me->parent->m_hFile, ImageName, H5P_DEFAULT)>0)
+				me->names->push_back(ImageName);
+			return 0;
+		}
+	};
+	Names.clear();
+	// Without the group no file ever stored its ranges
+	if(H5Lexists(m_hFile, XDX_SYSTEM_GROUP, H5P_DEFAULT)<=0 ||
+		H5Lexists(m_hFile, XDX_RANGES_GROUP, H5P_DEFAULT)<=0)
+		return ERR_SUCCESS;
+	ImageCollector collector;
+	collector.parent = this;
+	collector.names  = &Names;
+	if(H5Ovisit(ObjId, H5_INDEX_NAME, H5_ITER_NATIVE, ImageCollector::visit, &collector)<0)
+		return ERR_DISK_READ;
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::_OpenChunkStore()
+{
+	if(m_Chunks.IsOpen())
+		return ERR_SUCCESS;
+	// A chunk of a file is a chunk of its dataset, see _PathCreate
+	hid_t GroupId = -1;
+	DWORD hRes = _OpenSystemGroup(XDX_CHUNKS_GROUP, GroupId);
+	if(hRes==ERR_SUCCESS)
+		hRes = m_Chunks.Open(GroupId, m_Driver->GetBlockSize()*FILE_CHUNK_BLOCKS);
+	CloseH5handle(GroupId, H5I_GROUP);
+	return hRes;
+}
+void VirtualFS::_ChunkMapName(haddr_t Addr, char* Name, size_t Size)
+{
+	sprintf_s(Name, Size, "%s/%llx", XDX_MAPS_GROUP, (unsigned long long)Addr);
+}
+DWORD VirtualFS::_ReadChunkMap(hid_t ObjId, ChunkMapPtr& Map)
+{
+	DWORD      hRes = ERR_SUCCESS;
+	hid_t      dataset = -1, dataspace = -1;
+	hsize_t    dims[1] = {0};
+	char       MapName[64];
+	H5O_info_t info;
+	Map.reset();
+
+	if(H5Oget_info(ObjId, &info)<0)
+		return ERR_DISK_READ;
+	_ChunkMapName(info.addr, MapName, sizeof(MapName));
+	if(H5Lexists(m_hFile, XDX_SYSTEM_GROUP, H5P_DEFAULT)<=0 ||
+		H5Lexists(m_hFile, XDX_MAPS_GROUP, H5P_DEFAULT)<=0 ||
+		H5Lexists(m_hFile, MapName, H5P_DEFAULT)<=0)
+		return ERR_NOT_FOUND;
+	if((hRes=_OpenChunkStore())!=ERR_SUCCESS)
+		return hRes;
 
-	// Convert the Attribute ID to a string
-	char AttrName[64];
-	sprintf_s(AttrName, sizeof(AttrName), "%d", FieldId);
-		
-	// Open the dataset's attribute
-	if((att = H5Aopen(ObjId, AttrName, H5P_DEFAULT))<0)
-		{hRes = ERR_DISK_READ; goto L_DONE;}
-	
-	// Get the attribute type
-    if((ftype = H5Aget_type(att))<0)
+	ChunkMapPtr Loaded = std::make_shared<std::vector<uint64_t>>();
+	if((dataset = H5Dopen2(m_hFile, MapName, H5P_DEFAULT))<0 ||
+		(dataspace = H5Dget_space(dataset))<0 || H5Sget_simple_extent_dims(dataspace, dims, NULL)!=1)
 		{hRes = ERR_DISK_READ; goto L_DONE;}
-	
-    if((type_class = H5Tget_class(ftype))!=H5T_STRING) 
-		{hRes = ERR_DISK_READ; goto L_DONE;}
-	
-    if((type = H5Tget_native_type(ftype, H5T_DIR_ASCEND))<0)
+	Loaded->resize((size_t)dims[0]);
+	if(dims[0]>0 && H5Dread(dataset, H5T_NATIVE_UINT64, H5S_ALL, H5S_ALL, H5P_DEFAULT, Loaded->data())<0)
 		{hRes = ERR_DISK_READ; goto L_DONE;}
-
-	if((ValLength = H5Tget_size(ftype))<0)
+	Map = Loaded;
+L_DONE:
+	CloseH5handle(dataspace, H5I_DATASPACE);
+	CloseH5handle(dataset, H5I_DATASET);
+	return hRes;
+}
+DWORD VirtualFS::_WriteChunkMap(hid_t ObjId, const std::vector<uint64_t>& Map)
+{
+	DWORD      hRes = ERR_SUCCESS;
+	hid_t      group = -1, dataset = -1, dataspace = -1, dcpl = -1;
+	hsize_t    dims[1] = {Map.size()};
+	hsize_t    maxdims[1] = {H5S_UNLIMITED};
+	hsize_t    chunk[1] = {256};
+	char       MapName[64];
+	H5O_info_t info;
+
+	if(H5Oget_info(ObjId, &info)<0)
+		return ERR_DISK_READ;
+	_ChunkMapName(info.addr, MapName, sizeof(MapName));
+	_CompactTouch(info.addr);
+	// The references reach the index before any list holds them
+	if((hRes=_OpenChunkStore())!=ERR_SUCCESS || (hRes=m_Chunks.Flush())!=ERR_SUCCESS)
+		return hRes;
+	if(H5Lexists(m_hFile, XDX_SYSTEM_GROUP, H5P_DEFAULT)>0 &&
+		H5Lexists(m_hFile, XDX_MAPS_GROUP, H5P_DEFAULT)>0 &&
+		H5Lexists(m_hFile, MapName, H5P_DEFAULT)>0)
+		dataset = H5Dopen2(m_hFile, MapName, H5P_DEFAULT);
+	else
+	{
+		// The list grows with the file, so it is extendible unlike a range image
+		if((hRes=_OpenSystemGroup(XDX_MAPS_GROUP, group))!=ERR_SUCCESS)
+			goto L_DONE;
+		hsize_t empty[1] = {0};
+		if((dataspace = H5Screate_simple(1, empty, maxdims))<0 ||
+			(dcpl = H5Pcreate(H5P_DATASET_CREATE))<0 || H5Pset_chunk(dcpl, 1, chunk)<0)
+			{hRes = ERR_DISK_WRITE; goto L_DONE;}
+		dataset = H5Dcreate2(m_hFile, MapName, H5T_NATIVE_UINT64, dataspace, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+	}
+	if(dataset<0 || H5Dset_extent(dataset, dims)<0)
+		{hRes = ERR_DISK_WRITE; goto L_DONE;}
+	if(dims[0]>0 && H5Dwrite(dataset, H5T_NATIVE_UINT64, H5S_ALL, H5S_ALL, H5P_DEFAULT, Map.data())<0)
+		{hRes = ERR_DISK_WRITE; goto L_DONE;}
+L_DONE:
+	CloseH5handle(dcpl, H5I_GENPROP_LST);
+	CloseH5handle(dataset, H5I_DATASET);
+	CloseH5handle(dataspace, H5I_DATASPACE);
+	CloseH5handle(group, H5I_GROUP);
+	return hRes;
+}
+DWORD VirtualFS::_DeleteChunkMap(const char* MapName)
+{
+	DWORD   hRes = ERR_SUCCESS;
+	hid_t   dataset = -1, dataspace = -1;
+	hsize_t dims[1] = {0};
+	std::vector<uint64_t> Map;
+	if(H5Lexists(m_hFile, XDX_SYSTEM_GROUP, H5P_DEFAULT)<=0 ||
+		H5Lexists(m_hFile, XDX_MAPS_GROUP, H5P_DEFAULT)<=0 ||
+		H5Lexists(m_hFile, MapName, H5P_DEFAULT)<=0)
+		return ERR_SUCCESS;
+	if((hRes=_OpenChunkStore())!=ERR_SUCCESS)
+		return hRes;
+	if((dataset = H5Dopen2(m_hFile, MapName, H5P_DEFAULT))<0 ||
+		(dataspace = H5Dget_space(dataset))<0 || H5Sget_simple_extent_dims(dataspace, dims, NULL)!=1)
 		{hRes = ERR_DISK_READ; goto L_DONE;}
-	
-	// Allocate buffer to read the whole value
-	AttrValue = new char[ValLength];
-
-	// Read attribute
-    if(H5Aread(att, type, AttrValue)<0)
+	Map.resize((size_t)dims[0]);
+	if(dims[0]>0 && H5Dread(dataset, H5T_NATIVE_UINT64, H5S_ALL, H5S_ALL, H5P_DEFAULT, Map.data())<0)
 		{hRes = ERR_DISK_READ; goto L_DONE;}
-
-	// Copy to the buffer
-	//ZeroMemory(Buffer, BufLength);
-	memcpy_s(ByteVal, MaxSize, AttrValue, min(ValLength, MaxSize));
+	// The list goes before the references, a failure in between leaks chunks rather than losing them
+	CloseH5handle(dataspace, H5I_DATASPACE);
+	CloseH5handle(dataset, H5I_DATASET);
+	dataset = dataspace = -1;
+	if(H5Ldelete(m_hFile, MapName, H5P_DEFAULT)<0)
+		{hRes = ERR_DISK_WRITE; goto L_DONE;}
+	m_ChunkReleases.insert(m_ChunkReleases.end(), Map.begin(), Map.end());
+	if(m_ChunkReleases.size() >= MaxHeldChunks)
+		hRes = _ReleaseChunks(true);
 L_DONE:
-    H5Aclose(att);
-    H5Tclose(type);
-	if(AttrValue!=nullptr)
-		delete [] AttrValue;
-
-    return hRes;
+	CloseH5handle(dataspace, H5I_DATASPACE);
+	CloseH5handle(dataset, H5I_DATASET);
+	return hRes;
 }
-BOOL  VirtualFS::_IsPathValid(LPCWSTR Path)
+DWORD VirtualFS::_CollectChunkMaps(hid_t ObjId, std::vector<std::string>& Names)
 {
-	// Pointer is valid
-	if(Path==nullptr)
-		return FALSE; 
-	size_t PathLen = wcslen(Path);
-	// Path isn't too short
-	if(PathLen<2 || PathLen >= MAX_PATH)
-		return FALSE;
-	// Path starts with a slash
-	if(Path[0]!=L'/')
-		return FALSE;
-	// No empty path components
-	if(wcsstr(Path, L"//")!=nullptr)
-		return FALSE;
-	// Path doesn't end with a slash
-	if(Path[PathLen-1]==L'/')
-		return FALSE;
-	return TRUE;
+	class MapCollector
+	{
+	public:
+		VirtualFS*                parent;
+		std::vector<std::string>* names;
+		static herr_t visit(hid_t obj_id, const char *name, const H5O_info_t *info, void *opdata)
+		{
+			MapCollector *me = (MapCollector *)opdata;
+			if(info->type!=H5O_TYPE_DATASET)
+				return 0;
+			char MapName[64];
+			me->parent->_ChunkMapName(info->addr, MapName, sizeof(MapName));
+			if(H5Lexists(me->parent->m_hFile, MapName, H5P_DEFAULT)>0)
+				me->names->push_back(MapName);
+			return 0;
+		}
+	};
+	Names.clear();
+	// Without the group no file was ever deduplicated
+	if(H5Lexists(m_hFile, XDX_SYSTEM_GROUP, H5P_DEFAULT)<=0 ||
+		H5Lexists(m_hFile, XDX_MAPS_GROUP, H5P_DEFAULT)<=0)
+		return ERR_SUCCESS;
+	MapCollector collector;
+	collector.parent = this;
+	collector.names  = &Names;
+	if(H5Ovisit(ObjId, H5_INDEX_NAME, H5_ITER_NATIVE, MapCollector::visit, &collector)<0)
+		return ERR_DISK_READ;
+	return ERR_SUCCESS;
 }
-DWORD VirtualFS::_FollowPath(LPCWSTR Path, H5I_type_t& ObjectType, hid_t& ObjectId)
+DWORD VirtualFS::_ChunkRead(RealHandle& hFile, LPVOID Buffer, UINT64 Offset, size_t Length)
 {
-	DWORD hRes = ERR_SUCCESS;
-	ObjectType = H5I_UNINIT;
-	ObjectId = -1;
-
-	// Check the given path
-	if(Path == nullptr)
-		return ERR_NOT_FOUND;
-	size_t PathLength = wcslen(Path);
-	if(PathLength==0)
-		return ERR_NOT_FOUND;
-	if(PathLength<1 || PathLength>=MAX_PATH)
-		return ERR_ERROR_PARAM;
-	if(Path[0]!=L'/')
-		return ERR_ERROR_PARAM;
-	
-	// Convert the name to utf8
-	std::string Utf8Name = TICUtils::WStringToUtf8(Path);
-
-	// Check that the given name exists
-	// first try to check it as a dataset
-	ObjectId = H5Dopen2(m_hFile, Utf8Name.c_str(), H5P_DEFAULT);
-	if(ObjectId<0)
-	{		
-		// now as a group
-		ObjectId = H5Gopen2(m_hFile, Utf8Name.c_str(), H5P_DEFAULT);
-		if(ObjectId<0)
+	DWORD  hRes = ERR_SUCCESS;
+	size_t ChunkSize = m_Chunks.GetChunkSize();
+	const std::vector<uint64_t>& Map = *hFile.chunkMap;
+	std::vector<char> Chunk;
+	for(size_t Done = 0; Done < Length;)
+	{
+		UINT64 Index = (Offset + Done) / ChunkSize;
+		size_t From  = (size_t)((Offset + Done) % ChunkSize);
+		size_t Count = min(ChunkSize - From, Length - Done);
+		char*  Dst   = (char*)Buffer + Done;
+		uint64_t Ref = (Index < Map.size())?Map[(size_t)Index]:0;
+		// A whole chunk lands in the caller's buffer directly
+		if(Count==ChunkSize)
+			hRes = m_Chunks.Get(Ref, Dst);
+		else
 		{
-			hRes = ERR_NOT_FOUND;
-			Rollback();
-			return hRes;
+			Chunk.resize(ChunkSize);
+			if((hRes=m_Chunks.Get(Ref, Chunk.data()))==ERR_SUCCESS)
+				memcpy(Dst, Chunk.data() + From, Count);
 		}
-		// It's a group
-		ObjectType = H5I_GROUP;
-	}
-	else // it's a file
-	{
-		ObjectType = H5I_DATASET;
+		if(hRes!=ERR_SUCCESS)
+			return hRes;
+		Done += Count;
 	}
-
-	return hRes;
+	return ERR_SUCCESS;
 }
-DWORD VirtualFS::_PathCreate(LPCWSTR Name, DWORD Attributes, UINT64 CreatedBy)
+DWORD VirtualFS::_ChunkWrite(RealHandle& hFile, const void* Buffer, UINT64 Offset, size_t Length)
 {
-	DWORD hRes = ERR_SUCCESS;
-	std::string Utf8Name;
-	if(Name == nullptr)
-		return ERR_ERROR_PARAM;
-
-	bool isFolder = (Attributes & FILE_ATTRIBUTE_DIRECTORY)>0;
-	
-	// Check the given path
-	if(!_IsPathValid(Name))
-		return ERR_ERROR_PARAM;
-	
-	hid_t lcpl_id = H5P_DEFAULT;
-	hid_t path_id = -1;
-
-	// Setup the group to support unicode (Utf8)
-	if((lcpl_id = H5Pcreate(H5P_LINK_CREATE)) < 0 ||
-		H5Pset_char_encoding(lcpl_id, H5T_CSET_UTF8) < 0)
+	DWORD  hRes = ERR_SUCCESS;
+	size_t ChunkSize = m_Chunks.GetChunkSize();
+	std::vector<uint64_t>& Map = *hFile.chunkMap;
+	std::vector<char> Chunk(ChunkSize);
+	UINT64 End = Offset + Length;
+	if(Map.size() < (End + ChunkSize - 1) / ChunkSize)
+		Map.resize((size_t)((End + ChunkSize - 1) / ChunkSize), 0);
+	for(size_t Done = 0; Done < Length;)
 	{
-		wchar_t H5Msg[512] = {0};
-		GetLastErrorDesc(H5Msg, sizeof(H5Msg)/2-1);
-		wchar_t Msg[512] = {0};
-		swprintf_s(Msg, sizeof(Msg)/2, L"Failed to create an FS element: %ls", H5Msg);
-		ToLog(EV_ERROR, Msg);
-		Rollback();
-		goto L_DONE;
+		size_t Index = (size_t)((Offset + Done) / ChunkSize);
+		size_t From  = (size_t)((Offset + Done) % ChunkSize);
+		size_t Count = min(ChunkSize - From, Length - Done);
+		// A partial chunk keeps the rest of its content
+		if(Count < ChunkSize && (hRes=m_Chunks.Get(Map[Index], Chunk.data()))!=ERR_SUCCESS)
+			return hRes;
+		memcpy(Chunk.data() + From, (const char*)Buffer + Done, Count);
+		uint64_t Ref = 0;
+		if((hRes=m_Chunks.Put(Chunk.data(), Ref))!=ERR_SUCCESS)
+			return hRes;
+		// The list on the disk holds the old chunk until the new one replaces it
+		if(Map[Index]!=0)
+			hFile.chunkReleases.push_back(Map[Index]);
+		Map[Index]     = Ref;
+		hFile.mapDirty = true;
+		Done += Count;
 	}
-	// Convert the name to utf8
-	Utf8Name = TICUtils::WStringToUtf8(Name);
-	
-	// Check that the given name is not used already
-	path_id = isFolder?H5Gopen2(m_hFile, Utf8Name.c_str(), H5P_DEFAULT):H5Dopen2(m_hFile, Utf8Name.c_str(), H5P_DEFAULT);
-	if(path_id>0)
+	if(End > (UINT64)hFile.fileSize)
+	{
+		hFile.fileSize  = (file_offset_t)End;
+		hFile.sizeDirty = true;
+	}
+	// A file rewritten over and over would hold its old chunks for good
+	if(hFile.chunkReleases.size() + m_ChunkReleases.size() >= MaxHeldChunks &&
+		((hRes=_FlushFileSize(hFile))!=ERR_SUCCESS || (hRes=_ReleaseChunks(true))!=ERR_SUCCESS))
+		return hRes;
+	return ERR_SUCCESS;
+}
+////////////////////////////////////////////////////////////////
+// Releases the chunks dropped by the chunk maps written so far.
+// Until the maps are on the disk the chunks must stay, a crash
+// would bring the old maps back, so the caller has flushed the
+// file, or asks to flush it with Flush.
+////////////////////////////////////////////////////////////////
+DWORD VirtualFS::_ReleaseChunks(bool Flush)
+{
+	if(m_ChunkReleases.empty())
+		return ERR_SUCCESS;
+	if(Flush && H5Fflush(m_hFile, H5F_SCOPE_LOCAL)<0)
+		return ERR_DISK_WRITE;
+	for(size_t i = 0; i < m_ChunkReleases.size(); i++)
+		m_Chunks.Release(m_ChunkReleases[i]);
+	m_ChunkReleases.clear();
+	if(m_Compacting!=nullptr)
+		m_Compacting->chunks = true;
+	return ERR_SUCCESS;
+}
+UINT64 VirtualFS::_InlineCapacity(UINT64 Size)
+{
+	// The capacity doubles as the file grows, a reshape per doubling at most
+	if(Size > m_InlineLimit)
+		return 0;
+	UINT64 Capacity = INLINE_FILE_MIN;
+	while(Capacity < Size)
+		Capacity <<= 1;
+	return min(Capacity, (UINT64)m_InlineLimit);
+}
+DWORD VirtualFS::_InlineLayout(hid_t DatasetId, UINT64& Capacity)
+{
+	DWORD   hRes = ERR_SUCCESS;
+	hid_t   dcpl = -1, space = -1;
+	hsize_t dims[1] = {0};
+	Capacity = 0;
+	if((dcpl = H5Dget_create_plist(DatasetId))<0)
+		return ERR_DISK_READ;
+	if(H5Pget_layout(dcpl)==H5D_COMPACT)
 	{
-		hRes = ERR_DUPLICATE;
-		Rollback();
-		goto L_DONE;
+		if((space = H5Dget_space(DatasetId))<0 || H5Sget_simple_extent_dims(space, dims, NULL)!=1)
+			hRes = ERR_DISK_READ;
+		Capacity = dims[0];
 	}
+	CloseH5handle(space, H5I_DATASPACE);
+	CloseH5handle(dcpl, H5I_GENPROP_LST);
+	return hRes;
+}
+////////////////////////////////////////////////////////////////
+// Moves an open file to a new dataset: a compact one of Capacity
+// bytes, or a chunked one when Capacity is 0. A compact dataset
+// can not be resized, so this is how an inline file grows. The
+// new object takes the name of the old one and its range image,
+// and the handles of the file are rekeyed to it, Key included.
+////////////////////////////////////////////////////////////////
+DWORD VirtualFS::_ReshapeFile(RawHandle& Key, UINT64 Capacity)
+{
+	auto iiRealHandle = m_RealHandles.find(Key);
+	if(iiRealHandle == m_RealHandles.end())
+		return ERR_EXTERNAL;
+	RealHandle& hFile = iiRealHandle->second;
+	DWORD   hRes = ERR_SUCCESS;
+	hid_t   dataset = -1, space = -1, memspace = -1, dcpl = -1, lcpl = -1;
+	hsize_t Start[1]   = {0};
+	hsize_t Size[1]    = {(hsize_t)hFile.fileSize};
+	hsize_t dims[1]    = {(Capacity>0)?Capacity:Size[0]};
+	hsize_t maxdims[1] = {(Capacity>0)?Capacity:H5S_UNLIMITED};
+	hsize_t chunk_dims = m_Driver->GetBlockSize()*FILE_CHUNK_BLOCKS;
+	std::vector<char> Data((size_t)Size[0]);
+	std::string Utf8Name;
+	char OldImage[64] = {0}, NewImage[64] = {0};
+	bool Linked = false;
+	ssize_t NameLength = 0;
+	haddr_t NewAddr = HADDR_UNDEF;
+
+	// 0. The name the object has now, wsPath is the one it was opened with
+	if((NameLength = H5Iget_name(hFile.rawHandle, NULL, 0))<=0)
+		{hRes = ERR_NOT_FOUND; goto L_DONE;}
+	Utf8Name.resize((size_t)NameLength + 1);
+	H5Iget_name(hFile.rawHandle, &Utf8Name[0], Utf8Name.size());
+	Utf8Name.resize((size_t)NameLength);
+
+	// 1. The data is small, it goes over in one piece
+	if(Size[0]>0 &&
+		((space = H5Dget_space(hFile.rawHandle))<0 ||
+		H5Sselect_hyperslab(space, H5S_SELECT_SET, Start, NULL, Size, NULL)<0 ||
+		(memspace = H5Screate_simple(1, Size, NULL))<0 ||
+		H5Dread(hFile.rawHandle, H5T_NATIVE_SCHAR, memspace, space, H5P_DEFAULT, Data.data())<0))
+		{hRes = ERR_DISK_READ; goto L_DONE;}
+	CloseH5handle(space, H5I_DATASPACE);
+	space = -1;
+
+	// 2. The new dataset stays anonymous until it is complete
+	if((dcpl = H5Pcreate(H5P_DATASET_CREATE))<0 ||
+		((Capacity>0)?H5Pset_layout(dcpl, H5D_COMPACT):H5Pset_chunk(dcpl, 1, &chunk_dims))<0 ||
+		(space = H5Screate_simple(1, dims, maxdims))<0 ||
+		(dataset = H5Dcreate_anon(m_hFile, H5T_NATIVE_SCHAR, space, dcpl, H5P_DEFAULT))<0)
+		{hRes = ERR_DISK_WRITE; goto L_DONE;}
+	// The handles are rekeyed by the address, without it the swap must not happen
+	if((hRes=_ObjectAddr(dataset, NewAddr))!=ERR_SUCCESS)
+		goto L_DONE;
+	if(Size[0]>0 &&
+		(H5Sselect_hyperslab(space, H5S_SELECT_SET, Start, NULL, Size, NULL)<0 ||
+		H5Dwrite(dataset, H5T_NATIVE_SCHAR, memspace, space, H5P_DEFAULT, Data.data())<0))
+		{hRes = ERR_DISK_WRITE; goto L_DONE;}
+	if((hRes=_CopyAttributes(hFile.rawHandle, dataset, m_hDosType))!=ERR_SUCCESS)
+		goto L_DONE;
 
-	// Create a group or a dataset with the given name in the file.
-	if(isFolder)
+	// 3. The range image follows the address
+	if(H5Lexists(m_hFile, XDX_SYSTEM_GROUP, H5P_DEFAULT)>0 && H5Lexists(m_hFile, XDX_RANGES_GROUP, H5P_DEFAULT)>0 &&
+		_RangeImageName(hFile.rawHandle, OldImage, sizeof(OldImage))==ERR_SUCCESS && H5Lexists(m_hFile, OldImage, H5P_DEFAULT)>0)
 	{
-		path_id = H5Gcreate2(m_hFile, Utf8Name.c_str(), lcpl_id, H5P_DEFAULT, H5P_DEFAULT); // Create a group
+		if((hRes=_RangeImageName(dataset, NewImage, sizeof(NewImage)))!=ERR_SUCCESS)
+			goto L_DONE;
+		if(H5Lmove(m_hFile, OldImage, m_hFile, NewImage, H5P_DEFAULT, H5P_DEFAULT)<0)
+			{hRes = ERR_DISK_WRITE; goto L_DONE;}
 	}
-	else
-	{
-		// Define a dataspace 
-		hsize_t dims[1]  = {0};           // dataset dimensions at creation time
-		hsize_t maxdims[1] = {H5S_UNLIMITED};
-		hid_t dataspace = H5Screate_simple (1, dims, maxdims); 
 
-		// Modify dataset creation properties, enable chunking 
-		hsize_t chunk_dims = m_Driver->GetBlockSize()*FILE_CHUNK_BLOCKS;
-		hid_t prop = H5Pcreate (H5P_DATASET_CREATE);
-		if(H5Pset_chunk (prop, 1, &chunk_dims)>=0)
-		{
-			path_id = H5Dcreate2 (m_hFile, Utf8Name.c_str(), H5T_NATIVE_SCHAR, dataspace, H5P_DEFAULT, prop, H5P_DEFAULT); // Create a data file
-		}
-		
-		CloseH5handle(dataspace, H5I_DATASPACE);  // close the space
-		CloseH5handle(prop, H5I_GENPROP_LST);     // close create property list
-	}
-	if(path_id<0)
+	// 4. Swap the objects under the name, the old one lives on while it is open
+	if((lcpl = H5Pcreate(H5P_LINK_CREATE))<0 || H5Pset_char_encoding(lcpl, H5T_CSET_UTF8)<0 ||
+		H5Ldelete(m_hFile, Utf8Name.c_str(), H5P_DEFAULT)<0)
+		{hRes = ERR_DISK_WRITE; goto L_DONE;}
+	if(H5Olink(dataset, m_hFile, Utf8Name.c_str(), lcpl, H5P_DEFAULT)>=0)
+		Linked = true;
+	else
 	{
-		hRes = ERR_NOT_FOUND;
-		Rollback();
-		goto L_DONE;
+		H5Olink(hFile.rawHandle, m_hFile, Utf8Name.c_str(), lcpl, H5P_DEFAULT);
+		hRes = ERR_DISK_WRITE;
 	}
-
-	// Write its attributes
-	uint64_t Time = GetTime();
-	
-	FileAttributesDos attr;
-	attr.DW_FILE_ATTRIBUTES = Attributes ; 
-	attr.QW_CREATED_BY      = CreatedBy      ; 
-	attr.QW_CREATION_TIME   = Time   ; 
-	attr.QW_ACCESS_TIME     = Time ; 
-	attr.QW_WRITE_TIME      = Time  ; 
-	
-	if( (hRes=_WriteAttributeBytes(path_id, FILE_ATTRIBUTES_DOS, (PBYTE)&attr, sizeof(attr), 0))!=ERR_SUCCESS)
+L_DONE:
+	if(!Linked && NewImage[0]!=0)
+		H5Lmove(m_hFile, NewImage, m_hFile, OldImage, H5P_DEFAULT, H5P_DEFAULT);
+	CloseH5handle(lcpl, H5I_GENPROP_LST);
+	CloseH5handle(dcpl, H5I_GENPROP_LST);
+	CloseH5handle(memspace, H5I_DATASPACE);
+	CloseH5handle(space, H5I_DATASPACE);
+	if(!Linked)
 	{
+		CloseH5handle(dataset, H5I_DATASET);
 		wchar_t Msg[512] = {0};
-		swprintf_s(Msg, sizeof(Msg)/2, L"Failed to create an FS element (iNode attributes): %ls", ErrorTexts::GetErrorDesc(hRes));
+		swprintf_s(Msg, _countof(Msg), L"Failed to reshape %ls: %ls", hFile.wsPath.c_str(), ErrorTexts::GetErrorDesc(hRes));
 		ToLog(EV_ERROR, Msg);
-		Rollback();
-		goto L_DONE;
+		return hRes;
 	}
 
-	// Increment the number of directories
-	if(isFolder)
+	// 5. Rekey the handles, the new object has a new address
+	RealHandle Moved = std::move(hFile);
+	CloseH5handle(Moved.rawHandle, H5I_DATASET);
+	m_RealHandles.erase(iiRealHandle);
+	m_AddrHandles.erase(Moved.objAddr);
+	Moved.rawHandle      = dataset;
+	Moved.inlineCapacity = Capacity;
+	Moved.objAddr        = NewAddr;
+	m_AddrHandles[Moved.objAddr] = dataset;
+	m_RealHandles[dataset] = std::move(Moved);
+	for(auto iiUserHandle = m_UserHandles.begin(); iiUserHandle != m_UserHandles.end(); iiUserHandle++)
 	{
-		INFO.DIR_COUNT++;
-		hRes=_WriteMetaDW(FSMF_DW_DIR_COUNT, INFO.DIR_COUNT);
+		if(iiUserHandle->second.hRealHandle==Key)
+			iiUserHandle->second.hRealHandle = dataset;
 	}
-	else
+	Key = dataset;
+	return ERR_SUCCESS;
+}
+DWORD VirtualFS::_BuildPathIndex()
+{
+	class PathCollector
 	{
-		INFO.FILES_COUNT++;
-		hRes=_WriteMetaDW(FSMF_DW_FILES_COUNT, INFO.FILES_COUNT);
-	}
-
+	public:
+		PathIndex* paths;
+		static herr_t visit(hid_t group_id, const char *name, const H5L_info_t *link, void *opdata)
+		{
+			PathCollector *me = (PathCollector *)opdata;
+			// The system group is not a part of the FS
+			size_t SystemLen = strlen(XDX_SYSTEM_GROUP + 1);
+			if(strncmp(name, XDX_SYSTEM_GROUP + 1, SystemLen)==0 && (name[SystemLen]==0 || name[SystemLen]=='/'))
+				return 0;
+			H5O_info_t info;
+			if(H5Oget_info_by_name(group_id, name, &info, H5P_DEFAULT)<0)
+				return -1;
+			me->paths->Insert(std::string("/") + name, info.type==H5O_TYPE_GROUP);
+			return 0;
+		}
+	};
+	m_Paths.Disable();
+	m_Paths.Enable();
+	PathCollector collector;
+	collector.paths = &m_Paths;
+	if(H5Lvisit(m_hRoot, H5_INDEX_NAME, H5_ITER_NATIVE, PathCollector::visit, &collector)<0)
+		return ERR_DISK_READ;
+	return ERR_SUCCESS;
+}
+////////////////////////////////////////////////////////////////
+// The stored path index is valid while its generation is the one
+// in FSMF_QW_PATHS_GEN. Once the index is in memory the record is
+// moved past the stored one, so an index left by a session not
+// closed is rebuilt; Close stores it with the generation of the
+// record. A failure to move the record disables the index.
+////////////////////////////////////////////////////////////////
+DWORD VirtualFS::_ArmPathIndex(uint64_t Generation)
+{
+	DWORD hRes = _WriteMetaQW(FSMF_QW_PATHS_GEN, Generation + 1);
 	if(hRes!=ERR_SUCCESS)
 	{
-		wchar_t Msg[512] = {0};
-		swprintf_s(Msg, sizeof(Msg)/2, L"Failed to an FS element counter (meta counter I/O): %ls", ErrorTexts::GetErrorDesc(hRes));
-		ToLog(EV_ERROR, Msg);
-		Rollback();
-		goto L_DONE;
-	}	
-	Commit();
-L_DONE:
-	CloseH5handle(lcpl_id, H5I_GENPROP_LST);
-	CloseH5handle(path_id, isFolder?H5I_GROUP:H5I_DATASET);
-
+		ToLog(Logs::EV_ERROR, L"Failed to update the path index record, the index is disabled");
+		m_Paths.Disable();
+		return hRes;
+	}
+	m_PathsGen = Generation + 1;
+	return ERR_SUCCESS;
+}
+// Rearm - the index goes on changing, the stored one is stale again at once
+DWORD VirtualFS::_StorePathIndex(bool Rearm)
+{
+	hid_t GroupId = -1;
+	DWORD hRes = _OpenSystemGroup(XDX_SYSTEM_GROUP, GroupId);
+	CloseH5handle(GroupId, H5I_GROUP);
+	if(hRes==ERR_SUCCESS)
+		hRes = m_Paths.Store(m_hFile, XDX_PATHS, m_PathsGen);
+	if(Rearm && m_Paths.IsEnabled())
+	{
+		DWORD hArm = _ArmPathIndex(m_PathsGen);
+		if(hRes==ERR_SUCCESS)
+			hRes = hArm;
+	}
 	return hRes;
 }
-DWORD VirtualFS::_AcquireRealHandle(LPCWSTR FileName, UINT64 CreatedBy, DWORD DesiredAccess, DWORD ShareMode, DWORD CreationDisposition, RealHandle& hResFile)
+DWORD VirtualFS::_TxStatementEnd(DWORD Result, size_t Savepoint)
 {
-	DWORD hRes = ERR_SUCCESS;
-	RealHandle hHandleRes;
-	
-	// 1. Check the file handle exists already
-	bool HandleExists = false;
-	RealHandle* hFile = nullptr;
-	NamedHandlesT::iterator hFindName = m_NamedHandles.find(FileName);
-	if(hFindName!=m_NamedHandles.end())
+	// A failed statement is undone alone, the transaction goes on
+	if(Result!=ERR_SUCCESS)
 	{
-		RawHandle realKey = hFindName->second;
-		RealHandlesT::iterator hFindHandle = m_RealHandles.find(realKey);
-		if(hFindHandle == m_RealHandles.end())
-			return ERR_EXTERNAL;
-		hFile = &hFindHandle->second;
+		_TxUndo(Savepoint);
+		return Result;
 	}
-	HandleExists = (hFile!=nullptr);
-
-	// 2. If there's no handle then check if the file exists already
-	bool FileExists = false;
-	if(!HandleExists)
+	// Out of a transaction every statement commits by itself
+	if(!m_TxActive)
+		return _TxApply();
+	// The undo records go to the container with the changes they undo
+	DWORD hRes = _TxPersist();
+	if(hRes!=ERR_SUCCESS)
+		_TxUndo(Savepoint);
+	return hRes;
+}
+DWORD VirtualFS::_TxUndo(size_t Savepoint)
+{
+	DWORD hRes = ERR_SUCCESS;
+	hid_t lcpl_id = H5Pcreate(H5P_LINK_CREATE);
+	if(lcpl_id>=0)
+		H5Pset_char_encoding(lcpl_id, H5T_CSET_UTF8);
+	// Undo in the reverse order, so that every record sees the state it left
+	while(m_TxLog.size() > Savepoint)
 	{
-		H5I_type_t ObjectType = H5I_UNINIT;
-		if(_FollowPath(FileName, ObjectType, hHandleRes.rawHandle)==ERR_SUCCESS)
+		const TxRecord& Record = m_TxLog.back();
+		herr_t status = 0;
+		switch(Record.dwOperation)
 		{
-			if(ObjectType != H5I_DATASET)
-				return ERR_NOT_FOUND;
-			FileExists = true;
+			case TX_CREATED:
+				if((status = H5Ldelete(m_hFile, Record.sPath.c_str(), H5P_DEFAULT))>=0)
+					m_Paths.Erase(Record.sPath);
+				break;
+			case TX_MOVED:
+			case TX_DELETED:
+				if((status = H5Lmove(m_hFile, Record.sTarget.c_str(), m_hFile, Record.sPath.c_str(), (lcpl_id>=0)?lcpl_id:H5P_DEFAULT, H5P_DEFAULT))>=0)
+					m_Paths.Move(Record.sTarget, Record.sPath);
+				break;
 		}
+		if(status<0)
+		{
+			wchar_t Msg[512] = {0};
+			swprintf_s(Msg, _countof(Msg), L"Failed to undo the change of \"%ls\"", TICUtils::Utf8ToWString(Record.sPath.c_str()).c_str());
+			ToLog(EV_ERROR, Msg);
+			hRes = ERR_DISK_WRITE;
+		}
+		m_TxLog.pop_back();
 	}
-	else
-		FileExists = true;
-
-	if(!FileExists && HandleExists) // Shall never happen
-		return ERR_EXTERNAL;
+	CloseH5handle(lcpl_id, H5I_GENPROP_LST);
+	// The counters change only when a statement succeeds
+	if(Savepoint==0)
+	{
+		INFO.FILES_COUNT = m_TxFilesCount;
+		INFO.DIR_COUNT   = m_TxDirCount;
+		if(_TxForget()!=ERR_SUCCESS)
+			hRes = ERR_DISK_WRITE;
+	}
+	return hRes;
+}
+DWORD VirtualFS::_TxApply()
+{
+	DWORD hRes = ERR_SUCCESS;
 
-	// 2. Creation mode basic checks
-	//    CREATE_NEW        - Creates, fails to overwrite
-	//    CREATE_ALWAYS     - Creates, overwrites
-	//    OPEN_EXISTING     - Opens, doesn't create
-	//    OPEN_ALWAYS       - Opens, creates
-	//    TRUNCATE_EXISTING - Opens, doesn't create, truncates to 0
-	if(!FileExists && (CreationDisposition==OPEN_EXISTING || CreationDisposition==TRUNCATE_EXISTING))
-		return ERR_NOT_FOUND; // Those must fail if there's no file
-	if(FileExists && CreationDisposition==CREATE_NEW)
-		return ERR_IN_USE; // That one must fail if file already exists
-	if(FileExists && (CreationDisposition==CREATE_ALWAYS || CreationDisposition==TRUNCATE_EXISTING) && (DesiredAccess&GENERIC_WRITE)==0)
-		return ERR_ACCESS_DENIED; // That one must fail if file must be rewritten, but the write access not requested
-	if(!FileExists && (CreationDisposition==OPEN_ALWAYS || CreationDisposition==CREATE_ALWAYS || CreationDisposition==CREATE_NEW) && (DesiredAccess&GENERIC_WRITE)==0)
-		return ERR_ACCESS_DENIED; // That one must fail if file could be rewritten, but the write access not requested
+	// 1. Without the undo records an interrupted commit is not rolled back on open,
+	//    the trash left behind is simply dropped
+	if(_TxForget()!=ERR_SUCCESS)
+		hRes = ERR_DISK_WRITE;
+	if(m_Faults!=nullptr && m_Faults->AtCrashPoint(XHdf5::FaultInjector::CRASH_TX_PURGE))
+	{
+		H5Fflush(m_hFile, H5F_SCOPE_LOCAL);
+		m_Faults->Crash();
+	}
 
-	// 3. If there's no handle, allocate it
-	if(!HandleExists)
+	// 2. The deleted objects leave the trash for good. Their images and chunk maps
+	//    go first, while the trash still leads _TxRecover to those a crash leaves.
+	for(size_t i = 0; i < m_TxLog.size(); i++)
 	{
-		// 3.1. If there's no file create it first
-		if(!FileExists)
+		const TxRecord& Record = m_TxLog[i];
+		if(Record.dwOperation!=TX_DELETED)
+			continue;
+		for(size_t j = 0; j < Record.vImageNames.size(); j++)
+			_DeleteRangeImage(Record.vImageNames[j].c_str());
+		for(size_t j = 0; j < Record.vChunkMaps.size(); j++)
 		{
-			if((hRes=_PathCreate(FileName, FILE_ATTRIBUTE_NORMAL, CreatedBy))!=ERR_SUCCESS)
-			{
-				return hRes;
-			}
+			if(_DeleteChunkMap(Record.vChunkMaps[j].c_str())!=ERR_SUCCESS)
+				hRes = ERR_DISK_WRITE;
 		}
-		// 3.2. Either file exists or created by now - Open it normally anyway
-		hid_t item_id = -1;
-		H5I_type_t item_type = H5I_UNINIT;
-		if((hRes=_FollowPath(FileName, item_type, item_id))!=ERR_SUCCESS)
-			return hRes;
-
-		// Initilialize the new real handle
-		RealHandle tmpFile;
-		tmpFile.wsPath     = FileName;
-		tmpFile.rawHandle  = item_id;
-		tmpFile.uReaders   = 0;
-		tmpFile.uWriters   = 0;
-		tmpFile.isFile     = true;
-		tmpFile.fShareMode = ShareMode;
-
-		// Place the new real handle into the collections
-		m_RealHandles[item_id]   = tmpFile;
-		m_NamedHandles[FileName] = item_id;
-
-		// Get a reference from the collection
-		hFile = &m_RealHandles[item_id];
+		if(H5Ldelete(m_hFile, Record.sTarget.c_str(), H5P_DEFAULT)<0)
+			hRes = ERR_DISK_WRITE;
+		m_Paths.Erase(Record.sTarget);
 	}
+	m_TxLog.clear();
 
-	// 4. Increment RW lock counters
-	if(DesiredAccess & GENERIC_READ)
-		hFile->uReaders++;
-	if(DesiredAccess & GENERIC_WRITE)
-		hFile->uWriters++;
-
-	// 5. Check the share mode compatibility
-	//    Can fail only for the already opened handles
-	if((hFile->fShareMode & ShareMode) != ShareMode ||
-		HandleExists && ShareMode==0 ||
-		HandleExists && (hFile->fShareMode & FILE_SHARE_WRITE)==0 && (DesiredAccess&GENERIC_WRITE)>0 || // request write when no write share was previously set
-		HandleExists && (hFile->fShareMode & FILE_SHARE_READ)==0 && (DesiredAccess&GENERIC_READ)>0      // request read when no read share was previously set
-		)
+	// 3. The counters are kept in memory and persisted by _FlushMeta,
+	//    here they only become the new rollback point
+	m_TxFilesCount = INFO.FILES_COUNT;
+	m_TxDirCount   = INFO.DIR_COUNT;
+	return hRes;
+}
+// The undo records are stored as they are appended: the operation,
+// the lengths of both paths and the paths themselves, without zeros
+DWORD VirtualFS::_TxPersist()
+{
+	DWORD   hRes = ERR_SUCCESS;
+	hid_t   group = -1, dataset = -1, dataspace = -1, memspace = -1, dcpl = -1;
+	hsize_t maxdims[1] = {H5S_UNLIMITED}, chunk[1] = {4096};
+	// A failed statement already took its records back
+	if(m_TxLogEnds.size() > m_TxLog.size())
+		m_TxLogEnds.resize(m_TxLog.size());
+	size_t  Stored = m_TxLogEnds.size();
+	hsize_t Start[1] = {m_TxLogEnds.empty()?0:m_TxLogEnds.back()};
+	std::vector<char> Bytes;
+	for(size_t i = Stored; i < m_TxLog.size(); i++)
 	{
-		_ReleaseRealHandle(DesiredAccess, *hFile);
-		return ERR_ACCESS_DENIED;
+		const TxRecord& Record = m_TxLog[i];
+		DWORD Head[3] = {Record.dwOperation, (DWORD)Record.sPath.length(), (DWORD)Record.sTarget.length()};
+		Bytes.insert(Bytes.end(), (const char*)Head, (const char*)Head + sizeof(Head));
+		Bytes.insert(Bytes.end(), Record.sPath.begin(), Record.sPath.end());
+		Bytes.insert(Bytes.end(), Record.sTarget.begin(), Record.sTarget.end());
+		m_TxLogEnds.push_back(Start[0] + Bytes.size());
 	}
+	hsize_t dims[1]  = {Start[0] + Bytes.size()};
+	hsize_t count[1] = {Bytes.size()};
 
-
-	hResFile = *hFile;
-	return ERR_SUCCESS;
+	if(H5Lexists(m_hFile, XDX_SYSTEM_GROUP, H5P_DEFAULT)>0 && H5Lexists(m_hFile, XDX_TXLOG, H5P_DEFAULT)>0)
+		dataset = H5Dopen2(m_hFile, XDX_TXLOG, H5P_DEFAULT);
+	else
+	{
+		if((hRes=_OpenSystemGroup(XDX_SYSTEM_GROUP, group))!=ERR_SUCCESS)
+			goto L_DONE;
+		hsize_t empty[1] = {0};
+		if((dataspace = H5Screate_simple(1, empty, maxdims))<0 ||
+			(dcpl = H5Pcreate(H5P_DATASET_CREATE))<0 || H5Pset_chunk(dcpl, 1, chunk)<0)
+			{hRes = ERR_DISK_WRITE; goto L_DONE;}
+		dataset = H5Dcreate2(m_hFile, XDX_TXLOG, H5T_NATIVE_UCHAR, dataspace, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+		CloseH5handle(dataspace, H5I_DATASPACE);
+		dataspace = -1;
+	}
+	if(dataset<0 || H5Dset_extent(dataset, dims)<0)
+		{hRes = ERR_DISK_WRITE; goto L_DONE;}
+	if(!Bytes.empty())
+	{
+		if((dataspace = H5Dget_space(dataset))<0 || (memspace = H5Screate_simple(1, count, NULL))<0 ||
+			H5Sselect_hyperslab(dataspace, H5S_SELECT_SET, Start, NULL, count, NULL)<0 ||
+			H5Dwrite(dataset, H5T_NATIVE_UCHAR, memspace, dataspace, H5P_DEFAULT, Bytes.data())<0)
+			{hRes = ERR_DISK_WRITE; goto L_DONE;}
+	}
+L_DONE:
+	if(hRes!=ERR_SUCCESS)
+		m_TxLogEnds.resize(Stored);
+	CloseH5handle(dcpl, H5I_GENPROP_LST);
+	CloseH5handle(memspace, H5I_DATASPACE);
+	CloseH5handle(dataspace, H5I_DATASPACE);
+	CloseH5handle(dataset, H5I_DATASET);
+	CloseH5handle(group, H5I_GROUP);
+	return hRes;
 }
-DWORD VirtualFS::_ReleaseRealHandle(DWORD AccessMode, RealHandle hFile)
+DWORD VirtualFS::_TxForget()
 {
-	// 1. Find the real handle
-	RawHandle realKey = hFile.rawHandle;
-	RealHandlesT::iterator hFindHandle = m_RealHandles.find(realKey);
-	if(hFindHandle == m_RealHandles.end())
-		return ERR_NOT_FOUND;
-
-	// 2. Decrement RW lock counters	
-	if((AccessMode & GENERIC_READ) && hFile.uReaders>0)
-		hFindHandle->second.uReaders--;
-	if((AccessMode & GENERIC_WRITE) && hFile.uWriters>0)
-		hFindHandle->second.uWriters--;
-
-	// 3. Check the remaining readers/writers
-	bool SomeoneLeft = (hFindHandle->second.uReaders>0 || hFindHandle->second.uWriters>0);
-	if(SomeoneLeft)
+	if(m_TxLogEnds.empty())
 		return ERR_SUCCESS;
-
-	// 4. If no one uses this handle anymore then actually close it
-	CloseH5handle(hFile.rawHandle, hFile.isFile?H5I_DATASET:H5I_GROUP);
-
-	// 5. Now remove it from the collections
-	m_NamedHandles.erase(hFindHandle->second.wsPath);
-	m_RealHandles.erase(realKey);
-
+	m_TxLogEnds.clear();
+	if(H5Lexists(m_hFile, XDX_TXLOG, H5P_DEFAULT)>0 && H5Ldelete(m_hFile, XDX_TXLOG, H5P_DEFAULT)<0)
+		return ERR_DISK_WRITE;
 	return ERR_SUCCESS;
 }
-DWORD VirtualFS::_FileCloseInternal(UserHandlesT::iterator iiUserHandle)
+// Called at open before the path index is loaded, the counters on disk
+// are still those of the transaction start, see _FlushMeta
+DWORD VirtualFS::_TxRecover(bool& Recovered)
+{
+	DWORD   hRes = ERR_SUCCESS;
+	hid_t   dataset = -1, dataspace = -1;
+	hsize_t dims[1] = {0};
+	std::vector<char> Bytes;
+	Recovered = false;
+	if(H5Lexists(m_hFile, XDX_SYSTEM_GROUP, H5P_DEFAULT)<=0)
+		return ERR_SUCCESS;
+	if(H5Lexists(m_hFile, XDX_TXLOG, H5P_DEFAULT)>0)
+	{
+		if((dataset = H5Dopen2(m_hFile, XDX_TXLOG, H5P_DEFAULT))<0 ||
+			(dataspace = H5Dget_space(dataset))<0 || H5Sget_simple_extent_dims(dataspace, dims, NULL)!=1)
+			{hRes = ERR_DISK_READ; goto L_DONE;}
+		Bytes.resize((size_t)dims[0]);
+		if(dims[0]>0 && H5Dread(dataset, H5T_NATIVE_UCHAR, H5S_ALL, H5S_ALL, H5P_DEFAULT, Bytes.data())<0)
+			{hRes = ERR_DISK_READ; goto L_DONE;}
+		CloseH5handle(dataspace, H5I_DATASPACE);
+		CloseH5handle(dataset, H5I_DATASET);
+		dataset = dataspace = -1;
+
+		m_TxLog.clear();
+		m_TxLogEnds.clear();
+		for(size_t Pos = 0; Pos + sizeof(DWORD)*3 <= Bytes.size();)
+		{
+			DWORD Head[3];
+			memcpy(Head, Bytes.data() + Pos, sizeof(Head));
+			if(Head[0] > TX_DELETED || Bytes.size() - Pos - sizeof(Head) < (size_t)Head[1] + Head[2])
+				break;
+			Pos += sizeof(Head);
+			TxRecord Record;
+			Record.dwOperation = Head[0];
+			Record.sPath.assign(Bytes.data() + Pos, Head[1]);
+			Record.sTarget.assign(Bytes.data() + Pos + Head[1], Head[2]);
+			Pos += Head[1] + Head[2];
+			m_TxLog.push_back(Record);
+			m_TxLogEnds.push_back(Pos);
+		}
+		if(m_TxLogEnds.empty() || m_TxLogEnds.back()!=Bytes.size())
+			ToLog(EV_ERROR, L"The undo records of the interrupted transaction are damaged, the rest is rolled back");
+		wchar_t Msg[128] = {0};
+		swprintf_s(Msg, _countof(Msg), L"Rolling back %u changes of an interrupted transaction", (unsigned)m_TxLog.size());
+		ToLog(EV_INFO, Msg);
+		// Undoes the records and drops them from the container
+		m_TxLogEnds.push_back(Bytes.size());
+		if((hRes=_TxUndo(0))!=ERR_SUCCESS)
+			goto L_DONE;
+		Recovered = true;
+	}
+	// Whatever is left in the trash was deleted by a committed transaction
+	if(H5Lexists(m_hFile, XDX_TRASH_GROUP, H5P_DEFAULT)>0)
+		hRes = _TrashPurge();
+L_DONE:
+	CloseH5handle(dataspace, H5I_DATASPACE);
+	CloseH5handle(dataset, H5I_DATASET);
+	return hRes;
+}
+// The trash of a commit cut short still holds the range images and the
+// chunk maps of its files, they go as _TxApply would have dropped them
+DWORD VirtualFS::_TrashPurge()
 {
 	DWORD hRes = ERR_SUCCESS;
-	// Find the real handle where it points
-	UserHandle uhFile = iiUserHandle->second;
-	auto iiRealHandle = m_RealHandles.find(uhFile.hRealHandle);
-	if(iiRealHandle != m_RealHandles.end())
+	std::vector<std::string> ImageNames, ChunkMaps;
+	hid_t trash_id = H5Gopen2(m_hFile, XDX_TRASH_GROUP, H5P_DEFAULT);
+	if(trash_id<0)
+		return ERR_DISK_READ;
+	if((hRes=_CollectRangeImages(trash_id, ImageNames))==ERR_SUCCESS)
+		hRes = _CollectChunkMaps(trash_id, ChunkMaps);
+	CloseH5handle(trash_id, H5I_GROUP);
+	if(hRes!=ERR_SUCCESS)
+		return hRes;
+	for(size_t i = 0; i < ImageNames.size(); i++)
+		_DeleteRangeImage(ImageNames[i].c_str());
+	for(size_t i = 0; i < ChunkMaps.size(); i++)
 	{
-		RealHandle rhFile = iiRealHandle->second;
-
-		// 3. Close real handle
-		if((hRes=_ReleaseRealHandle(uhFile.fAccessMode, rhFile))!=ERR_SUCCESS)
-			return hRes;
+		if(_DeleteChunkMap(ChunkMaps[i].c_str())!=ERR_SUCCESS)
+			hRes = ERR_DISK_WRITE;
 	}
-	// Remove user handle
-	m_UserHandles.erase(iiUserHandle);
-
+	if(H5Ldelete(m_hFile, XDX_TRASH_GROUP, H5P_DEFAULT)<0)
+		hRes = ERR_DISK_WRITE;
+	// The maps are gone with the trash once the file is flushed, then the chunks
+	if(hRes==ERR_SUCCESS)
+		hRes = _ReleaseChunks(true);
+	return hRes;
+}
+DWORD VirtualFS::_CountObjects(hid_t ObjId, DWORD& Files, DWORD& Folders)
+{
+	class ObjectCounter
+	{
+	public:
+		DWORD files;
+		DWORD folders;
+		static herr_t visit(hid_t obj_id, const char *name, const H5O_info_t *info, void *opdata)
+		{
+			ObjectCounter *me = (ObjectCounter *)opdata;
+			if(info->type==H5O_TYPE_GROUP)
+				me->folders++;
+			else if(info->type==H5O_TYPE_DATASET)
+				me->files++;
+			return 0;
+		}
+	};
+	// The object itself is visited as well
+	ObjectCounter counter;
+	counter.files   = 0;
+	counter.folders = 0;
+	if(H5Ovisit(ObjId, H5_INDEX_NAME, H5_ITER_NATIVE, ObjectCounter::visit, &counter)<0)
+		return ERR_DISK_READ;
+	Files   = counter.files;
+	Folders = counter.folders;
+	return ERR_SUCCESS;
+}
+// Called with the write lock held
+void VirtualFS::_CompactTouch(haddr_t Addr)
+{
+	if(m_Compacting!=nullptr)
+		m_Compacting->changed.insert(Addr);
+}
+void VirtualFS::_CompactTouchObject(hid_t ObjId)
+{
+	haddr_t Addr = HADDR_UNDEF;
+	if(m_Compacting!=nullptr && _ObjectAddr(ObjId, Addr)==ERR_SUCCESS)
+		m_Compacting->changed.insert(Addr);
+}
+DWORD VirtualFS::_CopyAttributes(hid_t SrcId, hid_t DstId, hid_t DosType)
+{
+	class AttrCopier
+	{
+	public:
+		hid_t dst;
+		hid_t dos_type;
+		static herr_t copy_one(hid_t loc_id, const char *name, const H5A_info_t *info, void *opdata)
+		{
+			AttrCopier *me = (AttrCopier *)opdata;
+			hid_t  att = -1, type = -1, space = -1, copy = -1, stored = -1;
+			herr_t ret = -1;
+			std::vector<char> Value;
+			if((att = H5Aopen(loc_id, name, H5P_DEFAULT))<0 ||
+				(type = H5Aget_type(att))<0 ||
+				(space = H5Aget_space(att))<0)
+				goto L_DONE;
+			Value.resize(H5Tget_size(type) * max(H5Sget_simple_extent_npoints(space), (hssize_t)1));
+			if(H5Aread(att, type, Value.data())<0)
+				goto L_DONE;
+			H5Aclose(att);
+			att = -1;
+			// A committed type belongs to the source file, only its twin is shared in the copy
+			if(H5Tcommitted(type)>0 && H5Tequal(type, me->dos_type)>0)
+				stored = me->dos_type;
+			else if((stored = copy = H5Tcopy(type))<0)
+				goto L_DONE;
+			// A compaction copies the attributes of a changed folder again
+			if(H5Aexists(me->dst, name)>0 && H5Adelete(me->dst, name)<0)
+				goto L_DONE;
+			if((att = H5Acreate2(me->dst, name, stored, space, H5P_DEFAULT, H5P_DEFAULT))>=0 &&
+				H5Awrite(att, stored, Value.data())>=0)
+				ret = 0;
+		L_DONE:
+			if(att>=0)
+				H5Aclose(att);
+			if(copy>=0)
+				H5Tclose(copy);
+			if(type>=0)
+				H5Tclose(type);
+			if(space>=0)
+				H5Sclose(space);
+			return ret;
+		}
+	};
+	AttrCopier copier;
+	copier.dst      = DstId;
+	copier.dos_type = DosType;
+	if(H5Aiterate2(SrcId, H5_INDEX_NAME, H5_ITER_NATIVE, NULL, AttrCopier::copy_one, &copier)<0)
+		return ERR_DISK_WRITE;
 	return ERR_SUCCESS;
 }
 }
\ No newline at end of file
@@ -1,9 +1,16 @@
 #pragma once
+#include "platform.h"
 #include "defines.h"
 #include "AESCipher.h"
 #include <Hdf5.h>
 #include "h5fdblock.h"
 #include "vfile.h"
+#include "vpool.h"
+#include "vdedup.h"
+#include "vindex.h"
+#include <atomic>
+#include <climits>
+#include <functional>
 
 using namespace XDX::Objects;
 namespace XDX
@@ -15,8 +22,96 @@ public:
 	VirtualFS(LPCWSTR Alias, LPCWSTR DataFolder);
 	virtual ~VirtualFS();
 	void ToLog(DWORD Event, LPCWSTR Message);
-	void Commit(){}
-	void Rollback(){}
+	// Metadata transactions. Creates, moves and deletes made until Commit
+	// are undone by Rollback, the counters are written once on Commit.
+	DWORD BeginTransaction();
+	DWORD Commit();
+	DWORD Rollback();
+	// Persistent ranges of the open files
+	DWORD RangesStore(HANDLE File, TaggedRanges& Ranges);
+	DWORD RangesFind(HANDLE File, UINT64 Offset, UINT64 Length, std::vector<TaggedRange>& Found);
+	// Space accounting and compaction. Compact copies the live objects into
+	// a new container FileName, throttled to BytesPerSecond of file data
+	// (0 - unlimited). The copy goes in steps with the lock released in
+	// between, what the writers change meanwhile is copied again at the end.
+	DWORD GetSpaceStats(SpaceStats& Stats);
+	// I/O accounting. The counters run always, from the Open of the
+	// container on, and are kept after the Close. GetIoStats takes no
+	// lock, DumpIoStats writes them to the log in one line.
+	DWORD GetIoStats(IoStats& Stats);
+	void  DumpIoStats();
+	// Lists the tree under Root in one pass, the groups are opened through
+	// their parents and each is listed under the lock. The items go to
+	// Callback in batches of Options.BatchSize, with the lock released. With
+	// Options.Pool the batches are handled on the pool, several at a time,
+	// while the walk reads on; the Callback must then be thread safe. The
+	// Callback may call the container, a change to a group not listed yet
+	// shows in the walk. Options.Filter runs under the lock and must not.
+	DWORD Walk(LPCWSTR Root, WalkCallback Callback, const WalkOptions& Options);
+	// Path index. Enabled, the container keeps all its paths sorted in the
+	// /.xdx/paths dataset and Open loads them back. PathFind then lists the
+	// paths matching Pattern without a walk, WALK_* Flags select the kinds:
+	// '?' is a character, '*' a part of a name and '**' any part of a path,
+	// so "/projects/**.json" is every .json file under /projects.
+	DWORD SetPathIndex(BOOL Enable);
+	DWORD PathFind(LPCWSTR Pattern, DWORD Flags, std::vector<std::wstring>& Paths);
+	DWORD Compact(LPCWSTR FileName, UINT64 BytesPerSecond);
+	// Online backup. Snapshot freezes the container as it is at the call and
+	// streams that image into FileName while the writers go on, the blocks
+	// they overwrite are copied out first. An older snapshot in FileName is
+	// updated in place, only the changed blocks are written.
+	DWORD Snapshot(LPCWSTR FileName, UINT64 BytesPerSecond);
+	// Replication. From ReplicationStart on every block written to the
+	// container is appended, encrypted as stored, to the log LogName.
+	// ReplicaApply rolls a copy taken after the start (e.g. by Snapshot)
+	// forward from the log. Starting another log switches to it, a log is
+	// started over and refuses the copies taken before it: a copy rolled
+	// forward to the end of the previous log goes on with the new one.
+	DWORD ReplicationStart(LPCWSTR LogName);
+	DWORD ReplicationStop();
+	// Data key rotation. RotateDataKey re-encrypts the container in place
+	// under a new data key, throttled to BytesPerSecond (0 - unlimited).
+	// The blocks are recoded in batches from the start of the file on, on
+	// the Pool of SetPrefetch, and the container stays in use meanwhile: a
+	// block below the mark is read and written with the new key, the rest
+	// with the old one. The mark is kept in a journal by the container, so
+	// after a crash, or a failed call, Open finds the blocks as they were
+	// left and the next call goes on from the mark. The new key replaces
+	// the old one in the header at the end. It needs the NewDataCrypt of
+	// SetPrefetch, for the Open of a container left mid-rotation as well.
+	// A rotation and Compact exclude each other. A batch that cannot be
+	// written stops the I/O of the container until it is opened again.
+	DWORD RotateDataKey(UINT64 BytesPerSecond);
+	// The decrypted blocks go to the shared Cache, up to Quota bytes
+	// (0 - the whole cache). Set while the container is closed.
+	DWORD SetBlockCache(XHdf5::BlockCache* Cache, UINT64 Quota);
+	// Open fast path. With a block cache set, Open reads the first Bytes of
+	// the container along with its header in one request and seeds the cache
+	// with them. The blocks are decrypted in parallel on Pool when NewDataCrypt
+	// is given: a data crypto keeps its IV state, so each worker takes a fresh
+	// provider of the kind passed to Open. Set while the container is closed.
+	DWORD SetPrefetch(UINT64 Bytes, WorkerPool* Pool, std::function<ICrypto*()> NewDataCrypt);
+	// Test hook: the disk I/O of the container goes through Faults, which
+	// delays or fails it as configured. Set while the container is closed.
+	DWORD SetFaultInjector(XHdf5::FaultInjector* Faults);
+	// Deduplication. The files created while it is enabled keep their data
+	// in the chunk store of the container as a list of chunk references, the
+	// identical chunks of all such files are stored once. The other files
+	// are not affected. GetDedupStats reports the store.
+	DWORD SetDedup(BOOL Enable);
+	DWORD GetDedupStats(UINT64& Chunks, UINT64& References, UINT64& Deduplicated);
+	// Small files. A file up to Bytes long keeps its data in its object
+	// header, so it is read along with its attributes. It moves to an
+	// ordinary dataset once it grows past Bytes. 0 stores every new file
+	// as a dataset, the limit is INLINE_FILE_MAX.
+	DWORD SetInlineLimit(DWORD Bytes);
+	// Durability of FileWrite, one of XHdf5::DURABILITY_*: NONE leaves the
+	// data in the caches until a flush, OS writes it out, DISK also syncs.
+	// File is the handle to set, nullptr sets the default of new handles.
+	// The disk syncs of concurrent writers are batched, a sync waits up
+	// to Milliseconds for others to join it.
+	DWORD SetDurability(HANDLE File, DWORD Level);
+	DWORD SetCommitDelay(DWORD Milliseconds);
 public: // interface methods
 	virtual VOID     WINAPI AddRef() override;
 	virtual VOID     WINAPI Release() override;
@@ -47,14 +142,22 @@ protected: // HDF5 block driver callback
 	virtual int OnH5WriteUserBlock(void * Buffer, unsigned int Size);
 	virtual int OnH5ReadUserBlock(void * Buffer, unsigned int Size);
 	virtual int OnH5FillEmptyBlock(void * Buffer, unsigned int Size);
-	virtual int OnH5AfterBlockRead(void * Buffer, unsigned int Size);
-	virtual int OnH5BeforeBlockWrite(void * Buffer, unsigned int Size);
+	virtual int OnH5AfterBlockRead(haddr_t Addr, void * Buffer, unsigned int Size);
+	virtual int OnH5AfterBlocksRead(haddr_t Addr, void * Buffer, unsigned int BlockSize, unsigned int Count);
+	virtual int OnH5BeforeBlockWrite(haddr_t Addr, void * Buffer, unsigned int Size);
+	virtual int OnH5BeforeOverwrite(haddr_t Addr, haddr_t Size);
 	virtual void OnH5ToLog(DWORD Event, LPCWSTR Message);
 private: //methods
 	inline BOOL _IsCrypto(){return (m_PwdCrypt!=nullptr && m_DataCrypt!=nullptr)?TRUE:FALSE;}
-	inline void _MayBeEncrypt(void *_Data, DWORD _Size){if(_IsCrypto()) m_DataCrypt->Encrypt((PBYTE)_Data, _Size, TRUE);}
-	inline void _MayBeDecrypt(void *_Data, DWORD _Size){if(_IsCrypto()) m_DataCrypt->Decrypt((PBYTE)_Data, _Size, TRUE);}
+	// During a key rotation the blocks below the mark are under the new key
+	// A batch of the rotation not applied, the blocks at the mark are under either key
+	inline bool _IsRekeyBroken(){return m_Rekey!=nullptr && m_Rekey->IsBroken();}
+	inline ICrypto* _DataCryptAt(haddr_t _Addr){return (m_Rekey!=nullptr && _Addr<m_Rekey->GetMark())?m_RekeyCrypt:m_DataCrypt;}
+	inline void _MayBeEncrypt(haddr_t _Addr, void *_Data, DWORD _Size){if(_IsCrypto()){_DataCryptAt(_Addr)->Encrypt((PBYTE)_Data, _Size, TRUE); XHdf5::IoCounters::Add(m_Io.BytesEncrypted, _Size);}}
+	inline void _MayBeDecrypt(haddr_t _Addr, void *_Data, DWORD _Size){if(_IsCrypto()){_DataCryptAt(_Addr)->Decrypt((PBYTE)_Data, _Size, TRUE); XHdf5::IoCounters::Add(m_Io.BytesDecrypted, _Size);}}
 	static herr_t _WalkErrorCallback(unsigned n, const H5E_error2_t *err_desc, void *udata);
+	static void _Throttle(UINT64 Started, UINT64 Bytes, UINT64 BytesPerSecond);
+	static void _LatencyStats(const XHdf5::LatencyHistogram& Histogram, LatencyStats& Stats);
 	VOID  _ClearMem();
 	inline time_t GetTime();
 	inline void* MemAlloc(SIZE_T Bytes);
@@ -76,20 +179,75 @@ private: //methods
 		return -1;
 	}
 	DWORD _Init(LPCWSTR FileName, LPCWSTR Name, ICrypto* PwdCrypt, ICrypto* DataCrypt, DWORD BlockSize, DWORD Version, BOOL Create);
+	void  _ContainerPath(LPCWSTR FileName, wchar_t* UnicodePath, DWORD UnicodeSize, char* AnsiPath, DWORD AnsiSize, LPCWSTR Extension = L"dat");
 	DWORD _DefineRawHeader(DWORD BlockSize, DWORD Version);
 	DWORD _AssignAccessPassword();
+	DWORD _WrapDataKey(PBYTE Key, PBYTE KeyIV, PBYTE KeyEnc, PBYTE IVEnc);
+	ICrypto* _NewDataCrypt(PBYTE Key, PBYTE KeyIV);
+	void  _RekeyOpen(LPCWSTR FileName, const char* ContainerPath, BOOL Create);
+	DWORD _RekeyStart();
+	DWORD _RekeyLoad();
+	DWORD _RekeyFinish();
+	void  _RekeyClose();
+	int   _Recode(haddr_t Addr, char* Blocks, size_t Count);
 	DWORD _CreateMetaRecords(LPCWSTR Name, DWORD BlockSize, DWORD Version);
 	DWORD _ReadMetaRecords();
 	DWORD _WriteMetaDW(DWORD MetaId, DWORD Value);
 	DWORD _WriteMetaQW(DWORD MetaId, UINT64 Value);
 	DWORD _WriteMetaBytes(DWORD MetaId, PBYTE ByteVal, DWORD Size, size_t MaxLength);
-	DWORD _WriteAttributeBytes(hid_t ObjId, DWORD FieldId, PBYTE ByteVal, DWORD Size, size_t MaxLength);
+	DWORD _OpenMetaCache();
+	void  _CloseMetaCache();
+	hid_t _StringType(size_t Size);
+	DWORD _MetaAttribute(DWORD MetaId, size_t Size, bool Create, MetaAttr*& Attr);
+	DWORD _FlushMeta();
 	DWORD _ReadMeta(DWORD MetaId, PBYTE ByteVal, DWORD *MaxSize);
-	DWORD _ReadAttributeBytes(hid_t ObjId, DWORD FieldId, PBYTE ByteVal, DWORD MaxSize);
 	DWORD _GetAttributesById(hid_t ObjId, pAttrInfo Attr, bool IsGroup);
+	DWORD _ReadFileAttributes(hid_t LocId, const char* Name, FileAttributesDos& Attr);
+	DWORD _WriteFileAttributes(hid_t ObjId, const FileAttributesDos& Attr, bool IsNew);
+	DWORD _DatasetSize(hid_t LocId, const char* Name, UINT64& Size);
+	bool  _OpenFileSize(hid_t LocId, const char* Name, UINT64& Size);
+	DWORD _ObjectAddr(hid_t ObjId, haddr_t& Addr);
+	DWORD _FlushFileSize(RealHandle& hFile);
+	DWORD _FlushFileSizes();
+	DWORD _FlushToOS(RealHandle& hFile, std::shared_ptr<XHdf5::GroupCommit>* Commit);
+	DWORD _FileWrite(HANDLE File, LPVOID Buffer, UINT64 Offset, DWORD LengthToWrite, LPDWORD LengthWritten, std::shared_ptr<XHdf5::GroupCommit>& Commit);
 	BOOL  _IsPathValid(LPCWSTR Path);
 	DWORD _FollowPath(LPCWSTR Path, H5I_type_t& ObjectType, hid_t& ObjectId);
 	DWORD _PathCreate(LPCWSTR Name, DWORD Attributes, UINT64 CreatedBy);
+	DWORD _OpenSystemGroup(const char* Name, hid_t& GroupId);
+	DWORD _RangeImageName(hid_t ObjId, char* Name, size_t Size);
+	DWORD _ReadRangeImage(hid_t ObjId, RangeImagePtr& Image);
+	DWORD _WriteRangeImage(hid_t ObjId, const std::vector<uint64_t>& Image);
+	DWORD _DeleteRangeImage(const char* ImageName);
+	DWORD _CollectRangeImages(hid_t ObjId, std::vector<std::string>& Names);
+	DWORD _OpenChunkStore();
+	void  _ChunkMapName(haddr_t Addr, char* Name, size_t Size);
+	DWORD _ReadChunkMap(hid_t ObjId, ChunkMapPtr& Map);
+	DWORD _WriteChunkMap(hid_t ObjId, const std::vector<uint64_t>& Map);
+	DWORD _DeleteChunkMap(const char* MapName);
+	DWORD _CollectChunkMaps(hid_t ObjId, std::vector<std::string>& Names);
+	DWORD _ReleaseChunks(bool Flush);
+	DWORD _ChunkRead(RealHandle& hFile, LPVOID Buffer, UINT64 Offset, size_t Length);
+	DWORD _ChunkWrite(RealHandle& hFile, const void* Buffer, UINT64 Offset, size_t Length);
+	DWORD _DatasetWrite(RealHandle& hFile, LPVOID Buffer, UINT64 Offset, DWORD Length);
+	UINT64 _InlineCapacity(UINT64 Size);
+	DWORD _InlineLayout(hid_t DatasetId, UINT64& Capacity);
+	DWORD _ReshapeFile(RawHandle& Key, UINT64 Capacity);
+	DWORD _BuildPathIndex();
+	DWORD _ArmPathIndex(uint64_t Generation);
+	DWORD _StorePathIndex(bool Rearm);
+	size_t _TxSavepoint(){return m_TxLog.size();}
+	DWORD _TxStatementEnd(DWORD Result, size_t Savepoint);
+	DWORD _TxUndo(size_t Savepoint);
+	DWORD _TxApply();
+	DWORD _TxPersist();
+	DWORD _TxForget();
+	DWORD _TxRecover(bool& Recovered);
+	DWORD _TrashPurge();
+	DWORD _CountObjects(hid_t ObjId, DWORD& Files, DWORD& Folders);
+	void  _CompactTouch(haddr_t Addr);
+	void  _CompactTouchObject(hid_t ObjId);
+	DWORD _CopyAttributes(hid_t SrcId, hid_t DstId, hid_t DosType);
 	DWORD _AcquireRealHandle(LPCWSTR FileName, UINT64 CreatedBy, DWORD DesiredAccess, DWORD ShareMode, DWORD CreationDisposition, RealHandle& hFile);
 	DWORD _ReleaseRealHandle(DWORD AccessMode, RealHandle hFile);
 	DWORD _FileCloseInternal(UserHandlesT::iterator File);
@@ -107,6 +265,35 @@ private://members
 	hid_t               m_hFapl;
 	hid_t               m_hFcpl;
 	XHdf5::BlockDriver* m_Driver;
+	XHdf5::BlockSnapshot* m_Snapshot;     // Being streamed out by Snapshot, not owned
+	CompactState*       m_Compacting;     // Of the running Compact, not owned
+	XHdf5::ReplicationLog* m_ReplLog;     // The log of the written blocks, if replicated
+	XHdf5::BlockCache*  m_Cache;          // Shared with the other containers, not owned
+	UINT64              m_CacheQuota;
+	XHdf5::BlockCache::client_t m_CacheClient;
+	DWORD               m_Durability;     // Of the handles created from now on
+	DWORD               m_CommitDelay;
+	UINT64              m_Prefetch;       // Bytes read ahead by Open
+	WorkerPool*         m_PrefetchPool;   // Not owned
+	std::function<ICrypto*()> m_NewDataCrypt;
+	XHdf5::FaultInjector* m_Faults;       // Not owned
+	BOOL                m_Dedup;          // The files created from now on are deduplicated
+	ChunkStore          m_Chunks;         // Opened on the first deduplicated file
+	std::vector<uint64_t> m_ChunkReleases; // Dropped by the chunk maps written, see _ReleaseChunks
+	DWORD               m_InlineLimit;    // The largest inline file
+	PathIndex           m_Paths;          // Follows the links when enabled
+	uint64_t            m_PathsGen;       // In FSMF_QW_PATHS_GEN, the generation the index is stored with
+	XHdf5::IoCounters   m_Io;             // Of the container and its driver, reset by Open
+
+	// Kept open while the container is open
+	hid_t               m_hRoot;            // The root group holding the meta attributes
+	hid_t               m_hAttrSpace;       // The single element space of all the attributes
+	MetaAttrsT          m_MetaAttrs;        // The meta attributes by the field id
+	StrTypesT           m_StrTypes;         // The string types by size
+	hid_t               m_hDosType;         // The FileAttributesDos compound, committed on the first write
+	bool                m_DosTypeCommitted;
+	DWORD               m_MetaFilesCount;   // The counters as persisted, INFO holds the current ones
+	DWORD               m_MetaDirCount;
 
 	// Encryption related stuff
 	ICrypto*            m_PwdCrypt;
@@ -115,10 +302,26 @@ private://members
 	BYTE                MasterKey[MASTER_KEY_LEN]; 
 	BYTE                IV[MASTER_KEY_LEN]; // we don't need so much, so the encryptor will take only the required part of it
 
+	// Data key rotation, the journal is open while a rotation is unfinished
+	XHdf5::BlockRekey*  m_Rekey;
+	ICrypto*            m_RekeyCrypt;       // The new key, for the blocks below the mark
+	bool                m_Rekeying;         // RotateDataKey is running
+	char                m_RekeyPath[MAX_PATH];
+	BYTE                NewMasterKey[MASTER_KEY_LEN];
+	BYTE                NewIV[MASTER_KEY_LEN];
+
 	// Stuff related to the virtual files
 	uint64_t            m_HandlesCounter;
-	NamedHandlesT       m_NamedHandles;
+	AddrHandlesT        m_AddrHandles;
 	RealHandlesT        m_RealHandles;
 	UserHandlesT        m_UserHandles;
+
+	// Metadata transaction
+	bool                m_TxActive;         // An explicit transaction is open
+	TxLogT              m_TxLog;            // Undo records since the transaction start
+	std::vector<hsize_t> m_TxLogEnds;       // The end of every undo record stored in the container
+	DWORD               m_TxFilesCount;     // The counters at the start of the transaction
+	DWORD               m_TxDirCount;
+	uint64_t            m_TxTrashCounter;
 };
 }
\ No newline at end of file
@@ -0,0 +1,243 @@
+#include "stdafx.h"
+#include "vindex.h"
+#include <cstring>
+
+namespace
+{
+	void PutVarint(std::vector<unsigned char>& Out, uint64_t Value)
+	{
+		while(Value >= 0x80)
+		{
+			Out.push_back((unsigned char)(Value | 0x80));
+			Value >>= 7;
+		}
+		Out.push_back((unsigned char)Value);
+	}
+	bool GetVarint(const std::vector<unsigned char>& In, size_t& Pos, uint64_t& Value)
+	{
+		Value = 0;
+		for(int Shift = 0; Shift < 64 && Pos < In.size(); Shift += 7)
+		{
+			unsigned char Byte = In[Pos++];
+			Value |= (uint64_t)(Byte & 0x7F) << Shift;
+			if((Byte & 0x80)==0)
+				return true;
+		}
+		return false;
+	}
+	const char* GenerationAttr = "generation";
+	DWORD WriteGeneration(hid_t DatasetId, uint64_t Generation)
+	{
+		hid_t space = -1, attr = -1;
+		DWORD hRes  = ERR_SUCCESS;
+		if(H5Aexists(DatasetId, GenerationAttr)>0)
+			attr = H5Aopen(DatasetId, GenerationAttr, H5P_DEFAULT);
+		else if((space = H5Screate(H5S_SCALAR))>=0)
+			attr = H5Acreate2(DatasetId, GenerationAttr, H5T_NATIVE_UINT64, space, H5P_DEFAULT, H5P_DEFAULT);
+		if(attr<0 || H5Awrite(attr, H5T_NATIVE_UINT64, &Generation)<0)
+			hRes = ERR_DISK_WRITE;
+		if(attr>=0)
+			H5Aclose(attr);
+		if(space>=0)
+			H5Sclose(space);
+		return hRes;
+	}
+}
+
+namespace XDX
+{
+PathIndex::PathIndex()
+{
+	m_Enabled = false;
+	m_Dirty   = false;
+}
+void PathIndex::Enable()
+{
+	m_Enabled = true;
+	m_Dirty   = true;
+}
+void PathIndex::Disable()
+{
+	m_Paths.clear();
+	m_Enabled = false;
+	m_Dirty   = false;
+}
+void PathIndex::Range(const std::string& Prefix, PathIt& From, PathIt& To) const
+{
+	// '/' + 1 is '0', the first string past every path under Prefix
+	std::string End = Prefix;
+	End[End.length()-1] = '/' + 1;
+	From = m_Paths.lower_bound(Prefix);
+	To   = m_Paths.lower_bound(End);
+}
+void PathIndex::Insert(const std::string& Path, bool IsFolder)
+{
+	if(!m_Enabled)
+		return;
+	m_Paths.insert(IsFolder?Path + "/":Path);
+	m_Dirty = true;
+}
+void PathIndex::Erase(const std::string& Path)
+{
+	if(!m_Enabled)
+		return;
+	PathIt From, To;
+	size_t Count = m_Paths.size();
+	Range(Path + "/", From, To);
+	m_Paths.erase(From, To);
+	m_Paths.erase(Path);
+	if(m_Paths.size()!=Count)
+		m_Dirty = true;
+}
+void PathIndex::Move(const std::string& From, const std::string& To)
+{
+	if(!m_Enabled)
+		return;
+	if(m_Paths.erase(From)>0)
+		m_Paths.insert(To);
+	// A folder takes its content along
+	PathIt First, Last;
+	std::string Prefix = From + "/";
+	Range(Prefix, First, Last);
+	std::vector<std::string> Moved;
+	for(PathIt iiPath = First; iiPath != Last; iiPath++)
+		Moved.push_back(To + "/" + iiPath->substr(Prefix.length()));
+	m_Paths.erase(First, Last);
+	m_Paths.insert(Moved.begin(), Moved.end());
+	m_Dirty = true;
+}
+void PathIndex::Find(const std::string& Pattern, bool Files, bool Folders, std::vector<std::string>& Paths) const
+{
+	Paths.clear();
+	size_t Literal = Pattern.find_first_of("*?");
+	std::string Head = Pattern.substr(0, Literal);
+	for(auto iiPath = m_Paths.lower_bound(Head); iiPath != m_Paths.end(); iiPath++)
+	{
+		if(iiPath->compare(0, Head.length(), Head)!=0)
+			break;
+		bool IsFolder = (*iiPath)[iiPath->length()-1]=='/';
+		if(IsFolder?!Folders:!Files)
+			continue;
+		std::string Path = IsFolder?iiPath->substr(0, iiPath->length()-1):*iiPath;
+		if(Match(Pattern.c_str(), Path.c_str()))
+			Paths.push_back(Path);
+	}
+}
+bool PathIndex::Match(const char* Pattern, const char* Path)
+{
+	while(*Pattern)
+	{
+		if(*Pattern=='*')
+		{
+			// A star takes the shortest run that lets the rest match
+			bool AnyDepth = (Pattern[1]=='*');
+			Pattern += AnyDepth?2:1;
+			for(;; Path++)
+			{
+				if(Match(Pattern, Path))
+					return true;
+				if(*Path==0 || !AnyDepth && *Path=='/')
+					return false;
+			}
+		}
+		if(*Path==0 || ((*Pattern=='?')?(*Path=='/'):(*Pattern!=*Path)))
+			return false;
+		Pattern++;
+		Path++;
+	}
+	return *Path==0;
+}
+DWORD PathIndex::Load(hid_t LocId, const char* Name, uint64_t& Generation)
+{
+	DWORD   hRes = ERR_SUCCESS;
+	hid_t   dataset = -1, space = -1;
+	hsize_t dims[1] = {0};
+	std::vector<unsigned char> Data;
+	size_t   Pos = 0;
+	uint64_t Count = 0;
+	std::string Path;
+	hid_t    attr = -1;
+	m_Paths.clear();
+	Generation = 0;
+	if((dataset = H5Dopen2(LocId, Name, H5P_DEFAULT))<0 ||
+		(space = H5Dget_space(dataset))<0 || H5Sget_simple_extent_dims(space, dims, NULL)!=1)
+		{hRes = ERR_DISK_READ; goto L_DONE;}
+	if(H5Aexists(dataset, GenerationAttr)>0)
+	{
+		if((attr = H5Aopen(dataset, GenerationAttr, H5P_DEFAULT))<0 || H5Aread(attr, H5T_NATIVE_UINT64, &Generation)<0)
+			hRes = ERR_DISK_READ;
+		if(attr>=0)
+			H5Aclose(attr);
+		if(hRes!=ERR_SUCCESS)
+			goto L_DONE;
+	}
+	Data.resize((size_t)dims[0]);
+	if(dims[0]>0 && H5Dread(dataset, H5T_NATIVE_UCHAR, H5S_ALL, H5S_ALL, H5P_DEFAULT, Data.data())<0)
+		{hRes = ERR_DISK_READ; goto L_DONE;}
+	if(!GetVarint(Data, Pos, Count))
+		{hRes = ERR_DISK_READ; goto L_DONE;}
+	for(uint64_t i = 0; i < Count; i++)
+	{
+		uint64_t Shared = 0, Length = 0;
+		if(!GetVarint(Data, Pos, Shared) || !GetVarint(Data, Pos, Length) ||
+			Shared > Path.length() || Length > Data.size() - Pos)
+			{hRes = ERR_DISK_READ; goto L_DONE;}
+		Path.resize((size_t)Shared);
+		Path.append((const char*)Data.data() + Pos, (size_t)Length);
+		Pos += (size_t)Length;
+		m_Paths.insert(m_Paths.end(), Path);
+	}
+L_DONE:
+	if(space>=0)
+		H5Sclose(space);
+	if(dataset>=0)
+		H5Dclose(dataset);
+	m_Enabled = (hRes==ERR_SUCCESS);
+	m_Dirty   = false;
+	if(!m_Enabled)
+		m_Paths.clear();
+	return hRes;
+}
+DWORD PathIndex::Store(hid_t LocId, const char* Name, uint64_t Generation)
+{
+	DWORD   hRes = ERR_SUCCESS;
+	hid_t   dataset = -1, space = -1;
+	std::vector<unsigned char> Data;
+	const std::string* Last = nullptr;
+	if(!m_Dirty && H5Lexists(LocId, Name, H5P_DEFAULT)>0)
+	{
+		if((dataset = H5Dopen2(LocId, Name, H5P_DEFAULT))<0)
+			return ERR_DISK_READ;
+		hRes = WriteGeneration(dataset, Generation);
+		H5Dclose(dataset);
+		return hRes;
+	}
+	PutVarint(Data, m_Paths.size());
+	for(auto iiPath = m_Paths.begin(); iiPath != m_Paths.end(); iiPath++)
+	{
+		size_t Shared = 0;
+		while(Last!=nullptr && Shared < Last->length() && Shared < iiPath->length() && (*Last)[Shared]==(*iiPath)[Shared])
+			Shared++;
+		PutVarint(Data, Shared);
+		PutVarint(Data, iiPath->length() - Shared);
+		Data.insert(Data.end(), iiPath->begin() + Shared, iiPath->end());
+		Last = &*iiPath;
+	}
+	// The size changes with every store, so the old one is replaced
+	hsize_t dims[1] = {Data.size()};
+	if(H5Lexists(LocId, Name, H5P_DEFAULT)>0 && H5Ldelete(LocId, Name, H5P_DEFAULT)<0)
+		{hRes = ERR_DISK_WRITE; goto L_DONE;}
+	if((space = H5Screate_simple(1, dims, NULL))<0 ||
+		(dataset = H5Dcreate2(LocId, Name, H5T_NATIVE_UCHAR, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT))<0 ||
+		H5Dwrite(dataset, H5T_NATIVE_UCHAR, H5S_ALL, H5S_ALL, H5P_DEFAULT, Data.data())<0 ||
+		(hRes=WriteGeneration(dataset, Generation))!=ERR_SUCCESS)
+		{hRes = ERR_DISK_WRITE; goto L_DONE;}
+	m_Dirty = false;
+L_DONE:
+	if(space>=0)
+		H5Sclose(space);
+	if(dataset>=0)
+		H5Dclose(dataset);
+	return hRes;
+}
+}
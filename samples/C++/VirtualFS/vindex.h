@@ -0,0 +1,55 @@
+#pragma once
+#include "platform.h"
+#include <Hdf5.h>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace XDX
+{
+////////////////////////////////////////////////////////////////
+// The sorted Utf8 paths of a container, a folder ends with '/'.
+// The index follows the link operations of the container: a
+// path is inserted when created, erased with its content when
+// deleted and renamed with its content when moved, so the items
+// of a folder always form one range of the set.
+//
+// Stored as a single byte dataset with the paths front coded:
+// each path keeps only the bytes it does not share with the one
+// before it, and with the generation given by the owner, which
+// tells a stored index from a stale one. The updates are no-ops
+// until Enable or Load.
+////////////////////////////////////////////////////////////////
+class PathIndex
+{
+public:
+	PathIndex();
+	void  Enable();
+	void  Disable();
+	bool  IsEnabled() const {return m_Enabled;}
+	bool  IsDirty() const {return m_Dirty;}
+	size_t GetCount() const {return m_Paths.size();}
+	void  Insert(const std::string& Path, bool IsFolder);
+	// Erases the item at Path, a folder with its content
+	void  Erase(const std::string& Path);
+	void  Move(const std::string& From, const std::string& To);
+	// The paths matching Pattern, see Match. Only the range of the
+	// literal head of the pattern is scanned.
+	void  Find(const std::string& Pattern, bool Files, bool Folders, std::vector<std::string>& Paths) const;
+	// Generation is 0 for an index stored without one
+	DWORD Load(hid_t LocId, const char* Name, uint64_t& Generation);
+	// An index not changed since it was loaded or stored only takes the new Generation
+	DWORD Store(hid_t LocId, const char* Name, uint64_t Generation);
+	// '?' - any character but '/', '*' - any run without '/', '**' - any run
+	static bool Match(const char* Pattern, const char* Path);
+private:
+	typedef std::set<std::string>::iterator PathIt;
+	// The range of the folder Prefix (with its '/') and everything under it
+	void  Range(const std::string& Prefix, PathIt& From, PathIt& To) const;
+private:
+	std::set<std::string> m_Paths;
+	bool                  m_Enabled;
+	bool                  m_Dirty;
+};
+}
@@ -0,0 +1,261 @@
+#include "stdafx.h"
+#include "vmanager.h"
+
+namespace XDX
+{
+VirtualFSManager::VirtualFSManager(LPCWSTR DataFolder, UINT64 CacheBudget, UINT64 CacheQuota, DWORD MaxOpen, DWORD Workers):
+	m_DataFolder(DataFolder), m_Cache(CacheBudget), m_Pool(Workers)
+{
+	m_Logger     = nullptr;
+	m_MaxOpen    = (MaxOpen>0)?MaxOpen:1;
+	m_CacheQuota = CacheQuota;
+	m_Prefetch   = 0;
+	m_Closing    = 0;
+	m_DumpInterval = 0;
+}
+VirtualFSManager::~VirtualFSManager()
+{
+	SetStatsDump(0);
+	CloseAll();
+}
+void VirtualFSManager::SetLogger(pILog Logger)
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	m_Logger = Logger;
+	for(auto& iiContainer: m_Containers)
+		iiContainer.second.fs->SetLogger(Logger);
+}
+DWORD VirtualFSManager::Acquire(LPCWSTR FileName, ICrypto* PwdCrypt, ICrypto* DataCrypt, VirtualFS** FS)
+{
+	DWORD hRes = ERR_SUCCESS;
+	if(FileName==nullptr || FS==nullptr)
+		return ERR_ERROR_PARAM;
+	*FS = nullptr;
+
+	// The slot is reserved under the mutex, the container is opened and the
+	// victim closed without it, so a slow open holds up only its own callers
+	std::vector<ContainersT::iterator> Victims;
+	ContainersT::iterator iiContainer;
+	UINT64 Prefetch = 0;
+	std::function<ICrypto*()> NewDataCrypt;
+	{
+		std::unique_lock<std::mutex> Lock(m_Mutex);
+		while((iiContainer = m_Containers.find(FileName))!=m_Containers.end() && iiContainer->second.state!=STATE_OPEN)
+			m_Changed.wait(Lock);
+		if(iiContainer!=m_Containers.end())
+		{
+			// The password was checked by the first opener only
+			if(iiContainer->second.pwd_crypt!=PwdCrypt || iiContainer->second.data_crypt!=DataCrypt)
+				return ERR_ACCESS_DENIED;
+			iiContainer->second.users++;
+			iiContainer->second.fs->AddRef();
+			*FS = iiContainer->second.fs;
+			return ERR_SUCCESS;
+		}
+		// Make room: the least recently used idle container goes
+		if(m_Containers.size() - m_Closing >= m_MaxOpen)
+		{
+			auto Victim = m_Containers.end();
+			for(auto iiIdle = m_Containers.begin(); iiIdle != m_Containers.end(); iiIdle++)
+			{
+				if(iiIdle->second.state==STATE_OPEN && iiIdle->second.users==0 &&
+					(Victim==m_Containers.end() || iiIdle->second.last_used < Victim->second.last_used))
+					Victim = iiIdle;
+			}
+			if(Victim==m_Containers.end())
+				return ERR_LIMITS;
+			Victims.push_back(Victim);
+			_MarkClosing(Victims);
+		}
+		Container Item;
+		Item.fs         = new VirtualFS(FileName, m_DataFolder.c_str());
+		Item.state      = STATE_OPENING;
+		Item.pwd_crypt  = PwdCrypt;
+		Item.data_crypt = DataCrypt;
+		Item.users      = 0;
+		Item.last_used  = GetTickCount64();
+		Item.fs->SetLogger(m_Logger);
+		iiContainer  = m_Containers.insert(std::make_pair(std::wstring(FileName), Item)).first;
+		Prefetch     = m_Prefetch;
+		NewDataCrypt = m_NewDataCrypt;
+	}
+	_Close(Victims);
+	VirtualFS* fs = iiContainer->second.fs;
+	if((hRes=fs->SetBlockCache(&m_Cache, m_CacheQuota))==ERR_SUCCESS &&
+		(hRes=fs->SetPrefetch(Prefetch, &m_Pool, NewDataCrypt))==ERR_SUCCESS)
+		hRes = fs->Open(FileName, PwdCrypt, DataCrypt, 0);
+
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	if(hRes!=ERR_SUCCESS)
+	{
+		m_Containers.erase(iiContainer);
+		fs->Release();
+	}
+	else
+	{
+		iiContainer->second.state = STATE_OPEN;
+		iiContainer->second.users++;
+		fs->AddRef();
+		*FS = fs;
+	}
+	m_Changed.notify_all();
+	return hRes;
+}
+DWORD VirtualFSManager::Release(VirtualFS* FS)
+{
+	if(FS==nullptr)
+		return ERR_ERROR_PARAM;
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	for(auto iiContainer = m_Containers.begin(); iiContainer != m_Containers.end(); iiContainer++)
+	{
+		if(iiContainer->second.fs!=FS)
+			continue;
+		if(iiContainer->second.users==0)
+			return ERR_ERROR_PARAM;
+		iiContainer->second.users--;
+		iiContainer->second.last_used = GetTickCount64();
+		FS->Release();
+		return ERR_SUCCESS;
+	}
+	// Closed by CloseAll while in use, only the reference is left
+	FS->Release();
+	return ERR_SUCCESS;
+}
+void VirtualFSManager::SetPrefetch(UINT64 Bytes, std::function<ICrypto*()> NewDataCrypt)
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	m_Prefetch     = Bytes;
+	m_NewDataCrypt = NewDataCrypt;
+}
+DWORD VirtualFSManager::CloseIdle(UINT64 IdleMs)
+{
+	std::vector<ContainersT::iterator> Victims;
+	{
+		std::lock_guard<std::mutex> Lock(m_Mutex);
+		UINT64 Now = GetTickCount64();
+		for(auto iiContainer = m_Containers.begin(); iiContainer != m_Containers.end(); iiContainer++)
+		{
+			if(iiContainer->second.state==STATE_OPEN && iiContainer->second.users==0 && Now - iiContainer->second.last_used >= IdleMs)
+				Victims.push_back(iiContainer);
+		}
+		_MarkClosing(Victims);
+	}
+	return _Close(Victims);
+}
+// A container being opened or closed by another call meanwhile is left to it
+DWORD VirtualFSManager::CloseAll()
+{
+	std::vector<ContainersT::iterator> Victims;
+	{
+		std::lock_guard<std::mutex> Lock(m_Mutex);
+		for(auto iiContainer = m_Containers.begin(); iiContainer != m_Containers.end(); iiContainer++)
+		{
+			if(iiContainer->second.state==STATE_OPEN)
+				Victims.push_back(iiContainer);
+		}
+		_MarkClosing(Victims);
+	}
+	return _Close(Victims);
+}
+void VirtualFSManager::DumpStats()
+{
+	// The containers are dumped without the mutex, a slow logger must not hold up Acquire
+	std::vector<VirtualFS*> Open;
+	pILog Logger = nullptr;
+	{
+		std::lock_guard<std::mutex> Lock(m_Mutex);
+		Logger = m_Logger;
+		for(auto& iiContainer: m_Containers)
+		{
+			if(iiContainer.second.state!=STATE_OPEN)
+				continue;
+			iiContainer.second.fs->AddRef();
+			Open.push_back(iiContainer.second.fs);
+		}
+	}
+	for(auto iiFS: Open)
+	{
+		iiFS->DumpIoStats();
+		iiFS->Release();
+	}
+	if(!Logger)
+		return;
+	XHdf5::BlockCacheStats Stats;
+	m_Cache.GetStats(Stats);
+	wchar_t Msg[256];
+	swprintf_s(Msg, _countof(Msg), L"Block cache: %llu of %llu bytes used, %llu hits, %llu misses, %llu evictions, %u clients",
+		(unsigned long long)Stats.Used, (unsigned long long)Stats.Budget, (unsigned long long)Stats.Hits,
+		(unsigned long long)Stats.Misses, (unsigned long long)Stats.Evictions, (unsigned)Stats.Clients);
+	Logger->Log(Logs::EV_INFO, m_DataFolder.c_str(), Msg);
+	// The data buffers are shared by all the managers of the process
+	std::vector<XHdf5::NodeUsage> Usage;
+	XHdf5::DataMemory::GetUsage(Usage);
+	for(size_t i = 0; i < Usage.size(); i++)
+	{
+		swprintf_s(Msg, _countof(Msg), L"Data memory on node %u: %llu bytes mapped, %llu on huge pages, %llu in use",
+			(unsigned)i, (unsigned long long)Usage[i].Mapped, (unsigned long long)Usage[i].Huge, (unsigned long long)Usage[i].InUse);
+		Logger->Log(Logs::EV_INFO, m_DataFolder.c_str(), Msg);
+	}
+}
+void VirtualFSManager::SetStatsDump(UINT64 IntervalMs)
+{
+	{
+		std::lock_guard<std::mutex> Lock(m_DumpMutex);
+		m_DumpInterval = IntervalMs;
+	}
+	m_DumpWake.notify_all();
+	if(IntervalMs==0)
+	{
+		if(m_Dumper.joinable())
+			m_Dumper.join();
+	}
+	else if(!m_Dumper.joinable())
+		m_Dumper = std::thread(&VirtualFSManager::_DumpLoop, this);
+}
+// A wake before the interval is up is a new interval or the stop
+void VirtualFSManager::_DumpLoop()
+{
+	std::unique_lock<std::mutex> Lock(m_DumpMutex);
+	while(m_DumpInterval>0)
+	{
+		if(m_DumpWake.wait_for(Lock, std::chrono::milliseconds(m_DumpInterval))==std::cv_status::no_timeout)
+			continue;
+		Lock.unlock();
+		DumpStats();
+		Lock.lock();
+	}
+}
+// Takes the slots of the victims off the count, called with the mutex held
+void VirtualFSManager::_MarkClosing(std::vector<ContainersT::iterator>& Victims)
+{
+	for(auto& iiVictim: Victims)
+	{
+		iiVictim->second.state = STATE_CLOSING;
+		m_Closing++;
+	}
+}
+// Closes the containers marked by _MarkClosing on the pool, called without
+// the mutex. A container still referenced by a user lives on closed until released.
+DWORD VirtualFSManager::_Close(std::vector<ContainersT::iterator>& Victims)
+{
+	if(Victims.empty())
+		return ERR_SUCCESS;
+	std::vector<DWORD> Results(Victims.size(), ERR_SUCCESS);
+	m_Pool.ParallelFor(Victims.size(), [&Victims, &Results](size_t i)
+	{
+		Results[i] = Victims[i]->second.fs->Close();
+	});
+	DWORD hRes = ERR_SUCCESS;
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	for(size_t i = 0; i < Victims.size(); i++)
+	{
+		if(Results[i]!=ERR_SUCCESS)
+			hRes = Results[i];
+		Victims[i]->second.fs->Release();
+		m_Containers.erase(Victims[i]);
+		m_Closing--;
+	}
+	m_Changed.notify_all();
+	return hRes;
+}
+}
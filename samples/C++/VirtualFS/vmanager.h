@@ -0,0 +1,80 @@
+#pragma once
+#include "vfs.h"
+#include "vpool.h"
+#include <condition_variable>
+#include <map>
+#include <thread>
+
+namespace XDX
+{
+////////////////////////////////////////////////////////////////
+// Keeps the containers of one data folder open under a common
+// budget: one block cache with a quota per container, one worker
+// pool and at most MaxOpen open containers. A container acquired
+// by nobody is idle; the least recently used idle one is closed
+// to make room for another, CloseIdle closes the ones idle for
+// longer than asked. The containers are opened and closed
+// without the mutex, a slot is reserved under it first.
+////////////////////////////////////////////////////////////////
+class VirtualFSManager
+{
+public:
+	VirtualFSManager(LPCWSTR DataFolder, UINT64 CacheBudget, UINT64 CacheQuota, DWORD MaxOpen, DWORD Workers);
+	virtual ~VirtualFSManager();
+	void  SetLogger(pILog Logger);
+	// Returns the container FileName, opened if it was not. An open container
+	// is shared by the callers passing the same crypto providers. Every
+	// successful Acquire is paired with a Release of the returned pointer.
+	DWORD Acquire(LPCWSTR FileName, ICrypto* PwdCrypt, ICrypto* DataCrypt, VirtualFS** FS);
+	DWORD Release(VirtualFS* FS);
+	// The containers opened from now on read their first Bytes ahead, see
+	// VirtualFS::SetPrefetch; NewDataCrypt lets the pool decrypt them
+	void  SetPrefetch(UINT64 Bytes, std::function<ICrypto*()> NewDataCrypt);
+	DWORD CloseIdle(UINT64 IdleMs);
+	DWORD CloseAll();
+	void  GetCacheStats(XHdf5::BlockCacheStats& Stats){m_Cache.GetStats(Stats);}
+	// Logs the I/O counters of every open container and the cache stats.
+	// With SetStatsDump it is done every IntervalMs on a thread of its
+	// own, 0 stops it.
+	void  DumpStats();
+	void  SetStatsDump(UINT64 IntervalMs);
+	WorkerPool& GetPool(){return m_Pool;}
+private:
+	enum enStates
+	{
+		STATE_OPENING,          // Being opened by an Acquire, the others wait for it
+		STATE_OPEN,
+		STATE_CLOSING           // Being closed, its slot is free
+	};
+	struct Container
+	{
+		VirtualFS* fs;
+		DWORD      state;       // enStates
+		ICrypto*   pwd_crypt;   // Kept alive by the container while it is open
+		ICrypto*   data_crypt;
+		DWORD      users;       // Acquired and not released
+		UINT64     last_used;   // GetTickCount64 of the last Release
+	};
+	typedef std::map<std::wstring, Container> ContainersT;
+	void  _MarkClosing(std::vector<ContainersT::iterator>& Victims);
+	DWORD _Close(std::vector<ContainersT::iterator>& Victims);
+	void  _DumpLoop();
+private:
+	std::mutex          m_Mutex;
+	std::wstring        m_DataFolder;
+	pILog               m_Logger;
+	DWORD               m_MaxOpen;
+	UINT64              m_CacheQuota;
+	UINT64              m_Prefetch;
+	std::function<ICrypto*()> m_NewDataCrypt;
+	XHdf5::BlockCache   m_Cache;
+	WorkerPool          m_Pool;
+	ContainersT         m_Containers;
+	size_t              m_Closing;        // Of m_Containers in STATE_CLOSING
+	std::condition_variable m_Changed;    // A container left STATE_OPENING or STATE_CLOSING
+	std::mutex          m_DumpMutex;
+	std::condition_variable m_DumpWake;
+	std::thread         m_Dumper;
+	UINT64              m_DumpInterval;   // 0 - the dumper is stopped
+};
+}
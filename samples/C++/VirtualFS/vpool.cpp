@@ -0,0 +1,101 @@
+#include "stdafx.h"
+#include "vpool.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace XDX
+{
+namespace
+{
+	thread_local const WorkerPool* CurrentPool = nullptr;   // Of the worker thread
+}
+WorkerPool::WorkerPool(size_t Threads)
+{
+	m_Stop = false;
+	if(Threads==0)
+		Threads = std::max(std::thread::hardware_concurrency(), 1u);
+	for(size_t i = 0; i < Threads; i++)
+		m_Threads.emplace_back(&WorkerPool::Run, this);
+}
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> Lock(m_Mutex);
+		m_Stop = true;
+	}
+	m_Ready.notify_all();
+	for(auto& Thread: m_Threads)
+		Thread.join();
+}
+void WorkerPool::Submit(std::function<void()> Task)
+{
+	{
+		std::lock_guard<std::mutex> Lock(m_Mutex);
+		m_Tasks.push_back(std::move(Task));
+	}
+	m_Ready.notify_one();
+}
+void WorkerPool::ParallelFor(size_t Count, const std::function<void(size_t)>& Task)
+{
+	struct Job
+	{
+		std::atomic<size_t>     next;
+		size_t                  running;   // Helpers inside the job, guarded by mutex
+		std::mutex              mutex;
+		std::condition_variable done;
+	};
+	if(Count==0)
+		return;
+	std::shared_ptr<Job> job = std::make_shared<Job>();
+	job->next    = 0;
+	job->running = 0;
+	auto work = [job, Count, &Task]()
+	{
+		for(size_t i = job->next++; i < Count; i = job->next++)
+			Task(i);
+	};
+	// A helper starting after the indices ran out leaves at once, so the
+	// caller waits only for the started ones and never for a queued task
+	for(size_t i = 0, helpers = std::min(Count - 1, m_Threads.size()); i < helpers; i++)
+	{
+		Submit([job, work, Count]()
+		{
+			{
+				std::lock_guard<std::mutex> Lock(job->mutex);
+				if(job->next >= Count)
+					return;
+				job->running++;
+			}
+			work();
+			std::lock_guard<std::mutex> Lock(job->mutex);
+			if(--job->running==0)
+				job->done.notify_all();
+		});
+	}
+	work();
+	std::unique_lock<std::mutex> Lock(job->mutex);
+	job->done.wait(Lock, [&job](){return job->running==0;});
+}
+bool WorkerPool::IsWorkerThread() const
+{
+	return CurrentPool==this;
+}
+void WorkerPool::Run()
+{
+	CurrentPool = this;
+	for(;;)
+	{
+		std::function<void()> Task;
+		{
+			std::unique_lock<std::mutex> Lock(m_Mutex);
+			m_Ready.wait(Lock, [this](){return m_Stop || !m_Tasks.empty();});
+			if(m_Tasks.empty())
+				return;
+			Task = std::move(m_Tasks.front());
+			m_Tasks.pop_front();
+		}
+		Task();
+	}
+}
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace XDX
+{
+////////////////////////////////////////////////////////////////
+// A fixed set of worker threads shared by the containers of a
+// process. Submit queues a task; ParallelFor splits an indexed
+// job between the workers and the calling thread and returns when
+// every index is done, so it may be called from a worker too.
+////////////////////////////////////////////////////////////////
+class WorkerPool
+{
+public:
+	WorkerPool(size_t Threads);    // 0 - one per hardware thread
+	virtual ~WorkerPool();
+	void   Submit(std::function<void()> Task);
+	void   ParallelFor(size_t Count, const std::function<void(size_t)>& Task);
+	size_t GetThreads() const {return m_Threads.size();}
+	// The calling thread is a worker of this pool: a task waiting for the
+	// others there may hold up the very workers it waits for
+	bool   IsWorkerThread() const;
+private:
+	void Run();
+private:
+	std::mutex                        m_Mutex;
+	std::condition_variable           m_Ready;
+	std::deque<std::function<void()>> m_Tasks;
+	std::vector<std::thread>          m_Threads;
+	bool                              m_Stop;
+};
+}